@@ -1,16 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include "kdtree.h"
 #include "location.h"
 #include "kdtree_helpers.h"
 #include "kdtree_internal.h"
+#include "kdtree_hashset.h"
+#include "kdtree_epoch.h"
+#include "kdtree_file.h"
+#include "kdtree_stream.h"
+#include "kdtree_paged.h"
+#include "kdtree_latency.h"
+#include "kdtree_trace.h"
 
+//number of counters the size is spread over while several threads add
+#define KDTREE_SIZE_STRIPES 32
+
+//one share of the size, on its own cache line so adders on different
+//cores don't fight over it
+typedef struct {
+    _Alignas(64) size_t count;
+} kdtree_size_stripe;
+
+//block of nodes laid out by kdtree_relayout; snapshots taken while it was
+//the tree's block may still reach into it, so it is freed as a whole when
+//neither the tree nor any of them uses it
+typedef struct {
+    size_t refs;
+    size_t count;
+    kdtree_node nodes[];
+} kdtree_arena;
 
 typedef struct _kdtree{
     kdtree_node *root;
     size_t tree_size;
+    kdtree_arena *arena;         //block of nodes from the last relayout, or NULL
+    kdtree_layout layout;
+    size_t relayout_every;       //updates between automatic relayouts; 0 for never
+    size_t updates_since_layout;
+    kdtree_hashset *index;       //exact-match index of the points, or NULL
+    kdtree_concurrency concurrency;
+    kdtree_epoch *epoch;         //reclamation for concurrent readers, or NULL
+    kdtree_size_stripe *added;   //adds not yet in tree_size, in concurrent insert mode
+    bool snapshotted;            //nodes may be shared with snapshots, so copy before changing
+    bool read_only;              //this is a snapshot or a mapped file
+    kdtree_file *file;           //the file the points are in, or NULL if they are in nodes
+    kdtree_paged *paged;         //the paged file the points are in, or NULL
+    kdtree_query_counters totals;  //work done by queries, if KDTREE_STATS is defined
 } kdtree;
 
+//used only for its address, to spread threads over the size stripes
+static _Thread_local char kdtree_thread_tag;
+
+//pages read by this thread's last query on a paged tree
+static _Thread_local kdtree_io_stats kdtree_query_io;
+
+//work done by this thread's last query; the counting compiles away
+//entirely, conditions and all, unless KDTREE_STATS is defined
+static _Thread_local kdtree_query_counters kdtree_query_cost;
+
+#ifdef KDTREE_STATS
+#define KDTREE_COUNT(field, n) (kdtree_query_cost.field += (n))
+#define KDTREE_COUNT_IF(cond, field) ((cond) ? (void)kdtree_query_cost.field++ : (void)0)
+#define KDTREE_COUNT_START() (kdtree_query_cost = (kdtree_query_counters){0, 0, 0, 0})
+#define KDTREE_COUNT_FINISH(t) kdtree_add_query_totals(t)
+#else
+#define KDTREE_COUNT(field, n) ((void)0)
+#define KDTREE_COUNT_IF(cond, field) ((void)0)
+#define KDTREE_COUNT_START() ((void)0)
+#define KDTREE_COUNT_FINISH(t) ((void)0)
+#endif
+
+//links that readers may follow while the writer changes them are read
+//with acquire loads and written with release stores, so a reader that
+//finds a node also sees everything written to it before it was linked
+#define KDTREE_LOAD(link) __atomic_load_n(&(link), __ATOMIC_ACQUIRE)
+#define KDTREE_PUBLISH(link, node) __atomic_store_n(&(link), (node), __ATOMIC_RELEASE)
+
+#ifdef KDTREE_STATS
+//adds this thread's last query to the tree's totals, which any number
+//of readers may be adding to at once
+static void kdtree_add_query_totals(const kdtree *t){
+    kdtree_query_counters *totals = (kdtree_query_counters *)&t->totals;
+    __atomic_add_fetch(&totals->nodes_visited, kdtree_query_cost.nodes_visited, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->nodes_pruned, kdtree_query_cost.nodes_pruned, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->points_tested, kdtree_query_cost.points_tested, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->points_emitted, kdtree_query_cost.points_emitted, __ATOMIC_RELAXED);
+}
+#endif
+
+static bool kdtree_in_arena(const kdtree_node *node, const kdtree_arena *arena){
+    if (arena == NULL){
+        return false;
+    }
+    uintptr_t addr = (uintptr_t)node;
+    uintptr_t start = (uintptr_t)arena->nodes;
+    return addr >= start && addr < start + sizeof(kdtree_node) * arena->count;
+}
+
+static void kdtree_arena_unref(kdtree_arena *arena){
+    if (arena != NULL && __atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(arena);
+    }
+}
+
+//drops one link to node; a node nothing links to any more is freed (unless
+//it is in arena, the block of whoever held the link), and so is whatever
+//only it linked to
+static void kdtree_node_unref(kdtree_arena *arena, kdtree_node *node){
+    while (node != NULL && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        kdtree_node *right = node->right;
+        kdtree_node_unref(arena, node->left);
+        if (!kdtree_in_arena(node, arena)){
+            free(node);
+        }
+        node = right;
+    }
+}
+
+//frees memory that is no longer linked into the tree, waiting for
+//concurrent readers to finish with it if there might be any
+static void kdtree_release(kdtree *t, void *p){
+    if (t->epoch == NULL){
+        free(p);
+    } else if (!kdtree_epoch_retire(t->epoch, p, free)){
+        //no memory to remember it, and a reader may still be using it,
+        //so the only safe thing to do is leak it
+    }
+}
+
+//frees a node unless it lives in the tree's arena (which is freed as a
+//whole) or a snapshot still links to it
+static void kdtree_node_free(kdtree *t, kdtree_node *node){
+    if (t->snapshotted){
+        kdtree_node_unref(t->arena, node);
+    } else if (!kdtree_in_arena(node, t->arena)){
+        kdtree_release(t, node);
+    }
+}
+
+//returns node if only this tree can reach it, so it can be changed in
+//place, and otherwise a copy of it for the caller to link in instead;
+//node's parent must already be this tree's alone. NULL if out of memory
+static kdtree_node *kdtree_own(kdtree *t, kdtree_node *node){
+    if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1){
+        return node;
+    }
+    kdtree_node *copy = malloc(sizeof(kdtree_node));
+    if (copy == NULL){
+        return NULL;
+    }
+    copy->loc = node->loc;
+    copy->cut_dim = node->cut_dim;
+    copy->refs = 1;
+    copy->left = node->left;
+    copy->right = node->right;
+    if (copy->left != NULL){
+        __atomic_add_fetch(&copy->left->refs, 1, __ATOMIC_RELAXED);
+    }
+    if (copy->right != NULL){
+        __atomic_add_fetch(&copy->right->refs, 1, __ATOMIC_RELAXED);
+    }
+    kdtree_node_unref(t->arena, node);
+    return copy;
+}
+
+//counts an update and relayouts if the tree is set to do so automatically
+static void kdtree_count_update(kdtree *t){
+    t->updates_since_layout++;
+    if (t->relayout_every > 0 && t->updates_since_layout >= t->relayout_every){
+        kdtree_relayout(t);
+    }
+}
+
 //copied it over from helpers.c
 kdtree_link_info kdtree_find_extreme(kdtree_node *r, int r_dim, kdtree_node **ptr_to_r, int dim, int factor)
 {
@@ -82,6 +248,11 @@ kdtree_node *kdtree_create_helper(location *ptr, int n, int depth){
     }
 
     int median = n/2;
+    //points equal to the median in the cut dimension have to go right
+    //(that's where kdtree_contains looks for them), so use the first one
+    while (median > 0 && (cut_dimension == 0 ? ptr[median - 1].lon == ptr[median].lon : ptr[median - 1].lat == ptr[median].lat)){
+        median--;
+    }
 
     //create a new node at the median point(to be root of the subtree)
     kdtree_node *node = malloc(sizeof(kdtree_node));
@@ -90,6 +261,7 @@ kdtree_node *kdtree_create_helper(location *ptr, int n, int depth){
     }
     node->loc = ptr[median];
     node->cut_dim = cut_dimension;
+    node->refs = 1;
     //call the function recursively
     node->left = kdtree_create_helper(ptr, median, depth + 1);
     node->right = kdtree_create_helper(ptr + median + 1, n - (median + 1), depth + 1);
@@ -97,14 +269,40 @@ kdtree_node *kdtree_create_helper(location *ptr, int n, int depth){
     return node;
 }
 
+//orders locations by latitude and then longitude, to find duplicates
+static int kdtree_compare_locations(const void *a, const void *b){
+    const location *l1 = a;
+    const location *l2 = b;
+    if (l1->lat != l2->lat){
+        return l1->lat < l2->lat ? -1 : 1;
+    }
+    if (l1->lon != l2->lon){
+        return l1->lon < l2->lon ? -1 : 1;
+    }
+    return 0;
+}
+
 kdtree *kdtree_create(const location *pts, int n){
     kdtree *tree = malloc(sizeof(kdtree));
     if (tree == NULL){
         return NULL;
     }
 
-    tree->tree_size = n;
+    tree->tree_size = 0;
     tree->root = NULL;
+    tree->arena = NULL;
+    tree->layout = KDTREE_LAYOUT_DFS;
+    tree->relayout_every = 0;
+    tree->updates_since_layout = 0;
+    tree->index = NULL;
+    tree->concurrency = KDTREE_SINGLE_THREADED;
+    tree->epoch = NULL;
+    tree->added = NULL;
+    tree->snapshotted = false;
+    tree->read_only = false;
+    tree->file = NULL;
+    tree->paged = NULL;
+    tree->totals = (kdtree_query_counters){0, 0, 0, 0};
 
     if (n > 0){
         //copy points into a mutable array that we can sort
@@ -118,6 +316,17 @@ kdtree *kdtree_create(const location *pts, int n){
             pts_cpy[i] = pts[i];
         }
 
+        //keep one copy of each point
+        qsort(pts_cpy, n, sizeof(location), kdtree_compare_locations);
+        int unique = 1;
+        for (int i = 1; i < n; i++){
+            if (kdtree_compare_locations(&pts_cpy[i], &pts_cpy[unique - 1]) != 0){
+                pts_cpy[unique++] = pts_cpy[i];
+            }
+        }
+        n = unique;
+        tree->tree_size = n;
+
         //always start from depth 0
         tree->root = kdtree_create_helper(pts_cpy, n, 0);
 
@@ -126,111 +335,342 @@ kdtree *kdtree_create(const location *pts, int n){
     return tree;
 }
 
-bool kdtree_contains(const kdtree *t, const location *p){
+bool kdtree_do_contains(const kdtree *t, const location *p){
     if (t == NULL || p == NULL){
         return false;
     }
+    KDTREE_COUNT_START();
+    if (t->file != NULL){
+        return kdtree_file_contains(t->file, p);
+    }
+    if (t->paged != NULL){
+        kdtree_query_io = (kdtree_io_stats){0, 0};
+        return kdtree_paged_contains(t->paged, p, &kdtree_query_io);
+    }
+    if (t->index != NULL && t->epoch == NULL){
+        bool found = kdtree_hashset_contains(t->index, p);
+        KDTREE_COUNT(points_tested, 1);
+        KDTREE_COUNT(points_emitted, found);
+        KDTREE_COUNT_FINISH(t);
+        return found;
+    }
 
-    kdtree_node *curr_node = t->root;
+    size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+    kdtree_node *curr_node = KDTREE_LOAD(t->root);
     int depth = 0;
+    bool found = false;
 
     while (curr_node != NULL){
+        KDTREE_COUNT(nodes_visited, 1);
+        KDTREE_COUNT(points_tested, 1);
         if(curr_node->loc.lon == p->lon && curr_node->loc.lat == p->lat){
-            return true;
+            found = true;
+            break;
         }
 
         int cut_dim = depth % 2;
 
         //traverse the tree right or left
         if((cut_dim == 0 && p->lon < curr_node->loc.lon) || (cut_dim == 1 && p->lat < curr_node->loc.lat)){
-            curr_node = curr_node->left;
+            KDTREE_COUNT_IF(KDTREE_LOAD(curr_node->right) != NULL, nodes_pruned);
+            curr_node = KDTREE_LOAD(curr_node->left);
         }else{
-            curr_node = curr_node->right;
+            KDTREE_COUNT_IF(KDTREE_LOAD(curr_node->left) != NULL, nodes_pruned);
+            curr_node = KDTREE_LOAD(curr_node->right);
         }
         depth++;
     }
-    return false;
+    if (t->epoch != NULL){
+        kdtree_epoch_exit(t->epoch, ticket);
+    }
+    KDTREE_COUNT(points_emitted, found);
+    KDTREE_COUNT_FINISH(t);
+    return found;
 }
 
-kdtree_node *kdtree_add_helper(kdtree_node *node, const location *pt, int depth){
-    if (node == NULL){
-        //create one and populate
-        kdtree_node *new_node = malloc(sizeof(kdtree_node));
-        //by dereferencing we are creating a copy
-        new_node->loc = *pt;
-        new_node->cut_dim = depth % 2;
-        new_node->left = NULL;
-        new_node->right = NULL;
+//each public operation checks its arguments, then is traced and timed
+//around a kdtree_do_ one that does the work, which is what the library
+//and its wrapper modules call internally so nothing is recorded twice
+bool kdtree_contains(const kdtree *t, const location *p){
+    if (t == NULL || p == NULL){
+        return false;
+    }
+    kdtree_trace_record(KDTREE_OP_CONTAINS, p, NULL);
+    uint64_t start = kdtree_latency_start();
+    bool found = kdtree_do_contains(t, p);
+    kdtree_latency_stop(KDTREE_OP_CONTAINS, start);
+    return found;
+}
+
+//number of searches kdtree_contains_many keeps in flight
+#define KDTREE_CONTAINS_GROUP 16
+
+#ifdef __GNUC__
+#define KDTREE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define KDTREE_PREFETCH(p) ((void)(p))
+#endif
+
+typedef struct {
+    const kdtree_node *node;  //next node to visit
+    size_t query;             //index of the point being searched for
+} kdtree_search_lane;
+
+void kdtree_do_contains_many(const kdtree *t, const location *pts, size_t n, bool *out){
+    if (t == NULL || pts == NULL || out == NULL){
+        return;
+    }
+    KDTREE_COUNT_START();
+    if (t->index != NULL && t->epoch == NULL){
+        for (size_t i = 0; i < n; i++){
+            out[i] = kdtree_hashset_contains(t->index, &pts[i]);
+            KDTREE_COUNT(points_emitted, out[i]);
+        }
+        KDTREE_COUNT(points_tested, n);
+        KDTREE_COUNT_FINISH(t);
+        return;
+    }
+    if (t->file != NULL){
+        for (size_t i = 0; i < n; i++){
+            out[i] = kdtree_file_contains(t->file, &pts[i]);
+        }
+        return;
+    }
+    if (t->paged != NULL){
+        kdtree_query_io = (kdtree_io_stats){0, 0};
+        for (size_t i = 0; i < n; i++){
+            out[i] = kdtree_paged_contains(t->paged, &pts[i], &kdtree_query_io);
+        }
+        return;
+    }
 
-        // printf("Point ADDED: %lf - %lf   %d\n", pt->lat, pt->lon, new_node->cut_dim);
-        return new_node;
+    size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+    const kdtree_node *root = KDTREE_LOAD(t->root);
+    kdtree_search_lane lanes[KDTREE_CONTAINS_GROUP];
+    size_t active = 0;
+    size_t next_query = 0;
+    while (active < KDTREE_CONTAINS_GROUP && next_query < n){
+        lanes[active].node = root;
+        lanes[active].query = next_query++;
+        active++;
     }
 
-    int cut_dime = depth % 2;
-    if((cut_dime == 0 && pt->lon < node->loc.lon) || (cut_dime == 1 && pt->lat < node->loc.lat)){
-            node->left = kdtree_add_helper(node->left, pt, depth + 1);
-    }else{
-        node->right = kdtree_add_helper(node->right, pt, depth + 1);
+    //take one step in each search in turn; by the time we come back to
+    //a search, the child we prefetched for it has usually arrived
+    while (active > 0){
+        size_t i = 0;
+        while (i < active){
+            kdtree_search_lane *lane = &lanes[i];
+            const kdtree_node *node = lane->node;
+            const location *p = &pts[lane->query];
+
+            bool found = node != NULL && node->loc.lon == p->lon && node->loc.lat == p->lat;
+            KDTREE_COUNT(nodes_visited, node != NULL);
+            KDTREE_COUNT(points_tested, node != NULL);
+            if (node == NULL || found){
+                //this search is done; start the next one in its place,
+                //or close the gap if there are no more points
+                out[lane->query] = found;
+                KDTREE_COUNT(points_emitted, found);
+                if (next_query < n){
+                    lane->node = root;
+                    lane->query = next_query++;
+                    i++;
+                } else{
+                    lanes[i] = lanes[--active];
+                }
+                continue;
+            }
+
+            //choose the child without branching on the comparison
+            int cut_dim = node->cut_dim;
+            double key = cut_dim == 0 ? p->lon : p->lat;
+            double cut = cut_dim == 0 ? node->loc.lon : node->loc.lat;
+            const kdtree_node *children[2] = {KDTREE_LOAD(node->right), KDTREE_LOAD(node->left)};
+            const kdtree_node *child = children[key < cut];
+            KDTREE_COUNT_IF(children[key >= cut] != NULL, nodes_pruned);
+            KDTREE_PREFETCH(child);
+            lane->node = child;
+            i++;
+        }
     }
-    return node;
+    if (t->epoch != NULL){
+        kdtree_epoch_exit(t->epoch, ticket);
+    }
+    KDTREE_COUNT_FINISH(t);
 }
 
-bool kdtree_add(kdtree *t, const location *p){
-    if (t == NULL || p == NULL){
+void kdtree_contains_many(const kdtree *t, const location *pts, size_t n, bool *out){
+    if (t == NULL || pts == NULL || out == NULL){
+        return;
+    }
+    kdtree_trace_record_many(KDTREE_OP_CONTAINS, pts, n);
+    kdtree_do_contains_many(t, pts, n, out);
+}
+
+//finds the empty link where pt belongs and hangs a new leaf there; the
+//leaf is filled in before it is linked so readers never see it half done.
+//With several adders the leaf is attached with a compare-and-swap, and
+//if another thread attached one first we carry on down from that one.
+//Returns 1 if pt was added, 0 if it was already there, -1 if out of memory
+int kdtree_add_helper(kdtree *t, const location *pt){
+    bool shared = t->concurrency == KDTREE_CONCURRENT_INSERT;
+    kdtree_node *new_node = NULL;
+    kdtree_node **link = &t->root;
+    int depth = 0;
+    while (true){
+        kdtree_node *node = KDTREE_LOAD(*link);
+        if (node != NULL && t->snapshotted){
+            //copy the path down so snapshots don't see the new leaf
+            node = kdtree_own(t, node);
+            if (node == NULL){
+                return -1;
+            }
+            *link = node;
+        }
+        if (node == NULL){
+            if (new_node == NULL){
+                //create one and populate
+                new_node = malloc(sizeof(kdtree_node));
+                if (new_node == NULL){
+                    return -1;
+                }
+                //by dereferencing we are creating a copy
+                new_node->loc = *pt;
+                new_node->refs = 1;
+                new_node->left = NULL;
+                new_node->right = NULL;
+            }
+            new_node->cut_dim = depth % 2;
+            if (!shared){
+                KDTREE_PUBLISH(*link, new_node);
+                return 1;
+            }
+            if (__atomic_compare_exchange_n(link, &node, new_node, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)){
+                return 1;
+            }
+            //lost the race; node is now the winner's leaf
+        }
+
+        if (node->loc.lon == pt->lon && node->loc.lat == pt->lat){
+            free(new_node);
+            return 0;
+        }
+        int cut_dime = depth % 2;
+        if((cut_dime == 0 && pt->lon < node->loc.lon) || (cut_dime == 1 && pt->lat < node->loc.lat)){
+            link = &node->left;
+        }else{
+            link = &node->right;
+        }
+        depth++;
+    }
+}
+
+bool kdtree_do_add(kdtree *t, const location *p){
+    if (t == NULL || p == NULL || t->read_only){
         return false;
     }
-    //check if point is already in the tree
-    if (kdtree_contains(t, p)){
+    if (t->snapshotted && t->index == NULL && kdtree_do_contains(t, p)){
+        //don't copy the path to a point that is already there
         return false;
     }
+    //check if point is already in the tree
+    if (t->index != NULL){
+        int added = kdtree_hashset_add(t->index, p);
+        if (added == 0){
+            return false;
+        } else if (added < 0){
+            //out of memory for the index, so fall back to the tree
+            kdtree_disable_hash_index(t);
+        }
+    }
 
-    int cut_dim_of_root = t->root == NULL ? 0 : t->root->cut_dim;
-    t->root = kdtree_add_helper(t->root, p, cut_dim_of_root);
-    t->tree_size++;
+    int added = kdtree_add_helper(t, p);
+    if (added <= 0){
+        if (added < 0 && t->index != NULL){
+            kdtree_hashset_remove(t->index, p);
+        }
+        return false;
+    }
+    if (t->added != NULL){
+        //tree_size catches up when the mode is left
+        size_t stripe = ((uintptr_t)&kdtree_thread_tag >> 6) % KDTREE_SIZE_STRIPES;
+        __atomic_fetch_add(&t->added[stripe].count, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    //atomic so that kdtree_size can be called by concurrent readers
+    __atomic_store_n(&t->tree_size, t->tree_size + 1, __ATOMIC_RELAXED);
+    kdtree_count_update(t);
     return true;
 }
 
+bool kdtree_add(kdtree *t, const location *p){
+    if (t == NULL || p == NULL){
+        return false;
+    }
+    kdtree_trace_record(KDTREE_OP_ADD, p, NULL);
+    uint64_t start = kdtree_latency_start();
+    bool added = kdtree_do_add(t, p);
+    kdtree_latency_stop(KDTREE_OP_ADD, start);
+    return added;
+}
+
 //Helper function
-kdtree_node *kdtree_remove_helper(kdtree_node *node, const location *p){
+kdtree_node *kdtree_remove_helper(kdtree *t, kdtree_node *node, const location *p, bool *removed){
     if(node == NULL || p == NULL){
         return NULL;
     }
-    //base case(if we find the point to delete)
-    if(node->loc.lon == p->lon && node->loc.lat == p->lat){
-        //case1: if node has no children
-        if(node->left == NULL && node->right == NULL){
-            // printf("Point REMOVED: %lf - %lf    %d\n", p->lat, p->lon, node->cut_dim);
-            free(node);
-            return NULL;
-        }
-        //case 2: if node has 1 child
-        if (node->left == NULL){
-            // printf("Point REMOVED: %lf - %lf    %d\n", p->lat, p->lon, node->cut_dim);
-            int cut_dim = node->cut_dim;
-            kdtree_link_info min_node = kdtree_find_extreme(node->right, 1 - cut_dim, &node->right, cut_dim, -1);
-            node->loc = min_node.n->loc;
-            node->right = kdtree_remove_helper(node->right, &min_node.n->loc);
+    bool found = node->loc.lon == p->lon && node->loc.lat == p->lat;
+    //case1: if node has no children
+    if(found && node->left == NULL && node->right == NULL){
+        // printf("Point REMOVED: %lf - %lf    %d\n", p->lat, p->lon, node->cut_dim);
+        *removed = true;
+        kdtree_node_free(t, node);
+        return NULL;
+    }
+    if (t->snapshotted){
+        //everything changed below is changed in copies, path and all
+        kdtree_node *own = kdtree_own(t, node);
+        if (own == NULL){
+            //out of memory; leave this subtree as it is
             return node;
         }
-        if (node->right == NULL){
-            // printf("Point REMOVED: %lf - %lf    %d\n", p->lat, p->lon, node->cut_dim);
-            int cut_dim = node->cut_dim;
-            kdtree_link_info max_node = kdtree_find_extreme(node->left, 1 - cut_dim, &node->right, cut_dim, 1);
-            node->loc = max_node.n->loc;
-            node->right = kdtree_remove_helper(node->right, &max_node.n->loc);
-            return node;
+        node = own;
+    }
+    //base case(if we find the point to delete)
+    if(found){
+        //case 2: if node only has a left child, make it the right child so
+        //that the replacement is always the minimum of the right subtree
+        //(the maximum of the left subtree would have to be moved up with
+        //any ties on its left, breaking the rule that left is strictly less)
+        bool swapped = node->right == NULL;
+        if (swapped){
+            node->right = node->left;
+            node->left = NULL;
         }
-        //case 3: two children(we are replacing the deleted node with the minimum node in the right subtree)
+        //case 3: replace the deleted node with the minimum node in the right subtree
         
         int cut_dim = node->cut_dim;
         //find min node in the right subtree
         kdtree_link_info min_node = kdtree_find_extreme(node->right, 1 - cut_dim, &node->right, cut_dim, -1);
 
         //copy over the min node to replace deleted node
-        node->loc = min_node.n->loc;
+        location min_loc = min_node.n->loc;
+        node->loc = min_loc;
         //remove the copied over node from the tree
-        node->right = kdtree_remove_helper(node->right, &min_node.n->loc);
+        bool moved = false;
+        node->right = kdtree_remove_helper(t, node->right, &min_loc, &moved);
+        if (!moved){
+            //out of memory copying the path to the minimum, so put p back
+            node->loc = *p;
+            if (swapped){
+                node->left = node->right;
+                node->right = NULL;
+            }
+            return node;
+        }
 
+        *removed = true;
         return node;
     }
 
@@ -238,23 +678,190 @@ kdtree_node *kdtree_remove_helper(kdtree_node *node, const location *p){
     int cut_dim = node->cut_dim;
     //move left
     if((cut_dim == 0 && p->lon < node->loc.lon) || (cut_dim == 1 && p->lat < node->loc.lat)){
-        node->left = kdtree_remove_helper(node->left, p);
+        node->left = kdtree_remove_helper(t, node->left, p, removed);
     }else{
-        node->right = kdtree_remove_helper(node->right, p);
+        node->right = kdtree_remove_helper(t, node->right, p, removed);
     }
     return node;
 }
 
-void kdtree_remove(kdtree *t, const location *p){
+//nodes replaced while removing a point without changing any node that
+//readers can reach
+typedef struct {
+    kdtree_node **old;    //unlinked nodes, released once the copy is published
+    size_t old_count;
+    kdtree_node **made;   //copies, freed if we run out of memory part way
+    size_t made_count;
+    size_t capacity;
+    bool failed;
+} kdtree_path_copy;
+
+//makes room to remember one more node (there are never more copies
+//than unlinked nodes)
+static bool kdtree_path_reserve(kdtree_path_copy *pc){
+    if (pc->old_count < pc->capacity){
+        return true;
+    }
+    size_t capacity = pc->capacity == 0 ? 32 : pc->capacity * 2;
+    kdtree_node **old = realloc(pc->old, sizeof(kdtree_node *) * capacity);
+    if (old != NULL){
+        pc->old = old;
+    }
+    kdtree_node **made = realloc(pc->made, sizeof(kdtree_node *) * capacity);
+    if (made != NULL){
+        pc->made = made;
+    }
+    if (old == NULL || made == NULL){
+        pc->failed = true;
+        return false;
+    }
+    pc->capacity = capacity;
+    return true;
+}
+
+//returns a private copy of node, remembering both
+static kdtree_node *kdtree_copy_node(kdtree_path_copy *pc, kdtree_node *node){
+    if (!kdtree_path_reserve(pc)){
+        return NULL;
+    }
+    kdtree_node *copy = malloc(sizeof(kdtree_node));
+    if (copy == NULL){
+        pc->failed = true;
+        return NULL;
+    }
+    *copy = *node;
+    pc->old[pc->old_count++] = node;
+    pc->made[pc->made_count++] = copy;
+    return copy;
+}
+
+static kdtree_node *kdtree_copy_remove_helper(kdtree_path_copy *pc, kdtree_node *node, const location *p);
+
+//returns a copy of the subtree rooted at node without node's own point,
+//sharing every subtree that doesn't change; same cases as kdtree_remove_helper
+static kdtree_node *kdtree_copy_remove_root(kdtree_path_copy *pc, kdtree_node *node){
+    if (node->left == NULL && node->right == NULL){
+        if (kdtree_path_reserve(pc)){
+            pc->old[pc->old_count++] = node;
+        }
+        return NULL;
+    }
+    kdtree_node *left = node->left;
+    kdtree_node *right = node->right;
+    if (right == NULL){
+        right = left;
+        left = NULL;
+    }
+    int cut_dim = node->cut_dim;
+    location min_loc = kdtree_find_extreme(right, 1 - cut_dim, &right, cut_dim, -1).n->loc;
+
+    kdtree_node *copy = kdtree_copy_node(pc, node);
+    if (copy == NULL){
+        return NULL;
+    }
+    copy->loc = min_loc;
+    copy->left = left;
+    copy->right = kdtree_copy_remove_helper(pc, right, &min_loc);
+    return copy;
+}
+
+//returns a copy of the path from node to p with p removed; p must be in
+//the subtree rooted at node
+static kdtree_node *kdtree_copy_remove_helper(kdtree_path_copy *pc, kdtree_node *node, const location *p){
+    if (node->loc.lon == p->lon && node->loc.lat == p->lat){
+        return kdtree_copy_remove_root(pc, node);
+    }
+    kdtree_node *copy = kdtree_copy_node(pc, node);
+    if (copy == NULL){
+        return NULL;
+    }
+    int cut_dim = node->cut_dim;
+    if((cut_dim == 0 && p->lon < node->loc.lon) || (cut_dim == 1 && p->lat < node->loc.lat)){
+        copy->left = kdtree_copy_remove_helper(pc, node->left, p);
+    }else{
+        copy->right = kdtree_copy_remove_helper(pc, node->right, p);
+    }
+    return copy;
+}
+
+//removes p for KDTREE_SINGLE_WRITER trees: builds the changed part of the
+//tree off to the side, then swaps it in with a single store
+static bool kdtree_remove_concurrent(kdtree *t, const location *p){
+    kdtree_node **link = &t->root;
+    while (*link != NULL && ((*link)->loc.lon != p->lon || (*link)->loc.lat != p->lat)){
+        kdtree_node *node = *link;
+        int cut_dim = node->cut_dim;
+        if((cut_dim == 0 && p->lon < node->loc.lon) || (cut_dim == 1 && p->lat < node->loc.lat)){
+            link = &node->left;
+        }else{
+            link = &node->right;
+        }
+    }
+    if (*link == NULL){
+        return false;
+    }
+
+    kdtree_path_copy pc = {NULL, 0, NULL, 0, 0, false};
+    kdtree_node *replacement = kdtree_copy_remove_root(&pc, *link);
+    if (pc.failed){
+        for (size_t i = 0; i < pc.made_count; i++){
+            free(pc.made[i]);
+        }
+    } else{
+        KDTREE_PUBLISH(*link, replacement);
+        for (size_t i = 0; i < pc.old_count; i++){
+            kdtree_node_free(t, pc.old[i]);
+        }
+    }
+    free(pc.old);
+    free(pc.made);
+    return !pc.failed;
+}
+
+void kdtree_do_remove(kdtree *t, const location *p){
     if(t == NULL || p == NULL){
         return;
     }
 
-    
-    t->root = kdtree_remove_helper(t->root, p);
-    if (t->root != NULL){
-        t->tree_size--;
+    if (t->read_only){
+        return;
+    }
+
+    //with the index we know right away if there is anything to remove
+    if (t->index != NULL && !kdtree_hashset_remove(t->index, p)){
+        return;
+    }
+    if (t->snapshotted && t->index == NULL && !kdtree_do_contains(t, p)){
+        //don't copy the path to a point that isn't there
+        return;
+    }
+
+    bool removed = false;
+    if (t->epoch != NULL){
+        removed = kdtree_remove_concurrent(t, p);
+    } else{
+        t->root = kdtree_remove_helper(t, t->root, p, &removed);
+    }
+    if (!removed && t->index != NULL){
+        //out of memory, so the point is still there
+        if (kdtree_hashset_add(t->index, p) < 0){
+            kdtree_disable_hash_index(t);
+        }
+    }
+    if (removed){
+        __atomic_store_n(&t->tree_size, t->tree_size - 1, __ATOMIC_RELAXED);
+        kdtree_count_update(t);
+    }
+}
+
+void kdtree_remove(kdtree *t, const location *p){
+    if (t == NULL || p == NULL){
+        return;
     }
+    kdtree_trace_record(KDTREE_OP_REMOVE, p, NULL);
+    uint64_t start = kdtree_latency_start();
+    kdtree_do_remove(t, p);
+    kdtree_latency_stop(KDTREE_OP_REMOVE, start);
 }
 
 //Helpr function
@@ -262,9 +869,12 @@ void kdtree_range_helper(kdtree_node *node, const location *sw, const location *
     if (node == NULL){
         return;
     }
+    KDTREE_COUNT(nodes_visited, 1);
+    KDTREE_COUNT(points_tested, 1);
 
     //check if node is within range
     if(sw->lon <= node->loc.lon && ne->lon >= node->loc.lon && sw->lat <= node->loc.lat && ne->lat >= node->loc.lat){
+        KDTREE_COUNT(points_emitted, 1);
         //resize array if need be
         if((*index + 1) >= *capacity){
             *capacity *= 2;
@@ -281,23 +891,56 @@ void kdtree_range_helper(kdtree_node *node, const location *sw, const location *
     if(cut_dim == 0){
         //if the node is to the right of sw, traverse its left
         if(sw->lon <= node->loc.lon){
-            kdtree_range_helper(node->left, sw, ne, loc_points, index, capacity, depth + 1);
+            kdtree_range_helper(KDTREE_LOAD(node->left), sw, ne, loc_points, index, capacity, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->left) != NULL, nodes_pruned);
         }
         //if the node is to the left of ne, traverse its right
         if(ne->lon >= node->loc.lon){
-            kdtree_range_helper(node->right, sw, ne, loc_points, index, capacity, depth + 1);
+            kdtree_range_helper(KDTREE_LOAD(node->right), sw, ne, loc_points, index, capacity, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->right) != NULL, nodes_pruned);
         }
     } else{//for lat
         if(sw->lat <= node->loc.lat){
-            kdtree_range_helper(node->left, sw, ne, loc_points, index, capacity, depth + 1);
+            kdtree_range_helper(KDTREE_LOAD(node->left), sw, ne, loc_points, index, capacity, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->left) != NULL, nodes_pruned);
         }
         if(ne->lat >= node->loc.lat){
-            kdtree_range_helper(node->right, sw, ne, loc_points, index, capacity, depth + 1);
+            kdtree_range_helper(KDTREE_LOAD(node->right), sw, ne, loc_points, index, capacity, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->right) != NULL, nodes_pruned);
         }
     }
 }
 
-location *kdtree_range(const kdtree *t, const location *sw, const location *ne, int *n){
+//where kdtree_range_append puts points: the same array kdtree_range_helper fills
+typedef struct {
+    location **loc_points;
+    size_t *index;
+    size_t *capacity;
+    bool failed;  //the array could not be grown, so points were dropped
+} kdtree_range_output;
+
+static void kdtree_range_append(const location *loc, void *arg){
+    kdtree_range_output *out = arg;
+    if (out->failed){
+        return;
+    }
+    if((*out->index + 1) >= *out->capacity){
+        location *bigger = realloc(*out->loc_points, sizeof(location) * *out->capacity * 2);
+        if (bigger == NULL){
+            out->failed = true;
+            return;
+        }
+        *out->capacity *= 2;
+        *out->loc_points = bigger;
+    }
+    (*out->loc_points)[(*out->index)++] = *loc;
+}
+
+location *kdtree_do_range(const kdtree *t, const location *sw, const location *ne, int *n){
     if(t == NULL || sw == NULL || ne == NULL || n == NULL){
         return NULL;
     }
@@ -305,25 +948,60 @@ location *kdtree_range(const kdtree *t, const location *sw, const location *ne,
     size_t capacity = 15;
     size_t index = 0;
     location *loc_points = malloc(sizeof(location) * capacity);
+    if (loc_points == NULL){
+        *n = 0;
+        return NULL;
+    }
+    KDTREE_COUNT_START();
 
-    kdtree_range_helper(t->root, sw, ne,&loc_points,  &index, &capacity, 0);
+    kdtree_range_output out = {&loc_points, &index, &capacity, false};
+    if (t->file != NULL){
+        kdtree_file_range_for_each(t->file, sw, ne, kdtree_range_append, &out);
+    } else if (t->paged != NULL){
+        kdtree_query_io = (kdtree_io_stats){0, 0};
+        kdtree_paged_range_for_each(t->paged, sw, ne, kdtree_range_append, &out, &kdtree_query_io);
+    } else{
+        size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+        kdtree_range_helper(KDTREE_LOAD(t->root), sw, ne,&loc_points,  &index, &capacity, 0);
+        if (t->epoch != NULL){
+            kdtree_epoch_exit(t->epoch, ticket);
+        }
+        KDTREE_COUNT_FINISH(t);
+    }
 
+    if (out.failed){
+        index = 0;
+    }
     *n = index;
-    if (index == 0){//nothing was stored
+    if (index == 0){//nothing was stored, or memory ran out
         free(loc_points);
         return NULL;
     }
     return loc_points;
 }
 
+location *kdtree_range(const kdtree *t, const location *sw, const location *ne, int *n){
+    if (t == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    kdtree_trace_record(KDTREE_OP_RANGE, sw, ne);
+    uint64_t start = kdtree_latency_start();
+    location *pts = kdtree_do_range(t, sw, ne, n);
+    kdtree_latency_stop(KDTREE_OP_RANGE, start);
+    return pts;
+}
+
 //Helper function
 void kdtree_range_for_each_helper(kdtree_node *node, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg, int depth){
     if (node == NULL){
         return;
     }
+    KDTREE_COUNT(nodes_visited, 1);
+    KDTREE_COUNT(points_tested, 1);
 
     //check if node is within range
     if(sw->lon <= node->loc.lon && ne->lon >= node->loc.lon && sw->lat <= node->loc.lat && ne->lat >= node->loc.lat){
+        KDTREE_COUNT(points_emitted, 1);
         //call f on node
         f(&node->loc, arg);
     }
@@ -333,44 +1011,1061 @@ void kdtree_range_for_each_helper(kdtree_node *node, const location *sw, const l
     //for lon
     if(cut_dim == 0){
         if(sw->lon <= node->loc.lon){
-            kdtree_range_for_each_helper(node->left, sw, ne, f, arg, depth + 1);
+            kdtree_range_for_each_helper(KDTREE_LOAD(node->left), sw, ne, f, arg, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->left) != NULL, nodes_pruned);
         }
         if(ne->lon >= node->loc.lon){
-            kdtree_range_for_each_helper(node->right, sw, ne, f, arg, depth + 1);
+            kdtree_range_for_each_helper(KDTREE_LOAD(node->right), sw, ne, f, arg, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->right) != NULL, nodes_pruned);
         }
     } else{ //for lat
         if(sw->lat <= node->loc.lat){
-            kdtree_range_for_each_helper(node->left, sw, ne, f, arg, depth + 1);
+            kdtree_range_for_each_helper(KDTREE_LOAD(node->left), sw, ne, f, arg, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->left) != NULL, nodes_pruned);
         }
         if(ne->lat >= node->loc.lat){
-            kdtree_range_for_each_helper(node->right, sw, ne, f, arg, depth + 1);
+            kdtree_range_for_each_helper(KDTREE_LOAD(node->right), sw, ne, f, arg, depth + 1);
+        } else{
+            KDTREE_COUNT_IF(KDTREE_LOAD(node->right) != NULL, nodes_pruned);
         }
     }
 }
-void kdtree_range_for_each(const kdtree *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
+void kdtree_do_range_for_each(const kdtree *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
     if(t == NULL || sw == NULL || ne == NULL || f == NULL){
         return;
     }
-    kdtree_range_for_each_helper(t->root, sw, ne, f, arg, 0);
+    KDTREE_COUNT_START();
+    if (t->file != NULL){
+        kdtree_file_range_for_each(t->file, sw, ne, f, arg);
+        return;
+    }
+    if (t->paged != NULL){
+        kdtree_query_io = (kdtree_io_stats){0, 0};
+        kdtree_paged_range_for_each(t->paged, sw, ne, f, arg, &kdtree_query_io);
+        return;
+    }
+    size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+    kdtree_range_for_each_helper(KDTREE_LOAD(t->root), sw, ne, f, arg, 0);
+    if (t->epoch != NULL){
+        kdtree_epoch_exit(t->epoch, ticket);
+    }
+    KDTREE_COUNT_FINISH(t);
 }
 
-//helper function
-void kdtree_destroy_helper(kdtree_node *node){
-    //base case
-    if(node == NULL){
+void kdtree_range_for_each(const kdtree *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
+    if (t == NULL || sw == NULL || ne == NULL || f == NULL){
         return;
     }
-    //recursively free the nodes
-    kdtree_destroy_helper(node->left);
-    kdtree_destroy_helper(node->right);
+    kdtree_trace_record(KDTREE_OP_RANGE_FOR_EACH, sw, ne);
+    uint64_t start = kdtree_latency_start();
+    kdtree_do_range_for_each(t, sw, ne, f, arg);
+    kdtree_latency_stop(KDTREE_OP_RANGE_FOR_EACH, start);
+}
+
+static void kdtree_for_each_node(const kdtree_node *node, void (*f)(const location *, void *), void *arg){
+    while (node != NULL){
+        f(&node->loc, arg);
+        kdtree_for_each_node(KDTREE_LOAD(node->left), f, arg);
+        node = KDTREE_LOAD(node->right);
+    }
+}
+
+void kdtree_for_each_point(const kdtree *t, void (*f)(const location *, void *), void *arg){
+    //valid points may have any finite longitude, so no rectangle on the
+    //globe is sure to hold them all
+    location sw = {-INFINITY, -INFINITY};
+    location ne = {INFINITY, INFINITY};
+    if (t->file != NULL){
+        kdtree_file_range_for_each(t->file, &sw, &ne, f, arg);
+    } else if (t->paged != NULL){
+        kdtree_io_stats io = {0, 0};
+        kdtree_paged_range_for_each(t->paged, &sw, &ne, f, arg, &io);
+    } else{
+        size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+        kdtree_for_each_node(KDTREE_LOAD(t->root), f, arg);
+        if (t->epoch != NULL){
+            kdtree_epoch_exit(t->epoch, ticket);
+        }
+    }
+}
+
+location *kdtree_points(const kdtree *t, size_t *n){
+    size_t capacity = 15;
+    size_t index = 0;
+    location *pts = malloc(sizeof(location) * capacity);
+    if (pts == NULL){
+        return NULL;
+    }
+    kdtree_range_output out = {&pts, &index, &capacity, false};
+    kdtree_for_each_point(t, kdtree_range_append, &out);
+    if (out.failed){
+        free(pts);
+        return NULL;
+    }
+    *n = index;
+    return pts;
+}
+
+//subtrees nearer the root than this are handed out as separate tasks, so
+//there are enough of them for idle threads to steal
+#define KDTREE_PARALLEL_SPLIT_DEPTH 12
+//trees smaller than this are searched on the calling thread
+#define KDTREE_PARALLEL_MIN_SIZE 4096
+
+typedef struct {
+    kdtree_node *node;
+    int depth;
+} kdtree_range_task;
+
+typedef struct kdtree_range_pool kdtree_range_pool;
+
+//one thread's share of a parallel range query: a deque of subtrees still
+//to search, where the owner works at the tail and thieves take from the
+//head, and a buffer of the points it found
+typedef struct {
+    pthread_mutex_t lock;
+    kdtree_range_task *tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    location *found;
+    size_t found_count;
+    size_t found_capacity;
+    bool failed;
+    kdtree_range_pool *pool;
+    size_t id;
+} kdtree_range_worker;
+
+struct kdtree_range_pool{
+    const location *sw;
+    const location *ne;
+    void (*f)(const location *, void *);  //NULL to collect points instead
+    void *arg;
+    kdtree_range_worker *workers;
+    size_t count;
+    size_t pending;  //tasks pushed but not yet finished
+};
+
+static bool kdtree_range_push(kdtree_range_worker *w, kdtree_node *node, int depth){
+    bool pushed = true;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->capacity){
+        size_t capacity = w->capacity == 0 ? 64 : w->capacity * 2;
+        kdtree_range_task *bigger = realloc(w->tasks, sizeof(kdtree_range_task) * capacity);
+        if (bigger == NULL){
+            pushed = false;
+        } else{
+            w->tasks = bigger;
+            w->capacity = capacity;
+        }
+    }
+    if (pushed){
+        //count it before anyone can take it, so pending never reads 0 early
+        __atomic_add_fetch(&w->pool->pending, 1, __ATOMIC_RELAXED);
+        w->tasks[w->tail++] = (kdtree_range_task){node, depth};
+    }
+    pthread_mutex_unlock(&w->lock);
+    return pushed;
+}
+
+//takes the newest task from w's own deque if owner is true, or the oldest
+//(usually the biggest subtree) if stealing
+static bool kdtree_range_take(kdtree_range_worker *w, bool owner, kdtree_range_task *task){
+    bool taken = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head){
+        *task = owner ? w->tasks[--w->tail] : w->tasks[w->head++];
+        taken = true;
+    }
+    if (w->tail == w->head){
+        w->head = 0;
+        w->tail = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return taken;
+}
 
-    free(node);
+static void kdtree_range_report(kdtree_range_worker *w, const location *loc){
+    kdtree_range_pool *pool = w->pool;
+    if (pool->f != NULL){
+        pool->f(loc, pool->arg);
+        return;
+    }
+    if (w->found_count == w->found_capacity){
+        size_t capacity = w->found_capacity == 0 ? 256 : w->found_capacity * 2;
+        location *bigger = realloc(w->found, sizeof(location) * capacity);
+        if (bigger == NULL){
+            w->failed = true;
+            return;
+        }
+        w->found = bigger;
+        w->found_capacity = capacity;
+    }
+    w->found[w->found_count++] = *loc;
 }
+
+//searches one subtree, leaving the right half of each split near the root
+//on the deque for other threads and carrying on down the left half
+static void kdtree_range_run(kdtree_range_worker *w, kdtree_node *node, int depth){
+    const location *sw = w->pool->sw;
+    const location *ne = w->pool->ne;
+    while (node != NULL){
+        if(sw->lon <= node->loc.lon && ne->lon >= node->loc.lon && sw->lat <= node->loc.lat && ne->lat >= node->loc.lat){
+            kdtree_range_report(w, &node->loc);
+        }
+
+        int cut_dim = depth % 2;
+        double lo = cut_dim == 0 ? sw->lon : sw->lat;
+        double hi = cut_dim == 0 ? ne->lon : ne->lat;
+        double cut = cut_dim == 0 ? node->loc.lon : node->loc.lat;
+        kdtree_node *left = lo <= cut ? KDTREE_LOAD(node->left) : NULL;
+        kdtree_node *right = hi >= cut ? KDTREE_LOAD(node->right) : NULL;
+        depth++;
+        if (left != NULL && right != NULL){
+            if (depth > KDTREE_PARALLEL_SPLIT_DEPTH || !kdtree_range_push(w, right, depth)){
+                kdtree_range_run(w, right, depth);
+            }
+            node = left;
+        } else{
+            node = left != NULL ? left : right;
+        }
+    }
+}
+
+static void *kdtree_range_work(void *arg){
+    kdtree_range_worker *w = arg;
+    kdtree_range_pool *pool = w->pool;
+    while (true){
+        kdtree_range_task task;
+        bool found = kdtree_range_take(w, true, &task);
+        for (size_t i = 1; i < pool->count && !found; i++){
+            found = kdtree_range_take(&pool->workers[(w->id + i) % pool->count], false, &task);
+        }
+        if (found){
+            kdtree_range_run(w, task.node, task.depth);
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+        } else if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0){
+            return NULL;
+        } else{
+            //someone is still searching and may yet split off more work
+            sched_yield();
+        }
+    }
+}
+
+//runs a range query on up to nthreads threads, passing points to f, or
+//collecting them into *out if f is NULL; returns false if out of memory
+static bool kdtree_range_parallel_helper(const kdtree *t, const location *sw, const location *ne, size_t nthreads, void (*f)(const location *, void *), void *arg, location **out, int *n){
+    kdtree_range_pool pool = {sw, ne, f, arg, NULL, nthreads, 0};
+    KDTREE_COUNT_START();
+    pool.workers = calloc(nthreads, sizeof(kdtree_range_worker));
+    pthread_t *ids = malloc(sizeof(pthread_t) * nthreads);
+    if (pool.workers == NULL || ids == NULL){
+        free(pool.workers);
+        free(ids);
+        return false;
+    }
+    for (size_t i = 0; i < nthreads; i++){
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+    }
+
+    //the workers only run while this thread is inside the epoch, so its
+    //ticket protects them too
+    size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+    kdtree_node *root = KDTREE_LOAD(t->root);
+    bool ok = root == NULL || kdtree_range_push(&pool.workers[0], root, 0);
+    size_t started = 1;
+    while (ok && started < nthreads && pthread_create(&ids[started], NULL, kdtree_range_work, &pool.workers[started]) == 0){
+        started++;
+    }
+    if (ok){
+        kdtree_range_work(&pool.workers[0]);
+    }
+    for (size_t i = 1; i < started; i++){
+        pthread_join(ids[i], NULL);
+    }
+    if (t->epoch != NULL){
+        kdtree_epoch_exit(t->epoch, ticket);
+    }
+
+    //prefix sum of the buffer sizes gives where each one goes
+    size_t total = 0;
+    for (size_t i = 0; i < nthreads; i++){
+        ok = ok && !pool.workers[i].failed;
+        total += pool.workers[i].found_count;
+    }
+    if (f == NULL){
+        *out = NULL;
+        *n = 0;
+        if (ok && total > 0){
+            *out = malloc(sizeof(location) * total);
+            ok = *out != NULL;
+        }
+        if (ok){
+            size_t offset = 0;
+            for (size_t i = 0; i < nthreads; i++){
+                if (pool.workers[i].found_count > 0){
+                    memcpy(*out + offset, pool.workers[i].found, sizeof(location) * pool.workers[i].found_count);
+                }
+                offset += pool.workers[i].found_count;
+            }
+            *n = total;
+        }
+    }
+
+    for (size_t i = 0; i < nthreads; i++){
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].tasks);
+        free(pool.workers[i].found);
+    }
+    free(pool.workers);
+    free(ids);
+    return ok;
+}
+
+location *kdtree_range_parallel(const kdtree *t, const location *sw, const location *ne, size_t nthreads, int *n){
+    if(t == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    if (nthreads <= 1 || kdtree_size(t) < KDTREE_PARALLEL_MIN_SIZE || t->file != NULL || t->paged != NULL){
+        return kdtree_do_range(t, sw, ne, n);
+    }
+    location *pts;
+    if (!kdtree_range_parallel_helper(t, sw, ne, nthreads, NULL, NULL, &pts, n)){
+        *n = 0;
+        return NULL;
+    }
+    return pts;
+}
+
+void kdtree_range_for_each_parallel(const kdtree *t, const location *sw, const location *ne, size_t nthreads, void (*f)(const location *, void *), void *arg){
+    if(t == NULL || sw == NULL || ne == NULL || f == NULL){
+        return;
+    }
+    if (nthreads <= 1 || kdtree_size(t) < KDTREE_PARALLEL_MIN_SIZE || t->file != NULL || t->paged != NULL
+        || !kdtree_range_parallel_helper(t, sw, ne, nthreads, f, arg, NULL, NULL)){
+        kdtree_do_range_for_each(t, sw, ne, f, arg);
+    }
+}
+
+size_t kdtree_size(const kdtree *t){
+    if (t == NULL){
+        return 0;
+    }
+    size_t size = __atomic_load_n(&t->tree_size, __ATOMIC_RELAXED);
+    if (t->added != NULL){
+        for (size_t i = 0; i < KDTREE_SIZE_STRIPES; i++){
+            size += __atomic_load_n(&t->added[i].count, __ATOMIC_RELAXED);
+        }
+    }
+    return size;
+}
+
+//Helper function
+static bool kdtree_index_helper(kdtree_hashset *index, const kdtree_node *node){
+    if (node == NULL){
+        return true;
+    }
+    return kdtree_hashset_add(index, &node->loc) >= 0
+        && kdtree_index_helper(index, node->left)
+        && kdtree_index_helper(index, node->right);
+}
+
+bool kdtree_enable_hash_index(kdtree *t){
+    if (t == NULL){
+        return false;
+    }
+    if (t->index != NULL){
+        return true;
+    }
+    if (t->concurrency == KDTREE_CONCURRENT_INSERT || t->file != NULL || t->paged != NULL){
+        return false;
+    }
+
+    kdtree_hashset *index = malloc(sizeof(kdtree_hashset));
+    if (index == NULL){
+        return false;
+    }
+    if (!kdtree_hashset_init(index, t->tree_size)){
+        free(index);
+        return false;
+    }
+    if (!kdtree_index_helper(index, t->root)){
+        kdtree_hashset_destroy(index);
+        free(index);
+        return false;
+    }
+    t->index = index;
+    return true;
+}
+
+void kdtree_disable_hash_index(kdtree *t){
+    if (t == NULL || t->index == NULL){
+        return;
+    }
+    kdtree_hashset_destroy(t->index);
+    free(t->index);
+    t->index = NULL;
+}
+
+uint64_t kdtree_hilbert_index(const location *l){
+    //scale each coordinate to a 32-bit grid position
+    double lon = l->lon < -180.0 ? -180.0 : (l->lon > 180.0 ? 180.0 : l->lon);
+    double lat = l->lat;
+    uint32_t x = (uint32_t)((lon + 180.0) / 360.0 * 4294967295.0);
+    uint32_t y = (uint32_t)((lat + 90.0) / 180.0 * 4294967295.0);
+
+    //standard bit-at-a-time conversion, rotating the quadrant as we go
+    uint64_t d = 0;
+    for (uint32_t s = 1u << 31; s > 0; s >>= 1){
+        uint32_t rx = (x & s) != 0;
+        uint32_t ry = (y & s) != 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0){
+            if (rx == 1){
+                x = ~x;
+                y = ~y;
+            }
+            uint32_t tmp = x;
+            x = y;
+            y = tmp;
+        }
+    }
+    return d;
+}
+
+typedef struct {
+    kdtree_node *node;
+    size_t parent;  //preorder number of the parent
+} kdtree_layout_item;
+
+typedef struct {
+    uint64_t key;
+    size_t index;
+} kdtree_layout_key;
+
+static int kdtree_compare_layout_keys(const void *a, const void *b){
+    const kdtree_layout_key *k1 = a;
+    const kdtree_layout_key *k2 = b;
+    return (k1->key > k2->key) - (k1->key < k2->key);
+}
+
+//makes room for one more item in a growable array of layout items
+static bool kdtree_layout_reserve(kdtree_layout_item **items, size_t size, size_t *capacity){
+    if (size < *capacity){
+        return true;
+    }
+    kdtree_layout_item *bigger = realloc(*items, sizeof(kdtree_layout_item) * *capacity * 2);
+    if (bigger == NULL){
+        return false;
+    }
+    *items = bigger;
+    *capacity *= 2;
+    return true;
+}
+
+bool kdtree_relayout(kdtree *t){
+    if (t == NULL || t->read_only){
+        return false;
+    }
+    t->updates_since_layout = 0;
+    if (t->root == NULL){
+        return true;
+    }
+
+    //list the nodes in preorder with their parents, using an explicit
+    //stack since long-lived trees may be far from balanced
+    size_t count = 0;
+    size_t capacity = t->tree_size + 1;
+    size_t stack_size = 0;
+    size_t stack_capacity = 64;
+    kdtree_layout_item *nodes = malloc(sizeof(kdtree_layout_item) * capacity);
+    kdtree_layout_item *stack = malloc(sizeof(kdtree_layout_item) * stack_capacity);
+    if (nodes == NULL || stack == NULL){
+        free(nodes);
+        free(stack);
+        return false;
+    }
+    stack[stack_size++] = (kdtree_layout_item){t->root, 0};
+    while (stack_size > 0){
+        kdtree_layout_item item = stack[--stack_size];
+        if (!kdtree_layout_reserve(&nodes, count, &capacity)
+            || !kdtree_layout_reserve(&stack, stack_size + 1, &stack_capacity)){
+            free(nodes);
+            free(stack);
+            return false;
+        }
+        size_t i = count++;
+        nodes[i] = item;
+        if (item.node->right != NULL){
+            stack[stack_size++] = (kdtree_layout_item){item.node->right, i};
+        }
+        if (item.node->left != NULL){
+            stack[stack_size++] = (kdtree_layout_item){item.node->left, i};
+        }
+    }
+    free(stack);
+
+    //pos[i] is where the i-th node in preorder goes in the new block
+    kdtree_arena *arena = malloc(sizeof(kdtree_arena) + sizeof(kdtree_node) * count);
+    size_t *pos = malloc(sizeof(size_t) * count);
+    kdtree_layout_key *keys = NULL;
+    if (t->layout == KDTREE_LAYOUT_HILBERT){
+        keys = malloc(sizeof(kdtree_layout_key) * count);
+    }
+    if (arena == NULL || pos == NULL || (t->layout == KDTREE_LAYOUT_HILBERT && keys == NULL)){
+        free(arena);
+        free(pos);
+        free(keys);
+        free(nodes);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++){
+        pos[i] = i;
+    }
+    if (keys != NULL){
+        for (size_t i = 0; i < count; i++){
+            keys[i].key = kdtree_hilbert_index(&nodes[i].node->loc);
+            keys[i].index = i;
+        }
+        qsort(keys, count, sizeof(kdtree_layout_key), kdtree_compare_layout_keys);
+        for (size_t i = 0; i < count; i++){
+            pos[keys[i].index] = i;
+        }
+        free(keys);
+    }
+
+    //copy the nodes and relink them to their parents' copies
+    arena->refs = 1;
+    arena->count = count;
+    for (size_t i = 0; i < count; i++){
+        kdtree_node *copy = &arena->nodes[pos[i]];
+        copy->loc = nodes[i].node->loc;
+        copy->cut_dim = nodes[i].node->cut_dim;
+        copy->refs = 1;
+        copy->left = NULL;
+        copy->right = NULL;
+        if (i > 0){
+            size_t up = nodes[i].parent;
+            if (nodes[up].node->left == nodes[i].node){
+                arena->nodes[pos[up]].left = copy;
+            } else{
+                arena->nodes[pos[up]].right = copy;
+            }
+        }
+    }
+
+    //switch readers to the copy, then free the old nodes and the old block
+    //(or, if there are snapshots, whatever of them no snapshot still uses)
+    kdtree_arena *old_arena = t->arena;
+    kdtree_node *old_root = t->root;
+    KDTREE_PUBLISH(t->root, &arena->nodes[pos[0]]);
+    t->arena = arena;
+    if (t->snapshotted){
+        kdtree_node_unref(old_arena, old_root);
+        kdtree_arena_unref(old_arena);
+    } else{
+        for (size_t i = 0; i < count; i++){
+            if (!kdtree_in_arena(nodes[i].node, old_arena)){
+                kdtree_release(t, nodes[i].node);
+            }
+        }
+        if (old_arena != NULL){
+            kdtree_release(t, old_arena);
+        }
+    }
+
+    free(pos);
+    free(nodes);
+    return true;
+}
+
+void kdtree_set_auto_relayout(kdtree *t, kdtree_layout order, size_t updates){
+    if (t == NULL){
+        return;
+    }
+    t->layout = order;
+    t->relayout_every = updates;
+}
+
+size_t kdtree_do_add_many(kdtree *t, const location *pts, size_t n){
+    if (t == NULL || (pts == NULL && n > 0)){
+        return 0;
+    }
+
+    //add in Hilbert curve order, so each add goes down through mostly the
+    //same nodes as the one before and finds them in cache
+    kdtree_layout_key *keys = malloc(sizeof(kdtree_layout_key) * (n > 0 ? n : 1));
+    size_t added = 0;
+    if (keys == NULL){
+        for (size_t i = 0; i < n; i++){
+            added += kdtree_do_add(t, &pts[i]);
+        }
+        return added;
+    }
+    for (size_t i = 0; i < n; i++){
+        keys[i].key = kdtree_hilbert_index(&pts[i]);
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(kdtree_layout_key), kdtree_compare_layout_keys);
+    for (size_t i = 0; i < n; i++){
+        added += kdtree_do_add(t, &pts[keys[i].index]);
+    }
+    free(keys);
+    return added;
+}
+
+size_t kdtree_add_many(kdtree *t, const location *pts, size_t n){
+    if (t == NULL || (pts == NULL && n > 0)){
+        return 0;
+    }
+    kdtree_trace_record_many(KDTREE_OP_ADD, pts, n);
+    return kdtree_do_add_many(t, pts, n);
+}
+
+bool kdtree_set_concurrency(kdtree *t, kdtree_concurrency mode){
+    if (t == NULL){
+        return false;
+    }
+    if (mode == t->concurrency){
+        return true;
+    }
+    if (t->snapshotted){
+        //writes to shared nodes are only copied safely by a single thread
+        return false;
+    }
+
+    //set up what the new mode needs before tearing down the old one
+    kdtree_epoch *epoch = NULL;
+    kdtree_size_stripe *added = NULL;
+    if (mode == KDTREE_SINGLE_WRITER){
+        epoch = kdtree_epoch_create();
+        if (epoch == NULL){
+            return false;
+        }
+    } else if (mode == KDTREE_CONCURRENT_INSERT){
+        added = aligned_alloc(_Alignof(kdtree_size_stripe), sizeof(kdtree_size_stripe) * KDTREE_SIZE_STRIPES);
+        if (added == NULL){
+            return false;
+        }
+        for (size_t i = 0; i < KDTREE_SIZE_STRIPES; i++){
+            added[i].count = 0;
+        }
+        //the index can't be updated by several threads at once
+        kdtree_disable_hash_index(t);
+    }
+
+    //no other threads are left, so everything retired can go now
+    kdtree_epoch_destroy(t->epoch);
+    t->epoch = epoch;
+    size_t adds = 0;
+    if (t->added != NULL){
+        for (size_t i = 0; i < KDTREE_SIZE_STRIPES; i++){
+            adds += t->added[i].count;
+        }
+        free(t->added);
+    }
+    t->added = added;
+    t->concurrency = mode;
+
+    //count the adds made in concurrent insert mode
+    t->tree_size += adds;
+    if (adds > 0 && t->relayout_every > 0){
+        t->updates_since_layout += adds - 1;
+        kdtree_count_update(t);
+    }
+    return true;
+}
+
+kdtree *kdtree_snapshot(kdtree *t){
+    if (t == NULL || t->concurrency != KDTREE_SINGLE_THREADED || t->file != NULL || t->paged != NULL){
+        return NULL;
+    }
+    kdtree *snapshot = malloc(sizeof(kdtree));
+    if (snapshot == NULL){
+        return NULL;
+    }
+
+    //share the whole tree; from now on t copies nodes before changing them
+    *snapshot = *t;
+    snapshot->relayout_every = 0;
+    snapshot->updates_since_layout = 0;
+    snapshot->index = NULL;
+    snapshot->totals = (kdtree_query_counters){0, 0, 0, 0};
+    snapshot->snapshotted = true;
+    snapshot->read_only = true;
+    t->snapshotted = true;
+    if (t->root != NULL){
+        __atomic_add_fetch(&t->root->refs, 1, __ATOMIC_RELAXED);
+    }
+    if (t->arena != NULL){
+        __atomic_add_fetch(&t->arena->refs, 1, __ATOMIC_RELAXED);
+    }
+    return snapshot;
+}
+
+bool kdtree_save(const kdtree *t, const char *path){
+    if (t == NULL || path == NULL || t->paged != NULL){
+        return false;
+    }
+    if (t->file != NULL){
+        return kdtree_file_copy(t->file, path);
+    }
+    return kdtree_file_save(t->root, path);
+}
+
+bool kdtree_write(const kdtree *t, kdtree_file_writer *w){
+    if (t->paged != NULL){
+        return false;
+    }
+    if (t->file != NULL){
+        return kdtree_file_write_file(w, t->file);
+    }
+    return kdtree_file_write_tree(w, t->root);
+}
+
+kdtree *kdtree_open_mmap(const char *path){
+    return kdtree_open_file(kdtree_file_open(path));
+}
+
+kdtree *kdtree_open_file(kdtree_file *file){
+    if (file == NULL){
+        return NULL;
+    }
+    kdtree *t = kdtree_create(NULL, 0);
+    if (t == NULL){
+        kdtree_file_close(file);
+        return NULL;
+    }
+    t->file = file;
+    t->tree_size = kdtree_file_size(file);
+    t->read_only = true;
+    return t;
+}
+
+//nodes kdtree_load_stream reads the points into, and how many fit
+typedef struct {
+    kdtree_arena *arena;
+    size_t capacity;
+} kdtree_load_state;
+
+static bool kdtree_load_point(const location *loc, void *arg){
+    kdtree_load_state *s = arg;
+    if (s->arena->count == s->capacity){
+        size_t capacity = s->capacity + s->capacity / 2 + 1024;
+        kdtree_arena *bigger = realloc(s->arena, sizeof(kdtree_arena) + sizeof(kdtree_node) * capacity);
+        if (bigger == NULL){
+            return false;
+        }
+        s->arena = bigger;
+        s->capacity = capacity;
+    }
+    s->arena->nodes[s->arena->count++].loc = *loc;
+    return true;
+}
+
+static int kdtree_compare_node_locations(const void *a, const void *b){
+    return kdtree_compare_locations(&((const kdtree_node *)a)->loc, &((const kdtree_node *)b)->loc);
+}
+
+static double kdtree_node_coord(const kdtree_node *node, int dim){
+    return dim == 0 ? node->loc.lon : node->loc.lat;
+}
+
+static void kdtree_swap_nodes(kdtree_node *a, kdtree_node *b){
+    kdtree_node tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+//moves the node that belongs at k in order of the given coordinate
+//there, with nothing greater before it and nothing less after it
+static void kdtree_select(kdtree_node *nodes, size_t n, size_t k, int dim){
+    size_t lo = 0;
+    size_t hi = n - 1;
+    while (lo < hi){
+        double pivot = kdtree_node_coord(&nodes[k], dim);
+        size_t i = lo;
+        size_t j = hi;
+        while (i <= j){
+            while (kdtree_node_coord(&nodes[i], dim) < pivot){
+                i++;
+            }
+            while (pivot < kdtree_node_coord(&nodes[j], dim)){
+                j--;
+            }
+            if (i <= j){
+                kdtree_swap_nodes(&nodes[i], &nodes[j]);
+                i++;
+                if (j == 0){
+                    break;
+                }
+                j--;
+            }
+        }
+        if (j < k){
+            lo = i;
+        }
+        if (k < i){
+            hi = j;
+        }
+    }
+}
+
+//as kdtree_create_helper does with separate nodes, but each subtree's
+//root stays at its median and the halves are built around it
+kdtree_node *kdtree_build_in_place(kdtree_node *nodes, size_t n, int depth){
+    if (n == 0){
+        return NULL;
+    }
+    int cut_dimension = depth % 2;
+    size_t median = n / 2;
+    kdtree_select(nodes, n, median, cut_dimension);
+
+    //points equal to the median in the cut dimension have to go right,
+    //so gather any before it at the end of the left half and use the first
+    double cut = kdtree_node_coord(&nodes[median], cut_dimension);
+    size_t less = 0;
+    for (size_t i = 0; i < median; i++){
+        if (kdtree_node_coord(&nodes[i], cut_dimension) < cut){
+            kdtree_swap_nodes(&nodes[less++], &nodes[i]);
+        }
+    }
+    kdtree_swap_nodes(&nodes[less], &nodes[median]);
+    median = less;
+
+    kdtree_node *node = &nodes[median];
+    node->cut_dim = cut_dimension;
+    node->refs = 1;
+    node->left = kdtree_build_in_place(nodes, median, depth + 1);
+    node->right = kdtree_build_in_place(nodes + median + 1, n - (median + 1), depth + 1);
+    return node;
+}
+
+kdtree *kdtree_load_stream(kdtree_stream_reader *reader){
+    if (reader == NULL){
+        return NULL;
+    }
+    kdtree_load_state s;
+    s.capacity = kdtree_stream_size_hint(reader);
+    s.arena = malloc(sizeof(kdtree_arena) + sizeof(kdtree_node) * s.capacity);
+    if (s.arena == NULL){
+        return NULL;
+    }
+    s.arena->refs = 1;
+    s.arena->count = 0;
+    kdtree *t = NULL;
+    if (!kdtree_stream_read(reader, kdtree_load_point, &s) || (t = kdtree_create(NULL, 0)) == NULL){
+        free(s.arena);
+        return NULL;
+    }
+
+    //keep one copy of each point, then give back what wasn't used
+    size_t n = s.arena->count;
+    if (n > 0){
+        qsort(s.arena->nodes, n, sizeof(kdtree_node), kdtree_compare_node_locations);
+        size_t unique = 1;
+        for (size_t i = 1; i < n; i++){
+            if (kdtree_compare_locations(&s.arena->nodes[i].loc, &s.arena->nodes[unique - 1].loc) != 0){
+                s.arena->nodes[unique++].loc = s.arena->nodes[i].loc;
+            }
+        }
+        n = unique;
+    }
+    if (n == 0){
+        free(s.arena);
+        return t;
+    }
+    if (n < s.capacity){
+        kdtree_arena *smaller = realloc(s.arena, sizeof(kdtree_arena) + sizeof(kdtree_node) * n);
+        if (smaller != NULL){
+            s.arena = smaller;
+        }
+    }
+    s.arena->count = n;
+
+    t->root = kdtree_build_in_place(s.arena->nodes, n, 0);
+    t->arena = s.arena;
+    t->tree_size = n;
+    return t;
+}
+
+bool kdtree_save_paged(const kdtree *t, const char *path){
+    if (t == NULL || path == NULL){
+        return false;
+    }
+    size_t n;
+    location *pts = kdtree_points(t, &n);
+    bool ok = pts != NULL && kdtree_paged_save(pts, n, path);
+    free(pts);
+    return ok;
+}
+
+kdtree *kdtree_open_paged(const char *path, size_t cache_pages){
+    kdtree_paged *paged = kdtree_paged_open(path, cache_pages);
+    if (paged == NULL){
+        return NULL;
+    }
+    kdtree *t = kdtree_create(NULL, 0);
+    if (t == NULL){
+        kdtree_paged_close(paged);
+        return NULL;
+    }
+    t->paged = paged;
+    t->tree_size = kdtree_paged_size(paged);
+    t->read_only = true;
+    return t;
+}
+
+void kdtree_last_query_io(kdtree_io_stats *io){
+    if (io != NULL){
+        *io = kdtree_query_io;
+    }
+}
+
+void kdtree_get_io_totals(const kdtree *t, kdtree_io_stats *io){
+    if (io == NULL){
+        return;
+    }
+    *io = (kdtree_io_stats){0, 0};
+    if (t != NULL && t->paged != NULL){
+        kdtree_paged_get_totals(t->paged, io);
+    }
+}
+
+void kdtree_last_query_counters(kdtree_query_counters *c){
+    if (c != NULL){
+        *c = kdtree_query_cost;
+    }
+}
+
+void kdtree_get_query_totals(const kdtree *t, kdtree_query_counters *c){
+    if (c == NULL){
+        return;
+    }
+    *c = (kdtree_query_counters){0, 0, 0, 0};
+    if (t != NULL){
+        c->nodes_visited = __atomic_load_n(&t->totals.nodes_visited, __ATOMIC_RELAXED);
+        c->nodes_pruned = __atomic_load_n(&t->totals.nodes_pruned, __ATOMIC_RELAXED);
+        c->points_tested = __atomic_load_n(&t->totals.points_tested, __ATOMIC_RELAXED);
+        c->points_emitted = __atomic_load_n(&t->totals.points_emitted, __ATOMIC_RELAXED);
+    }
+}
+
+//a node waiting to be measured by kdtree_stats
+typedef struct {
+    const kdtree_node *node;
+    size_t depth;
+} kdtree_stats_item;
+
+//walks the nodes without recursing, since the trees worth measuring are
+//the ones that may have grown too deep to recurse through
+static bool kdtree_stats_walk(const kdtree *t, kdtree_tree_stats *s, size_t *depth_sum){
+    size_t size = 0;
+    size_t capacity = 64;
+    kdtree_stats_item *stack = malloc(sizeof(kdtree_stats_item) * capacity);
+    if (stack == NULL){
+        return false;
+    }
+    const kdtree_node *root = KDTREE_LOAD(t->root);
+    if (root != NULL){
+        stack[size++] = (kdtree_stats_item){root, 0};
+    }
+    while (size > 0){
+        kdtree_stats_item item = stack[--size];
+        const kdtree_node *children[2] = {KDTREE_LOAD(item.node->left), KDTREE_LOAD(item.node->right)};
+        if (!kdtree_in_arena(item.node, t->arena)){
+            s->memory += sizeof(kdtree_node);
+        }
+        if (children[0] == NULL && children[1] == NULL){
+            s->leaves++;
+            *depth_sum += item.depth;
+            s->max_leaf_depth = item.depth > s->max_leaf_depth ? item.depth : s->max_leaf_depth;
+            continue;
+        }
+        if (size + 2 > capacity){
+            kdtree_stats_item *bigger = realloc(stack, sizeof(kdtree_stats_item) * capacity * 2);
+            if (bigger == NULL){
+                free(stack);
+                return false;
+            }
+            stack = bigger;
+            capacity *= 2;
+        }
+        for (int i = 0; i < 2; i++){
+            if (children[i] != NULL){
+                stack[size++] = (kdtree_stats_item){children[i], item.depth + 1};
+            }
+        }
+    }
+    free(stack);
+    return true;
+}
+
+bool kdtree_stats(const kdtree *t, kdtree_tree_stats *s){
+    if (t == NULL || s == NULL){
+        return false;
+    }
+    *s = (kdtree_tree_stats){0, 0, 0, 0.0, 0, 0.0, sizeof(kdtree)};
+    s->size = kdtree_size(t);
+    size_t depth_sum = 0;
+    bool ok = true;
+    if (t->paged != NULL){
+        s->memory += kdtree_paged_memory(t->paged);
+        return true;
+    } else if (t->file != NULL){
+        s->memory += kdtree_file_length(s->size);
+        ok = kdtree_file_shape(t->file, &s->leaves, &depth_sum, &s->max_leaf_depth);
+    } else{
+        size_t ticket = t->epoch == NULL ? 0 : kdtree_epoch_enter(t->epoch);
+        ok = kdtree_stats_walk(t, s, &depth_sum);
+        if (t->epoch != NULL){
+            kdtree_epoch_exit(t->epoch, ticket);
+        }
+        if (t->arena != NULL){
+            s->memory += sizeof(kdtree_arena) + sizeof(kdtree_node) * t->arena->count;
+        }
+        if (t->index != NULL){
+            s->memory += sizeof(kdtree_hashset) + sizeof(location) * t->index->capacity;
+        }
+        if (t->added != NULL){
+            s->memory += sizeof(kdtree_size_stripe) * KDTREE_SIZE_STRIPES;
+        }
+    }
+
+    if (ok && s->leaves > 0){
+        s->height = s->max_leaf_depth + 1;
+        s->mean_leaf_depth = (double)depth_sum / s->leaves;
+        //a balanced tree of n points has floor(log2(n)) + 1 levels
+        size_t balanced = 0;
+        for (size_t n = s->size; n > 0; n /= 2){
+            balanced++;
+        }
+        s->imbalance = balanced == 0 ? 1.0 : (double)s->height / balanced;
+    }
+    return ok;
+}
+
 void kdtree_destroy(kdtree *t){
     if(t == NULL){
         return;
     }
-    kdtree_destroy_helper(t->root);
+    //with no readers left, anything retired can be freed right away
+    kdtree_epoch_destroy(t->epoch);
+    t->epoch = NULL;
+    free(t->added);
+    //nodes and the arena are only freed if no snapshot still uses them
+    kdtree_node_unref(t->arena, t->root);
+    kdtree_arena_unref(t->arena);
+    kdtree_file_close(t->file);
+    kdtree_paged_close(t->paged);
+    kdtree_disable_hash_index(t);
     //free kdtree itself
     free(t);
 }
\ No newline at end of file
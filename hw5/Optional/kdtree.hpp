@@ -0,0 +1,347 @@
+#ifndef __KDTREE_HPP__
+#define __KDTREE_HPP__
+
+#if __cplusplus < 201402L
+#error "kdtree.hpp needs C++14 or later (compile with -std=c++14)"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Header-only C++ front-end for the k-d tree in kdtree.c.  The
+ * algorithms are the same as the C version (median-split build,
+ * unbalanced add, replace-with-extreme remove, pruned range search),
+ * but the dimension and coordinate type are template parameters, the
+ * cutting dimension is a compile-time constant at every level, and the
+ * comparators are plain inlined comparisons instead of calls through
+ * function pointers.
+ *
+ * Points are equal when all of their coordinates compare equal; as in
+ * the C version, a point goes to the left subtree of a node if and only
+ * if its coordinate in the node's cutting dimension is strictly less
+ * than the node's.
+ *
+ * Needs C++14 or later, for std::exchange.  ./HppUnit checks the
+ * template for each coordinate type against a std::set.
+ */
+namespace kdtree_cpp
+{
+    /**
+     * Payload type for trees that only store points.
+     */
+    struct no_payload {};
+
+    template <std::size_t Dim, typename Coord, typename Payload = no_payload>
+    class KdTree
+    {
+        static_assert(Dim > 0, "a k-d tree needs at least one dimension");
+        static_assert(std::is_same<Coord, float>::value
+                      || std::is_same<Coord, double>::value
+                      || std::is_same<Coord, std::int32_t>::value,
+                      "supported coordinate types are float, double and int32_t");
+
+    public:
+        using point_type = std::array<Coord, Dim>;
+
+        struct value_type
+        {
+            point_type pt;
+            Payload payload;
+        };
+
+        KdTree() = default;
+
+        /**
+         * Builds a balanced tree containing the given values.  If several
+         * values have the same point, only the first one is kept.
+         *
+         * @param values the values to build from; taken by value so that
+         * callers can move their array in and avoid a copy
+         */
+        explicit KdTree(std::vector<value_type> values)
+        {
+            // stable sort so that the first of each run of duplicates survives
+            std::stable_sort(values.begin(), values.end(),
+                             [](const value_type &a, const value_type &b) { return a.pt < b.pt; });
+            values.erase(std::unique(values.begin(), values.end(),
+                                     [](const value_type &a, const value_type &b) { return a.pt == b.pt; }),
+                         values.end());
+            size_ = values.size();
+            root_ = build<0>(values.begin(), values.end());
+        }
+
+        KdTree(const KdTree &) = delete;
+        KdTree &operator=(const KdTree &) = delete;
+        KdTree(KdTree &&other) noexcept
+            : root_(std::move(other.root_)), size_(std::exchange(other.size_, 0))
+        {
+        }
+
+        KdTree &operator=(KdTree &&other) noexcept
+        {
+            if (this != &other){
+                destroy(std::move(root_));
+                root_ = std::move(other.root_);
+                size_ = std::exchange(other.size_, 0);
+            }
+            return *this;
+        }
+        ~KdTree() { destroy(std::move(root_)); }
+
+        /**
+         * Adds a copy of the given point and payload.  There is no effect if
+         * the point is already in the tree.
+         *
+         * @return true if and only if the point was added
+         */
+        bool add(const point_type &p, const Payload &payload = Payload())
+        {
+            // each pass goes down at most Dim levels, so it starts at a
+            // node that cuts on dimension 0
+            std::unique_ptr<node> *link = &root_;
+            while (*link != nullptr && (*link)->value.pt != p){
+                link = add_from<0>(*link, p);
+            }
+            if (*link != nullptr){
+                return false;
+            }
+            link->reset(new node{value_type{p, payload}, nullptr, nullptr});
+            size_++;
+            return true;
+        }
+
+        /**
+         * Determines if the tree contains the given point.
+         */
+        bool contains(const point_type &p) const
+        {
+            return find(p) != nullptr;
+        }
+
+        /**
+         * Returns a pointer to the payload stored with the given point, or
+         * nullptr if the point is not in the tree.  The pointer is valid
+         * until the next add or remove.
+         */
+        const Payload *find(const point_type &p) const
+        {
+            // as in add, each pass starts at a node that cuts on dimension 0
+            const node *curr = root_.get();
+            while (curr != nullptr && curr->value.pt != p){
+                curr = find_from<0>(curr, p);
+            }
+            return curr == nullptr ? nullptr : &curr->value.payload;
+        }
+
+        /**
+         * Removes the given point.  There is no effect if the point is not
+         * in the tree.
+         *
+         * @return true if and only if a point was removed
+         */
+        bool remove(const point_type &p)
+        {
+            if (remove_from<0>(root_, p)){
+                size_--;
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * Passes each value whose point is in or on the border of the box
+         * with the given corners to f, in arbitrary order.
+         *
+         * @param lo the corner with the smallest coordinates
+         * @param hi the corner with the largest coordinates
+         * @param f a callable taking a const value_type &
+         */
+        template <typename F>
+        void range_for_each(const point_type &lo, const point_type &hi, F &&f) const
+        {
+            range_from<0>(root_.get(), lo, hi, f);
+        }
+
+        /**
+         * Returns the values whose points are in or on the border of the box
+         * with the given corners, in arbitrary order.
+         */
+        std::vector<value_type> range(const point_type &lo, const point_type &hi) const
+        {
+            std::vector<value_type> out;
+            range_for_each(lo, hi, [&out](const value_type &v) { out.push_back(v); });
+            return out;
+        }
+
+        std::size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+    private:
+        struct node
+        {
+            value_type value;
+            std::unique_ptr<node> left;
+            std::unique_ptr<node> right;
+        };
+
+        using iterator = typename std::vector<value_type>::iterator;
+
+        static constexpr std::size_t next_dim(std::size_t dim)
+        {
+            return dim + 1 == Dim ? 0 : dim + 1;
+        }
+
+        template <std::size_t D>
+        static std::unique_ptr<node> build(iterator first, iterator last)
+        {
+            if (first == last){
+                return nullptr;
+            }
+
+            auto less = [](const value_type &a, const value_type &b) { return a.pt[D] < b.pt[D]; };
+            iterator median = first + (last - first) / 2;
+            std::nth_element(first, median, last, less);
+
+            // points equal to the median in dimension D must go right, so
+            // use the first of them as the root of this subtree
+            const Coord cut = median->pt[D];
+            iterator split = std::partition(first, median, [cut](const value_type &v) { return v.pt[D] < cut; });
+            std::iter_swap(split, median);
+
+            std::unique_ptr<node> root(new node{std::move(*split), nullptr, nullptr});
+            root->left = build<next_dim(D)>(first, split);
+            root->right = build<next_dim(D)>(split + 1, last);
+            return root;
+        }
+
+        // goes down from link, which cuts on D and doesn't hold p, to the
+        // link where p is or belongs, stopping early at an empty link or
+        // at p, and otherwise at the first link that cuts on dimension 0
+        template <std::size_t D>
+        static std::unique_ptr<node> *add_from(std::unique_ptr<node> &link, const point_type &p)
+        {
+            std::unique_ptr<node> &next = p[D] < link->value.pt[D] ? link->left : link->right;
+            if (D + 1 == Dim || next == nullptr || next->value.pt == p){
+                return &next;
+            }
+            return add_from<next_dim(D)>(next, p);
+        }
+
+        // the same for lookups, which don't need the links
+        template <std::size_t D>
+        static const node *find_from(const node *n, const point_type &p)
+        {
+            const node *next = p[D] < n->value.pt[D] ? n->left.get() : n->right.get();
+            if (D + 1 == Dim || next == nullptr || next->value.pt == p){
+                return next;
+            }
+            return find_from<next_dim(D)>(next, p);
+        }
+
+        // finds the link to the node with the smallest coordinate in
+        // dimension dim in the subtree rooted at r, which cuts on D
+        template <std::size_t D>
+        static std::unique_ptr<node> *find_min(std::unique_ptr<node> &r, std::size_t dim)
+        {
+            std::unique_ptr<node> *best = &r;
+            if (r->left != nullptr){
+                std::unique_ptr<node> *cand = find_min<next_dim(D)>(r->left, dim);
+                if ((*cand)->value.pt[dim] < (*best)->value.pt[dim]){
+                    best = cand;
+                }
+            }
+            // if r cuts on dim then nothing on its right is smaller than r
+            if (D != dim && r->right != nullptr){
+                std::unique_ptr<node> *cand = find_min<next_dim(D)>(r->right, dim);
+                if ((*cand)->value.pt[dim] < (*best)->value.pt[dim]){
+                    best = cand;
+                }
+            }
+            return best;
+        }
+
+        template <std::size_t D>
+        static bool remove_from(std::unique_ptr<node> &link, const point_type &p)
+        {
+            if (link == nullptr){
+                return false;
+            }
+
+            node &n = *link;
+            if (n.value.pt != p){
+                return remove_from<next_dim(D)>(p[D] < n.value.pt[D] ? n.left : n.right, p);
+            }
+
+            if (n.left == nullptr && n.right == nullptr){
+                link.reset();
+                return true;
+            }
+
+            // with no right subtree, the left one becomes the right one so
+            // that the replacement is always the minimum of the right subtree
+            if (n.right == nullptr){
+                n.right = std::move(n.left);
+            }
+            std::unique_ptr<node> *min_link = find_min<next_dim(D)>(n.right, D);
+            n.value = (*min_link)->value;
+            point_type min_pt = n.value.pt;
+            return remove_from<next_dim(D)>(n.right, min_pt);
+        }
+
+        template <std::size_t D, typename F>
+        static void range_from(const node *n, const point_type &lo, const point_type &hi, F &f)
+        {
+            if (n == nullptr){
+                return;
+            }
+
+            const point_type &pt = n->value.pt;
+            bool inside = true;
+            for (std::size_t d = 0; d < Dim; d++){
+                inside = inside && !(pt[d] < lo[d]) && !(hi[d] < pt[d]);
+            }
+            if (inside){
+                f(n->value);
+            }
+
+            if (lo[D] < pt[D]){
+                range_from<next_dim(D)>(n->left.get(), lo, hi, f);
+            }
+            if (!(hi[D] < pt[D])){
+                range_from<next_dim(D)>(n->right.get(), lo, hi, f);
+            }
+        }
+
+        // unlinks children before freeing so that destroying a degenerate
+        // (list-shaped) tree does not recurse once per node
+        static void destroy(std::unique_ptr<node> root)
+        {
+            std::vector<std::unique_ptr<node>> pending;
+            if (root != nullptr){
+                pending.push_back(std::move(root));
+            }
+            while (!pending.empty()){
+                std::unique_ptr<node> n = std::move(pending.back());
+                pending.pop_back();
+                if (n->left != nullptr){
+                    pending.push_back(std::move(n->left));
+                }
+                if (n->right != nullptr){
+                    pending.push_back(std::move(n->right));
+                }
+            }
+        }
+
+        std::unique_ptr<node> root_;
+        std::size_t size_ = 0;
+    };
+}
+
+#endif
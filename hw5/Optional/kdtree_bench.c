@@ -0,0 +1,800 @@
+#define _POSIX_C_SOURCE 200809L
+//for syscall, since glibc has no wrapper for perf_event_open
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "kdtree.h"
+#include "kdtree_compact.h"
+#include "kdtree_dataset.h"
+#include "kdtree_forest.h"
+#include "kdtree_packed.h"
+#include "location.h"
+
+/**
+ * Measures the wall-clock throughput and latency of every kdtree
+ * operation for trees of several sizes and kinds of data, and compares
+ * them with an earlier run.
+ *
+ * USAGE: ./Bench [sizes [baseline [tolerance [datasets [layouts]]]]]
+ *
+ * sizes is a comma-separated list such as 1e3,1e4,1e5 (the default is
+ * 1e3,1e4,1e5,1e6; up to 1e8 needs about 8GB).  datasets is a
+ * comma-separated list of the kinds in kdtree_dataset.h, such as
+ * uniform,zipf (the default, or -, is all of them).  layouts is a
+ * comma-separated list of the structures in bench_layout_names (the
+ * default is pointer).  For each kind and size,
+ * builds trees of that many points, then times adds of up to 100000
+ * more points, taken from the end of the same stream, lookups of random
+ * points and removes of the added points.  Then range queries centered
+ * on random points, as large as would hold 10 points (small) or 1000
+ * points (medium) if the points were uniform, and queries of the whole
+ * world; medium queries with kdtree_range_for_each; and destroying the
+ * tree.  The lookups and queries, which don't change the tree, are run
+ * on each of the layouts, holding the same points and answering the
+ * same calls; the other cases are always of the pointer tree.  Each
+ * case stops after about a second, with as many calls as it made by
+ * then.
+ * Prints the results to standard output as JSON, one result per
+ * line.
+ *
+ * On Linux, each result also gives the cycles, instructions, L1 data
+ * cache read misses, last-level cache misses, data TLB read misses and
+ * mispredicted branches per call, counted by the processor in user mode
+ * while the case ran; these include the cost of recording latencies.
+ * Counters the processor or kernel can't provide are null, and if none
+ * can be opened (as in most virtual machines and containers, or when
+ * /proc/sys/kernel/perf_event_paranoid is above 2) a warning is printed
+ * on standard error and "counters" is null.
+ *
+ * If a baseline file written by an earlier run is given (- for none),
+ * each result is compared with the one for the same kind of data,
+ * layout, operation and size there; results with no kind are uniform,
+ * and those with no layout are of the pointer tree.  Any
+ * whose calls per second fell, or whose 99th percentile latency rose, by
+ * more than the tolerance (0.25 by default, for 25%) is reported on
+ * standard error, and the exit status is 2.
+ *
+ * Build with optimization for meaningful numbers, for example
+ * make clean && make Bench CFLAGS="-std=c17 -O2 -pthread".
+ */
+
+//most adds, lookups and removes timed for each size
+#define BENCH_UPDATES 100000
+//builds repeated for small trees, so their times aren't a single sample
+#define BENCH_BUILD_WORK 1000000
+//each case stops after about this long; on clustered data a box around
+//a dense spot can hold far more points than its area suggests, and
+//removes after a sorted stream of adds can take time in proportion to
+//the number of points
+#define BENCH_CASE_SECONDS 1.0
+
+//hardware counters, in the order of bench_counter_names
+#define BENCH_COUNTERS 6
+//the grid of the packed layout, as fine as KDTREE_COORDS_INT32 keys
+#define BENCH_PACKED_STEPS 1000000
+//the tiles of the forest layout, about 20 degrees on a side
+#define BENCH_FOREST_LAT_BANDS 9
+#define BENCH_FOREST_LON_BANDS 18
+
+//the structures the lookups and queries can be run on, in the order of
+//bench_layout_names
+typedef enum {
+    BENCH_POINTER,  //the tree as built and added to
+    BENCH_DFS,      //a copy of it after kdtree_relayout in preorder
+    BENCH_HILBERT,  //a copy of it after kdtree_relayout in Hilbert order
+    BENCH_HASH,     //a copy of it with kdtree_enable_hash_index
+    BENCH_FOREST,   //kdtree_forest of the points, querying tiles on every processor
+    BENCH_COMPACT,  //kdtree_compact with KDTREE_COORDS_INT32 keys
+    BENCH_PACKED,   //kdtree_packed of the tree
+    BENCH_LAYOUTS   //the number of layouts
+} bench_layout;
+
+static const char *bench_layout_names[BENCH_LAYOUTS] = {
+    "pointer", "dfs", "hilbert", "hash", "forest", "compact", "packed"
+};
+
+//the same points in one of the layouts; only the field for it is set
+typedef struct {
+    bench_layout layout;
+    kdtree *t;
+    kdtree_forest *forest;
+    kdtree_compact *compact;
+    kdtree_packed *packed;
+} bench_tree;
+
+typedef struct {
+    const char *dataset;
+    const char *layout;
+    const char *operation;
+    size_t size;
+    size_t calls;
+    double seconds;
+    uint64_t p50;    //nanoseconds
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    double counts[BENCH_COUNTERS];  //totals for all calls; NAN if not counted
+} bench_result;
+
+//results of the baseline run
+typedef struct {
+    char dataset[32];
+    char layout[32];
+    char operation[32];
+    size_t size;
+    double calls_per_second;
+    uint64_t p99;
+} bench_baseline;
+
+static bench_baseline *bench_baselines;
+static size_t bench_baseline_count;
+static double bench_tolerance = 0.25;
+static size_t bench_regressions;
+static bool bench_first = true;
+
+static const char *bench_counter_names[BENCH_COUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses"
+};
+//file descriptors of the counters, -1 for those that couldn't be opened
+static int bench_counter_fds[BENCH_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+static bool bench_counting;
+
+static uint64_t bench_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_compare_ns(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+//whether a case that has made done of the given number of calls, and
+//should stop at the given time, goes on; the clock is read only every
+//64 calls so reading it doesn't add to fast operations
+static bool bench_more(size_t done, size_t calls, uint64_t stop){
+    return done < calls && (done < 10 || done % 64 != 0 || bench_now() < stop);
+}
+
+//fills in the percentiles of the given times, ranked as
+//kdtree_latency_read ranks them
+static void bench_percentiles(uint64_t *ns, size_t count, bench_result *r){
+    qsort(ns, count, sizeof(uint64_t), bench_compare_ns);
+    r->p50 = ns[(count + 1) / 2 - 1];
+    r->p99 = ns[count - count / 100 - 1];
+    r->p999 = ns[count - count / 1000 - 1];
+    r->max = ns[count - 1];
+}
+
+//fills in the percentiles recorded by the library since the last reset
+static void bench_recorded(kdtree_operation op, bench_result *r){
+    kdtree_latency l;
+    kdtree_latency_read(op, &l);
+    r->p50 = l.p50;
+    r->p99 = l.p99;
+    r->p999 = l.p999;
+    r->max = l.max;
+}
+
+#ifdef __linux__
+//opens a counter of the calling thread in user mode, disabled for now;
+//returns its file descriptor, or -1 with errno set
+static int bench_counter_open(uint32_t type, uint64_t config){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    //so counts can be scaled if the kernel has to share the counters
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define BENCH_CACHE(cache, op, result) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_ ## op << 8) | (PERF_COUNT_HW_CACHE_RESULT_ ## result << 16))
+#endif
+
+//opens whichever counters are available; warns and returns false if
+//there are none
+static bool bench_counters_open(const char *program){
+#ifdef __linux__
+    const uint32_t types[BENCH_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    const uint64_t configs[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        BENCH_CACHE(PERF_COUNT_HW_CACHE_L1D, READ, MISS),
+        PERF_COUNT_HW_CACHE_MISSES,
+        BENCH_CACHE(PERF_COUNT_HW_CACHE_DTLB, READ, MISS),
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int error = 0;
+    for (int i = 0; i < BENCH_COUNTERS; i++){
+        bench_counter_fds[i] = bench_counter_open(types[i], configs[i]);
+        if (bench_counter_fds[i] >= 0){
+            bench_counting = true;
+        } else if (error == 0){
+            error = errno;
+        }
+    }
+    if (!bench_counting){
+        fprintf(stderr, "%s: no hardware counters (%s); reporting times only\n", program, strerror(error));
+    }
+    return bench_counting;
+#else
+    fprintf(stderr, "%s: no hardware counters on this system; reporting times only\n", program);
+    return false;
+#endif
+}
+
+static void bench_counters_close(void){
+    for (int i = 0; i < BENCH_COUNTERS; i++){
+        if (bench_counter_fds[i] >= 0){
+            close(bench_counter_fds[i]);
+            bench_counter_fds[i] = -1;
+        }
+    }
+}
+
+//starts the counters from zero
+static void bench_counters_start(void){
+#ifdef __linux__
+    for (int i = 0; i < BENCH_COUNTERS; i++){
+        if (bench_counter_fds[i] >= 0){
+            ioctl(bench_counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(bench_counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+//stops the counters and adds what they counted to the given totals,
+//which become NAN for counters that aren't available
+static void bench_counters_stop(double *counts){
+    for (int i = 0; i < BENCH_COUNTERS; i++){
+        uint64_t values[3];  //count, time enabled, time running
+        bool ok = false;
+#ifdef __linux__
+        ok = bench_counter_fds[i] >= 0
+            && ioctl(bench_counter_fds[i], PERF_EVENT_IOC_DISABLE, 0) == 0
+            && read(bench_counter_fds[i], values, sizeof(values)) == sizeof(values)
+            && values[2] > 0;
+#endif
+        counts[i] = ok ? counts[i] + (double)values[0] * values[1] / values[2] : NAN;
+    }
+}
+
+static void bench_compare(const bench_result *r){
+    double rate = r->calls / r->seconds;
+    for (size_t i = 0; i < bench_baseline_count; i++){
+        const bench_baseline *b = &bench_baselines[i];
+        if (b->size != r->size || strcmp(b->operation, r->operation) != 0 || strcmp(b->dataset, r->dataset) != 0
+            || strcmp(b->layout, r->layout) != 0){
+            continue;
+        }
+        if (rate < b->calls_per_second * (1.0 - bench_tolerance)){
+            fprintf(stderr, "REGRESSION %s %s %s n=%zu: %.0f calls/second, baseline %.0f\n",
+                    r->dataset, r->layout, r->operation, r->size, rate, b->calls_per_second);
+            bench_regressions++;
+        }
+        if (r->p99 > b->p99 * (1.0 + bench_tolerance)){
+            fprintf(stderr, "REGRESSION %s %s %s n=%zu: p99 %" PRIu64 "ns, baseline %" PRIu64 "ns\n",
+                    r->dataset, r->layout, r->operation, r->size, r->p99, b->p99);
+            bench_regressions++;
+        }
+    }
+}
+
+static void bench_report(const bench_result *r){
+    printf("%s  {\"dataset\": \"%s\", \"layout\": \"%s\", \"operation\": \"%s\", \"size\": %zu, \"calls\": %zu, \"seconds\": %.6f, \"calls_per_second\": %.1f, "
+           "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"counters\": ",
+           bench_first ? "" : ",\n", r->dataset, r->layout, r->operation, r->size, r->calls, r->seconds, r->calls / r->seconds,
+           r->p50, r->p99, r->p999, r->max);
+    if (!bench_counting){
+        printf("null}");
+    } else{
+        //per call
+        for (int i = 0; i < BENCH_COUNTERS; i++){
+            printf(isnan(r->counts[i]) ? "%s\"%s\": null" : "%s\"%s\": %.2f",
+                   i == 0 ? "{" : ", ", bench_counter_names[i], r->counts[i] / r->calls);
+        }
+        printf("}}");
+    }
+    fflush(stdout);
+    bench_first = false;
+    bench_compare(r);
+}
+
+//copies the string after "key": in the given line, or the given default
+//if it isn't there or is too long
+static void bench_string(const char *line, const char *key, char *out, size_t size, const char *missing){
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\": \"", key);
+    const char *at = strstr(line, quoted);
+    size_t len = at == NULL ? 0 : strcspn(at + strlen(quoted), "\"");
+    if (at == NULL || len >= size){
+        snprintf(out, size, "%s", missing);
+        return;
+    }
+    memcpy(out, at + strlen(quoted), len);
+    out[len] = '\0';
+}
+
+//the number after "key": in the given line, or -1 if it isn't there
+static double bench_field(const char *line, const char *key){
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\": ", key);
+    const char *at = strstr(line, quoted);
+    return at == NULL ? -1.0 : strtod(at + strlen(quoted), NULL);
+}
+
+//reads the results of an earlier run, one to a line
+static bool bench_read_baseline(const char *path){
+    FILE *in = fopen(path, "r");
+    if (in == NULL){
+        return false;
+    }
+    char line[1024];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), in) != NULL){
+        if (strstr(line, "\"operation\": \"") == NULL){
+            continue;
+        }
+        if (bench_baseline_count == capacity){
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            bench_baseline *bigger = realloc(bench_baselines, sizeof(bench_baseline) * capacity);
+            if (bigger == NULL){
+                fclose(in);
+                return false;
+            }
+            bench_baselines = bigger;
+        }
+        bench_baseline *b = &bench_baselines[bench_baseline_count];
+        bench_string(line, "dataset", b->dataset, sizeof(b->dataset), "uniform");
+        bench_string(line, "layout", b->layout, sizeof(b->layout), "pointer");
+        bench_string(line, "operation", b->operation, sizeof(b->operation), "");
+        b->size = bench_field(line, "size");
+        b->calls_per_second = bench_field(line, "calls_per_second");
+        b->p99 = bench_field(line, "p99_ns");
+        bench_baseline_count++;
+    }
+    fclose(in);
+    return true;
+}
+
+//a box centered on a random one of the n points, moved inside the world
+//if need be, of the size that would hold the given number of them if
+//they were spread uniformly
+static void bench_box(uint64_t *seed, size_t expect, const location *pts, size_t n, location *sw, location *ne){
+    double side = expect >= n ? 1.0 : sqrt((double)expect / n);
+    const location *center = &pts[kdtree_dataset_random(seed) % n];
+    double lat = (center->lat + 90.0) / 180.0 - side / 2.0;
+    double lon = (center->lon + 180.0) / 360.0 - side / 2.0;
+    lat = lat < 0.0 ? 0.0 : (lat > 1.0 - side ? 1.0 - side : lat);
+    lon = lon < 0.0 ? 0.0 : (lon > 1.0 - side ? 1.0 - side : lon);
+    sw->lat = lat * 180.0 - 90.0;
+    sw->lon = lon * 360.0 - 180.0;
+    ne->lat = (lat + side) * 180.0 - 90.0;
+    ne->lon = (lon + side) * 360.0 - 180.0;
+}
+
+static void bench_count_point(const location *l, void *count){
+    (*(size_t *)count)++;
+}
+
+//makes the given layout of the points in the given tree, which was
+//built from the first n of the given points and then had the next added
+//added one at a time; returns false if memory ran out
+static bool bench_tree_create(bench_tree *b, bench_layout layout, kdtree *t, const location *pts, size_t n, size_t added){
+    *b = (bench_tree){layout, NULL, NULL, NULL, NULL};
+    if (layout == BENCH_POINTER){
+        b->t = t;
+        return true;
+    }
+    if (layout == BENCH_DFS || layout == BENCH_HILBERT || layout == BENCH_HASH){
+        //built the same way, so it has the same shape
+        b->t = kdtree_create(pts, n);
+        for (size_t i = 0; i < added && b->t != NULL; i++){
+            kdtree_add(b->t, &pts[n + i]);
+        }
+        if (b->t == NULL){
+            return false;
+        }
+    }
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    switch (layout){
+    case BENCH_DFS:
+    case BENCH_HILBERT:
+        kdtree_set_auto_relayout(b->t, layout == BENCH_DFS ? KDTREE_LAYOUT_DFS : KDTREE_LAYOUT_HILBERT, 0);
+        return kdtree_relayout(b->t);
+    case BENCH_HASH:
+        return kdtree_enable_hash_index(b->t);
+    case BENCH_FOREST:
+        b->forest = kdtree_forest_create(pts, n + added, BENCH_FOREST_LAT_BANDS, BENCH_FOREST_LON_BANDS, processors > 1 ? processors : 1);
+        return b->forest != NULL;
+    case BENCH_COMPACT:
+        b->compact = kdtree_compact_create(pts, n + added, KDTREE_COORDS_INT32);
+        return b->compact != NULL;
+    case BENCH_PACKED:
+        b->packed = kdtree_packed_create(t, BENCH_PACKED_STEPS);
+        return b->packed != NULL;
+    default:
+        return false;
+    }
+}
+
+//frees what bench_tree_create made, which leaves the pointer tree
+static void bench_tree_destroy(bench_tree *b){
+    if (b->layout != BENCH_POINTER){
+        kdtree_destroy(b->t);
+    }
+    kdtree_forest_destroy(b->forest);
+    kdtree_compact_destroy(b->compact);
+    kdtree_packed_destroy(b->packed);
+}
+
+static bool bench_contains(const bench_tree *b, const location *l){
+    switch (b->layout){
+    case BENCH_FOREST:
+        return kdtree_forest_contains(b->forest, l);
+    case BENCH_COMPACT:
+        return kdtree_compact_contains(b->compact, l);
+    case BENCH_PACKED:
+        return kdtree_packed_contains(b->packed, l);
+    default:
+        return kdtree_contains(b->t, l);
+    }
+}
+
+static location *bench_range(const bench_tree *b, const location *sw, const location *ne, int *count){
+    switch (b->layout){
+    case BENCH_FOREST:
+        return kdtree_forest_range(b->forest, sw, ne, count);
+    case BENCH_COMPACT:
+        return kdtree_compact_range(b->compact, sw, ne, count);
+    case BENCH_PACKED:
+        return kdtree_packed_range(b->packed, sw, ne, count);
+    default:
+        return kdtree_range(b->t, sw, ne, count);
+    }
+}
+
+static void bench_range_for_each(const bench_tree *b, const location *sw, const location *ne, size_t *found){
+    switch (b->layout){
+    case BENCH_FOREST:
+        kdtree_forest_range_for_each(b->forest, sw, ne, bench_count_point, found);
+        break;
+    case BENCH_COMPACT:
+        kdtree_compact_range_for_each(b->compact, sw, ne, bench_count_point, found);
+        break;
+    case BENCH_PACKED:
+        kdtree_packed_range_for_each(b->packed, sw, ne, bench_count_point, found);
+        break;
+    default:
+        kdtree_range_for_each(b->t, sw, ne, bench_count_point, found);
+        break;
+    }
+}
+
+//times lookups of the given picks of the points; the library records
+//the latencies of calls on a kdtree, and those on the other structures
+//are timed here
+static void bench_lookups(const char *data, const bench_tree *b, size_t n, const location *pts, const size_t *picks, size_t calls){
+    uint64_t *ns = b->t == NULL ? malloc(sizeof(uint64_t) * calls) : NULL;
+    if (b->t == NULL && ns == NULL){
+        return;
+    }
+    size_t found = 0;
+    size_t done = 0;
+    bench_result r = {data, bench_layout_names[b->layout], "contains", n, 0, 0.0, 0, 0, 0, 0, {0}};
+    kdtree_latency_reset();
+    bench_counters_start();
+    uint64_t start = bench_now();
+    uint64_t stop = start + (uint64_t)(BENCH_CASE_SECONDS * 1e9);
+    while (bench_more(done, calls, stop)){
+        size_t i = done++;
+        uint64_t before = ns == NULL ? 0 : bench_now();
+        found += bench_contains(b, &pts[picks[i]]);
+        if (ns != NULL){
+            ns[i] = bench_now() - before;
+        }
+    }
+    r.seconds = (bench_now() - start) / 1e9;
+    bench_counters_stop(r.counts);
+    r.calls = done;
+    if (ns != NULL){
+        bench_percentiles(ns, done, &r);
+    } else{
+        bench_recorded(KDTREE_OP_CONTAINS, &r);
+    }
+    bench_report(&r);
+    free(ns);
+}
+
+//times up to the given number of range queries around the given points,
+//which are in the tree, reporting them under size n; latencies are
+//taken as in bench_lookups
+static void bench_ranges(const char *data, const char *name, const bench_tree *b, size_t n, const location *pts, size_t points, size_t expect, size_t calls, bool for_each, uint64_t *seed){
+    location *sw = malloc(sizeof(location) * calls);
+    location *ne = malloc(sizeof(location) * calls);
+    uint64_t *ns = b->t == NULL ? malloc(sizeof(uint64_t) * calls) : NULL;
+    if (sw == NULL || ne == NULL || (b->t == NULL && ns == NULL)){
+        free(sw);
+        free(ne);
+        free(ns);
+        return;
+    }
+    for (size_t i = 0; i < calls; i++){
+        bench_box(seed, expect, pts, points, &sw[i], &ne[i]);
+    }
+    size_t found = 0;
+    bench_result r = {data, bench_layout_names[b->layout], name, n, 0, 0.0, 0, 0, 0, 0, {0}};
+    kdtree_latency_reset();
+    bench_counters_start();
+    uint64_t start = bench_now();
+    uint64_t stop = start + (uint64_t)(BENCH_CASE_SECONDS * 1e9);
+    size_t done = 0;
+    while (bench_more(done, calls, stop)){
+        size_t i = done++;
+        uint64_t before = ns == NULL ? 0 : bench_now();
+        if (for_each){
+            bench_range_for_each(b, &sw[i], &ne[i], &found);
+        } else{
+            int count;
+            free(bench_range(b, &sw[i], &ne[i], &count));
+            found += count;
+        }
+        if (ns != NULL){
+            ns[i] = bench_now() - before;
+        }
+    }
+    r.seconds = (bench_now() - start) / 1e9;
+    bench_counters_stop(r.counts);
+    r.calls = done;
+    if (ns != NULL){
+        bench_percentiles(ns, done, &r);
+    } else{
+        bench_recorded(for_each ? KDTREE_OP_RANGE_FOR_EACH : KDTREE_OP_RANGE, &r);
+    }
+    bench_report(&r);
+    free(sw);
+    free(ne);
+    free(ns);
+}
+
+//runs every case for one kind of data and size, with the lookups and
+//queries on each of the given layouts; returns false if memory ran out
+static bool bench_size(kdtree_dataset d, size_t n, const bool *layouts){
+    const char *data = kdtree_dataset_name(d);
+    size_t m = n < BENCH_UPDATES ? n : BENCH_UPDATES;
+    location *pts = malloc(sizeof(location) * (n + m));
+    size_t reps = n >= BENCH_BUILD_WORK ? 1 : BENCH_BUILD_WORK / n;
+    reps = reps > 100 ? 100 : reps;
+    uint64_t *build_ns = malloc(sizeof(uint64_t) * reps);
+    uint64_t *destroy_ns = malloc(sizeof(uint64_t) * reps);
+    uint64_t seed = 474 + n;
+    if (pts == NULL || build_ns == NULL || destroy_ns == NULL || !kdtree_dataset_generate(d, seed, pts, n + m)){
+        free(pts);
+        free(build_ns);
+        free(destroy_ns);
+        return false;
+    }
+    //for the picks below, so they aren't the points over again
+    seed = ~seed;
+
+    //build, and destroy all but the last tree built
+    kdtree *t = NULL;
+    bench_result built = {data, "pointer", "build", n, reps, 0.0, 0, 0, 0, 0, {0}};
+    bench_result destroyed = {data, "pointer", "destroy", n, reps, 0.0, 0, 0, 0, 0, {0}};
+    for (size_t i = 0; i < reps; i++){
+        bench_counters_start();
+        uint64_t start = bench_now();
+        t = kdtree_create(pts, n);
+        build_ns[i] = bench_now() - start;
+        bench_counters_stop(built.counts);
+        built.seconds += build_ns[i] / 1e9;
+        if (t == NULL){
+            break;
+        }
+        if (i + 1 < reps){
+            bench_counters_start();
+            start = bench_now();
+            kdtree_destroy(t);
+            destroy_ns[i] = bench_now() - start;
+            bench_counters_stop(destroyed.counts);
+            destroyed.seconds += destroy_ns[i] / 1e9;
+        }
+    }
+    if (t == NULL){
+        free(pts);
+        free(build_ns);
+        free(destroy_ns);
+        return false;
+    }
+    bench_percentiles(build_ns, reps, &built);
+    bench_report(&built);
+
+    bench_result r = {data, "pointer", "add", n, 0, 0.0, 0, 0, 0, 0, {0}};
+    kdtree_latency_reset();
+    bench_counters_start();
+    uint64_t start = bench_now();
+    uint64_t stop = start + (uint64_t)(BENCH_CASE_SECONDS * 1e9);
+    size_t added = 0;
+    while (bench_more(added, m, stop)){
+        kdtree_add(t, &pts[n + added++]);
+    }
+    r.seconds = (bench_now() - start) / 1e9;
+    bench_counters_stop(r.counts);
+    r.calls = added;
+    bench_recorded(KDTREE_OP_ADD, &r);
+    bench_report(&r);
+
+    //lookups of points picked at random, so they aren't in cache by luck
+    size_t *picks = malloc(sizeof(size_t) * m);
+    if (picks == NULL){
+        kdtree_destroy(t);
+        free(pts);
+        free(build_ns);
+        free(destroy_ns);
+        return false;
+    }
+    for (size_t i = 0; i < m; i++){
+        picks[i] = kdtree_dataset_random(&seed) % (n + added);
+    }
+
+    //every layout answers the same calls
+    size_t small_calls = m;
+    size_t medium_calls = m / 100 > 10 ? m / 100 : 10;
+    size_t world_calls = n >= 1000000 ? 3 : 10;
+    bool ok = true;
+    for (int k = 0; k < BENCH_LAYOUTS && ok; k++){
+        bench_tree b;
+        if (!layouts[k]){
+            continue;
+        }
+        ok = bench_tree_create(&b, k, t, pts, n, added);
+        if (ok){
+            uint64_t boxes = seed;
+            bench_lookups(data, &b, n, pts, picks, m);
+            bench_ranges(data, "range_small", &b, n, pts, n + added, 10, small_calls, false, &boxes);
+            bench_ranges(data, "range_medium", &b, n, pts, n + added, 1000, medium_calls, false, &boxes);
+            bench_ranges(data, "range_world", &b, n, pts, n + added, n + added, world_calls, false, &boxes);
+            bench_ranges(data, "for_each", &b, n, pts, n + added, 1000, medium_calls, true, &boxes);
+        }
+        bench_tree_destroy(&b);
+    }
+    free(picks);
+    if (!ok){
+        kdtree_destroy(t);
+        free(pts);
+        free(build_ns);
+        free(destroy_ns);
+        return false;
+    }
+
+    r = (bench_result){data, "pointer", "remove", n, 0, 0.0, 0, 0, 0, 0, {0}};
+    kdtree_latency_reset();
+    bench_counters_start();
+    start = bench_now();
+    stop = start + (uint64_t)(BENCH_CASE_SECONDS * 1e9);
+    size_t removed = 0;
+    while (bench_more(removed, added, stop)){
+        kdtree_remove(t, &pts[n + removed++]);
+    }
+    r.seconds = (bench_now() - start) / 1e9;
+    bench_counters_stop(r.counts);
+    r.calls = removed;
+    bench_recorded(KDTREE_OP_REMOVE, &r);
+    bench_report(&r);
+
+    bench_counters_start();
+    start = bench_now();
+    kdtree_destroy(t);
+    destroy_ns[reps - 1] = bench_now() - start;
+    bench_counters_stop(destroyed.counts);
+    destroyed.seconds += destroy_ns[reps - 1] / 1e9;
+    bench_percentiles(destroy_ns, reps, &destroyed);
+    bench_report(&destroyed);
+
+    free(pts);
+    free(build_ns);
+    free(destroy_ns);
+    return true;
+}
+
+int main(int argc, char **argv){
+    const char *sizes = argc > 1 ? argv[1] : "1e3,1e4,1e5,1e6";
+    if (argc > 3){
+        bench_tolerance = strtod(argv[3], NULL);
+    }
+    bool datasets[KDTREE_DATASETS];
+    bool all = argc <= 4 || strcmp(argv[4], "-") == 0;
+    for (int d = 0; d < KDTREE_DATASETS; d++){
+        datasets[d] = all;
+    }
+    bool usage = argc > 6 || bench_tolerance <= 0.0;
+    for (char *name = all ? NULL : strtok(argv[4], ","); name != NULL && !usage; name = strtok(NULL, ",")){
+        kdtree_dataset d;
+        if (kdtree_dataset_parse(name, &d)){
+            datasets[d] = true;
+        } else{
+            usage = true;
+        }
+    }
+    bool layouts[BENCH_LAYOUTS] = {argc <= 5};
+    for (char *name = argc > 5 ? strtok(argv[5], ",") : NULL; name != NULL && !usage; name = strtok(NULL, ",")){
+        int k = 0;
+        while (k < BENCH_LAYOUTS && strcmp(name, bench_layout_names[k]) != 0){
+            k++;
+        }
+        if (k < BENCH_LAYOUTS){
+            layouts[k] = true;
+        } else{
+            usage = true;
+        }
+    }
+    if (usage){
+        fprintf(stderr, "USAGE: %s [sizes [baseline [tolerance [datasets [layouts]]]]]\n", argv[0]);
+        return 1;
+    }
+    const char *baseline = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL;
+    if (baseline != NULL && !bench_read_baseline(baseline)){
+        fprintf(stderr, "%s: could not read %s\n", argv[0], argv[2]);
+        return 1;
+    }
+
+    kdtree_latency_enable(true);
+    bool counters = bench_counters_open(argv[0]);
+#ifdef __OPTIMIZE__
+    printf("{\"benchmark\": \"kdtree\", \"optimized\": true, \"counters\": %s, \"results\": [\n", counters ? "true" : "false");
+#else
+    printf("{\"benchmark\": \"kdtree\", \"optimized\": false, \"counters\": %s, \"results\": [\n", counters ? "true" : "false");
+#endif
+    int status = 0;
+    for (int d = 0; d < KDTREE_DATASETS && status == 0; d++){
+        const char *next = datasets[d] ? sizes : "";
+        while (*next != '\0'){
+            char *end;
+            double size = strtod(next, &end);
+            if (end == next || size < 1.0 || size > 1e9){
+                fprintf(stderr, "%s: bad size in %s\n", argv[0], sizes);
+                status = 1;
+                break;
+            }
+            if (!bench_size(d, (size_t)size, layouts)){
+                fprintf(stderr, "%s: out of memory at %.0f points\n", argv[0], size);
+                status = 1;
+                break;
+            }
+            next = *end == ',' ? end + 1 : end;
+        }
+    }
+    printf("\n]}\n");
+
+    bench_counters_close();
+    free(bench_baselines);
+    if (status == 0 && bench_regressions > 0){
+        fprintf(stderr, "%zu regressions against %s\n", bench_regressions, baseline);
+        status = 2;
+    }
+    return status;
+}
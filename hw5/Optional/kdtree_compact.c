@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "kdtree_compact.h"
+#include "location.h"
+
+// kids value for a node with no child slots
+#define KDC_NONE UINT32_MAX
+// kids value for a slot that does not hold a node
+#define KDC_EMPTY (UINT32_MAX - 1)
+// largest number of slots, leaving the top two values for the markers
+#define KDC_MAX_SLOTS (UINT32_MAX - 3)
+
+// passes kdc_select makes without halving its range before it sorts instead
+#define KDC_SELECT_SLOW_PASSES 8
+
+typedef struct {
+    int32_t key[2];  // dimension 0 is longitude and 1 is latitude, as in kdtree_helpers.h
+    uint32_t kids;   // index of the slot of the left child; the right child is the next slot
+} kdc_slot;
+
+typedef struct _kdtree_compact{
+    kdc_slot *slots;
+    uint32_t used;       // slots handed out so far (always even)
+    uint32_t capacity;
+    uint32_t free_pair;  // first pair on the free list, chained through kids
+    uint32_t top;        // pair whose first slot holds the root, or KDC_NONE if empty
+    size_t tree_size;
+    kdtree_coord_type type;
+} kdtree_compact;
+
+//gets the keys for a point, or returns false if it can't be stored
+static bool kdc_keys(const kdtree_compact *t, const location *p, int32_t key[2]){
+    return kdtree_quantize(t->type, p->lon, &key[0]) && kdtree_quantize(t->type, p->lat, &key[1]);
+}
+
+static bool kdc_equal(const int32_t a[2], const int32_t b[2]){
+    return a[0] == b[0] && a[1] == b[1];
+}
+
+//hands out two adjacent empty slots and returns the index of the first
+static uint32_t kdc_alloc_pair(kdtree_compact *t){
+    uint32_t pair;
+    if (t->free_pair != KDC_NONE){
+        pair = t->free_pair;
+        t->free_pair = t->slots[pair].kids;
+    } else{
+        if (t->used + 2 > t->capacity){
+            if (t->capacity >= KDC_MAX_SLOTS / 5 * 4 - 8){
+                return KDC_NONE;
+            }
+            //grow by a quarter rather than doubling so that a tree that
+            //has had points added stays well under 16 bytes per point
+            uint32_t capacity = t->capacity + t->capacity / 4 + 8;
+            kdc_slot *slots = realloc(t->slots, sizeof(kdc_slot) * capacity);
+            if (slots == NULL){
+                return KDC_NONE;
+            }
+            t->slots = slots;
+            t->capacity = capacity;
+        }
+        pair = t->used;
+        t->used += 2;
+    }
+    t->slots[pair].kids = KDC_EMPTY;
+    t->slots[pair + 1].kids = KDC_EMPTY;
+    return pair;
+}
+
+static void kdc_free_pair(kdtree_compact *t, uint32_t pair){
+    t->slots[pair].kids = t->free_pair;
+    t->slots[pair + 1].kids = KDC_EMPTY;
+    t->free_pair = pair;
+}
+
+//releases the child slots of the node in slot s if both are empty
+static void kdc_trim(kdtree_compact *t, uint32_t s){
+    uint32_t pair = t->slots[s].kids;
+    if (pair < KDC_EMPTY && t->slots[pair].kids == KDC_EMPTY && t->slots[pair + 1].kids == KDC_EMPTY){
+        kdc_free_pair(t, pair);
+        t->slots[s].kids = KDC_NONE;
+    }
+}
+
+static int kdc_compare_keys(const void *a, const void *b){
+    const kdc_slot *s1 = a;
+    const kdc_slot *s2 = b;
+    for (int d = 0; d < 2; d++){
+        if (s1->key[d] != s2->key[d]){
+            return s1->key[d] < s2->key[d] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+//as kdc_compare_keys, but by the second key first
+static int kdc_compare_keys_flipped(const void *a, const void *b){
+    const kdc_slot *s1 = a;
+    const kdc_slot *s2 = b;
+    for (int d = 1; d >= 0; d--){
+        if (s1->key[d] != s2->key[d]){
+            return s1->key[d] < s2->key[d] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+//puts the k-th smallest point by dimension d at index k, as kdtree_select
+//does: points equal to the pivot stop the scans from both ends and are
+//swapped, so a run of equal keys, such as points on one meridian, is
+//split down the middle instead of one point per pass.  The order earlier
+//levels leave can still make the pivot at k one of the ends every time,
+//so if a pass doesn't halve the range once in a while the rest is sorted
+static void kdc_select(kdc_slot *a, size_t n, size_t k, int d){
+    size_t lo = 0;
+    size_t hi = n - 1;
+    size_t halved = n;  //the size of the range when it last halved
+    int slow = 0;       //passes since then
+    while (lo < hi){
+        if (hi - lo < halved / 2){
+            halved = hi - lo + 1;
+            slow = 0;
+        } else if (++slow > KDC_SELECT_SLOW_PASSES){
+            qsort(a + lo, hi - lo + 1, sizeof(kdc_slot), d == 0 ? kdc_compare_keys : kdc_compare_keys_flipped);
+            return;
+        }
+        int32_t pivot = a[k].key[d];
+        size_t i = lo;
+        size_t j = hi;
+        while (i <= j){
+            while (a[i].key[d] < pivot){
+                i++;
+            }
+            while (pivot < a[j].key[d]){
+                j--;
+            }
+            if (i <= j){
+                kdc_slot tmp = a[i]; a[i] = a[j]; a[j] = tmp;
+                i++;
+                if (j == 0){
+                    break;
+                }
+                j--;
+            }
+        }
+        if (j < k){
+            lo = i;
+        }
+        if (k < i){
+            hi = j;
+        }
+    }
+}
+
+//returns how many of n points go left so that the subtree is complete
+//(every level full except the last, which is filled from the left);
+//then at most one node has a single child and wastes a slot
+static size_t kdc_left_size(size_t n){
+    size_t half = 1;  //size of the last level of the left subtree when full
+    while (4 * half <= n + 1){
+        half *= 2;
+    }
+    size_t upper = half - 1;           //left subtree nodes above its last level
+    size_t last = n - (2 * half - 1);  //nodes on the whole tree's last level
+    return upper + (last < half ? last : half);
+}
+
+//builds a balanced subtree from pts into slot s; slots are preallocated
+static void kdc_create_helper(kdtree_compact *t, kdc_slot *pts, size_t n, int depth, uint32_t s){
+    int cut_dim = depth % 2;
+    size_t median = kdc_left_size(n);
+    kdc_select(pts, n, median, cut_dim);
+
+    //points equal to the median in the cut dimension have to go right,
+    //so the first of them becomes the root of this subtree
+    int32_t cut = pts[median].key[cut_dim];
+    size_t split = 0;
+    for (size_t i = 0; i < median; i++){
+        if (pts[i].key[cut_dim] < cut){
+            kdc_slot tmp = pts[i]; pts[i] = pts[split]; pts[split] = tmp;
+            split++;
+        }
+    }
+    kdc_slot tmp = pts[median]; pts[median] = pts[split]; pts[split] = tmp;
+
+    t->slots[s].key[0] = pts[split].key[0];
+    t->slots[s].key[1] = pts[split].key[1];
+    t->slots[s].kids = KDC_NONE;
+    if (n == 1){
+        return;
+    }
+
+    uint32_t pair = kdc_alloc_pair(t);
+    t->slots[s].kids = pair;
+    if (split > 0){
+        kdc_create_helper(t, pts, split, depth + 1, pair);
+    }
+    if (n - split - 1 > 0){
+        kdc_create_helper(t, pts + split + 1, n - split - 1, depth + 1, pair + 1);
+    }
+}
+
+kdtree_compact *kdtree_compact_create(const location *pts, int n, kdtree_coord_type type){
+    kdtree_compact *t = malloc(sizeof(kdtree_compact));
+    if (t == NULL){
+        return NULL;
+    }
+    t->slots = NULL;
+    t->used = 0;
+    t->capacity = 0;
+    t->free_pair = KDC_NONE;
+    t->top = KDC_NONE;
+    t->tree_size = 0;
+    t->type = type;
+
+    if (n <= 0){
+        return t;
+    }
+    if ((size_t)n > KDC_MAX_SLOTS / 2 - 1){
+        free(t);
+        return NULL;
+    }
+
+    //quantize into a scratch array that we can sort and partition
+    kdc_slot *keys = malloc(sizeof(kdc_slot) * n);
+    if (keys == NULL){
+        free(t);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++){
+        if (!kdc_keys(t, &pts[i], keys[i].key)){
+            free(keys);
+            free(t);
+            return NULL;
+        }
+    }
+
+    //remove duplicates
+    qsort(keys, n, sizeof(kdc_slot), kdc_compare_keys);
+    size_t count = 1;
+    for (int i = 1; i < n; i++){
+        if (!kdc_equal(keys[i].key, keys[count - 1].key)){
+            keys[count++] = keys[i];
+        }
+    }
+
+    //every node uses at most one pair, plus one pair for the root
+    t->capacity = 2 * (uint32_t)count + 2;
+    t->slots = malloc(sizeof(kdc_slot) * t->capacity);
+    if (t->slots == NULL){
+        free(keys);
+        free(t);
+        return NULL;
+    }
+    t->top = kdc_alloc_pair(t);
+    kdc_create_helper(t, keys, count, 0, t->top);
+    t->tree_size = count;
+    free(keys);
+
+    //give back the slots the leaves didn't need
+    kdc_slot *trimmed = realloc(t->slots, sizeof(kdc_slot) * t->used);
+    if (trimmed != NULL){
+        t->slots = trimmed;
+        t->capacity = t->used;
+    }
+    return t;
+}
+
+bool kdtree_compact_contains(const kdtree_compact *t, const location *p){
+    if (t == NULL || p == NULL || t->top == KDC_NONE){
+        return false;
+    }
+    int32_t key[2];
+    if (!kdc_keys(t, p, key)){
+        return false;
+    }
+
+    uint32_t s = t->top;
+    int depth = 0;
+    while (t->slots[s].kids != KDC_EMPTY){
+        const kdc_slot *node = &t->slots[s];
+        if (kdc_equal(node->key, key)){
+            return true;
+        }
+        if (node->kids == KDC_NONE){
+            return false;
+        }
+        int cut_dim = depth % 2;
+        s = node->kids + !(key[cut_dim] < node->key[cut_dim]);
+        depth++;
+    }
+    return false;
+}
+
+bool kdtree_compact_add(kdtree_compact *t, const location *p){
+    if (t == NULL || p == NULL){
+        return false;
+    }
+    int32_t key[2];
+    if (!kdc_keys(t, p, key)){
+        return false;
+    }
+
+    if (t->top == KDC_NONE){
+        uint32_t pair = kdc_alloc_pair(t);
+        if (pair == KDC_NONE){
+            return false;
+        }
+        t->slots[pair].key[0] = key[0];
+        t->slots[pair].key[1] = key[1];
+        t->slots[pair].kids = KDC_NONE;
+        t->top = pair;
+        t->tree_size++;
+        return true;
+    }
+
+    uint32_t s = t->top;
+    int depth = 0;
+    while (true){
+        if (kdc_equal(t->slots[s].key, key)){
+            return false;
+        }
+        if (t->slots[s].kids == KDC_NONE){
+            //note that this may move the slots
+            uint32_t pair = kdc_alloc_pair(t);
+            if (pair == KDC_NONE){
+                return false;
+            }
+            t->slots[s].kids = pair;
+        }
+
+        int cut_dim = depth % 2;
+        uint32_t child = t->slots[s].kids + !(key[cut_dim] < t->slots[s].key[cut_dim]);
+        if (t->slots[child].kids == KDC_EMPTY){
+            t->slots[child].key[0] = key[0];
+            t->slots[child].key[1] = key[1];
+            t->slots[child].kids = KDC_NONE;
+            t->tree_size++;
+            return true;
+        }
+        s = child;
+        depth++;
+    }
+}
+
+//returns the slot with the smallest key in dimension dim in the subtree in slot s
+static uint32_t kdc_find_min(const kdtree_compact *t, uint32_t s, int depth, int dim){
+    uint32_t best = s;
+    uint32_t pair = t->slots[s].kids;
+    if (pair == KDC_NONE){
+        return best;
+    }
+    for (int dir = 0; dir < 2; dir++){
+        //if s cuts on dim then nothing on its right is smaller than s
+        if (t->slots[pair + dir].kids == KDC_EMPTY || (dir == 1 && depth % 2 == dim)){
+            continue;
+        }
+        uint32_t cand = kdc_find_min(t, pair + dir, depth + 1, dim);
+        if (t->slots[cand].key[dim] < t->slots[best].key[dim]){
+            best = cand;
+        }
+    }
+    return best;
+}
+
+//removes key from the subtree in slot s; returns true if it was there
+static bool kdc_remove_helper(kdtree_compact *t, uint32_t s, int depth, const int32_t key[2]){
+    kdc_slot *node = &t->slots[s];
+    if (node->kids == KDC_EMPTY){
+        return false;
+    }
+    int cut_dim = depth % 2;
+
+    if (!kdc_equal(node->key, key)){
+        if (node->kids == KDC_NONE){
+            return false;
+        }
+        bool found = kdc_remove_helper(t, node->kids + !(key[cut_dim] < node->key[cut_dim]), depth + 1, key);
+        kdc_trim(t, s);
+        return found;
+    }
+
+    //case1: leaf
+    if (node->kids == KDC_NONE){
+        node->kids = KDC_EMPTY;
+        return true;
+    }
+
+    //case 2: no right subtree, so the left one becomes the right one
+    uint32_t pair = node->kids;
+    if (t->slots[pair + 1].kids == KDC_EMPTY){
+        t->slots[pair + 1] = t->slots[pair];
+        t->slots[pair].kids = KDC_EMPTY;
+    }
+
+    //replace with the minimum of the right subtree, then remove that
+    uint32_t min = kdc_find_min(t, pair + 1, depth + 1, cut_dim);
+    int32_t min_key[2] = {t->slots[min].key[0], t->slots[min].key[1]};
+    node->key[0] = min_key[0];
+    node->key[1] = min_key[1];
+    kdc_remove_helper(t, pair + 1, depth + 1, min_key);
+    kdc_trim(t, s);
+    return true;
+}
+
+void kdtree_compact_remove(kdtree_compact *t, const location *p){
+    if (t == NULL || p == NULL || t->top == KDC_NONE){
+        return;
+    }
+    int32_t key[2];
+    if (!kdc_keys(t, p, key)){
+        return;
+    }
+
+    if (kdc_remove_helper(t, t->top, 0, key)){
+        t->tree_size--;
+    }
+    if (t->slots[t->top].kids == KDC_EMPTY){
+        kdc_free_pair(t, t->top);
+        t->top = KDC_NONE;
+    }
+}
+
+//Helper function
+static void kdc_range_helper(const kdtree_compact *t, uint32_t s, int depth, const int64_t lo[2], const int64_t hi[2], void (*f)(const location *, void *), void *arg){
+    const kdc_slot *node = &t->slots[s];
+    if (node->kids == KDC_EMPTY){
+        return;
+    }
+
+    if (lo[0] <= node->key[0] && hi[0] >= node->key[0] && lo[1] <= node->key[1] && hi[1] >= node->key[1]){
+        location loc = {kdtree_dequantize(t->type, node->key[1]), kdtree_dequantize(t->type, node->key[0])};
+        f(&loc, arg);
+    }
+
+    if (node->kids == KDC_NONE){
+        return;
+    }
+    int cut_dim = depth % 2;
+    if (lo[cut_dim] <= node->key[cut_dim]){
+        kdc_range_helper(t, node->kids, depth + 1, lo, hi, f, arg);
+    }
+    if (hi[cut_dim] >= node->key[cut_dim]){
+        kdc_range_helper(t, node->kids + 1, depth + 1, lo, hi, f, arg);
+    }
+}
+
+void kdtree_compact_range_for_each(const kdtree_compact *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
+    if (t == NULL || sw == NULL || ne == NULL || f == NULL || t->top == KDC_NONE){
+        return;
+    }
+    //widest key ranges whose coordinates are inside the rectangle
+    int64_t lo[2] = {kdtree_quantize_lower(t->type, sw->lon), kdtree_quantize_lower(t->type, sw->lat)};
+    int64_t hi[2] = {kdtree_quantize_upper(t->type, ne->lon), kdtree_quantize_upper(t->type, ne->lat)};
+    kdc_range_helper(t, t->top, 0, lo, hi, f, arg);
+}
+
+typedef struct {
+    location *pts;
+    size_t count;
+    size_t capacity;
+    bool failed;
+} kdc_collector;
+
+static void kdc_collect(const location *l, void *arg){
+    kdc_collector *c = arg;
+    if (c->count == c->capacity){
+        size_t capacity = c->capacity == 0 ? 16 : c->capacity * 2;
+        location *pts = realloc(c->pts, sizeof(location) * capacity);
+        if (pts == NULL){
+            c->failed = true;
+            return;
+        }
+        c->pts = pts;
+        c->capacity = capacity;
+    }
+    c->pts[c->count++] = *l;
+}
+
+location *kdtree_compact_range(const kdtree_compact *t, const location *sw, const location *ne, int *n){
+    if (t == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    kdc_collector c = {NULL, 0, 0, false};
+    kdtree_compact_range_for_each(t, sw, ne, kdc_collect, &c);
+
+    if (c.failed){
+        free(c.pts);
+        *n = 0;
+        return NULL;
+    }
+    *n = c.count;
+    return c.pts;
+}
+
+size_t kdtree_compact_size(const kdtree_compact *t){
+    return t == NULL ? 0 : t->tree_size;
+}
+
+size_t kdtree_compact_memory(const kdtree_compact *t){
+    if (t == NULL){
+        return 0;
+    }
+    return sizeof(kdtree_compact) + sizeof(kdc_slot) * t->capacity;
+}
+
+void kdtree_compact_destroy(kdtree_compact *t){
+    if (t == NULL){
+        return;
+    }
+    free(t->slots);
+    free(t);
+}
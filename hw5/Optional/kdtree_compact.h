@@ -0,0 +1,124 @@
+#ifndef __KDTREE_COMPACT_H__
+#define __KDTREE_COMPACT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "location.h"
+#include "kdtree_quantize.h"
+
+/**
+ * A k-d tree with the same interface as kdtree, but that stores each
+ * point as two 32-bit keys (see kdtree_quantize.h) in a single array of
+ * 12-byte slots, with children referenced by 32-bit index instead of by
+ * pointer.  The two children of a node are kept in adjacent slots so
+ * that one index reaches both, and leaves have no child slots at all,
+ * so a balanced tree uses about 12 bytes per point.
+ *
+ * All comparisons are done on the keys.  Two locations that quantize to
+ * the same keys are therefore considered the same point.  Locations
+ * whose coordinates survive the round trip (for example coordinates
+ * with at most six decimal places in KDTREE_COORDS_INT32 mode) are
+ * returned exactly by kdtree_compact_range; others come back rounded.
+ */
+typedef struct _kdtree_compact kdtree_compact;
+
+
+/**
+ * Creates a balanced compact tree containing the given points.  If
+ * several points have the same keys then only one copy is kept.
+ *
+ * @param pts an array of valid locations; NULL is allowed if n = 0
+ * @param n the number of points in that array
+ * @param type the key format to store coordinates in
+ * @return a pointer to the new tree, or NULL if memory could not be
+ * allocated or a coordinate is out of the format's range
+ */
+kdtree_compact *kdtree_compact_create(const location *pts, int n, kdtree_coord_type type);
+
+
+/**
+ * Adds the given point to the given compact tree.  There is no effect if
+ * a point with the same keys is already in the tree.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the point was added
+ */
+bool kdtree_compact_add(kdtree_compact *t, const location *p);
+
+
+/**
+ * Determines if the given compact tree contains a point with the same keys
+ * as the given point.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only of the tree contains the location
+ */
+bool kdtree_compact_contains(const kdtree_compact *t, const location *p);
+
+
+/**
+ * Removes the point with the same keys as the given point from the given
+ * compact tree.  There is no effect if there is no such point.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ */
+void kdtree_compact_remove(kdtree_compact *t, const location *p);
+
+
+/**
+ * Returns a dynamically allocated array of the points in the given tree
+ * in or on the borders of the given rectangle, as for kdtree_range.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param n a pointer to an integer, non-NULL
+ * @return a pointer to an array containing the points in the range, or NULL
+ */
+location *kdtree_compact_range(const kdtree_compact *t, const location *sw, const location *ne, int *n);
+
+
+/**
+ * Passes the points in the given tree in or on the borders of the given
+ * rectangle to the given function, as for kdtree_range_for_each.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param f a pointer to a function that takes a location and
+ * the extra argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to f
+ */
+void kdtree_compact_range_for_each(const kdtree_compact *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg);
+
+
+/**
+ * Returns the number of points in the given compact tree.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ */
+size_t kdtree_compact_size(const kdtree_compact *t);
+
+
+/**
+ * Returns the number of bytes of memory used by the given compact tree.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ */
+size_t kdtree_compact_memory(const kdtree_compact *t);
+
+
+/**
+ * Destroys the given compact tree.
+ *
+ * @param t a pointer to a valid compact tree, non-NULL
+ */
+void kdtree_compact_destroy(kdtree_compact *t);
+
+#endif
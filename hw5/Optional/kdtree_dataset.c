@@ -0,0 +1,232 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kdtree_dataset.h"
+#include "kdtree_internal.h"
+#include "location.h"
+
+//cluster centers stay between these latitudes, where people are
+#define KDTREE_DATASET_SOUTH -60.0
+#define KDTREE_DATASET_NORTH 70.0
+//spread of a cluster, in degrees
+#define KDTREE_DATASET_MIN_SIGMA 0.02
+#define KDTREE_DATASET_MAX_SIGMA 0.5
+//points per equal-sized hotspot, and per Zipf cluster
+#define KDTREE_DATASET_HOTSPOT_POINTS 1000
+#define KDTREE_DATASET_ZIPF_POINTS 100
+//exponent of the Zipf distribution of cluster sizes
+#define KDTREE_DATASET_ZIPF_EXPONENT 1.1
+
+#define KDTREE_DATASET_PI 3.14159265358979323846
+
+static const char *kdtree_dataset_names[KDTREE_DATASETS] = {
+    "uniform", "hotspots", "zipf", "curve", "sorted", "boundary"
+};
+
+typedef struct {
+    location center;
+    double sigma;
+} kdtree_dataset_cluster;
+
+uint64_t kdtree_dataset_random(uint64_t *state){
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+//in [0, 1)
+static double kdtree_dataset_uniform(uint64_t *state){
+    return (kdtree_dataset_random(state) >> 11) * 0x1.0p-53;
+}
+
+//standard normal, by the Box-Muller transform
+static double kdtree_dataset_normal(uint64_t *state){
+    double u = 1.0 - kdtree_dataset_uniform(state);
+    double v = kdtree_dataset_uniform(state);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * KDTREE_DATASET_PI * v);
+}
+
+const char *kdtree_dataset_name(kdtree_dataset d){
+    return d < KDTREE_DATASETS ? kdtree_dataset_names[d] : "unknown";
+}
+
+bool kdtree_dataset_parse(const char *name, kdtree_dataset *d){
+    for (int i = 0; i < KDTREE_DATASETS; i++){
+        if (strcmp(name, kdtree_dataset_names[i]) == 0){
+            *d = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static location kdtree_dataset_anywhere(uint64_t *state){
+    location l;
+    l.lat = kdtree_dataset_uniform(state) * 180.0 - 90.0;
+    l.lon = kdtree_dataset_uniform(state) * 360.0 - 180.0;
+    return l;
+}
+
+//a point drawn from the given cluster, reflected at the poles and
+//wrapped at the antimeridian so it is valid
+static location kdtree_dataset_near(const kdtree_dataset_cluster *c, uint64_t *state){
+    location l;
+    l.lat = c->center.lat + c->sigma * kdtree_dataset_normal(state);
+    l.lon = c->center.lon + c->sigma * kdtree_dataset_normal(state);
+    if (l.lat > 90.0){
+        l.lat = 180.0 - l.lat;
+    } else if (l.lat < -90.0){
+        l.lat = -180.0 - l.lat;
+    }
+    if (l.lon > 180.0){
+        l.lon -= 360.0;
+    } else if (l.lon < -180.0){
+        l.lon += 360.0;
+    }
+    return l;
+}
+
+static kdtree_dataset_cluster *kdtree_dataset_clusters(size_t k, uint64_t *state){
+    kdtree_dataset_cluster *clusters = malloc(sizeof(kdtree_dataset_cluster) * k);
+    if (clusters == NULL){
+        return NULL;
+    }
+    for (size_t i = 0; i < k; i++){
+        clusters[i].center.lat = KDTREE_DATASET_SOUTH + kdtree_dataset_uniform(state) * (KDTREE_DATASET_NORTH - KDTREE_DATASET_SOUTH);
+        clusters[i].center.lon = kdtree_dataset_uniform(state) * 360.0 - 180.0;
+        clusters[i].sigma = KDTREE_DATASET_MIN_SIGMA + kdtree_dataset_uniform(state) * (KDTREE_DATASET_MAX_SIGMA - KDTREE_DATASET_MIN_SIGMA);
+    }
+    return clusters;
+}
+
+static bool kdtree_dataset_hotspots(uint64_t *state, location *pts, size_t n){
+    size_t k = n / KDTREE_DATASET_HOTSPOT_POINTS + 1;
+    kdtree_dataset_cluster *clusters = kdtree_dataset_clusters(k, state);
+    if (clusters == NULL){
+        return false;
+    }
+    for (size_t i = 0; i < n; i++){
+        pts[i] = kdtree_dataset_near(&clusters[kdtree_dataset_random(state) % k], state);
+    }
+    free(clusters);
+    return true;
+}
+
+static bool kdtree_dataset_zipf(uint64_t *state, location *pts, size_t n){
+    size_t k = n / KDTREE_DATASET_ZIPF_POINTS + 1;
+    kdtree_dataset_cluster *clusters = kdtree_dataset_clusters(k, state);
+    double *cumulative = malloc(sizeof(double) * k);
+    if (clusters == NULL || cumulative == NULL){
+        free(clusters);
+        free(cumulative);
+        return false;
+    }
+    double total = 0.0;
+    for (size_t i = 0; i < k; i++){
+        total += pow(i + 1.0, -KDTREE_DATASET_ZIPF_EXPONENT);
+        cumulative[i] = total;
+    }
+    for (size_t i = 0; i < n; i++){
+        //the first cluster whose share reaches past a uniform draw
+        double u = kdtree_dataset_uniform(state) * total;
+        size_t lo = 0;
+        size_t hi = k - 1;
+        while (lo < hi){
+            size_t mid = lo + (hi - lo) / 2;
+            if (cumulative[mid] > u){
+                hi = mid;
+            } else{
+                lo = mid + 1;
+            }
+        }
+        pts[i] = kdtree_dataset_near(&clusters[lo], state);
+    }
+    free(clusters);
+    free(cumulative);
+    return true;
+}
+
+typedef struct {
+    uint64_t key;
+    location loc;
+} kdtree_dataset_keyed;
+
+static int kdtree_dataset_compare_keys(const void *a, const void *b){
+    uint64_t x = ((const kdtree_dataset_keyed *)a)->key;
+    uint64_t y = ((const kdtree_dataset_keyed *)b)->key;
+    return (x > y) - (x < y);
+}
+
+static bool kdtree_dataset_curve(location *pts, size_t n){
+    kdtree_dataset_keyed *keyed = malloc(sizeof(kdtree_dataset_keyed) * (n > 0 ? n : 1));
+    if (keyed == NULL){
+        return false;
+    }
+    for (size_t i = 0; i < n; i++){
+        keyed[i].key = kdtree_hilbert_index(&pts[i]);
+        keyed[i].loc = pts[i];
+    }
+    qsort(keyed, n, sizeof(kdtree_dataset_keyed), kdtree_dataset_compare_keys);
+    for (size_t i = 0; i < n; i++){
+        pts[i] = keyed[i].loc;
+    }
+    free(keyed);
+    return true;
+}
+
+static int kdtree_dataset_compare_longitude(const void *a, const void *b){
+    return location_compare_longitude(a, b);
+}
+
+static void kdtree_dataset_boundary(uint64_t *state, location *pts, size_t n){
+    for (size_t i = 0; i < n; i++){
+        location l = kdtree_dataset_anywhere(state);
+        switch (kdtree_dataset_random(state) % 5){
+        case 0:
+            l.lat = l.lat < 0.0 ? -90.0 : 90.0;
+            break;
+        case 1:
+            l.lon = l.lon < 0.0 ? -180.0 : 180.0;
+            break;
+        case 2:
+            l.lat = 0.0;
+            break;
+        case 3:
+            l.lon = 0.0;
+            break;
+        default:
+            break;
+        }
+        pts[i] = l;
+    }
+}
+
+bool kdtree_dataset_generate(kdtree_dataset d, uint64_t seed, location *pts, size_t n){
+    uint64_t state = seed;
+    switch (d){
+    case KDTREE_DATASET_UNIFORM:
+        for (size_t i = 0; i < n; i++){
+            pts[i] = kdtree_dataset_anywhere(&state);
+        }
+        return true;
+    case KDTREE_DATASET_HOTSPOTS:
+        return kdtree_dataset_hotspots(&state, pts, n);
+    case KDTREE_DATASET_ZIPF:
+        return kdtree_dataset_zipf(&state, pts, n);
+    case KDTREE_DATASET_CURVE:
+        return kdtree_dataset_zipf(&state, pts, n) && kdtree_dataset_curve(pts, n);
+    case KDTREE_DATASET_SORTED:
+        if (!kdtree_dataset_zipf(&state, pts, n)){
+            return false;
+        }
+        qsort(pts, n, sizeof(location), kdtree_dataset_compare_longitude);
+        return true;
+    case KDTREE_DATASET_BOUNDARY:
+        kdtree_dataset_boundary(&state, pts, n);
+        return true;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef __KDTREE_DATASET_H__
+#define __KDTREE_DATASET_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "location.h"
+
+/**
+ * Generators of test points that look like real sightings rather than
+ * like uniform noise.  The same kind, seed and count always give the
+ * same points in the same order.  Every point is valid, and the points
+ * are distinct with overwhelming probability.
+ */
+typedef enum
+{
+  KDTREE_DATASET_UNIFORM,   // uniform over latitude and longitude
+  KDTREE_DATASET_HOTSPOTS,  // Gaussian clusters of about equal size around random centers
+  KDTREE_DATASET_ZIPF,      // Gaussian clusters whose sizes follow Zipf's law, like towns and cities
+  KDTREE_DATASET_CURVE,     // the Zipf clusters in order along a Hilbert curve, like a survey path
+  KDTREE_DATASET_SORTED,    // the Zipf clusters sorted by longitude, as a stream arriving west to east
+  KDTREE_DATASET_BOUNDARY,  // mostly on the poles, the antimeridian, the equator and the prime meridian
+  KDTREE_DATASETS           // the number of kinds
+} kdtree_dataset;
+
+
+/**
+ * Returns the short lowercase name of the given kind of data, such as
+ * "zipf".
+ *
+ * @param d a kind of data
+ * @return its name
+ */
+const char *kdtree_dataset_name(kdtree_dataset d);
+
+
+/**
+ * Finds the kind of data with the given name.
+ *
+ * @param name a name as returned by kdtree_dataset_name, non-NULL
+ * @param d a pointer to where to store the kind, non-NULL
+ * @return true if there is a kind with that name, false otherwise
+ */
+bool kdtree_dataset_parse(const char *name, kdtree_dataset *d);
+
+
+/**
+ * Fills the given array with points of the given kind.  Cluster centers
+ * fall between latitudes -60 and 70, and the spread of each cluster is
+ * between 0.02 and 0.5 degrees; points that would fall off the globe
+ * are reflected back at the poles and wrapped at the antimeridian.
+ * There is about one equal-sized hotspot per 1000 points, and one Zipf
+ * cluster per 100 points, with the k-th largest holding about 1/k^1.1
+ * as many as the largest.  Of the boundary points, a fifth each lie on
+ * a pole, on longitude -180 or 180, on the equator and on the prime
+ * meridian, and the rest are uniform; they share coordinates with one
+ * another but are still distinct.
+ *
+ * @param d a kind of data
+ * @param seed any number; different seeds give unrelated points
+ * @param pts an array of n locations, non-NULL if n > 0
+ * @param n the number of points to generate
+ * @return true if successful, false if memory could not be allocated,
+ * in which case the array's contents are unspecified
+ */
+bool kdtree_dataset_generate(kdtree_dataset d, uint64_t seed, location *pts, size_t n);
+
+
+/**
+ * Returns the next number from the splitmix64 generator that
+ * kdtree_dataset_generate draws from, and advances its state, so that
+ * programs using the points can make repeatable picks of their own.
+ *
+ * @param state a pointer to the generator's state, which may start as
+ * any number, non-NULL
+ * @return a number uniform over all 64-bit values
+ */
+uint64_t kdtree_dataset_random(uint64_t *state);
+
+#endif
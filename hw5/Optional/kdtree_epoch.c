@@ -0,0 +1,135 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "kdtree_epoch.h"
+
+//number of readers that can be inside at the same time; more wait
+#define KDTREE_EPOCH_SLOTS 128
+//retirements between automatic collections
+#define KDTREE_EPOCH_COLLECT_EVERY 64
+
+//each reader slot is 0 when free, or (epoch << 1) | 1 while reading,
+//and gets its own cache line so readers don't slow each other down
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t state;
+} kdtree_epoch_slot;
+
+typedef struct {
+    void *p;
+    void (*release)(void *);
+    uint64_t epoch;
+} kdtree_epoch_retired;
+
+struct kdtree_epoch{
+    kdtree_epoch_slot slots[KDTREE_EPOCH_SLOTS];
+    _Alignas(64) atomic_uint_fast64_t global;
+    //the rest is only touched by the writer
+    kdtree_epoch_retired *retired;
+    size_t retired_count;
+    size_t retired_capacity;
+    size_t since_collect;
+};
+
+//used only for its address, to spread threads over the slots
+static _Thread_local char kdtree_epoch_thread_tag;
+
+kdtree_epoch *kdtree_epoch_create(void){
+    kdtree_epoch *e = aligned_alloc(64, sizeof(kdtree_epoch));
+    if (e == NULL){
+        return NULL;
+    }
+    for (size_t i = 0; i < KDTREE_EPOCH_SLOTS; i++){
+        atomic_init(&e->slots[i].state, 0);
+    }
+    atomic_init(&e->global, 1);
+    e->retired = NULL;
+    e->retired_count = 0;
+    e->retired_capacity = 0;
+    e->since_collect = 0;
+    return e;
+}
+
+size_t kdtree_epoch_enter(kdtree_epoch *e){
+    size_t i = ((uintptr_t)&kdtree_epoch_thread_tag >> 6) % KDTREE_EPOCH_SLOTS;
+    while (true){
+        for (size_t tries = 0; tries < KDTREE_EPOCH_SLOTS; tries++){
+            uint_fast64_t expected = 0;
+            uint_fast64_t epoch = atomic_load(&e->global);
+            //sequentially consistent, so the writer sees this slot taken
+            //before this thread reads anything it might free
+            if (atomic_compare_exchange_strong(&e->slots[i].state, &expected, (epoch << 1) | 1)){
+                return i;
+            }
+            i = (i + 1) % KDTREE_EPOCH_SLOTS;
+        }
+        sched_yield();
+    }
+}
+
+void kdtree_epoch_exit(kdtree_epoch *e, size_t ticket){
+    atomic_store_explicit(&e->slots[ticket].state, 0, memory_order_release);
+}
+
+void kdtree_epoch_collect(kdtree_epoch *e){
+    e->since_collect = 0;
+    //make the writer's unlinking stores visible before looking at the
+    //slots, so a reader that enters after the scan can't find old memory
+    atomic_thread_fence(memory_order_seq_cst);
+
+    //the epoch can move on once every reader has seen the current one
+    uint_fast64_t global = atomic_load(&e->global);
+    bool advance = true;
+    for (size_t i = 0; i < KDTREE_EPOCH_SLOTS && advance; i++){
+        uint_fast64_t state = atomic_load(&e->slots[i].state);
+        advance = state == 0 || (state >> 1) == global;
+    }
+    if (advance){
+        global++;
+        atomic_store(&e->global, global);
+    }
+
+    //readers are all in the last two epochs, so anything retired before
+    //that was unlinked before any of them started
+    size_t kept = 0;
+    for (size_t i = 0; i < e->retired_count; i++){
+        if (e->retired[i].epoch + 2 <= global){
+            e->retired[i].release(e->retired[i].p);
+        } else{
+            e->retired[kept++] = e->retired[i];
+        }
+    }
+    e->retired_count = kept;
+}
+
+bool kdtree_epoch_retire(kdtree_epoch *e, void *p, void (*release)(void *)){
+    if (e->retired_count == e->retired_capacity){
+        size_t capacity = e->retired_capacity == 0 ? 64 : e->retired_capacity * 2;
+        kdtree_epoch_retired *bigger = realloc(e->retired, sizeof(kdtree_epoch_retired) * capacity);
+        if (bigger == NULL){
+            return false;
+        }
+        e->retired = bigger;
+        e->retired_capacity = capacity;
+    }
+    e->retired[e->retired_count].p = p;
+    e->retired[e->retired_count].release = release;
+    e->retired[e->retired_count].epoch = atomic_load(&e->global);
+    e->retired_count++;
+
+    if (++e->since_collect >= KDTREE_EPOCH_COLLECT_EVERY){
+        kdtree_epoch_collect(e);
+    }
+    return true;
+}
+
+void kdtree_epoch_destroy(kdtree_epoch *e){
+    if (e == NULL){
+        return;
+    }
+    for (size_t i = 0; i < e->retired_count; i++){
+        e->retired[i].release(e->retired[i].p);
+    }
+    free(e->retired);
+    free(e);
+}
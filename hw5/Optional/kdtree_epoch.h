@@ -0,0 +1,79 @@
+#ifndef __KDTREE_EPOCH_H__
+#define __KDTREE_EPOCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Epoch-based reclamation for structures that are read by any number of
+ * threads and changed by one writer thread.  Readers bracket each access
+ * with kdtree_epoch_enter and kdtree_epoch_exit.  When the writer
+ * unlinks memory that readers might still be looking at, it passes it to
+ * kdtree_epoch_retire instead of freeing it, and the memory is freed
+ * once every reader that could have seen it has exited.
+ */
+typedef struct kdtree_epoch kdtree_epoch;
+
+
+/**
+ * Creates a reclamation domain with no readers and nothing retired.
+ *
+ * @return a pointer to the new domain, or NULL if memory could not be
+ * allocated
+ */
+kdtree_epoch *kdtree_epoch_create(void);
+
+
+/**
+ * Marks the calling thread as reading.  Memory retired after this call
+ * is not freed until the matching call to kdtree_epoch_exit.  Returns a
+ * ticket to pass to kdtree_epoch_exit.  Any thread may call this.
+ *
+ * @param e a pointer to a valid domain, non-NULL
+ * @return the ticket for this read
+ */
+size_t kdtree_epoch_enter(kdtree_epoch *e);
+
+
+/**
+ * Marks the end of a read started by kdtree_epoch_enter.
+ *
+ * @param e a pointer to a valid domain, non-NULL
+ * @param ticket the value returned by the matching kdtree_epoch_enter
+ */
+void kdtree_epoch_exit(kdtree_epoch *e, size_t ticket);
+
+
+/**
+ * Arranges for the given function to be called on the given pointer once
+ * no reader can still be using it.  Only the writer may call this.
+ *
+ * @param e a pointer to a valid domain, non-NULL
+ * @param p the pointer to free later
+ * @param release a function that frees p, non-NULL
+ * @return true if successful, false if memory for the bookkeeping could
+ * not be allocated, in which case the caller still owns p
+ */
+bool kdtree_epoch_retire(kdtree_epoch *e, void *p, void (*release)(void *));
+
+
+/**
+ * Frees whatever retired memory no reader can still be using, advancing
+ * the epoch if possible.  Only the writer may call this.  It is called
+ * by kdtree_epoch_retire every so often, so calling it is only needed to
+ * free memory sooner.
+ *
+ * @param e a pointer to a valid domain, non-NULL
+ */
+void kdtree_epoch_collect(kdtree_epoch *e);
+
+
+/**
+ * Frees everything that was retired and then the domain itself.  There
+ * must be no readers.
+ *
+ * @param e a pointer to a valid domain, non-NULL
+ */
+void kdtree_epoch_destroy(kdtree_epoch *e);
+
+#endif
@@ -0,0 +1,434 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "kdtree_external.h"
+#include "kdtree_file.h"
+#include "kdtree_internal.h"
+#include "kdtree_stream.h"
+
+//records per merge buffer below which merging more runs at once costs
+//more in small reads than another pass does
+#define KDTREE_EXTERNAL_MIN_BUFFER 256
+
+//points in a temporary file, in native byte order
+typedef struct {
+    int fd;
+    size_t count;
+} kdtree_run;
+
+typedef struct {
+    const char *tmp_dir;
+    size_t budget;
+    kdtree_file_writer *out;
+    kdtree_external_stats stats;
+} kdtree_external;
+
+//collects points into runs sorted by one dimension
+typedef struct {
+    kdtree_external *x;
+    int dim;
+    location *buf;
+    size_t capacity;
+    size_t count;
+    kdtree_run *runs;
+    size_t run_count;
+    size_t run_capacity;
+} kdtree_run_builder;
+
+//one run being merged, through its share of the buffer
+typedef struct {
+    kdtree_run run;
+    size_t read;      //records read from the run so far
+    location *buf;
+    size_t have;      //records in buf
+    size_t pos;       //next record in buf
+} kdtree_merge_input;
+
+static int kdtree_external_compare(const location *a, const location *b, int dim){
+    return dim == 0 ? location_compare_longitude(a, b) : location_compare_latitude(a, b);
+}
+
+static double kdtree_external_coord(const location *l, int dim){
+    return dim == 0 ? l->lon : l->lat;
+}
+
+//creates a file in the temporary directory and removes its name at
+//once, so it goes away when closed, even after a crash; -1 on failure
+static int kdtree_external_temp(const kdtree_external *x){
+    char *name = malloc(strlen(x->tmp_dir) + 24);
+    if (name == NULL){
+        return -1;
+    }
+    sprintf(name, "%s/kdtree_build_XXXXXX", x->tmp_dir);
+    int fd = mkstemp(name);
+    if (fd >= 0){
+        unlink(name);
+    }
+    free(name);
+    return fd;
+}
+
+static bool kdtree_external_write(kdtree_external *x, int fd, const location *pts, size_t n, size_t index){
+    const char *p = (const char *)pts;
+    size_t left = n * sizeof(location);
+    off_t offset = (off_t)index * sizeof(location);
+    while (left > 0){
+        ssize_t done = pwrite(fd, p, left, offset);
+        if (done < 0 && errno == EINTR){
+            continue;
+        }
+        if (done <= 0){
+            return false;
+        }
+        p += done;
+        left -= done;
+        offset += done;
+    }
+    x->stats.temp_bytes += n * sizeof(location);
+    return true;
+}
+
+static bool kdtree_external_read(int fd, location *pts, size_t n, size_t index){
+    char *p = (char *)pts;
+    size_t left = n * sizeof(location);
+    off_t offset = (off_t)index * sizeof(location);
+    while (left > 0){
+        ssize_t done = pread(fd, p, left, offset);
+        if (done < 0 && errno == EINTR){
+            continue;
+        }
+        if (done <= 0){
+            return false;
+        }
+        p += done;
+        left -= done;
+        offset += done;
+    }
+    return true;
+}
+
+static void kdtree_external_close_runs(kdtree_run *runs, size_t n){
+    for (size_t i = 0; i < n; i++){
+        close(runs[i].fd);
+    }
+}
+
+//sorts the buffered points, drops duplicates and writes them out as a run
+static bool kdtree_external_spill(kdtree_run_builder *b){
+    if (b->count == 0){
+        return true;
+    }
+    if (b->run_count == b->run_capacity){
+        size_t capacity = b->run_capacity * 2 + 8;
+        kdtree_run *bigger = realloc(b->runs, sizeof(kdtree_run) * capacity);
+        if (bigger == NULL){
+            return false;
+        }
+        b->runs = bigger;
+        b->run_capacity = capacity;
+    }
+    if (b->dim == 0){
+        qsort(b->buf, b->count, sizeof(location), (int (*)(const void *, const void *)) location_compare_longitude);
+    } else{
+        qsort(b->buf, b->count, sizeof(location), (int (*)(const void *, const void *)) location_compare_latitude);
+    }
+    size_t unique = 1;
+    for (size_t i = 1; i < b->count; i++){
+        if (kdtree_external_compare(&b->buf[i], &b->buf[unique - 1], b->dim) != 0){
+            b->buf[unique++] = b->buf[i];
+        }
+    }
+
+    int fd = kdtree_external_temp(b->x);
+    if (fd < 0){
+        return false;
+    }
+    if (!kdtree_external_write(b->x, fd, b->buf, unique, 0)){
+        close(fd);
+        return false;
+    }
+    b->runs[b->run_count++] = (kdtree_run){fd, unique};
+    b->count = 0;
+    return true;
+}
+
+static bool kdtree_external_collect(const location *l, void *arg){
+    kdtree_run_builder *b = arg;
+    if (b->count == b->capacity && !kdtree_external_spill(b)){
+        return false;
+    }
+    b->buf[b->count++] = *l;
+    return true;
+}
+
+//refills an input's buffer from its run
+static bool kdtree_merge_fill(kdtree_merge_input *in, size_t capacity){
+    size_t n = in->run.count - in->read;
+    if (n > capacity){
+        n = capacity;
+    }
+    if (!kdtree_external_read(in->run.fd, in->buf, n, in->read)){
+        return false;
+    }
+    in->read += n;
+    in->have = n;
+    in->pos = 0;
+    return true;
+}
+
+static bool kdtree_merge_less(const kdtree_merge_input *inputs, size_t a, size_t b, int dim){
+    return kdtree_external_compare(&inputs[a].buf[inputs[a].pos], &inputs[b].buf[inputs[b].pos], dim) < 0;
+}
+
+//restores the heap below i, whose input's next point may have grown
+static void kdtree_merge_sift(const kdtree_merge_input *inputs, size_t *heap, size_t size, size_t i, int dim){
+    while (true){
+        size_t least = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < size && kdtree_merge_less(inputs, heap[left], heap[least], dim)){
+            least = left;
+        }
+        if (right < size && kdtree_merge_less(inputs, heap[right], heap[least], dim)){
+            least = right;
+        }
+        if (least == i){
+            return;
+        }
+        size_t tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+//merges the given sorted runs into one new run, dropping duplicates,
+//with the budget split evenly between the inputs and the output; the
+//inputs are closed either way
+static bool kdtree_external_merge(kdtree_external *x, kdtree_run *runs, size_t k, int dim, kdtree_run *out){
+    size_t per_buffer = x->budget / sizeof(location) / (k + 1);
+    location *space = malloc(sizeof(location) * per_buffer * (k + 1));
+    kdtree_merge_input *inputs = malloc(sizeof(kdtree_merge_input) * k);
+    size_t *heap = malloc(sizeof(size_t) * k);
+    int fd = kdtree_external_temp(x);
+    bool ok = space != NULL && inputs != NULL && heap != NULL && fd >= 0;
+
+    size_t size = 0;
+    for (size_t i = 0; i < k && ok; i++){
+        inputs[i] = (kdtree_merge_input){runs[i], 0, space + per_buffer * i, 0, 0};
+        ok = kdtree_merge_fill(&inputs[i], per_buffer);
+        if (ok && inputs[i].have > 0){
+            heap[size++] = i;
+        }
+    }
+    for (size_t i = size / 2; i-- > 0 && ok;){
+        kdtree_merge_sift(inputs, heap, size, i, dim);
+    }
+
+    location *pending = space + per_buffer * k;
+    size_t waiting = 0;
+    size_t written = 0;
+    location last;
+    while (size > 0 && ok){
+        kdtree_merge_input *in = &inputs[heap[0]];
+        location l = in->buf[in->pos++];
+        if ((written == 0 && waiting == 0) || kdtree_external_compare(&l, &last, dim) != 0){
+            pending[waiting++] = l;
+            last = l;
+            if (waiting == per_buffer){
+                ok = kdtree_external_write(x, fd, pending, waiting, written);
+                written += waiting;
+                waiting = 0;
+            }
+        }
+        if (in->pos == in->have){
+            if (in->read < in->run.count){
+                ok = ok && kdtree_merge_fill(in, per_buffer);
+            } else{
+                heap[0] = heap[--size];
+            }
+        }
+        if (ok){
+            kdtree_merge_sift(inputs, heap, size, 0, dim);
+        }
+    }
+    ok = ok && kdtree_external_write(x, fd, pending, waiting, written);
+    written += waiting;
+
+    kdtree_external_close_runs(runs, k);
+    free(space);
+    free(inputs);
+    free(heap);
+    if (!ok){
+        if (fd >= 0){
+            close(fd);
+        }
+        return false;
+    }
+    x->stats.merges++;
+    *out = (kdtree_run){fd, written};
+    return true;
+}
+
+//merges the given sorted runs down to one, in several passes if there
+//are more than the budget can buffer at once; the runs are closed
+//either way and the array is reused
+static bool kdtree_external_merge_all(kdtree_external *x, kdtree_run *runs, size_t n, int dim, kdtree_run *out){
+    size_t fan_in = x->budget / sizeof(location) / KDTREE_EXTERNAL_MIN_BUFFER - 1;
+    while (n > 1){
+        size_t merged = 0;
+        for (size_t i = 0; i < n; i += fan_in){
+            size_t k = n - i < fan_in ? n - i : fan_in;
+            kdtree_run run = runs[i];
+            if (k > 1 && !kdtree_external_merge(x, runs + i, k, dim, &run)){
+                kdtree_external_close_runs(runs, merged);
+                kdtree_external_close_runs(runs + i + k, n - i - k);
+                return false;
+            }
+            runs[merged++] = run;
+        }
+        n = merged;
+    }
+    if (n == 0){
+        //nothing to sort, but the caller still wants a file
+        *out = (kdtree_run){kdtree_external_temp(x), 0};
+    } else{
+        *out = runs[0];
+    }
+    x->stats.sorts++;
+    return out->fd >= 0;
+}
+
+//sorts the count points starting at first in the given file into a new
+//run, by the given dimension
+static bool kdtree_external_sort(kdtree_external *x, int fd, size_t first, size_t count, int dim, kdtree_run *out){
+    size_t capacity = x->budget / sizeof(location);
+    kdtree_run_builder b = {x, dim, malloc(sizeof(location) * capacity), capacity, 0, NULL, 0, 0};
+    bool ok = b.buf != NULL;
+    for (size_t done = 0; done < count && ok;){
+        size_t n = count - done < capacity ? count - done : capacity;
+        ok = kdtree_external_read(fd, b.buf, n, first + done);
+        b.count = n;
+        ok = ok && kdtree_external_spill(&b);
+        done += n;
+    }
+    free(b.buf);
+    if (!ok){
+        kdtree_external_close_runs(b.runs, b.run_count);
+        free(b.runs);
+        return false;
+    }
+    ok = kdtree_external_merge_all(x, b.runs, b.run_count, dim, out);
+    free(b.runs);
+    return ok;
+}
+
+//builds the count points starting at first in the given file in memory
+//and writes their records
+static bool kdtree_external_build_part(kdtree_external *x, int fd, size_t first, size_t count, int depth){
+    kdtree_node *nodes = malloc(sizeof(kdtree_node) * count);
+    if (nodes == NULL){
+        return false;
+    }
+    location chunk[KDTREE_EXTERNAL_MIN_BUFFER];
+    bool ok = true;
+    for (size_t done = 0; done < count && ok;){
+        size_t n = count - done < KDTREE_EXTERNAL_MIN_BUFFER ? count - done : KDTREE_EXTERNAL_MIN_BUFFER;
+        ok = kdtree_external_read(fd, chunk, n, first + done);
+        for (size_t i = 0; i < n && ok; i++){
+            nodes[done + i].loc = chunk[i];
+        }
+        done += n;
+    }
+    ok = ok && kdtree_file_write_tree(x->out, kdtree_build_in_place(nodes, count, depth));
+    free(nodes);
+    x->stats.partitions++;
+    return ok;
+}
+
+//writes the subtree of the count distinct points starting at first in the
+//given file, which is sorted by sorted_dim, with its root at the given
+//depth; its root record is then the last one written
+static bool kdtree_external_build(kdtree_external *x, int fd, size_t first, size_t count, int sorted_dim, int depth){
+    if (count == 0){
+        return true;
+    }
+    if (count <= x->budget / sizeof(kdtree_node)){
+        return kdtree_external_build_part(x, fd, first, count, depth);
+    }
+
+    int dim = depth % 2;
+    kdtree_run sorted = {fd, count};
+    if (sorted_dim != dim){
+        if (!kdtree_external_sort(x, fd, first, count, dim, &sorted)){
+            return false;
+        }
+        first = 0;
+    }
+
+    //points equal to the median in the cut dimension have to go right, so
+    //split at the first of them, found by binary search
+    size_t median = count / 2;
+    location pivot;
+    bool ok = kdtree_external_read(sorted.fd, &pivot, 1, first + median);
+    size_t lo = 0;
+    size_t hi = median;
+    while (lo < hi && ok){
+        size_t mid = lo + (hi - lo) / 2;
+        location l;
+        ok = kdtree_external_read(sorted.fd, &l, 1, first + mid);
+        if (kdtree_external_coord(&l, dim) < kdtree_external_coord(&pivot, dim)){
+            lo = mid + 1;
+        } else{
+            hi = mid;
+        }
+    }
+    median = lo;
+    ok = ok && kdtree_external_read(sorted.fd, &pivot, 1, first + median);
+
+    ok = ok && kdtree_external_build(x, sorted.fd, first, median, dim, depth + 1);
+    uint64_t left_index = kdtree_file_writer_count(x->out) - 1;
+    ok = ok && kdtree_external_build(x, sorted.fd, first + median + 1, count - median - 1, dim, depth + 1);
+    ok = ok && kdtree_file_write_record(x->out, &pivot, count - median - 1 > 0, median > 0, left_index);
+    if (sorted.fd != fd){
+        close(sorted.fd);
+    }
+    return ok;
+}
+
+bool kdtree_build_external(kdtree_stream_reader *reader, const char *path, const char *tmp_dir, size_t memory_budget, kdtree_external_stats *stats){
+    if (reader == NULL || path == NULL || tmp_dir == NULL || memory_budget < KDTREE_EXTERNAL_MIN_BUDGET){
+        return false;
+    }
+    kdtree_external x = {tmp_dir, memory_budget, NULL, {0, 0, 0, 0, 0}};
+
+    //runs sorted by longitude, the first cut dimension, with no duplicates
+    size_t capacity = memory_budget / sizeof(location);
+    kdtree_run_builder b = {&x, 0, malloc(sizeof(location) * capacity), capacity, 0, NULL, 0, 0};
+    bool ok = b.buf != NULL && kdtree_stream_read(reader, kdtree_external_collect, &b) && kdtree_external_spill(&b);
+    free(b.buf);
+    kdtree_run all;
+    if (!ok){
+        kdtree_external_close_runs(b.runs, b.run_count);
+        free(b.runs);
+        return false;
+    }
+    ok = kdtree_external_merge_all(&x, b.runs, b.run_count, 0, &all);
+    free(b.runs);
+    if (!ok){
+        return false;
+    }
+    x.stats.points = all.count;
+
+    x.out = kdtree_file_writer_open(path);
+    ok = x.out != NULL && kdtree_external_build(&x, all.fd, 0, all.count, 0, 0);
+    close(all.fd);
+    ok = x.out != NULL && kdtree_file_writer_close(x.out, ok);
+    if (stats != NULL){
+        *stats = x.stats;
+    }
+    return ok;
+}
@@ -0,0 +1,71 @@
+#ifndef __KDTREE_EXTERNAL_H__
+#define __KDTREE_EXTERNAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * Building a tree file from more points than fit in memory.
+ *
+ * The records are read as for kdtree_load_stream and sorted by longitude
+ * on disk: sorted, duplicate-free runs the size of the memory budget are
+ * written to temporary files and then merged, as many at a time as the
+ * budget has room to buffer.  The median of the sorted points is the
+ * root; the points on either side of it are each sorted again on disk by
+ * the other coordinate and split at their own medians, and so on down
+ * until a part fits in the budget as nodes.  That part is built in
+ * memory and its records are written to the tree file.  Parts are
+ * finished left before right and children before parents, which is the
+ * order of the records in the file, so the file is written front to back
+ * and is as balanced as a tree from kdtree_create.  Open it with
+ * kdtree_open_mmap.
+ *
+ * The temporary files are removed from their directory as soon as they
+ * are created, so nothing is left behind even after a crash.  Between
+ * them they need about twice the space of the points at 16 bytes each.
+ */
+
+
+// the smallest memory budget kdtree_build_external accepts
+#define KDTREE_EXTERNAL_MIN_BUDGET (64 * 1024)
+
+
+/**
+ * Counters describing an external build.
+ */
+typedef struct
+{
+  size_t points;      // distinct points in the tree
+  size_t sorts;       // sorts done on disk, including the first
+  size_t merges;      // merges of runs, more than sorts if a sort took several passes
+  size_t partitions;  // subtrees built in memory
+  size_t temp_bytes;  // bytes written to temporary files
+} kdtree_external_stats;
+
+
+/**
+ * Reads records from the given reader and writes a balanced tree of the
+ * distinct valid ones to the given path, in the format of kdtree_save,
+ * using no more than about the given amount of memory for points.  The
+ * read buffer kdtree_load_stream uses for descriptors that are not
+ * regular files comes on top.  The path holds either its old contents or
+ * the complete new file, as for kdtree_save.
+ *
+ * @param reader a pointer to a reader whose fd and format are set, as for
+ * kdtree_load_stream, non-NULL
+ * @param path the name of the tree file, non-NULL
+ * @param tmp_dir the directory to put temporary files in, non-NULL
+ * @param memory_budget bytes of memory to use, at least
+ * KDTREE_EXTERNAL_MIN_BUDGET
+ * @param stats a pointer to where to store counters describing the
+ * build, or NULL
+ * @return true if successful, false if the budget is too small, the
+ * records or the temporary files could not be read or written, or memory
+ * could not be allocated
+ */
+bool kdtree_build_external(kdtree_stream_reader *reader, const char *path, const char *tmp_dir, size_t memory_budget, kdtree_external_stats *stats);
+
+#endif
@@ -0,0 +1,507 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kdtree_file.h"
+
+#define KDTREE_FILE_HEADER_SIZE 64
+#define KDTREE_FILE_RECORD_SIZE 24
+#define KDTREE_FILE_HAS_RIGHT 1
+#define KDTREE_FILE_HAS_LEFT 2
+
+#define KDTREE_FNV_PRIME 0x100000001b3ULL
+
+static const char kdtree_file_magic[8] = {'K', 'D', 'T', 'R', 'E', 'E', '\r', '\n'};
+
+struct kdtree_file{
+    const unsigned char *map;
+    size_t length;
+    size_t count;
+    const unsigned char *records;
+};
+
+uint64_t kdtree_file_get64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+void kdtree_file_put64(unsigned char *p, uint64_t v){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static void kdtree_file_put32(unsigned char *p, uint32_t v){
+    for (int i = 0; i < 4; i++){
+        p[i] = v >> (8 * i);
+    }
+}
+
+static uint32_t kdtree_file_get32(const unsigned char *p){
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t kdtree_file_checksum(uint64_t h, uint64_t word){
+    return (h ^ word) * KDTREE_FNV_PRIME;
+}
+
+static uint64_t kdtree_file_header_checksum(const unsigned char *header){
+    uint64_t h = KDTREE_FILE_CHECKSUM_START;
+    for (size_t i = 0; i < KDTREE_FILE_HEADER_SIZE - 8; i += 8){
+        h = kdtree_file_checksum(h, kdtree_file_get64(header + i));
+    }
+    return h;
+}
+
+static uint64_t kdtree_file_bits(double d){
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static location kdtree_file_location(const unsigned char *record){
+    location l;
+    uint64_t lon = kdtree_file_get64(record);
+    uint64_t lat = kdtree_file_get64(record + 8);
+    memcpy(&l.lon, &lon, sizeof(double));
+    memcpy(&l.lat, &lat, sizeof(double));
+    return l;
+}
+
+static void kdtree_file_header(unsigned char *header, uint64_t count, uint64_t checksum){
+    memset(header, 0, KDTREE_FILE_HEADER_SIZE);
+    memcpy(header, kdtree_file_magic, sizeof(kdtree_file_magic));
+    kdtree_file_put32(header + 8, KDTREE_FILE_VERSION);
+    kdtree_file_put32(header + 12, KDTREE_FILE_RECORD_SIZE);
+    kdtree_file_put64(header + 16, count);
+    kdtree_file_put64(header + 24, KDTREE_FILE_HEADER_SIZE);
+    kdtree_file_put64(header + 32, count > 0 ? count - 1 : 0);
+    kdtree_file_put64(header + 40, checksum);
+    kdtree_file_put64(header + 56, kdtree_file_header_checksum(header));
+}
+
+//a node waiting in the postorder walk
+typedef struct {
+    const kdtree_node *node;
+    int state;            //0: left not done yet, 1: right not done, 2: ready
+    uint64_t left_index;  //index of the left child's record, once written
+} kdtree_file_frame;
+
+//opens a temporary file next to path; the name goes in tmp
+static FILE *kdtree_file_create(const char *path, char **tmp){
+    *tmp = malloc(strlen(path) + 5);
+    if (*tmp == NULL){
+        return NULL;
+    }
+    sprintf(*tmp, "%s.tmp", path);
+    FILE *out = fopen(*tmp, "wb");
+    if (out == NULL){
+        free(*tmp);
+    }
+    return out;
+}
+
+//flushes the temporary file to disk and moves it to path
+static bool kdtree_file_finish(FILE *out, char *tmp, const char *path, bool ok){
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok){
+        remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+struct kdtree_file_writer{
+    FILE *out;           //NULL when writing to memory
+    char *tmp;
+    char *path;
+    unsigned char *mem;  //where to write, if not to a file
+    size_t length;       //bytes at mem
+    uint64_t written;
+    uint64_t checksum;
+    bool ok;             //false once anything has failed
+};
+
+kdtree_file_writer *kdtree_file_writer_open(const char *path){
+    if (path == NULL){
+        return NULL;
+    }
+    kdtree_file_writer *w = malloc(sizeof(kdtree_file_writer));
+    char *copy = malloc(strlen(path) + 1);
+    if (w == NULL || copy == NULL){
+        free(w);
+        free(copy);
+        return NULL;
+    }
+    w->out = kdtree_file_create(path, &w->tmp);
+    if (w->out == NULL){
+        free(w);
+        free(copy);
+        return NULL;
+    }
+    strcpy(copy, path);
+    w->path = copy;
+    w->mem = NULL;
+    w->length = 0;
+    w->written = 0;
+    w->checksum = KDTREE_FILE_CHECKSUM_START;
+
+    //the header goes in last, once the count and checksum are known
+    unsigned char header[KDTREE_FILE_HEADER_SIZE] = {0};
+    w->ok = fwrite(header, 1, sizeof(header), w->out) == sizeof(header);
+    return w;
+}
+
+kdtree_file_writer *kdtree_file_writer_open_memory(void *mem, size_t length){
+    if (mem == NULL || length < KDTREE_FILE_HEADER_SIZE){
+        return NULL;
+    }
+    kdtree_file_writer *w = malloc(sizeof(kdtree_file_writer));
+    if (w == NULL){
+        return NULL;
+    }
+    w->out = NULL;
+    w->tmp = NULL;
+    w->path = NULL;
+    w->mem = mem;
+    w->length = length;
+    w->written = 0;
+    w->checksum = KDTREE_FILE_CHECKSUM_START;
+    w->ok = true;
+    memset(mem, 0, KDTREE_FILE_HEADER_SIZE);
+    return w;
+}
+
+//appends bytes after the header and the records written so far
+static bool kdtree_file_writer_append(kdtree_file_writer *w, const unsigned char *bytes, size_t n){
+    if (w->out != NULL){
+        return fwrite(bytes, 1, n, w->out) == n;
+    }
+    size_t offset = KDTREE_FILE_HEADER_SIZE + w->written * KDTREE_FILE_RECORD_SIZE;
+    if (offset > w->length || w->length - offset < n){
+        return false;
+    }
+    memcpy(w->mem + offset, bytes, n);
+    return true;
+}
+
+bool kdtree_file_write_record(kdtree_file_writer *w, const location *loc, bool has_right, bool has_left, uint64_t left_index){
+    if (!w->ok){
+        return false;
+    }
+    uint64_t link = (has_right ? KDTREE_FILE_HAS_RIGHT : 0) | (has_left ? KDTREE_FILE_HAS_LEFT | left_index << 2 : 0);
+    uint64_t words[3] = {kdtree_file_bits(loc->lon), kdtree_file_bits(loc->lat), link};
+    unsigned char record[KDTREE_FILE_RECORD_SIZE];
+    for (int i = 0; i < 3; i++){
+        kdtree_file_put64(record + 8 * i, words[i]);
+        w->checksum = kdtree_file_checksum(w->checksum, words[i]);
+    }
+    w->ok = kdtree_file_writer_append(w, record, sizeof(record));
+    w->written++;
+    return w->ok;
+}
+
+bool kdtree_file_write_tree(kdtree_file_writer *w, const kdtree_node *root){
+    size_t size = 0;
+    size_t capacity = 64;
+    kdtree_file_frame *stack = malloc(sizeof(kdtree_file_frame) * capacity);
+    bool ok = w->ok && stack != NULL;
+    if (ok && root != NULL){
+        stack[size++] = (kdtree_file_frame){root, 0, 0};
+    }
+    while (ok && size > 0){
+        kdtree_file_frame *top = &stack[size - 1];
+        const kdtree_node *child = NULL;
+        if (top->state == 0){
+            top->state = 1;
+            child = top->node->left;
+        } else if (top->state == 1){
+            //the left subtree, if any, has just been written
+            top->left_index = w->written - 1;
+            top->state = 2;
+            child = top->node->right;
+        } else{
+            ok = kdtree_file_write_record(w, &top->node->loc, top->node->right != NULL, top->node->left != NULL, top->left_index);
+            size--;
+            continue;
+        }
+
+        if (child != NULL){
+            if (size == capacity){
+                kdtree_file_frame *bigger = realloc(stack, sizeof(kdtree_file_frame) * capacity * 2);
+                if (bigger == NULL){
+                    ok = false;
+                    break;
+                }
+                stack = bigger;
+                capacity *= 2;
+            }
+            stack[size++] = (kdtree_file_frame){child, 0, 0};
+        }
+    }
+    free(stack);
+    w->ok = ok;
+    return ok;
+}
+
+bool kdtree_file_write_file(kdtree_file_writer *w, const kdtree_file *f){
+    //the records keep their order, so only left links move
+    uint64_t base = w->written;
+    for (uint64_t i = 0; i < f->count && w->ok; i++){
+        const unsigned char *record = f->records + i * KDTREE_FILE_RECORD_SIZE;
+        location l = kdtree_file_location(record);
+        uint64_t link = kdtree_file_get64(record + 16);
+        kdtree_file_write_record(w, &l, link & KDTREE_FILE_HAS_RIGHT, link & KDTREE_FILE_HAS_LEFT, base + (link >> 2));
+    }
+    return w->ok;
+}
+
+uint64_t kdtree_file_writer_count(const kdtree_file_writer *w){
+    return w->written;
+}
+
+size_t kdtree_file_length(size_t count){
+    return KDTREE_FILE_HEADER_SIZE + count * KDTREE_FILE_RECORD_SIZE;
+}
+
+bool kdtree_file_writer_close(kdtree_file_writer *w, bool keep){
+    unsigned char header[KDTREE_FILE_HEADER_SIZE];
+    kdtree_file_header(header, w->written, w->checksum);
+    if (w->out == NULL){
+        //memory must be filled exactly, or the header would not match it
+        bool ok = keep && w->ok && KDTREE_FILE_HEADER_SIZE + w->written * KDTREE_FILE_RECORD_SIZE == w->length;
+        if (ok){
+            memcpy(w->mem, header, sizeof(header));
+        }
+        free(w);
+        return ok;
+    }
+    bool ok = keep && w->ok && fseek(w->out, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), w->out) == sizeof(header);
+    ok = kdtree_file_finish(w->out, w->tmp, w->path, ok);
+    free(w->path);
+    free(w);
+    return ok;
+}
+
+bool kdtree_file_save(const kdtree_node *root, const char *path){
+    kdtree_file_writer *w = kdtree_file_writer_open(path);
+    if (w == NULL){
+        return false;
+    }
+    kdtree_file_write_tree(w, root);
+    return kdtree_file_writer_close(w, true);
+}
+
+bool kdtree_file_copy(const kdtree_file *f, const char *path){
+    if (f == NULL || path == NULL){
+        return false;
+    }
+    char *tmp;
+    FILE *out = kdtree_file_create(path, &tmp);
+    if (out == NULL){
+        return false;
+    }
+    bool ok = fwrite(f->map, 1, f->length, out) == f->length;
+    return kdtree_file_finish(out, tmp, path, ok);
+}
+
+//checks everything about a mapped file that queries rely on
+static bool kdtree_file_valid(const unsigned char *map, size_t length){
+    if (length < KDTREE_FILE_HEADER_SIZE
+        || memcmp(map, kdtree_file_magic, sizeof(kdtree_file_magic)) != 0
+        || kdtree_file_get32(map + 8) != KDTREE_FILE_VERSION
+        || kdtree_file_get32(map + 12) != KDTREE_FILE_RECORD_SIZE
+        || kdtree_file_get64(map + 24) != KDTREE_FILE_HEADER_SIZE
+        || kdtree_file_get64(map + 56) != kdtree_file_header_checksum(map)){
+        return false;
+    }
+    uint64_t count = kdtree_file_get64(map + 16);
+    if (count > (length - KDTREE_FILE_HEADER_SIZE) / KDTREE_FILE_RECORD_SIZE
+        || length != KDTREE_FILE_HEADER_SIZE + count * KDTREE_FILE_RECORD_SIZE
+        || kdtree_file_get64(map + 32) != (count > 0 ? count - 1 : 0)){
+        return false;
+    }
+
+    //links must point strictly backwards, which also keeps them in bounds
+    const unsigned char *records = map + KDTREE_FILE_HEADER_SIZE;
+    uint64_t checksum = KDTREE_FILE_CHECKSUM_START;
+    for (uint64_t i = 0; i < count; i++){
+        const unsigned char *record = records + i * KDTREE_FILE_RECORD_SIZE;
+        uint64_t link = kdtree_file_get64(record + 16);
+        if (((link & KDTREE_FILE_HAS_RIGHT) && i == 0)
+            || ((link & KDTREE_FILE_HAS_LEFT) && (link >> 2) >= i)
+            || (!(link & KDTREE_FILE_HAS_LEFT) && (link >> 2) != 0)){
+            return false;
+        }
+        checksum = kdtree_file_checksum(checksum, kdtree_file_get64(record));
+        checksum = kdtree_file_checksum(checksum, kdtree_file_get64(record + 8));
+        checksum = kdtree_file_checksum(checksum, link);
+    }
+    return checksum == kdtree_file_get64(map + 40);
+}
+
+kdtree_file *kdtree_file_open(const char *path){
+    if (path == NULL){
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    kdtree_file *f = kdtree_file_map(fd);
+    //the mapping keeps the file open
+    close(fd);
+    return f;
+}
+
+kdtree_file *kdtree_file_map(int fd){
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < KDTREE_FILE_HEADER_SIZE){
+        return NULL;
+    }
+    size_t length = st.st_size;
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED){
+        return NULL;
+    }
+
+    kdtree_file *f = malloc(sizeof(kdtree_file));
+    if (f == NULL || !kdtree_file_valid(map, length)){
+        free(f);
+        munmap(map, length);
+        return NULL;
+    }
+    f->map = map;
+    f->length = length;
+    f->count = kdtree_file_get64(f->map + 16);
+    f->records = f->map + KDTREE_FILE_HEADER_SIZE;
+    return f;
+}
+
+size_t kdtree_file_size(const kdtree_file *f){
+    return f == NULL ? 0 : f->count;
+}
+
+bool kdtree_file_contains(const kdtree_file *f, const location *p){
+    if (f == NULL || p == NULL || f->count == 0){
+        return false;
+    }
+    uint64_t i = f->count - 1;
+    int depth = 0;
+    while (true){
+        const unsigned char *record = f->records + i * KDTREE_FILE_RECORD_SIZE;
+        location l = kdtree_file_location(record);
+        if (l.lon == p->lon && l.lat == p->lat){
+            return true;
+        }
+        uint64_t link = kdtree_file_get64(record + 16);
+        if ((depth % 2 == 0 && p->lon < l.lon) || (depth % 2 == 1 && p->lat < l.lat)){
+            if (!(link & KDTREE_FILE_HAS_LEFT)){
+                return false;
+            }
+            i = link >> 2;
+        } else{
+            if (!(link & KDTREE_FILE_HAS_RIGHT)){
+                return false;
+            }
+            i--;
+        }
+        depth++;
+    }
+}
+
+static void kdtree_file_range_helper(const kdtree_file *f, uint64_t i, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg, int depth){
+    const unsigned char *record = f->records + i * KDTREE_FILE_RECORD_SIZE;
+    location l = kdtree_file_location(record);
+    uint64_t link = kdtree_file_get64(record + 16);
+    if (sw->lon <= l.lon && ne->lon >= l.lon && sw->lat <= l.lat && ne->lat >= l.lat){
+        fn(&l, arg);
+    }
+
+    //same pruning as kdtree_range_for_each_helper
+    double low = depth % 2 == 0 ? sw->lon : sw->lat;
+    double high = depth % 2 == 0 ? ne->lon : ne->lat;
+    double cut = depth % 2 == 0 ? l.lon : l.lat;
+    if ((link & KDTREE_FILE_HAS_LEFT) && low <= cut){
+        kdtree_file_range_helper(f, link >> 2, sw, ne, fn, arg, depth + 1);
+    }
+    if ((link & KDTREE_FILE_HAS_RIGHT) && high >= cut){
+        kdtree_file_range_helper(f, i - 1, sw, ne, fn, arg, depth + 1);
+    }
+}
+
+void kdtree_file_range_for_each(const kdtree_file *f, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg){
+    if (f == NULL || sw == NULL || ne == NULL || fn == NULL || f->count == 0){
+        return;
+    }
+    kdtree_file_range_helper(f, f->count - 1, sw, ne, fn, arg, 0);
+}
+
+bool kdtree_file_shape(const kdtree_file *f, size_t *leaves, size_t *depth_sum, size_t *max_depth){
+    *leaves = 0;
+    *depth_sum = 0;
+    *max_depth = 0;
+    if (f->count == 0){
+        return true;
+    }
+    //record indexes and their depths, walked without recursing
+    size_t size = 0;
+    size_t capacity = 64;
+    uint64_t (*stack)[2] = malloc(sizeof(*stack) * capacity);
+    if (stack == NULL){
+        return false;
+    }
+    stack[size][0] = f->count - 1;
+    stack[size++][1] = 0;
+    while (size > 0){
+        size--;
+        uint64_t i = stack[size][0];
+        uint64_t depth = stack[size][1];
+        uint64_t link = kdtree_file_get64(f->records + i * KDTREE_FILE_RECORD_SIZE + 16);
+        if (!(link & (KDTREE_FILE_HAS_LEFT | KDTREE_FILE_HAS_RIGHT))){
+            (*leaves)++;
+            *depth_sum += depth;
+            *max_depth = depth > *max_depth ? depth : *max_depth;
+            continue;
+        }
+        if (size + 2 > capacity){
+            uint64_t (*bigger)[2] = realloc(stack, sizeof(*stack) * capacity * 2);
+            if (bigger == NULL){
+                free(stack);
+                return false;
+            }
+            stack = bigger;
+            capacity *= 2;
+        }
+        if (link & KDTREE_FILE_HAS_LEFT){
+            stack[size][0] = link >> 2;
+            stack[size++][1] = depth + 1;
+        }
+        if (link & KDTREE_FILE_HAS_RIGHT){
+            stack[size][0] = i - 1;
+            stack[size++][1] = depth + 1;
+        }
+    }
+    free(stack);
+    return true;
+}
+
+void kdtree_file_close(kdtree_file *f){
+    if (f == NULL){
+        return;
+    }
+    munmap((void *)f->map, f->length);
+    free(f);
+}
@@ -0,0 +1,283 @@
+#ifndef __KDTREE_FILE_H__
+#define __KDTREE_FILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree_internal.h"
+#include "location.h"
+
+/**
+ * A k-d tree saved in a file and mapped read-only into memory, queried
+ * where it lies with no loading step.
+ *
+ * The file is a 64-byte header followed by one 24-byte record per
+ * point, all little-endian whatever the machine:
+ *
+ *   offset  size  header field
+ *        0     8  magic "KDTREE\r\n"
+ *        8     4  format version (KDTREE_FILE_VERSION)
+ *       12     4  record size (24)
+ *       16     8  number of records
+ *       24     8  offset of the first record (64)
+ *       32     8  index of the root record
+ *       40     8  checksum of the records
+ *       48     8  reserved, 0
+ *       56     8  checksum of the first 56 bytes
+ *
+ *   offset  size  record field
+ *        0     8  longitude, IEEE 754 double
+ *        8     8  latitude, IEEE 754 double
+ *       16     8  bit 0: has a right child, which is the record before
+ *                 this one; bit 1: has a left child, whose index is
+ *                 bits 2 to 63
+ *
+ * Records are in postorder (left subtree, right subtree, node), so links
+ * are indexes rather than pointers and always point backwards, and the
+ * root is the last record.  The cutting dimension of a record is its
+ * depth mod 2 (0 for longitude), as in the tree.  Checksums are 64-bit
+ * FNV-1a over the little-endian 64-bit words.
+ */
+typedef struct kdtree_file kdtree_file;
+
+#define KDTREE_FILE_VERSION 1
+
+// the checksum of nothing
+#define KDTREE_FILE_CHECKSUM_START 0xcbf29ce484222325ULL
+
+
+/**
+ * Writes the tree rooted at the given node to the given path in the
+ * format above.  The file is written under a temporary name, flushed to
+ * disk and then renamed, so the path always holds either the old file
+ * or the complete new one.
+ *
+ * @param root a pointer to the root of a tree that no thread changes
+ * during the call, or NULL for an empty tree
+ * @param path the name of the file, non-NULL
+ * @return true if successful, false if the file could not be written
+ */
+bool kdtree_file_save(const kdtree_node *root, const char *path);
+
+
+/**
+ * A tree file being written record by record, for trees that are never
+ * all in memory at once.  Records are written in postorder, so each
+ * record's children must already be written.
+ */
+typedef struct kdtree_file_writer kdtree_file_writer;
+
+
+/**
+ * Starts writing a tree file to the given path.  Nothing is at the path
+ * until kdtree_file_writer_close keeps the file.
+ *
+ * @param path the name of the file, non-NULL
+ * @return a pointer to the writer, or NULL if the temporary file could
+ * not be created or memory could not be allocated
+ */
+kdtree_file_writer *kdtree_file_writer_open(const char *path);
+
+
+/**
+ * Starts writing a tree file into the given memory, such as a shared
+ * memory segment, which must be exactly the size kdtree_file_length
+ * gives for the number of records that will be written.
+ *
+ * @param mem a pointer to the memory, non-NULL
+ * @param length the number of bytes at mem
+ * @return a pointer to the writer, or NULL if length is too small for a
+ * header or memory could not be allocated
+ */
+kdtree_file_writer *kdtree_file_writer_open_memory(void *mem, size_t length);
+
+
+/**
+ * Appends one record.  Its right child, if any, must be the record
+ * written just before it.
+ *
+ * @param w a pointer to a writer, non-NULL
+ * @param loc a pointer to the record's point, non-NULL
+ * @param has_right whether the record has a right child
+ * @param has_left whether the record has a left child
+ * @param left_index the index of the left child's record, if has_left
+ * @return true if successful, false if this or any earlier write failed
+ */
+bool kdtree_file_write_record(kdtree_file_writer *w, const location *loc, bool has_right, bool has_left, uint64_t left_index);
+
+
+/**
+ * Appends the records of the tree rooted at the given node, whose root
+ * record is then the last one written.
+ *
+ * @param w a pointer to a writer, non-NULL
+ * @param root a pointer to the root of a tree, or NULL for none
+ * @return true if successful, false if this or any earlier write failed
+ */
+bool kdtree_file_write_tree(kdtree_file_writer *w, const kdtree_node *root);
+
+
+/**
+ * Appends the records of the given mapped file, whose root record is
+ * then the last one written.
+ *
+ * @param w a pointer to a writer, non-NULL
+ * @param f a pointer to a mapped file, non-NULL
+ * @return true if successful, false if this or any earlier write failed
+ */
+bool kdtree_file_write_file(kdtree_file_writer *w, const kdtree_file *f);
+
+
+/**
+ * Returns the number of records written so far, which is the index the
+ * next record will have.
+ *
+ * @param w a pointer to a writer, non-NULL
+ */
+uint64_t kdtree_file_writer_count(const kdtree_file_writer *w);
+
+
+/**
+ * Returns the size of a tree file with the given number of records.
+ *
+ * @param count the number of records
+ */
+size_t kdtree_file_length(size_t count);
+
+
+/**
+ * Finishes the file and frees the writer.  If keep is true the header
+ * is filled in and the file is flushed to disk and moved to its path,
+ * as for kdtree_file_save, so the last record written is the root;
+ * otherwise the temporary file is removed.  A writer into memory fills
+ * in the header only if it wrote exactly as many records as the memory
+ * holds.
+ *
+ * @param w a pointer to a writer, non-NULL
+ * @param keep whether to keep the file
+ * @return true if the file was kept, false if keep was false or it could
+ * not be written
+ */
+bool kdtree_file_writer_close(kdtree_file_writer *w, bool keep);
+
+
+/**
+ * Maps the given file and checks its header, its checksums and that
+ * every link points backwards, so that no query on it can run off the
+ * end or loop.  This reads the whole file once.
+ *
+ * @param path the name of a file written by kdtree_file_save, non-NULL
+ * @return a pointer to the mapped file, or NULL if it could not be
+ * opened or mapped or is not a valid tree file
+ */
+kdtree_file *kdtree_file_open(const char *path);
+
+
+/**
+ * Maps the file open on the given descriptor, which may be a shared
+ * memory object, and checks it as kdtree_file_open does.  The
+ * descriptor may be closed afterwards.
+ *
+ * @param fd a descriptor open for reading
+ * @return a pointer to the mapped file, or NULL if it could not be
+ * mapped or is not a valid tree file
+ */
+kdtree_file *kdtree_file_map(int fd);
+
+
+/**
+ * Writes a copy of the given mapped file to the given path, as for
+ * kdtree_file_save.
+ *
+ * @param f a pointer to a mapped file, non-NULL
+ * @param path the name of the new file, non-NULL
+ * @return true if successful, false if the file could not be written
+ */
+bool kdtree_file_copy(const kdtree_file *f, const char *path);
+
+
+/**
+ * Returns the number of points in the given mapped file.
+ *
+ * @param f a pointer to a mapped file, non-NULL
+ */
+size_t kdtree_file_size(const kdtree_file *f);
+
+
+/**
+ * Determines if the given mapped file contains a point with the same
+ * coordinates as the given point.
+ *
+ * @param f a pointer to a mapped file, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the point is in the file
+ */
+bool kdtree_file_contains(const kdtree_file *f, const location *p);
+
+
+/**
+ * Passes the points in the given mapped file that are in or on the
+ * borders of the given rectangle to the given function.
+ *
+ * @param f a pointer to a mapped file, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location, non-NULL
+ * @param fn a pointer to a function, non-NULL
+ * @param arg a pointer to be passed as the extra argument to fn
+ */
+void kdtree_file_range_for_each(const kdtree_file *f, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg);
+
+
+/**
+ * Measures the shape of the tree in the given mapped file, as
+ * kdtree_stats does, with the root at depth 0.
+ *
+ * @param f a pointer to a mapped file, non-NULL
+ * @param leaves a pointer to where to store the number of leaves, non-NULL
+ * @param depth_sum a pointer to where to store the sum of their depths,
+ * non-NULL
+ * @param max_depth a pointer to where to store the greatest of their
+ * depths, non-NULL
+ * @return true if successful, false if memory could not be allocated
+ */
+bool kdtree_file_shape(const kdtree_file *f, size_t *leaves, size_t *depth_sum, size_t *max_depth);
+
+
+/**
+ * Adds one 64-bit word to a running checksum that started at
+ * KDTREE_FILE_CHECKSUM_START.
+ *
+ * @param h the checksum so far
+ * @param word the next word
+ * @return the new checksum
+ */
+uint64_t kdtree_file_checksum(uint64_t h, uint64_t word);
+
+
+/**
+ * Reads a little-endian 64-bit word, whatever the machine's byte order.
+ *
+ * @param p a pointer to 8 bytes, non-NULL
+ */
+uint64_t kdtree_file_get64(const unsigned char *p);
+
+
+/**
+ * Writes a 64-bit word as 8 little-endian bytes, whatever the machine's
+ * byte order.
+ *
+ * @param p a pointer to room for 8 bytes, non-NULL
+ * @param v the word to write
+ */
+void kdtree_file_put64(unsigned char *p, uint64_t v);
+
+
+/**
+ * Unmaps and closes the given file.
+ *
+ * @param f a pointer to a mapped file, or NULL
+ */
+void kdtree_file_close(kdtree_file *f);
+
+#endif
@@ -0,0 +1,316 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "kdtree.h"
+#include "kdtree_forest.h"
+#include "kdtree_internal.h"
+#include "kdtree_latency.h"
+#include "kdtree_trace.h"
+#include "location.h"
+
+//fewest tiles a range query has to search before it uses more threads
+#define KDTREE_FOREST_PARALLEL_TILES 2
+
+typedef struct {
+    pthread_rwlock_t lock;  //read for queries, write for adds and removes
+    kdtree *tree;
+} kdtree_shard;
+
+struct kdtree_forest{
+    kdtree_shard *shards;   //row-major, row 0 at the south pole
+    size_t lat_bands;
+    size_t lon_bands;
+    size_t threads;
+};
+
+//one range query spread over several threads; each takes the next
+//unsearched tile until there are none left
+typedef struct {
+    kdtree_forest *f;
+    const location *sw;
+    const location *ne;
+    const size_t *tiles;
+    size_t count;
+    size_t next;
+    location **results;
+    int *sizes;
+} kdtree_forest_query;
+
+//which of bands equal slices of [low, low + span] v is in, clamped to the
+//ends; never decreases as v increases, so a rectangle's points are all in
+//the tiles between the ones holding its corners
+static size_t kdtree_forest_band(double v, double low, double span, size_t bands){
+    double pos = (v - low) / span * bands;
+    if (!(pos > 0)){
+        return 0;
+    }
+    if (pos >= bands){
+        return bands - 1;
+    }
+    return (size_t)pos;
+}
+
+static size_t kdtree_forest_tile(const kdtree_forest *f, const location *p){
+    size_t row = kdtree_forest_band(p->lat, -90.0, 180.0, f->lat_bands);
+    size_t col = kdtree_forest_band(p->lon, -180.0, 360.0, f->lon_bands);
+    return row * f->lon_bands + col;
+}
+
+kdtree_forest *kdtree_forest_create(const location *pts, int n, size_t lat_bands, size_t lon_bands, size_t threads){
+    if (lat_bands == 0 || lon_bands == 0 || threads == 0 || (n > 0 && pts == NULL)){
+        return NULL;
+    }
+    size_t tiles = lat_bands * lon_bands;
+    kdtree_forest *f = malloc(sizeof(kdtree_forest));
+    if (f == NULL){
+        return NULL;
+    }
+    f->lat_bands = lat_bands;
+    f->lon_bands = lon_bands;
+    f->threads = threads;
+    f->shards = malloc(sizeof(kdtree_shard) * tiles);
+
+    //sort the points by tile: count each tile's points, then place them
+    size_t total = n > 0 ? n : 0;
+    size_t *start = calloc(tiles + 1, sizeof(size_t));
+    location *sorted = malloc(sizeof(location) * (total > 0 ? total : 1));
+    if (f->shards == NULL || start == NULL || sorted == NULL){
+        free(f->shards);
+        free(f);
+        free(start);
+        free(sorted);
+        return NULL;
+    }
+    for (size_t i = 0; i < total; i++){
+        start[kdtree_forest_tile(f, &pts[i]) + 1]++;
+    }
+    for (size_t i = 0; i < tiles; i++){
+        start[i + 1] += start[i];
+    }
+    for (size_t i = 0; i < total; i++){
+        sorted[start[kdtree_forest_tile(f, &pts[i])]++] = pts[i];
+    }
+    //the loop above moved each start to the start of the next tile
+
+    size_t built = 0;
+    bool ok = true;
+    while (built < tiles && ok){
+        kdtree_shard *shard = &f->shards[built];
+        size_t first = built == 0 ? 0 : start[built - 1];
+        shard->tree = kdtree_create(sorted + first, start[built] - first);
+        ok = shard->tree != NULL;
+        if (ok && pthread_rwlock_init(&shard->lock, NULL) != 0){
+            kdtree_destroy(shard->tree);
+            ok = false;
+        }
+        if (ok){
+            built++;
+        }
+    }
+    free(start);
+    free(sorted);
+
+    if (!ok){
+        //only destroy the tiles that were set up
+        f->lat_bands = 1;
+        f->lon_bands = built;
+        kdtree_forest_destroy(f);
+        return NULL;
+    }
+    return f;
+}
+
+bool kdtree_forest_add(kdtree_forest *f, const location *p){
+    if (f == NULL || p == NULL){
+        return false;
+    }
+    kdtree_shard *shard = &f->shards[kdtree_forest_tile(f, p)];
+    pthread_rwlock_wrlock(&shard->lock);
+    bool added = kdtree_add(shard->tree, p);
+    pthread_rwlock_unlock(&shard->lock);
+    return added;
+}
+
+bool kdtree_forest_contains(kdtree_forest *f, const location *p){
+    if (f == NULL || p == NULL){
+        return false;
+    }
+    kdtree_shard *shard = &f->shards[kdtree_forest_tile(f, p)];
+    pthread_rwlock_rdlock(&shard->lock);
+    bool found = kdtree_contains(shard->tree, p);
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+void kdtree_forest_remove(kdtree_forest *f, const location *p){
+    if (f == NULL || p == NULL){
+        return;
+    }
+    kdtree_shard *shard = &f->shards[kdtree_forest_tile(f, p)];
+    pthread_rwlock_wrlock(&shard->lock);
+    kdtree_remove(shard->tree, p);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+//lists the tiles that intersect the rectangle; returns how many, or 0 if
+//memory could not be allocated
+static size_t kdtree_forest_tiles(const kdtree_forest *f, const location *sw, const location *ne, size_t **tiles){
+    size_t row_lo = kdtree_forest_band(sw->lat, -90.0, 180.0, f->lat_bands);
+    size_t row_hi = kdtree_forest_band(ne->lat, -90.0, 180.0, f->lat_bands);
+    size_t col_lo = kdtree_forest_band(sw->lon, -180.0, 360.0, f->lon_bands);
+    size_t col_hi = kdtree_forest_band(ne->lon, -180.0, 360.0, f->lon_bands);
+    if (row_hi < row_lo || col_hi < col_lo){
+        *tiles = NULL;
+        return 0;
+    }
+
+    size_t count = (row_hi - row_lo + 1) * (col_hi - col_lo + 1);
+    *tiles = malloc(sizeof(size_t) * count);
+    if (*tiles == NULL){
+        return 0;
+    }
+    size_t k = 0;
+    for (size_t row = row_lo; row <= row_hi; row++){
+        for (size_t col = col_lo; col <= col_hi; col++){
+            (*tiles)[k++] = row * f->lon_bands + col;
+        }
+    }
+    return count;
+}
+
+static void *kdtree_forest_range_worker(void *arg){
+    kdtree_forest_query *q = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->count){
+        kdtree_shard *shard = &q->f->shards[q->tiles[i]];
+        pthread_rwlock_rdlock(&shard->lock);
+        q->results[i] = kdtree_do_range(shard->tree, q->sw, q->ne, &q->sizes[i]);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return NULL;
+}
+
+static location *kdtree_forest_do_range(kdtree_forest *f, const location *sw, const location *ne, int *n){
+    *n = 0;
+
+    size_t *tiles;
+    size_t count = kdtree_forest_tiles(f, sw, ne, &tiles);
+    location **results = calloc(count > 0 ? count : 1, sizeof(location *));
+    int *sizes = calloc(count > 0 ? count : 1, sizeof(int));
+    if (count == 0 || results == NULL || sizes == NULL){
+        free(tiles);
+        free(results);
+        free(sizes);
+        return NULL;
+    }
+
+    //search the tiles, with helpers if there are enough of them
+    kdtree_forest_query q = {f, sw, ne, tiles, count, 0, results, sizes};
+    size_t helpers = 0;
+    pthread_t *ids = NULL;
+    if (count >= KDTREE_FOREST_PARALLEL_TILES && f->threads > 1){
+        size_t wanted = (f->threads < count ? f->threads : count) - 1;
+        ids = malloc(sizeof(pthread_t) * wanted);
+        if (ids == NULL){
+            wanted = 0;
+        }
+        while (helpers < wanted && pthread_create(&ids[helpers], NULL, kdtree_forest_range_worker, &q) == 0){
+            helpers++;
+        }
+    }
+    kdtree_forest_range_worker(&q);
+    for (size_t i = 0; i < helpers; i++){
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+
+    //put the tiles' results together
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++){
+        total += sizes[i];
+    }
+    location *all = NULL;
+    if (total > 0){
+        all = malloc(sizeof(location) * total);
+    }
+    if (all != NULL){
+        size_t k = 0;
+        for (size_t i = 0; i < count; i++){
+            if (sizes[i] > 0){
+                memcpy(all + k, results[i], sizeof(location) * sizes[i]);
+                k += sizes[i];
+            }
+        }
+        *n = total;
+    }
+    for (size_t i = 0; i < count; i++){
+        free(results[i]);
+    }
+    free(results);
+    free(sizes);
+    free(tiles);
+    return all;
+}
+
+//a query over the forest is traced and timed as one call, however many
+//tiles it searches
+location *kdtree_forest_range(kdtree_forest *f, const location *sw, const location *ne, int *n){
+    if (f == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    kdtree_trace_record(KDTREE_OP_RANGE, sw, ne);
+    uint64_t start = kdtree_latency_start();
+    location *pts = kdtree_forest_do_range(f, sw, ne, n);
+    kdtree_latency_stop(KDTREE_OP_RANGE, start);
+    return pts;
+}
+
+static void kdtree_forest_do_range_for_each(kdtree_forest *f, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg){
+    size_t *tiles;
+    size_t count = kdtree_forest_tiles(f, sw, ne, &tiles);
+    for (size_t i = 0; i < count; i++){
+        kdtree_shard *shard = &f->shards[tiles[i]];
+        pthread_rwlock_rdlock(&shard->lock);
+        kdtree_do_range_for_each(shard->tree, sw, ne, fn, arg);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    free(tiles);
+}
+
+void kdtree_forest_range_for_each(kdtree_forest *f, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg){
+    if (f == NULL || sw == NULL || ne == NULL || fn == NULL){
+        return;
+    }
+    kdtree_trace_record(KDTREE_OP_RANGE_FOR_EACH, sw, ne);
+    uint64_t start = kdtree_latency_start();
+    kdtree_forest_do_range_for_each(f, sw, ne, fn, arg);
+    kdtree_latency_stop(KDTREE_OP_RANGE_FOR_EACH, start);
+}
+
+size_t kdtree_forest_size(kdtree_forest *f){
+    if (f == NULL){
+        return 0;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < f->lat_bands * f->lon_bands; i++){
+        kdtree_shard *shard = &f->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        total += kdtree_size(shard->tree);
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return total;
+}
+
+void kdtree_forest_destroy(kdtree_forest *f){
+    if (f == NULL){
+        return;
+    }
+    for (size_t i = 0; i < f->lat_bands * f->lon_bands; i++){
+        pthread_rwlock_destroy(&f->shards[i].lock);
+        kdtree_destroy(f->shards[i].tree);
+    }
+    free(f->shards);
+    free(f);
+}
@@ -0,0 +1,122 @@
+#ifndef __KDTREE_FOREST_H__
+#define __KDTREE_FOREST_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "location.h"
+
+/**
+ * A set of locations split over a grid of tiles covering the globe, each
+ * tile backed by its own kdtree and its own lock.  Adds and removes lock
+ * only the tile that owns the point, so threads working in different
+ * parts of the world don't wait for each other, and range queries only
+ * visit the tiles that intersect the rectangle, searching them in
+ * parallel when there are several.  A grid with one longitude band
+ * splits the globe into latitude bands.
+ *
+ * All functions may be called from any number of threads at once, except
+ * kdtree_forest_destroy.  Points are the same or different exactly as
+ * for kdtree.
+ */
+typedef struct kdtree_forest kdtree_forest;
+
+
+/**
+ * Creates a forest containing copies of the given points.
+ *
+ * @param pts an array of valid locations; NULL is allowed if n = 0
+ * @param n the number of points in that array
+ * @param lat_bands the number of rows of tiles, which split latitudes
+ * -90 to 90 evenly, positive
+ * @param lon_bands the number of columns of tiles, which split longitudes
+ * -180 to 180 evenly, positive
+ * @param threads the most threads a range query may use, positive
+ * @return a pointer to the new forest, or NULL if memory could not be
+ * allocated
+ */
+kdtree_forest *kdtree_forest_create(const location *pts, int n, size_t lat_bands, size_t lon_bands, size_t threads);
+
+
+/**
+ * Adds a copy of the given point to the given forest.  There is no
+ * effect if the point is already there.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the point was added
+ */
+bool kdtree_forest_add(kdtree_forest *f, const location *p);
+
+
+/**
+ * Determines if the given forest contains a point with the same
+ * coordinates as the given point.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the forest contains the location
+ */
+bool kdtree_forest_contains(kdtree_forest *f, const location *p);
+
+
+/**
+ * Removes the given point from the given forest.  There is no effect if
+ * the point is not there.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ */
+void kdtree_forest_remove(kdtree_forest *f, const location *p);
+
+
+/**
+ * Returns a dynamically allocated array of the points in the given forest
+ * in or on the borders of the given rectangle, as for kdtree_range.
+ * It is traced, and its latency recorded, as one call to kdtree_range,
+ * however many tiles it searches.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param n a pointer to an integer, non-NULL
+ * @return a pointer to an array containing the points in the range, or NULL
+ */
+location *kdtree_forest_range(kdtree_forest *f, const location *sw, const location *ne, int *n);
+
+
+/**
+ * Passes the points in the given forest in or on the borders of the
+ * given rectangle to the given function, as for kdtree_range_for_each.
+ * The function is always called from the calling thread, one tile at a
+ * time, and must not change the forest.  It is traced, and its
+ * latency recorded, as one call to kdtree_range_for_each.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param fn a pointer to a function that takes a location and
+ * the extra argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to fn
+ */
+void kdtree_forest_range_for_each(kdtree_forest *f, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg);
+
+
+/**
+ * Returns the number of points in the given forest.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ */
+size_t kdtree_forest_size(kdtree_forest *f);
+
+
+/**
+ * Destroys the given forest.  No other thread may be using it.
+ *
+ * @param f a pointer to a valid forest, non-NULL
+ */
+void kdtree_forest_destroy(kdtree_forest *f);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "kdtree_hashset.h"
+
+//empty slots hold a NaN latitude, which no valid location has
+#define KDTREE_HASHSET_EMPTY_BITS UINT64_MAX
+
+static uint64_t kdtree_hashset_bits(double d){
+    if (d == 0.0){
+        d = 0.0;  //so -0.0 hashes like 0.0
+    }
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static bool kdtree_hashset_is_empty(const location *slot){
+    uint64_t bits;
+    memcpy(&bits, &slot->lat, sizeof(bits));
+    return bits == KDTREE_HASHSET_EMPTY_BITS;
+}
+
+static void kdtree_hashset_clear(location *slot){
+    uint64_t bits = KDTREE_HASHSET_EMPTY_BITS;
+    memcpy(&slot->lat, &bits, sizeof(bits));
+}
+
+static size_t kdtree_hashset_hash(const kdtree_hashset *s, const location *l){
+    //mix the two coordinates and finish with the splitmix64 finalizer
+    uint64_t h = kdtree_hashset_bits(l->lat) * 0x9e3779b97f4a7c15ull ^ kdtree_hashset_bits(l->lon);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (size_t)h & (s->capacity - 1);
+}
+
+//returns the slot holding l, or the empty slot where it would go
+static size_t kdtree_hashset_find(const kdtree_hashset *s, const location *l){
+    size_t i = kdtree_hashset_hash(s, l);
+    while (!kdtree_hashset_is_empty(&s->slots[i])
+           && !(s->slots[i].lat == l->lat && s->slots[i].lon == l->lon)){
+        i = (i + 1) & (s->capacity - 1);
+    }
+    return i;
+}
+
+static bool kdtree_hashset_alloc(kdtree_hashset *s, size_t capacity){
+    s->slots = malloc(sizeof(location) * capacity);
+    if (s->slots == NULL){
+        return false;
+    }
+    s->capacity = capacity;
+    s->count = 0;
+    for (size_t i = 0; i < capacity; i++){
+        kdtree_hashset_clear(&s->slots[i]);
+    }
+    return true;
+}
+
+bool kdtree_hashset_init(kdtree_hashset *s, size_t expected){
+    //keep the load factor at or below one half
+    size_t capacity = 16;
+    while (capacity < 2 * expected){
+        capacity *= 2;
+    }
+    return kdtree_hashset_alloc(s, capacity);
+}
+
+bool kdtree_hashset_contains(const kdtree_hashset *s, const location *l){
+    return !kdtree_hashset_is_empty(&s->slots[kdtree_hashset_find(s, l)]);
+}
+
+static bool kdtree_hashset_grow(kdtree_hashset *s){
+    kdtree_hashset bigger;
+    if (!kdtree_hashset_alloc(&bigger, s->capacity * 2)){
+        return false;
+    }
+    for (size_t i = 0; i < s->capacity; i++){
+        if (!kdtree_hashset_is_empty(&s->slots[i])){
+            bigger.slots[kdtree_hashset_find(&bigger, &s->slots[i])] = s->slots[i];
+            bigger.count++;
+        }
+    }
+    free(s->slots);
+    *s = bigger;
+    return true;
+}
+
+int kdtree_hashset_add(kdtree_hashset *s, const location *l){
+    size_t i = kdtree_hashset_find(s, l);
+    if (!kdtree_hashset_is_empty(&s->slots[i])){
+        return 0;
+    }
+    if (2 * (s->count + 1) > s->capacity){
+        if (!kdtree_hashset_grow(s)){
+            return -1;
+        }
+        i = kdtree_hashset_find(s, l);
+    }
+    s->slots[i] = *l;
+    s->count++;
+    return 1;
+}
+
+bool kdtree_hashset_remove(kdtree_hashset *s, const location *l){
+    size_t i = kdtree_hashset_find(s, l);
+    if (kdtree_hashset_is_empty(&s->slots[i])){
+        return false;
+    }
+
+    //shift back any later entries in the same run that would no longer be
+    //reachable from their home slot across the hole
+    size_t mask = s->capacity - 1;
+    size_t hole = i;
+    size_t j = i;
+    while (true){
+        j = (j + 1) & mask;
+        if (kdtree_hashset_is_empty(&s->slots[j])){
+            break;
+        }
+        size_t home = kdtree_hashset_hash(s, &s->slots[j]);
+        //move j to the hole unless its home is cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)){
+            s->slots[hole] = s->slots[j];
+            hole = j;
+        }
+    }
+    kdtree_hashset_clear(&s->slots[hole]);
+    s->count--;
+    return true;
+}
+
+void kdtree_hashset_destroy(kdtree_hashset *s){
+    free(s->slots);
+    s->slots = NULL;
+    s->capacity = 0;
+    s->count = 0;
+}
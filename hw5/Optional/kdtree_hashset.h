@@ -0,0 +1,75 @@
+#ifndef __KDTREE_HASHSET_H__
+#define __KDTREE_HASHSET_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "location.h"
+
+/**
+ * An open-addressing hash set of locations, used as a side index next to
+ * a k-d tree so that exact-match lookups do not have to walk the tree.
+ * Locations are hashed on the bit patterns of their coordinates (with
+ * -0.0 treated as 0.0 so that the set agrees with the == comparisons
+ * used by the tree).  Collisions are resolved by linear probing and
+ * removal shifts later entries back, so there are no tombstones.
+ */
+typedef struct
+{
+  location *slots;
+  size_t capacity;  // always a power of 2
+  size_t count;
+} kdtree_hashset;
+
+
+/**
+ * Initializes the given set to be empty with room for at least the
+ * given number of locations before it has to grow.
+ *
+ * @param s a pointer to an uninitialized set, non-NULL
+ * @param expected the number of locations expected
+ * @return true if successful, false if memory could not be allocated
+ */
+bool kdtree_hashset_init(kdtree_hashset *s, size_t expected);
+
+
+/**
+ * Determines if the given set contains the given location.
+ *
+ * @param s a pointer to a valid set, non-NULL
+ * @param l a pointer to a valid location, non-NULL
+ * @return true if and only if l is in the set
+ */
+bool kdtree_hashset_contains(const kdtree_hashset *s, const location *l);
+
+
+/**
+ * Adds the given location to the given set.
+ *
+ * @param s a pointer to a valid set, non-NULL
+ * @param l a pointer to a valid location, non-NULL
+ * @return 1 if the location was added, 0 if it was already there, and
+ * -1 if memory could not be allocated to grow the set
+ */
+int kdtree_hashset_add(kdtree_hashset *s, const location *l);
+
+
+/**
+ * Removes the given location from the given set.
+ *
+ * @param s a pointer to a valid set, non-NULL
+ * @param l a pointer to a valid location, non-NULL
+ * @return true if the location was removed, false if it was not there
+ */
+bool kdtree_hashset_remove(kdtree_hashset *s, const location *l);
+
+
+/**
+ * Frees the memory used by the given set.  The set must be initialized
+ * again before being used.
+ *
+ * @param s a pointer to a valid set, non-NULL
+ */
+void kdtree_hashset_destroy(kdtree_hashset *s);
+
+#endif
@@ -0,0 +1,212 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <random>
+#include <set>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kdtree.hpp"
+
+/**
+ * Unit tests for the kdtree_cpp::KdTree template in kdtree.hpp, which
+ * check every operation against a std::set of the same points.
+ *
+ * USAGE: ./HppUnit test-number
+ *
+ * Tests 1, 2 and 3 use float, double and int32_t coordinates.
+ */
+
+template <typename Coord>
+using unit_tree = kdtree_cpp::KdTree<2, Coord, int>;
+
+template <typename Coord>
+using unit_point = typename unit_tree<Coord>::point_type;
+
+
+/**
+ * Returns a point on a small grid, so that many points share a
+ * coordinate with others and the same points come up more than once.
+ *
+ * @param gen the generator to draw the grid cell from
+ */
+template <typename Coord>
+unit_point<Coord> unit_random_point(std::mt19937 &gen)
+{
+  std::uniform_int_distribution<int> cell(-40, 40);
+  int lat = cell(gen);
+  int lon = cell(gen);
+  if (std::is_same<Coord, std::int32_t>::value)
+    {
+      return unit_point<Coord>{{static_cast<Coord>(lat * 1000000), static_cast<Coord>(lon * 1000000)}};
+    }
+  return unit_point<Coord>{{static_cast<Coord>(lat * 0.25), static_cast<Coord>(lon * 0.25)}};
+}
+
+
+/**
+ * Determines if the given tree holds exactly the points in the given
+ * set: as many of them, and each of them.
+ */
+template <typename Coord>
+bool unit_same_points(const unit_tree<Coord> &t, const std::set<unit_point<Coord>> &ref)
+{
+  if (t.size() != ref.size() || t.empty() != ref.empty())
+    {
+      return false;
+    }
+  for (const unit_point<Coord> &p : ref)
+    {
+      if (!t.contains(p))
+	{
+	  return false;
+	}
+    }
+  return true;
+}
+
+
+/**
+ * Determines if a range query on the given tree returns exactly the
+ * points in the given set that are in or on the border of the box.
+ */
+template <typename Coord>
+bool unit_same_range(const unit_tree<Coord> &t, const std::set<unit_point<Coord>> &ref,
+		     const unit_point<Coord> &lo, const unit_point<Coord> &hi)
+{
+  std::vector<unit_point<Coord>> expected;
+  for (const unit_point<Coord> &p : ref)
+    {
+      if (!(p[0] < lo[0]) && !(hi[0] < p[0]) && !(p[1] < lo[1]) && !(hi[1] < p[1]))
+	{
+	  expected.push_back(p);
+	}
+    }
+
+  std::vector<unit_point<Coord>> found;
+  for (const auto &v : t.range(lo, hi))
+    {
+      found.push_back(v.pt);
+    }
+  std::size_t visited = 0;
+  t.range_for_each(lo, hi, [&visited](const typename unit_tree<Coord>::value_type &) { visited++; });
+
+  std::sort(found.begin(), found.end());
+  return found == expected && visited == expected.size();
+}
+
+
+template <typename Coord>
+void unit_test_template(std::size_t n, const char *name)
+{
+  std::mt19937 gen(474);
+  std::set<unit_point<Coord>> ref;
+
+  // build from the first half, which has duplicates; the first copy of
+  // each point keeps its payload
+  std::vector<typename unit_tree<Coord>::value_type> values;
+  for (std::size_t i = 0; i < n / 2; i++)
+    {
+      unit_point<Coord> p = unit_random_point<Coord>(gen);
+      values.push_back({p, static_cast<int>(i)});
+      ref.insert(p);
+    }
+  std::vector<typename unit_tree<Coord>::value_type> given = values;
+  unit_tree<Coord> t(std::move(values));
+  bool ok = unit_same_points(t, ref);
+  std::set<unit_point<Coord>> seen;
+  for (std::size_t i = 0; i < given.size() && ok; i++)
+    {
+      const int *payload = t.find(given[i].pt);
+      ok = payload != nullptr && (*payload == given[i].payload) == seen.insert(given[i].pt).second;
+    }
+
+  // add the second half, one at a time
+  for (std::size_t i = n / 2; i < n && ok; i++)
+    {
+      unit_point<Coord> p = unit_random_point<Coord>(gen);
+      ok = t.add(p, static_cast<int>(i)) == ref.insert(p).second;
+    }
+  ok = ok && unit_same_points(t, ref);
+
+  // remove points that are there and points that aren't
+  for (std::size_t i = 0; i < n / 2 && ok; i++)
+    {
+      unit_point<Coord> p = unit_random_point<Coord>(gen);
+      ok = t.remove(p) == (ref.erase(p) == 1);
+    }
+  ok = ok && unit_same_points(t, ref);
+  for (std::size_t i = 0; i < 200 && ok; i++)
+    {
+      unit_point<Coord> p = unit_random_point<Coord>(gen);
+      ok = t.contains(p) == (ref.count(p) == 1) && (t.find(p) != nullptr) == t.contains(p);
+    }
+
+  // boxes of every size, including ones whose edges are on points
+  for (std::size_t i = 0; i < 100 && ok; i++)
+    {
+      unit_point<Coord> a = unit_random_point<Coord>(gen);
+      unit_point<Coord> b = unit_random_point<Coord>(gen);
+      unit_point<Coord> lo{{std::min(a[0], b[0]), std::min(a[1], b[1])}};
+      unit_point<Coord> hi{{std::max(a[0], b[0]), std::max(a[1], b[1])}};
+      ok = unit_same_range(t, ref, lo, hi);
+    }
+
+  // a moved-from tree is empty, and the points go with the move
+  unit_tree<Coord> moved(std::move(t));
+  ok = ok && t.empty() && t.size() == 0 && unit_same_points(moved, ref);
+  t = std::move(moved);
+  ok = ok && moved.empty() && unit_same_points(t, ref);
+
+  // removing everything leaves an empty tree that can be added to
+  for (const unit_point<Coord> &p : ref)
+    {
+      ok = ok && t.remove(p) && !t.contains(p);
+    }
+  unit_point<Coord> p = unit_random_point<Coord>(gen);
+  ok = ok && t.empty() && t.range(p, p).empty() && t.add(p) && t.contains(p) && t.size() == 1;
+
+  if (ok)
+    {
+      std::printf("PASSED\n");
+    }
+  else
+    {
+      std::printf("FAILED -- %s tree differs from std::set\n", name);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+  int test = 0;
+
+  if (argc > 1)
+    {
+      test = std::atoi(argv[1]);
+    }
+
+  switch (test)
+    {
+    case 1:
+      unit_test_template<float>(20000, "float");
+      break;
+
+    case 2:
+      unit_test_template<double>(20000, "double");
+      break;
+
+    case 3:
+      unit_test_template<std::int32_t>(20000, "int32_t");
+      break;
+
+    default:
+      std::fprintf(stderr, "USAGE: %s test-number\n", argv[0]);
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "kdtree_ingest.h"
+
+//how long the background thread sleeps when the ring is empty
+#define KDTREE_INGEST_IDLE_NS 50000
+
+typedef struct {
+    location loc;
+    bool add;  //false for a remove
+} kdtree_ingest_op;
+
+//a slot in the ring; seq says whose turn it is: pos when free for the
+//producer that claims position pos, pos + 1 once that producer has
+//filled it, and pos + capacity once the consumer has emptied it
+typedef struct {
+    atomic_size_t seq;
+    kdtree_ingest_op op;
+} kdtree_ingest_cell;
+
+struct kdtree_ingest{
+    kdtree_ingest_cell *cells;
+    size_t mask;
+    size_t batch;
+    kdtree *tree;
+    pthread_t consumer;
+    //producers and the consumer each get their own cache line
+    _Alignas(64) atomic_size_t enqueue_pos;
+    atomic_size_t rejected;
+    _Alignas(64) atomic_size_t applied;
+    atomic_size_t batches;
+    atomic_size_t max_depth;
+    atomic_bool stop;
+    size_t dequeue_pos;  //only touched by the consumer
+};
+
+static bool kdtree_ingest_push(kdtree_ingest *q, const location *p, bool add){
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    kdtree_ingest_cell *cell;
+    while (true){
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0){
+            //the slot is free; claim it if no other producer beat us
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        } else if (diff < 0){
+            //the consumer hasn't emptied this slot since the last lap
+            atomic_fetch_add_explicit(&q->rejected, 1, memory_order_relaxed);
+            return false;
+        } else{
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->op.loc = *p;
+    cell->op.add = add;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+//applies a batch in order, giving each run of adds to kdtree_add_many
+static void kdtree_ingest_apply(kdtree_ingest *q, const kdtree_ingest_op *ops, location *adds, size_t n){
+    size_t run = 0;
+    for (size_t i = 0; i < n; i++){
+        if (ops[i].add){
+            adds[run++] = ops[i].loc;
+            continue;
+        }
+        kdtree_add_many(q->tree, adds, run);
+        run = 0;
+        kdtree_remove(q->tree, &ops[i].loc);
+    }
+    kdtree_add_many(q->tree, adds, run);
+}
+
+static void *kdtree_ingest_consume(void *arg){
+    kdtree_ingest *q = arg;
+    kdtree_ingest_op *ops = malloc(sizeof(kdtree_ingest_op) * q->batch);
+    location *adds = malloc(sizeof(location) * q->batch);
+    size_t batch = ops != NULL && adds != NULL ? q->batch : 1;
+    kdtree_ingest_op one;
+    location one_add;
+    if (batch == 1){
+        //out of memory for batches; go one update at a time
+        free(ops);
+        free(adds);
+        ops = &one;
+        adds = &one_add;
+    }
+
+    while (true){
+        size_t depth = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed) - q->dequeue_pos;
+        if (depth > atomic_load_explicit(&q->max_depth, memory_order_relaxed)){
+            atomic_store_explicit(&q->max_depth, depth, memory_order_relaxed);
+        }
+
+        size_t n = 0;
+        while (n < batch){
+            kdtree_ingest_cell *cell = &q->cells[q->dequeue_pos & q->mask];
+            if (atomic_load_explicit(&cell->seq, memory_order_acquire) != q->dequeue_pos + 1){
+                break;
+            }
+            ops[n++] = cell->op;
+            atomic_store_explicit(&cell->seq, q->dequeue_pos + q->mask + 1, memory_order_release);
+            q->dequeue_pos++;
+        }
+
+        if (n > 0){
+            kdtree_ingest_apply(q, ops, adds, n);
+            atomic_store_explicit(&q->applied, q->dequeue_pos, memory_order_release);
+            atomic_fetch_add_explicit(&q->batches, 1, memory_order_relaxed);
+        } else if (atomic_load(&q->stop) && atomic_load(&q->enqueue_pos) == q->dequeue_pos){
+            break;
+        } else{
+            struct timespec idle = {0, KDTREE_INGEST_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    if (batch > 1){
+        free(ops);
+        free(adds);
+    }
+    return NULL;
+}
+
+kdtree_ingest *kdtree_ingest_create(kdtree *t, size_t capacity, size_t batch){
+    if (t == NULL || capacity == 0 || batch == 0){
+        return NULL;
+    }
+    size_t size = 1;
+    while (size < capacity){
+        size *= 2;
+    }
+
+    kdtree_ingest *q = aligned_alloc(64, (sizeof(kdtree_ingest) + 63) / 64 * 64);
+    if (q == NULL){
+        return NULL;
+    }
+    q->cells = malloc(sizeof(kdtree_ingest_cell) * size);
+    if (q->cells == NULL){
+        free(q);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++){
+        atomic_init(&q->cells[i].seq, i);
+    }
+    q->mask = size - 1;
+    q->batch = batch;
+    q->tree = t;
+    q->dequeue_pos = 0;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->rejected, 0);
+    atomic_init(&q->applied, 0);
+    atomic_init(&q->batches, 0);
+    atomic_init(&q->max_depth, 0);
+    atomic_init(&q->stop, false);
+
+    if (pthread_create(&q->consumer, NULL, kdtree_ingest_consume, q) != 0){
+        free(q->cells);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+bool kdtree_ingest_add(kdtree_ingest *q, const location *p){
+    return q != NULL && p != NULL && kdtree_ingest_push(q, p, true);
+}
+
+bool kdtree_ingest_remove(kdtree_ingest *q, const location *p){
+    return q != NULL && p != NULL && kdtree_ingest_push(q, p, false);
+}
+
+void kdtree_ingest_flush(kdtree_ingest *q){
+    if (q == NULL){
+        return;
+    }
+    //positions are applied in order, so once the consumer is past the
+    //last one claimed before now, everything submitted before now is in
+    size_t target = atomic_load(&q->enqueue_pos);
+    while (atomic_load_explicit(&q->applied, memory_order_acquire) < target){
+        sched_yield();
+    }
+}
+
+void kdtree_ingest_get_stats(const kdtree_ingest *q, kdtree_ingest_stats *s){
+    if (q == NULL || s == NULL){
+        return;
+    }
+    size_t applied = atomic_load(&q->applied);
+    size_t submitted = atomic_load(&q->enqueue_pos);
+    s->capacity = q->mask + 1;
+    s->submitted = submitted;
+    s->applied = applied;
+    s->depth = submitted - applied;
+    s->max_depth = atomic_load(&q->max_depth);
+    s->rejected = atomic_load(&q->rejected);
+    s->batches = atomic_load(&q->batches);
+}
+
+void kdtree_ingest_destroy(kdtree_ingest *q){
+    if (q == NULL){
+        return;
+    }
+    atomic_store(&q->stop, true);
+    pthread_join(q->consumer, NULL);
+    free(q->cells);
+    free(q);
+}
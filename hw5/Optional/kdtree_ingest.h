@@ -0,0 +1,103 @@
+#ifndef __KDTREE_INGEST_H__
+#define __KDTREE_INGEST_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * A queue in front of a kdtree that any number of threads can submit
+ * adds and removes to without waiting for the tree.  Updates go into a
+ * fixed-size lock-free ring, and a single background thread takes them
+ * out in batches and applies them in the order they were submitted,
+ * using kdtree_add_many for runs of adds.  When the ring is full,
+ * submissions fail instead of waiting, so producers can decide whether
+ * to retry, drop or slow down.
+ *
+ * The background thread is the tree's only writer while the queue
+ * exists.  Other threads may read the tree at the same time if it is in
+ * KDTREE_SINGLE_WRITER mode.
+ */
+typedef struct kdtree_ingest kdtree_ingest;
+
+
+/**
+ * Counters describing a queue.
+ */
+typedef struct
+{
+  size_t capacity;   // the most updates the ring can hold
+  size_t depth;      // updates submitted but not yet applied
+  size_t max_depth;  // the largest depth the background thread has seen
+  size_t submitted;  // updates accepted since the queue was created
+  size_t rejected;   // submissions refused because the ring was full
+  size_t applied;    // updates applied to the tree
+  size_t batches;    // batches the background thread has applied
+} kdtree_ingest_stats;
+
+
+/**
+ * Creates a queue for the given tree and starts its background thread.
+ *
+ * @param t a pointer to a valid k-d tree that no other thread will
+ * change while the queue exists, non-NULL
+ * @param capacity the number of updates the ring can hold, rounded up to
+ * a power of 2, positive
+ * @param batch the most updates to apply at once, positive
+ * @return a pointer to the new queue, or NULL if memory or the thread
+ * could not be allocated
+ */
+kdtree_ingest *kdtree_ingest_create(kdtree *t, size_t capacity, size_t batch);
+
+
+/**
+ * Submits an add of the given point.  Never waits.
+ *
+ * @param q a pointer to a valid queue, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if the add was queued, false if the ring was full
+ */
+bool kdtree_ingest_add(kdtree_ingest *q, const location *p);
+
+
+/**
+ * Submits a remove of the given point.  Never waits.
+ *
+ * @param q a pointer to a valid queue, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if the remove was queued, false if the ring was full
+ */
+bool kdtree_ingest_remove(kdtree_ingest *q, const location *p);
+
+
+/**
+ * Waits until every update submitted (by any thread) before this call
+ * has been applied to the tree.
+ *
+ * @param q a pointer to a valid queue, non-NULL
+ */
+void kdtree_ingest_flush(kdtree_ingest *q);
+
+
+/**
+ * Reads the given queue's counters.  The values are read one at a time
+ * while the queue is running, so they may not be exactly consistent.
+ *
+ * @param q a pointer to a valid queue, non-NULL
+ * @param s a pointer to where to store the counters, non-NULL
+ */
+void kdtree_ingest_get_stats(const kdtree_ingest *q, kdtree_ingest_stats *s);
+
+
+/**
+ * Applies everything still queued, stops the background thread and
+ * destroys the queue.  The tree is not destroyed.  No thread may submit
+ * updates during or after this call.
+ *
+ * @param q a pointer to a valid queue, non-NULL
+ */
+void kdtree_ingest_destroy(kdtree_ingest *q);
+
+#endif
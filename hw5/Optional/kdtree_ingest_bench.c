@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "kdtree.h"
+#include "kdtree_dataset.h"
+#include "location.h"
+
+/**
+ * Measures how kdtree_add throughput scales with the number of threads
+ * adding to one tree in KDTREE_CONCURRENT_INSERT mode.
+ *
+ * USAGE: ./IngestBench [points [max-threads [dataset]]]
+ *
+ * For 1, 2, 4, ... max-threads threads (32 by default), builds a tree from
+ * scratch by splitting the same points (1000000 by default, of the given
+ * kind in kdtree_dataset.h, uniform by default) evenly between the
+ * threads, and prints the time, the adds per second and the speedup over
+ * the single-threaded mode.
+ */
+
+typedef struct {
+    kdtree *t;
+    const location *pts;
+    size_t n;
+    size_t added;
+} ingest_arg;
+
+static void *ingest_worker(void *a){
+    ingest_arg *arg = a;
+    for (size_t i = 0; i < arg->n; i++){
+        arg->added += kdtree_add(arg->t, &arg->pts[i]);
+    }
+    return NULL;
+}
+
+static double ingest_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//builds a tree from pts using the given number of threads, or in
+//KDTREE_SINGLE_THREADED mode if threads is 0; returns the seconds taken
+static double ingest_run(const location *pts, size_t n, size_t threads, size_t *added){
+    kdtree *t = kdtree_create(NULL, 0);
+    if (t == NULL || (threads > 0 && !kdtree_set_concurrency(t, KDTREE_CONCURRENT_INSERT))){
+        kdtree_destroy(t);
+        return -1.0;
+    }
+
+    size_t workers = threads == 0 ? 1 : threads;
+    ingest_arg *args = malloc(sizeof(ingest_arg) * workers);
+    pthread_t *ids = malloc(sizeof(pthread_t) * workers);
+    if (args == NULL || ids == NULL){
+        free(args);
+        free(ids);
+        kdtree_destroy(t);
+        return -1.0;
+    }
+    for (size_t i = 0; i < workers; i++){
+        size_t start = n * i / workers;
+        size_t end = n * (i + 1) / workers;
+        args[i] = (ingest_arg){t, pts + start, end - start, 0};
+    }
+
+    double start = ingest_now();
+    if (threads == 0){
+        ingest_worker(&args[0]);
+    } else{
+        size_t started = 0;
+        while (started < workers && pthread_create(&ids[started], NULL, ingest_worker, &args[started]) == 0){
+            started++;
+        }
+        //do the work of any threads that couldn't be started here
+        for (size_t i = started; i < workers; i++){
+            ingest_worker(&args[i]);
+        }
+        for (size_t i = 0; i < started; i++){
+            pthread_join(ids[i], NULL);
+        }
+    }
+    double elapsed = ingest_now() - start;
+
+    *added = 0;
+    for (size_t i = 0; i < workers; i++){
+        *added += args[i].added;
+    }
+    free(args);
+    free(ids);
+    kdtree_destroy(t);
+    return elapsed;
+}
+
+int main(int argc, char **argv){
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+    kdtree_dataset d = KDTREE_DATASET_UNIFORM;
+    if (n == 0 || max_threads == 0 || argc > 4 || (argc > 3 && !kdtree_dataset_parse(argv[3], &d))){
+        fprintf(stderr, "USAGE: %s [points [max-threads [dataset]]]\n", argv[0]);
+        return 1;
+    }
+
+    //the same seed as always, so uniform points are the ones earlier
+    //runs used
+    location *pts = malloc(sizeof(location) * n);
+    if (pts == NULL || !kdtree_dataset_generate(d, 474, pts, n)){
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        free(pts);
+        return 1;
+    }
+
+    size_t added;
+    double base = ingest_run(pts, n, 0, &added);
+    if (base < 0){
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        free(pts);
+        return 1;
+    }
+    printf("%-10s %10s %14s %8s\n", "threads", "seconds", "adds/second", "speedup");
+    printf("%-10s %10.3f %14.0f %8.2f\n", "single", base, added / base, 1.0);
+    for (size_t threads = 1; threads <= max_threads; threads *= 2){
+        double elapsed = ingest_run(pts, n, threads, &added);
+        if (elapsed < 0){
+            fprintf(stderr, "%s: out of memory\n", argv[0]);
+            break;
+        }
+        printf("%-10zu %10.3f %14.0f %8.2f\n", threads, elapsed, added / elapsed, base / elapsed);
+    }
+
+    free(pts);
+    return 0;
+}
@@ -1,14 +1,112 @@
 #ifndef __KDTREE_INTERNAL_H__
 #define __KDTREE_INTERNAL_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
 #include "location.h"
 
 // Define kdtree_node here so it's accessible to both kdtree.c and kdtree_helpers.h
 typedef struct kdtree_node {
     location loc;
     int cut_dim;
+    uint32_t refs;  // links to this node; more than 1 once a snapshot shares it
     struct kdtree_node *left;
     struct kdtree_node *right;
 } kdtree_node;
 
+/**
+ * Returns the position of the given location along a Hilbert curve over
+ * a 2^32 by 2^32 grid covering longitudes -180 to 180 and latitudes -90
+ * to 90.  Nearby positions are nearby points.  Longitudes outside the
+ * valid range are clamped.
+ *
+ * @param l a pointer to a valid location, non-NULL
+ * @return the index of the grid cell containing l along the curve
+ */
+uint64_t kdtree_hilbert_index(const location *l);
+
+/**
+ * Builds a balanced tree out of the given nodes without moving them
+ * anywhere else, setting each node's links, cutting dimension and
+ * reference count.  Only the nodes' points need be set beforehand; they
+ * are reordered.
+ *
+ * @param nodes an array of n nodes whose points are distinct and valid
+ * @param n the number of nodes in that array
+ * @param depth the depth of the subtree's root in the whole tree
+ * @return a pointer to the root, which is one of the nodes, or NULL if
+ * n is 0
+ */
+kdtree_node *kdtree_build_in_place(kdtree_node *nodes, size_t n, int depth);
+
+/**
+ * kdtree_contains, kdtree_contains_many, kdtree_add, kdtree_add_many,
+ * kdtree_remove, kdtree_range and kdtree_range_for_each without tracing
+ * or recording latency, for work the library and its wrapper modules do
+ * on their own behalf, such as replaying a log or taking back an update,
+ * rather than a caller's.  The arguments and results are those of the
+ * public functions.
+ */
+bool kdtree_do_contains(const kdtree *t, const location *p);
+void kdtree_do_contains_many(const kdtree *t, const location *pts, size_t n, bool *out);
+bool kdtree_do_add(kdtree *t, const location *p);
+size_t kdtree_do_add_many(kdtree *t, const location *pts, size_t n);
+void kdtree_do_remove(kdtree *t, const location *p);
+location *kdtree_do_range(const kdtree *t, const location *sw, const location *ne, int *n);
+void kdtree_do_range_for_each(const kdtree *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg);
+
+/**
+ * Passes every point in the given tree to the given function, whatever
+ * its coordinates, as kdtree_range_for_each would with a rectangle that
+ * held them all.  The walk is not traced, timed or counted.
+ *
+ * @param t a pointer to a tree that no thread changes during the call,
+ * non-NULL
+ * @param f a pointer to a function that takes a location and the extra
+ * argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to f
+ */
+void kdtree_for_each_point(const kdtree *t, void (*f)(const location *, void *), void *arg);
+
+/**
+ * Returns a newly allocated array of every point in the given tree, as
+ * collected by kdtree_for_each_point.
+ *
+ * @param t a pointer to a tree that no thread changes during the call,
+ * non-NULL
+ * @param n a pointer to where to store the number of points, non-NULL
+ * @return a pointer to the array, which the caller must free and which
+ * is non-NULL even if the tree is empty, or NULL if memory could not be
+ * allocated
+ */
+location *kdtree_points(const kdtree *t, size_t *n);
+
+struct kdtree_file;
+struct kdtree_file_writer;
+
+/**
+ * Appends the records of the given tree to the given tree file writer,
+ * whose last record is then the root.
+ *
+ * @param t a pointer to a tree that no thread changes during the call,
+ * non-NULL
+ * @param w a pointer to a writer, non-NULL
+ * @return true if successful, false if a write failed or the tree is a
+ * paged tree
+ */
+bool kdtree_write(const kdtree *t, struct kdtree_file_writer *w);
+
+/**
+ * Makes a read-only tree out of the given mapped file, as
+ * kdtree_open_mmap does, which then owns it.
+ *
+ * @param file a pointer to a mapped file, or NULL
+ * @return a pointer to the tree, or NULL if file is NULL or memory could
+ * not be allocated, in which case the file is closed
+ */
+kdtree *kdtree_open_file(struct kdtree_file *file);
+
 #endif
@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "kdtree.h"
+#include "kdtree_latency.h"
+
+//buckets for each power of two, so a bucket is at most 1/32 of its value
+#define KDTREE_LATENCY_SUB_BITS 5
+#define KDTREE_LATENCY_SUB (1 << KDTREE_LATENCY_SUB_BITS)
+//latencies from 2^KDTREE_LATENCY_MAX_BITS nanoseconds up share the last bucket
+#define KDTREE_LATENCY_MAX_BITS 40
+#define KDTREE_LATENCY_BUCKETS ((KDTREE_LATENCY_MAX_BITS - KDTREE_LATENCY_SUB_BITS + 1) * KDTREE_LATENCY_SUB)
+
+typedef uint64_t kdtree_latency_counts[KDTREE_OPERATIONS][KDTREE_LATENCY_BUCKETS];
+
+//one thread's histogram; counts are written only by that thread, with
+//relaxed atomic stores so readers can load them at any time
+typedef struct kdtree_latency_thread{
+    struct kdtree_latency_thread *prev;
+    struct kdtree_latency_thread *next;
+    kdtree_latency_counts counts;
+} kdtree_latency_thread;
+
+static int kdtree_latency_on;
+
+//guards the list of threads and the two histograms below
+static pthread_mutex_t kdtree_latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static kdtree_latency_thread *kdtree_latency_threads;
+static kdtree_latency_counts kdtree_latency_exited;  //of threads that have exited
+static kdtree_latency_counts kdtree_latency_base;    //of every thread at the last reset
+
+//runs the destructor that folds a thread's histogram in when it exits
+static pthread_once_t kdtree_latency_once = PTHREAD_ONCE_INIT;
+static pthread_key_t kdtree_latency_key;
+static bool kdtree_latency_key_ok;
+
+static _Thread_local kdtree_latency_thread *kdtree_latency_mine;
+
+static uint64_t kdtree_latency_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+//values below 2 * KDTREE_LATENCY_SUB get a bucket each; above that each
+//power of two is split into KDTREE_LATENCY_SUB buckets
+static size_t kdtree_latency_bucket(uint64_t ns){
+    if (ns < 2 * KDTREE_LATENCY_SUB){
+        return ns;
+    }
+    int shift = 63 - __builtin_clzll(ns) - KDTREE_LATENCY_SUB_BITS;
+    size_t bucket = (size_t)shift * KDTREE_LATENCY_SUB + (ns >> shift);
+    return bucket < KDTREE_LATENCY_BUCKETS ? bucket : KDTREE_LATENCY_BUCKETS - 1;
+}
+
+//the largest value that goes in the given bucket
+static uint64_t kdtree_latency_top(size_t bucket){
+    if (bucket < 2 * KDTREE_LATENCY_SUB){
+        return bucket;
+    }
+    int shift = bucket / KDTREE_LATENCY_SUB - 1;
+    uint64_t sub = bucket % KDTREE_LATENCY_SUB + KDTREE_LATENCY_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+//adds the given histogram to sum; the caller holds the lock
+static void kdtree_latency_add(kdtree_latency_counts sum, kdtree_latency_counts counts){
+    for (size_t op = 0; op < KDTREE_OPERATIONS; op++){
+        for (size_t b = 0; b < KDTREE_LATENCY_BUCKETS; b++){
+            sum[op][b] += __atomic_load_n(&counts[op][b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void kdtree_latency_exit(void *arg){
+    kdtree_latency_thread *h = arg;
+    pthread_mutex_lock(&kdtree_latency_lock);
+    kdtree_latency_add(kdtree_latency_exited, h->counts);
+    if (h->prev != NULL){
+        h->prev->next = h->next;
+    } else{
+        kdtree_latency_threads = h->next;
+    }
+    if (h->next != NULL){
+        h->next->prev = h->prev;
+    }
+    pthread_mutex_unlock(&kdtree_latency_lock);
+    free(h);
+    kdtree_latency_mine = NULL;
+}
+
+static void kdtree_latency_make_key(void){
+    kdtree_latency_key_ok = pthread_key_create(&kdtree_latency_key, kdtree_latency_exit) == 0;
+}
+
+//gives the calling thread a histogram and adds it to the list
+static kdtree_latency_thread *kdtree_latency_register(void){
+    pthread_once(&kdtree_latency_once, kdtree_latency_make_key);
+    kdtree_latency_thread *h = calloc(1, sizeof(kdtree_latency_thread));
+    if (h == NULL || !kdtree_latency_key_ok || pthread_setspecific(kdtree_latency_key, h) != 0){
+        free(h);
+        return NULL;
+    }
+    pthread_mutex_lock(&kdtree_latency_lock);
+    h->next = kdtree_latency_threads;
+    if (h->next != NULL){
+        h->next->prev = h;
+    }
+    kdtree_latency_threads = h;
+    pthread_mutex_unlock(&kdtree_latency_lock);
+    kdtree_latency_mine = h;
+    return h;
+}
+
+uint64_t kdtree_latency_start(void){
+    return __atomic_load_n(&kdtree_latency_on, __ATOMIC_RELAXED) ? kdtree_latency_now() : 0;
+}
+
+void kdtree_latency_stop(kdtree_operation op, uint64_t start){
+    if (start == 0){
+        return;
+    }
+    uint64_t elapsed = kdtree_latency_now() - start;
+    kdtree_latency_thread *h = kdtree_latency_mine != NULL ? kdtree_latency_mine : kdtree_latency_register();
+    if (h == NULL){
+        return;
+    }
+    uint64_t *count = &h->counts[op][kdtree_latency_bucket(elapsed)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+void kdtree_latency_enable(bool on){
+    __atomic_store_n(&kdtree_latency_on, on, __ATOMIC_RELAXED);
+}
+
+//adds up every thread's histogram for all operations; the caller holds
+//the lock
+static void kdtree_latency_sum(kdtree_latency_counts sum){
+    memcpy(sum, kdtree_latency_exited, sizeof(kdtree_latency_counts));
+    for (kdtree_latency_thread *h = kdtree_latency_threads; h != NULL; h = h->next){
+        kdtree_latency_add(sum, h->counts);
+    }
+}
+
+void kdtree_latency_read(kdtree_operation op, kdtree_latency *l){
+    kdtree_latency_counts *sum = malloc(sizeof(kdtree_latency_counts));
+    *l = (kdtree_latency){0, 0, 0, 0, 0};
+    if (sum == NULL){
+        return;
+    }
+    pthread_mutex_lock(&kdtree_latency_lock);
+    kdtree_latency_sum(*sum);
+    uint64_t *counts = (*sum)[op];
+    for (size_t b = 0; b < KDTREE_LATENCY_BUCKETS; b++){
+        counts[b] -= kdtree_latency_base[op][b];
+        l->count += counts[b];
+    }
+    pthread_mutex_unlock(&kdtree_latency_lock);
+
+    //the call at each percentile's rank, counting from 1
+    uint64_t ranks[3] = {(l->count + 1) / 2, l->count - l->count / 100, l->count - l->count / 1000};
+    uint64_t *values[3] = {&l->p50, &l->p99, &l->p999};
+    uint64_t seen = 0;
+    size_t next = 0;
+    for (size_t b = 0; b < KDTREE_LATENCY_BUCKETS; b++){
+        seen += counts[b];
+        while (next < 3 && counts[b] > 0 && seen >= ranks[next]){
+            *values[next++] = kdtree_latency_top(b);
+        }
+        if (counts[b] > 0){
+            l->max = kdtree_latency_top(b);
+        }
+    }
+    free(sum);
+}
+
+void kdtree_latency_reset(void){
+    pthread_mutex_lock(&kdtree_latency_lock);
+    kdtree_latency_sum(kdtree_latency_base);
+    pthread_mutex_unlock(&kdtree_latency_lock);
+}
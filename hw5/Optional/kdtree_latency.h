@@ -0,0 +1,38 @@
+#ifndef __KDTREE_LATENCY_H__
+#define __KDTREE_LATENCY_H__
+
+#include <stdint.h>
+
+#include "kdtree.h"
+
+/**
+ * The recording side of kdtree_latency_read.  Each thread that records
+ * gets a histogram of its own the first time it does, with a bucket for
+ * every operation and latency, that only it writes.  Readers add up the
+ * histograms of the threads that are still running and of those that
+ * have exited, whose counts are folded into one histogram as they exit.
+ * A reset remembers the counts so far rather than clearing histograms
+ * that other threads are writing, and later reads subtract them.
+ */
+
+
+/**
+ * Starts timing an operation if recording is on.
+ *
+ * @return a start time to pass to kdtree_latency_stop, or 0 if recording
+ * is off
+ */
+uint64_t kdtree_latency_start(void);
+
+
+/**
+ * Records an operation started by kdtree_latency_start in the calling
+ * thread's histogram.  There is no effect if start is 0 or memory for
+ * the histogram could not be allocated.
+ *
+ * @param op the operation
+ * @param start the value kdtree_latency_start returned
+ */
+void kdtree_latency_stop(kdtree_operation op, uint64_t start);
+
+#endif
@@ -0,0 +1,335 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "kdtree.h"
+#include "kdtree_internal.h"
+#include "kdtree_managed.h"
+#include "location.h"
+
+//updates still unreplayed when the rebuild stops letting writers in
+#define KDTREE_MANAGED_FINAL_REPLAY 64
+
+//a tree and the number of references to it: one from the handle while it
+//is current, plus one for each query running on it
+typedef struct {
+    kdtree *tree;
+    size_t refs;
+} kdtree_version;
+
+typedef struct {
+    location loc;
+    bool add;  //false for a remove
+} kdtree_logged_update;
+
+struct kdtree_managed{
+    pthread_mutex_t swap_lock;   //held just long enough to take a reference to current
+    kdtree_version *current;
+
+    //everything below is guarded by write_lock
+    pthread_mutex_t write_lock;
+    bool rebuilding;
+    bool worker_joinable;
+    pthread_t worker;
+    bool last_ok;
+    location *snapshot;          //points the rebuild starts from
+    size_t snapshot_count;
+    kdtree_logged_update *log;   //updates made since the snapshot
+    size_t log_count;
+    size_t log_capacity;
+    bool log_failed;             //an update couldn't be logged, so the rebuild is useless
+    size_t rebuild_every;
+    size_t updates_since_rebuild;
+};
+
+static kdtree_version *kdtree_managed_acquire(kdtree_managed *m){
+    pthread_mutex_lock(&m->swap_lock);
+    kdtree_version *v = m->current;
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&m->swap_lock);
+    return v;
+}
+
+static void kdtree_managed_release(kdtree_version *v){
+    if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        kdtree_destroy(v->tree);
+        free(v);
+    }
+}
+
+//makes a tree that queries can read while one thread changes it
+static kdtree_version *kdtree_managed_version(const location *pts, int n){
+    kdtree_version *v = malloc(sizeof(kdtree_version));
+    if (v == NULL){
+        return NULL;
+    }
+    v->tree = kdtree_create(pts, n);
+    v->refs = 1;
+    if (v->tree == NULL || !kdtree_set_concurrency(v->tree, KDTREE_SINGLE_WRITER)){
+        kdtree_destroy(v->tree);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+static void kdtree_managed_replay(kdtree *t, const kdtree_logged_update *log, size_t count){
+    for (size_t i = 0; i < count; i++){
+        if (log[i].add){
+            kdtree_do_add(t, &log[i].loc);
+        } else{
+            kdtree_do_remove(t, &log[i].loc);
+        }
+    }
+}
+
+static void *kdtree_managed_worker(void *arg){
+    kdtree_managed *m = arg;
+    kdtree_version *fresh = kdtree_managed_version(m->snapshot, m->snapshot_count);
+    bool ok = fresh != NULL;
+
+    //catch up on the log in batches while writers carry on, then replay
+    //the last few and swap with writers held off
+    size_t replayed = 0;
+    kdtree_version *old = NULL;
+    while (true){
+        pthread_mutex_lock(&m->write_lock);
+        ok = ok && !m->log_failed;
+        if (!ok || m->log_count - replayed <= KDTREE_MANAGED_FINAL_REPLAY){
+            if (ok){
+                kdtree_managed_replay(fresh->tree, m->log + replayed, m->log_count - replayed);
+                pthread_mutex_lock(&m->swap_lock);
+                old = m->current;
+                m->current = fresh;
+                pthread_mutex_unlock(&m->swap_lock);
+            }
+            free(m->snapshot);
+            m->snapshot = NULL;
+            m->log_count = 0;
+            m->rebuilding = false;
+            m->last_ok = ok;
+            pthread_mutex_unlock(&m->write_lock);
+            break;
+        }
+
+        //the log may move as it grows, so copy the batch out
+        size_t end = m->log_count;
+        kdtree_logged_update *batch = malloc(sizeof(kdtree_logged_update) * (end - replayed));
+        if (batch != NULL){
+            memcpy(batch, m->log + replayed, sizeof(kdtree_logged_update) * (end - replayed));
+        }
+        pthread_mutex_unlock(&m->write_lock);
+        if (batch == NULL){
+            ok = false;
+            continue;
+        }
+        kdtree_managed_replay(fresh->tree, batch, end - replayed);
+        free(batch);
+        replayed = end;
+    }
+
+    if (ok){
+        //queries still running on the old tree keep it alive until they finish
+        kdtree_managed_release(old);
+    } else if (fresh != NULL){
+        kdtree_managed_release(fresh);
+    }
+    return NULL;
+}
+
+//starts a rebuild; write_lock must be held
+static bool kdtree_managed_start(kdtree_managed *m){
+    if (m->rebuilding){
+        return true;
+    }
+    if (m->worker_joinable){
+        //the last rebuild is done with the lock, so this doesn't wait long
+        pthread_join(m->worker, NULL);
+        m->worker_joinable = false;
+    }
+
+    //writers are held off, so the tree doesn't change while it's copied
+    m->snapshot = kdtree_points(m->current->tree, &m->snapshot_count);
+    if (m->snapshot == NULL){
+        return false;
+    }
+
+    m->log_count = 0;
+    m->log_failed = false;
+    m->updates_since_rebuild = 0;
+    if (pthread_create(&m->worker, NULL, kdtree_managed_worker, m) != 0){
+        free(m->snapshot);
+        m->snapshot = NULL;
+        return false;
+    }
+    m->rebuilding = true;
+    m->worker_joinable = true;
+    return true;
+}
+
+//logs an update for the running rebuild, if any, and starts a rebuild if
+//one is due; write_lock must be held
+static void kdtree_managed_record(kdtree_managed *m, const location *p, bool add){
+    if (m->rebuilding && !m->log_failed){
+        if (m->log_count == m->log_capacity){
+            size_t capacity = m->log_capacity == 0 ? 256 : m->log_capacity * 2;
+            kdtree_logged_update *bigger = realloc(m->log, sizeof(kdtree_logged_update) * capacity);
+            if (bigger == NULL){
+                m->log_failed = true;
+                return;
+            }
+            m->log = bigger;
+            m->log_capacity = capacity;
+        }
+        m->log[m->log_count].loc = *p;
+        m->log[m->log_count].add = add;
+        m->log_count++;
+    }
+
+    m->updates_since_rebuild++;
+    if (m->rebuild_every > 0 && m->updates_since_rebuild >= m->rebuild_every){
+        kdtree_managed_start(m);
+    }
+}
+
+kdtree_managed *kdtree_managed_create(const location *pts, int n){
+    kdtree_managed *m = malloc(sizeof(kdtree_managed));
+    if (m == NULL){
+        return NULL;
+    }
+    m->current = kdtree_managed_version(pts, n);
+    if (m->current == NULL){
+        free(m);
+        return NULL;
+    }
+    pthread_mutex_init(&m->swap_lock, NULL);
+    pthread_mutex_init(&m->write_lock, NULL);
+    m->rebuilding = false;
+    m->worker_joinable = false;
+    m->last_ok = true;
+    m->snapshot = NULL;
+    m->snapshot_count = 0;
+    m->log = NULL;
+    m->log_count = 0;
+    m->log_capacity = 0;
+    m->log_failed = false;
+    m->rebuild_every = 0;
+    m->updates_since_rebuild = 0;
+    return m;
+}
+
+bool kdtree_managed_add(kdtree_managed *m, const location *p){
+    if (m == NULL || p == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&m->write_lock);
+    bool added = kdtree_add(m->current->tree, p);
+    if (added){
+        kdtree_managed_record(m, p, true);
+    }
+    pthread_mutex_unlock(&m->write_lock);
+    return added;
+}
+
+void kdtree_managed_remove(kdtree_managed *m, const location *p){
+    if (m == NULL || p == NULL){
+        return;
+    }
+    pthread_mutex_lock(&m->write_lock);
+    size_t before = kdtree_size(m->current->tree);
+    kdtree_remove(m->current->tree, p);
+    if (kdtree_size(m->current->tree) != before){
+        kdtree_managed_record(m, p, false);
+    }
+    pthread_mutex_unlock(&m->write_lock);
+}
+
+bool kdtree_managed_contains(kdtree_managed *m, const location *p){
+    if (m == NULL || p == NULL){
+        return false;
+    }
+    kdtree_version *v = kdtree_managed_acquire(m);
+    bool found = kdtree_contains(v->tree, p);
+    kdtree_managed_release(v);
+    return found;
+}
+
+location *kdtree_managed_range(kdtree_managed *m, const location *sw, const location *ne, int *n){
+    if (m == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    kdtree_version *v = kdtree_managed_acquire(m);
+    location *pts = kdtree_range(v->tree, sw, ne, n);
+    kdtree_managed_release(v);
+    return pts;
+}
+
+void kdtree_managed_range_for_each(kdtree_managed *m, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
+    if (m == NULL || sw == NULL || ne == NULL || f == NULL){
+        return;
+    }
+    kdtree_version *v = kdtree_managed_acquire(m);
+    kdtree_range_for_each(v->tree, sw, ne, f, arg);
+    kdtree_managed_release(v);
+}
+
+size_t kdtree_managed_size(kdtree_managed *m){
+    if (m == NULL){
+        return 0;
+    }
+    kdtree_version *v = kdtree_managed_acquire(m);
+    size_t size = kdtree_size(v->tree);
+    kdtree_managed_release(v);
+    return size;
+}
+
+bool kdtree_managed_rebuild(kdtree_managed *m){
+    if (m == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&m->write_lock);
+    bool started = kdtree_managed_start(m);
+    pthread_mutex_unlock(&m->write_lock);
+    return started;
+}
+
+void kdtree_managed_set_rebuild_every(kdtree_managed *m, size_t updates){
+    if (m == NULL){
+        return;
+    }
+    pthread_mutex_lock(&m->write_lock);
+    m->rebuild_every = updates;
+    pthread_mutex_unlock(&m->write_lock);
+}
+
+bool kdtree_managed_wait(kdtree_managed *m){
+    if (m == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&m->write_lock);
+    bool joinable = m->worker_joinable;
+    pthread_t worker = m->worker;
+    m->worker_joinable = false;
+    pthread_mutex_unlock(&m->write_lock);
+    if (joinable){
+        pthread_join(worker, NULL);
+    }
+
+    pthread_mutex_lock(&m->write_lock);
+    bool ok = m->last_ok;
+    pthread_mutex_unlock(&m->write_lock);
+    return ok;
+}
+
+void kdtree_managed_destroy(kdtree_managed *m){
+    if (m == NULL){
+        return;
+    }
+    kdtree_managed_wait(m);
+    kdtree_managed_release(m->current);
+    pthread_mutex_destroy(&m->swap_lock);
+    pthread_mutex_destroy(&m->write_lock);
+    free(m->log);
+    free(m);
+}
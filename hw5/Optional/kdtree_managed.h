@@ -0,0 +1,146 @@
+#ifndef __KDTREE_MANAGED_H__
+#define __KDTREE_MANAGED_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "location.h"
+
+/**
+ * A handle to a kdtree that can be rebalanced without stopping service.
+ * A rebuild copies the current points and builds a balanced tree from
+ * them on a background thread.  Adds and removes made in the meantime go
+ * to the current tree and are also logged, and the log is replayed onto
+ * the new tree before the handle switches to it.  Queries that started
+ * on the old tree finish on it; it is destroyed when the last of them
+ * is done.
+ *
+ * Queries may be called from any number of threads at once and never
+ * wait for adds, removes or rebuilds.  Adds, removes and rebuilds may
+ * also be called from any thread, but are done one at a time.
+ */
+typedef struct kdtree_managed kdtree_managed;
+
+
+/**
+ * Creates a handle to a balanced tree containing copies of the given
+ * points.
+ *
+ * @param pts an array of valid locations; NULL is allowed if n = 0
+ * @param n the number of points in that array
+ * @return a pointer to the new handle, or NULL if memory could not be
+ * allocated
+ */
+kdtree_managed *kdtree_managed_create(const location *pts, int n);
+
+
+/**
+ * Adds a copy of the given point.  There is no effect if the point is
+ * already there.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the point was added
+ */
+bool kdtree_managed_add(kdtree_managed *m, const location *p);
+
+
+/**
+ * Removes the given point.  There is no effect if it is not there.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ */
+void kdtree_managed_remove(kdtree_managed *m, const location *p);
+
+
+/**
+ * Determines if there is a point with the same coordinates as the given
+ * point.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if and only if the point is there
+ */
+bool kdtree_managed_contains(kdtree_managed *m, const location *p);
+
+
+/**
+ * Returns a dynamically allocated array of the points in or on the
+ * borders of the given rectangle, as for kdtree_range.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param n a pointer to an integer, non-NULL
+ * @return a pointer to an array containing the points in the range, or NULL
+ */
+location *kdtree_managed_range(kdtree_managed *m, const location *sw, const location *ne, int *n);
+
+
+/**
+ * Passes the points in or on the borders of the given rectangle to the
+ * given function, as for kdtree_range_for_each.  The function must not
+ * change the handle.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param f a pointer to a function that takes a location and
+ * the extra argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to f
+ */
+void kdtree_managed_range_for_each(kdtree_managed *m, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg);
+
+
+/**
+ * Returns the number of points.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ */
+size_t kdtree_managed_size(kdtree_managed *m);
+
+
+/**
+ * Starts rebuilding the tree in the background.  There is no effect if a
+ * rebuild is already running.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @return true if a rebuild is running, false if one could not be
+ * started for lack of memory or threads
+ */
+bool kdtree_managed_rebuild(kdtree_managed *m);
+
+
+/**
+ * Makes the handle start a rebuild by itself after every given number of
+ * successful adds and removes.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @param updates the number of updates between rebuilds, or 0 to only
+ * rebuild when kdtree_managed_rebuild is called
+ */
+void kdtree_managed_set_rebuild_every(kdtree_managed *m, size_t updates);
+
+
+/**
+ * Waits for the running rebuild, if any, to finish.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ * @return true if the last rebuild succeeded, false if it ran out of
+ * memory and was abandoned (the old tree is still in use)
+ */
+bool kdtree_managed_wait(kdtree_managed *m);
+
+
+/**
+ * Waits for any running rebuild and destroys the handle and its tree.
+ * No other thread may be using the handle.
+ *
+ * @param m a pointer to a valid handle, non-NULL
+ */
+void kdtree_managed_destroy(kdtree_managed *m);
+
+#endif
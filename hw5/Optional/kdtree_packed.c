@@ -0,0 +1,558 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "kdtree_internal.h"
+#include "kdtree_packed.h"
+#include "location.h"
+
+// kids values at or above this are blocks rather than splits
+#define KDP_BLOCK 0x80000000u
+// zero bytes after the last block, so a read of 8 bytes never runs off
+#define KDP_PAD 8
+
+typedef struct {
+    uint32_t key[2];  // grid steps east of -180 and north of -90; dimension 0 is longitude as in kdtree_helpers.h
+} kdp_point;
+
+typedef struct {
+    uint32_t left_max;   // largest coordinate in the cutting dimension on the left
+    uint32_t right_min;  // smallest on the right
+    uint32_t kids[2];    // index of a split, or KDP_BLOCK plus the index of a block
+} kdp_split;
+
+typedef struct _kdtree_packed{
+    unsigned char *bits;  // the blocks back to back, then KDP_PAD zero bytes
+    uint64_t *blocks;     // bit offset of each block in bits
+    kdp_split *splits;
+    size_t bytes;
+    size_t block_count;
+    size_t split_count;
+    uint32_t root;        // a kids value; meaningless when empty
+    size_t tree_size;
+    uint32_t steps;
+} kdtree_packed;
+
+//the grid area a query covers, wide by a step either way so rounding
+//never loses a point; points are then checked exactly
+typedef struct {
+    const kdtree_packed *p;
+    const location *sw;
+    const location *ne;
+    int64_t low[2];
+    int64_t high[2];
+    int64_t inner_low[2];   // far enough inside the query that rounding can't
+    int64_t inner_high[2];  // put a point outside it
+    void (*f)(const location *, void *);
+    void *arg;
+} kdp_query;
+
+static uint64_t kdp_load64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static void kdp_store64(unsigned char *p, uint64_t v){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+//reads n <= 32 bits at *pos, lowest first, and moves past them
+static uint32_t kdp_get(const unsigned char *bits, uint64_t *pos, int n){
+    uint64_t word = kdp_load64(bits + (*pos >> 3)) >> (*pos & 7);
+    *pos += n;
+    return word & (((uint64_t)1 << n) - 1);
+}
+
+//reads a run of ones ended by a zero and returns its length
+static uint64_t kdp_get_unary(const unsigned char *bits, uint64_t *pos){
+    uint64_t q = 0;
+    while (true){
+        //at least 57 bits of the word are real, and a run longer than
+        //that carries on into the next word
+        uint64_t word = kdp_load64(bits + (*pos >> 3)) >> (*pos & 7);
+        int ones = __builtin_ctzll(~word);
+        if (ones < 57){
+            *pos += ones + 1;
+            return q + ones;
+        }
+        *pos += 57;
+        q += 57;
+    }
+}
+
+static bool kdp_quantize(uint32_t steps, double v, double offset, uint32_t *key){
+    double scaled = round(v * steps) + offset * steps;
+    if (!(scaled >= 0.0 && scaled <= 360.0 * steps)){
+        return false;
+    }
+    *key = (uint32_t)scaled;
+    return true;
+}
+
+static double kdp_dequantize(uint32_t steps, uint32_t key, double offset){
+    return ((int64_t)key - (int64_t)(offset * steps)) / (double)steps;
+}
+
+static bool kdp_less(const kdp_point *a, const kdp_point *b, int d){
+    if (a->key[d] != b->key[d]){
+        return a->key[d] < b->key[d];
+    }
+    return a->key[1 - d] < b->key[1 - d];
+}
+
+static int kdp_compare(const void *a, const void *b){
+    const kdp_point *pa = a;
+    const kdp_point *pb = b;
+    return kdp_less(pa, pb, 0) ? -1 : (kdp_less(pb, pa, 0) ? 1 : 0);
+}
+
+//puts the point that sorts k-th by dimension d, then the other, at a[k],
+//with those before it in front; the points are distinct, so there are no
+//ties to degrade on
+static void kdp_select(kdp_point *a, size_t n, size_t k, int d){
+    size_t lo = 0;
+    size_t hi = n - 1;
+    while (lo < hi){
+        //median of three pivot, moved to hi
+        size_t mid = lo + (hi - lo) / 2;
+        if (kdp_less(&a[mid], &a[lo], d)){
+            kdp_point tmp = a[mid]; a[mid] = a[lo]; a[lo] = tmp;
+        }
+        if (kdp_less(&a[hi], &a[lo], d)){
+            kdp_point tmp = a[hi]; a[hi] = a[lo]; a[lo] = tmp;
+        }
+        if (kdp_less(&a[mid], &a[hi], d)){
+            kdp_point tmp = a[mid]; a[mid] = a[hi]; a[hi] = tmp;
+        }
+        kdp_point pivot = a[hi];
+
+        size_t store = lo;
+        for (size_t i = lo; i < hi; i++){
+            if (kdp_less(&a[i], &pivot, d)){
+                kdp_point tmp = a[i]; a[i] = a[store]; a[store] = tmp;
+                store++;
+            }
+        }
+        kdp_point tmp = a[hi]; a[hi] = a[store]; a[store] = tmp;
+
+        if (store == k){
+            return;
+        } else if (store < k){
+            lo = store + 1;
+        } else{
+            hi = store - 1;
+        }
+    }
+}
+
+//the arrays being filled in by kdtree_packed_create
+typedef struct {
+    kdtree_packed *p;
+    size_t bits_capacity;   // bytes
+    size_t block_capacity;
+    size_t split_capacity;
+    uint64_t pos;           // bits written
+    bool failed;
+} kdp_builder;
+
+//writes the low n <= 32 bits of v
+static void kdp_put(kdp_builder *b, uint64_t v, int n){
+    size_t need = (b->pos >> 3) + KDP_PAD + 8;
+    if (need > b->bits_capacity){
+        size_t capacity = need + need / 2;
+        unsigned char *bigger = realloc(b->p->bits, capacity);
+        if (bigger == NULL){
+            b->failed = true;
+            return;
+        }
+        memset(bigger + b->bits_capacity, 0, capacity - b->bits_capacity);
+        b->p->bits = bigger;
+        b->bits_capacity = capacity;
+    }
+    unsigned char *at = b->p->bits + (b->pos >> 3);
+    kdp_store64(at, kdp_load64(at) | (v & (((uint64_t)1 << n) - 1)) << (b->pos & 7));
+    b->pos += n;
+}
+
+//encodes a block of 1 to KDTREE_PACKED_BLOCK points and returns its kids value
+static uint32_t kdp_write_block(kdp_builder *b, kdp_point *pts, size_t n){
+    kdtree_packed *p = b->p;
+    if (p->block_count == b->block_capacity){
+        size_t capacity = b->block_capacity * 2 + 16;
+        uint64_t *bigger = capacity < KDP_BLOCK ? realloc(p->blocks, sizeof(uint64_t) * capacity) : NULL;
+        if (bigger == NULL){
+            b->failed = true;
+            return 0;
+        }
+        p->blocks = bigger;
+        b->block_capacity = capacity;
+    }
+    p->blocks[p->block_count] = b->pos;
+
+    qsort(pts, n, sizeof(kdp_point), kdp_compare);
+    uint32_t lat_min = pts[0].key[1];
+    uint32_t lat_max = pts[0].key[1];
+    for (size_t i = 1; i < n; i++){
+        lat_min = pts[i].key[1] < lat_min ? pts[i].key[1] : lat_min;
+        lat_max = pts[i].key[1] > lat_max ? pts[i].key[1] : lat_max;
+    }
+    //longitude gaps average span / n, which is what the Rice parameter
+    //should be near; latitudes take however many bits the span needs
+    uint64_t mean = (uint64_t)(pts[n - 1].key[0] - pts[0].key[0]) / n;
+    int k = 0;
+    while (k < 31 && ((uint64_t)2 << k) <= mean){
+        k++;
+    }
+    int width = 0;
+    while (width < 32 && ((uint64_t)1 << width) <= lat_max - lat_min){
+        width++;
+    }
+
+    //the header: lowest longitude and latitude, count - 1, Rice
+    //parameter and latitude width
+    kdp_put(b, pts[0].key[0], 32);
+    kdp_put(b, lat_min, 32);
+    kdp_put(b, n - 1, 8);
+    kdp_put(b, k, 5);
+    kdp_put(b, width, 6);
+    uint32_t prev = pts[0].key[0];
+    for (size_t i = 0; i < n && !b->failed; i++){
+        uint64_t gap = pts[i].key[0] - prev;
+        uint64_t q = gap >> k;
+        for (; q >= 32; q -= 32){
+            kdp_put(b, UINT32_MAX, 32);
+        }
+        //q ones and then the zero that ends them
+        kdp_put(b, ((uint64_t)1 << q) - 1, q + 1);
+        kdp_put(b, gap, k);
+        kdp_put(b, pts[i].key[1] - lat_min, width);
+        prev = pts[i].key[0];
+    }
+    return KDP_BLOCK | p->block_count++;
+}
+
+static uint32_t kdp_build(kdp_builder *b, kdp_point *pts, size_t n, int depth){
+    if (n <= KDTREE_PACKED_BLOCK){
+        return kdp_write_block(b, pts, n);
+    }
+    int d = depth % 2;
+    size_t m = n / 2;
+    kdp_select(pts, n, m, d);
+    uint32_t left_max = 0;
+    for (size_t i = 0; i < m; i++){
+        left_max = pts[i].key[d] > left_max ? pts[i].key[d] : left_max;
+    }
+
+    kdtree_packed *p = b->p;
+    if (p->split_count == b->split_capacity){
+        size_t capacity = b->split_capacity * 2 + 16;
+        kdp_split *bigger = realloc(p->splits, sizeof(kdp_split) * capacity);
+        if (bigger == NULL){
+            b->failed = true;
+            return 0;
+        }
+        p->splits = bigger;
+        b->split_capacity = capacity;
+    }
+    uint32_t s = p->split_count++;
+    p->splits[s].left_max = left_max;
+    p->splits[s].right_min = pts[m].key[d];
+    uint32_t left = kdp_build(b, pts, m, depth + 1);
+    uint32_t right = b->failed ? 0 : kdp_build(b, pts + m, n - m, depth + 1);
+    p->splits[s].kids[0] = left;
+    p->splits[s].kids[1] = right;
+    return s;
+}
+
+//the points kdtree_packed_create collects from the tree
+typedef struct {
+    kdp_point *pts;
+    size_t count;
+    size_t capacity;
+    uint32_t steps;
+    bool failed;
+} kdp_collector;
+
+static void kdp_collect(const location *l, void *arg){
+    kdp_collector *c = arg;
+    if (c->failed){
+        return;
+    }
+    if (c->count == c->capacity){
+        size_t capacity = c->capacity * 2 + 1024;
+        kdp_point *bigger = realloc(c->pts, sizeof(kdp_point) * capacity);
+        if (bigger == NULL){
+            c->failed = true;
+            return;
+        }
+        c->pts = bigger;
+        c->capacity = capacity;
+    }
+    kdp_point *pt = &c->pts[c->count];
+    c->failed = !kdp_quantize(c->steps, l->lon, 180.0, &pt->key[0]) || !kdp_quantize(c->steps, l->lat, 90.0, &pt->key[1]);
+    c->count++;
+}
+
+kdtree_packed *kdtree_packed_create(const kdtree *t, uint32_t steps_per_degree){
+    if (t == NULL || steps_per_degree < 1 || steps_per_degree > KDTREE_PACKED_MAX_STEPS){
+        return NULL;
+    }
+    kdtree_packed *p = malloc(sizeof(kdtree_packed));
+    if (p == NULL){
+        return NULL;
+    }
+    p->bits = NULL;
+    p->blocks = NULL;
+    p->splits = NULL;
+    p->bytes = 0;
+    p->block_count = 0;
+    p->split_count = 0;
+    p->root = 0;
+    p->tree_size = 0;
+    p->steps = steps_per_degree;
+
+    //every point, so one off the grid fails the copy rather than being left out
+    kdp_collector c = {NULL, 0, 0, steps_per_degree, false};
+    kdtree_for_each_point(t, kdp_collect, &c);
+    if (c.failed){
+        free(c.pts);
+        free(p);
+        return NULL;
+    }
+
+    //points that round to the same grid point are one point
+    if (c.count > 0){
+        qsort(c.pts, c.count, sizeof(kdp_point), kdp_compare);
+        size_t kept = 1;
+        for (size_t i = 1; i < c.count; i++){
+            if (kdp_compare(&c.pts[i], &c.pts[kept - 1]) != 0){
+                c.pts[kept++] = c.pts[i];
+            }
+        }
+        c.count = kept;
+    }
+
+    kdp_builder b = {p, 0, 0, 0, 0, false};
+    if (c.count > 0){
+        p->root = kdp_build(&b, c.pts, c.count, 0);
+    }
+    free(c.pts);
+    if (b.failed){
+        kdtree_packed_destroy(p);
+        return NULL;
+    }
+
+    //give back what the arrays grew past
+    if (c.count > 0){
+        p->bytes = (b.pos + 7) / 8 + KDP_PAD;
+        unsigned char *bits = realloc(p->bits, p->bytes);
+        p->bits = bits == NULL ? p->bits : bits;
+        uint64_t *blocks = realloc(p->blocks, sizeof(uint64_t) * p->block_count);
+        p->blocks = blocks == NULL ? p->blocks : blocks;
+    }
+    if (p->split_count > 0){
+        kdp_split *splits = realloc(p->splits, sizeof(kdp_split) * p->split_count);
+        p->splits = splits == NULL ? p->splits : splits;
+    }
+    p->tree_size = c.count;
+    return p;
+}
+
+//decodes a block, passing the points in the query to its function, and
+//stops once past the query's east edge; if the block is known to be
+//inside the query, every point is passed without checking
+static void kdp_scan_block(const kdp_query *q, uint32_t b, bool inside){
+    const kdtree_packed *p = q->p;
+    uint64_t pos = p->blocks[b];
+    uint32_t lon = kdp_get(p->bits, &pos, 32);
+    uint32_t lat_min = kdp_get(p->bits, &pos, 32);
+    size_t n = kdp_get(p->bits, &pos, 8) + 1;
+    int k = kdp_get(p->bits, &pos, 5);
+    int width = kdp_get(p->bits, &pos, 6);
+    for (size_t i = 0; i < n; i++){
+        uint64_t high = kdp_get_unary(p->bits, &pos);
+        lon += (high << k) | kdp_get(p->bits, &pos, k);
+        uint32_t lat = lat_min + kdp_get(p->bits, &pos, width);
+        if (inside){
+            location l = {kdp_dequantize(p->steps, lat, 90.0), kdp_dequantize(p->steps, lon, 180.0)};
+            q->f(&l, q->arg);
+        } else if (lon > q->high[0]){
+            return;
+        } else if (lon >= q->low[0] && lat >= q->low[1] && lat <= q->high[1]){
+            location l = {kdp_dequantize(p->steps, lat, 90.0), kdp_dequantize(p->steps, lon, 180.0)};
+            if (q->sw->lon <= l.lon && q->ne->lon >= l.lon && q->sw->lat <= l.lat && q->ne->lat >= l.lat){
+                q->f(&l, q->arg);
+            }
+        }
+    }
+}
+
+//low and high bound the grid coordinates under the node, as the splits
+//above it say
+static void kdp_range_helper(const kdp_query *q, uint32_t node, int depth, int64_t low[2], int64_t high[2]){
+    if (node >= KDP_BLOCK){
+        bool inside = low[0] >= q->inner_low[0] && high[0] <= q->inner_high[0]
+            && low[1] >= q->inner_low[1] && high[1] <= q->inner_high[1];
+        kdp_scan_block(q, node - KDP_BLOCK, inside);
+        return;
+    }
+    const kdp_split *s = &q->p->splits[node];
+    int d = depth % 2;
+    int64_t bound = high[d];
+    if (q->low[d] <= s->left_max){
+        high[d] = s->left_max;
+        kdp_range_helper(q, s->kids[0], depth + 1, low, high);
+        high[d] = bound;
+    }
+    if (q->high[d] >= s->right_min){
+        bound = low[d];
+        low[d] = s->right_min;
+        kdp_range_helper(q, s->kids[1], depth + 1, low, high);
+        low[d] = bound;
+    }
+}
+
+//sets the grid bounds of a query, or returns false if it misses the grid
+static bool kdp_query_bounds(kdp_query *q){
+    double low[2] = {q->sw->lon, q->sw->lat};
+    double high[2] = {q->ne->lon, q->ne->lat};
+    double offset[2] = {180.0, 90.0};
+    int64_t top = (int64_t)360 * q->p->steps;
+    for (int d = 0; d < 2; d++){
+        double a = floor(low[d] * q->p->steps) - 1.0 + offset[d] * q->p->steps;
+        double b = ceil(high[d] * q->p->steps) + 1.0 + offset[d] * q->p->steps;
+        if (!(b >= 0.0 && a <= top)){
+            return false;
+        }
+        q->low[d] = a < 0.0 ? 0 : (int64_t)a;
+        q->high[d] = b > top ? top : (int64_t)b;
+        q->inner_low[d] = (int64_t)a + 3;
+        q->inner_high[d] = (int64_t)b - 3;
+    }
+    return true;
+}
+
+void kdtree_packed_range_for_each(const kdtree_packed *p, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg){
+    if (p == NULL || sw == NULL || ne == NULL || f == NULL || p->tree_size == 0){
+        return;
+    }
+    kdp_query q = {p, sw, ne, {0, 0}, {0, 0}, {0, 0}, {0, 0}, f, arg};
+    if (kdp_query_bounds(&q)){
+        int64_t low[2] = {0, 0};
+        int64_t high[2] = {(int64_t)360 * p->steps, (int64_t)360 * p->steps};
+        kdp_range_helper(&q, p->root, 0, low, high);
+    }
+}
+
+//a growing array of the points in a range
+typedef struct {
+    location *pts;
+    int count;
+    int capacity;
+    bool failed;
+} kdp_output;
+
+static void kdp_append(const location *l, void *arg){
+    kdp_output *c = arg;
+    if (c->failed){
+        return;
+    }
+    if (c->count == c->capacity){
+        int capacity = c->capacity * 2 + 16;
+        location *bigger = realloc(c->pts, sizeof(location) * capacity);
+        if (bigger == NULL){
+            c->failed = true;
+            return;
+        }
+        c->pts = bigger;
+        c->capacity = capacity;
+    }
+    c->pts[c->count++] = *l;
+}
+
+location *kdtree_packed_range(const kdtree_packed *p, const location *sw, const location *ne, int *n){
+    if (p == NULL || sw == NULL || ne == NULL || n == NULL){
+        return NULL;
+    }
+    kdp_output c = {NULL, 0, 0, false};
+    kdtree_packed_range_for_each(p, sw, ne, kdp_append, &c);
+
+    if (c.failed){
+        free(c.pts);
+        *n = 0;
+        return NULL;
+    }
+    *n = c.count;
+    return c.pts;
+}
+
+//looks for a grid point in a block, stopping once past its longitude
+static bool kdp_block_contains(const kdtree_packed *p, uint32_t b, const kdp_point *key){
+    uint64_t pos = p->blocks[b];
+    uint32_t lon = kdp_get(p->bits, &pos, 32);
+    uint32_t lat_min = kdp_get(p->bits, &pos, 32);
+    size_t n = kdp_get(p->bits, &pos, 8) + 1;
+    int k = kdp_get(p->bits, &pos, 5);
+    int width = kdp_get(p->bits, &pos, 6);
+    for (size_t i = 0; i < n; i++){
+        uint64_t high = kdp_get_unary(p->bits, &pos);
+        lon += (high << k) | kdp_get(p->bits, &pos, k);
+        if (lon > key->key[0]){
+            return false;
+        }
+        uint32_t lat = lat_min + kdp_get(p->bits, &pos, width);
+        if (lon == key->key[0] && lat == key->key[1]){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool kdp_contains_helper(const kdtree_packed *p, uint32_t node, const kdp_point *key, int depth){
+    if (node >= KDP_BLOCK){
+        return kdp_block_contains(p, node - KDP_BLOCK, key);
+    }
+    //a coordinate equal to both bounds may be on either side
+    const kdp_split *s = &p->splits[node];
+    int d = depth % 2;
+    return (key->key[d] <= s->left_max && kdp_contains_helper(p, s->kids[0], key, depth + 1))
+        || (key->key[d] >= s->right_min && kdp_contains_helper(p, s->kids[1], key, depth + 1));
+}
+
+bool kdtree_packed_contains(const kdtree_packed *p, const location *l){
+    kdp_point key;
+    if (p == NULL || l == NULL || p->tree_size == 0
+        || !kdp_quantize(p->steps, l->lon, 180.0, &key.key[0]) || !kdp_quantize(p->steps, l->lat, 90.0, &key.key[1])){
+        return false;
+    }
+    return kdp_contains_helper(p, p->root, &key, 0);
+}
+
+size_t kdtree_packed_size(const kdtree_packed *p){
+    return p == NULL ? 0 : p->tree_size;
+}
+
+size_t kdtree_packed_memory(const kdtree_packed *p){
+    if (p == NULL){
+        return 0;
+    }
+    return sizeof(kdtree_packed) + p->bytes + sizeof(uint64_t) * p->block_count + sizeof(kdp_split) * p->split_count;
+}
+
+void kdtree_packed_destroy(kdtree_packed *p){
+    if (p == NULL){
+        return;
+    }
+    free(p->bits);
+    free(p->blocks);
+    free(p->splits);
+    free(p);
+}
@@ -0,0 +1,117 @@
+#ifndef __KDTREE_PACKED_H__
+#define __KDTREE_PACKED_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * A read-only copy of a tree compressed for keeping around cold.
+ *
+ * Coordinates are rounded to a grid of a given number of steps per
+ * degree and the points split at medians, alternating longitude and
+ * latitude as in kdtree, until no more than KDTREE_PACKED_BLOCK points
+ * are left in a part.  Each part is a block of bits: the block's lowest
+ * longitude and latitude on the grid, then its points in order of
+ * longitude, each as the gap from the previous longitude in a Rice code
+ * and the distance from the lowest latitude in as few bits as the
+ * block's span needs.  The splits above the blocks keep the largest
+ * coordinate on their left and the smallest on their right, so queries
+ * decode only the blocks whose part of the plane meets the query, and
+ * stop decoding a block once they pass its east edge.
+ *
+ * Two points that round to the same grid point are the same point.
+ * Points come back as their grid points, so coordinates with no more
+ * decimal places than the grid has (for example six with 1000000 steps
+ * per degree, as for KDTREE_COORDS_INT32) come back exactly.
+ */
+typedef struct _kdtree_packed kdtree_packed;
+
+// the most points in a block
+#define KDTREE_PACKED_BLOCK 128
+
+// the most steps per degree, so that 360 degrees of steps fit in 32 bits
+#define KDTREE_PACKED_MAX_STEPS 11930464
+
+
+/**
+ * Creates a compressed copy of the given tree.
+ *
+ * @param t a pointer to a tree that no thread changes during the call,
+ * non-NULL
+ * @param steps_per_degree the grid to round coordinates to, from 1 to
+ * KDTREE_PACKED_MAX_STEPS
+ * @return a pointer to the new copy, or NULL if steps_per_degree is out
+ * of range, a point's longitude is outside -180 to 180 (so it is off the
+ * grid), or memory could not be allocated
+ */
+kdtree_packed *kdtree_packed_create(const kdtree *t, uint32_t steps_per_degree);
+
+
+/**
+ * Determines if the given packed tree contains the grid point nearest the
+ * given point.
+ *
+ * @param p a pointer to a packed tree, non-NULL
+ * @param l a pointer to a valid location, non-NULL
+ * @return true if and only if the tree contains the location
+ */
+bool kdtree_packed_contains(const kdtree_packed *p, const location *l);
+
+
+/**
+ * Returns a dynamically allocated array of the points in the given packed
+ * tree in or on the borders of the given rectangle, as for kdtree_range.
+ *
+ * @param p a pointer to a packed tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param n a pointer to an integer, non-NULL
+ * @return a pointer to an array containing the points in the range, or NULL
+ */
+location *kdtree_packed_range(const kdtree_packed *p, const location *sw, const location *ne, int *n);
+
+
+/**
+ * Passes the points in the given packed tree in or on the borders of the
+ * given rectangle to the given function, as for kdtree_range_for_each.
+ *
+ * @param p a pointer to a packed tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param f a pointer to a function that takes a location and
+ * the extra argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to f
+ */
+void kdtree_packed_range_for_each(const kdtree_packed *p, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg);
+
+
+/**
+ * Returns the number of points in the given packed tree.
+ *
+ * @param p a pointer to a packed tree, non-NULL
+ */
+size_t kdtree_packed_size(const kdtree_packed *p);
+
+
+/**
+ * Returns the number of bytes of memory used by the given packed tree.
+ *
+ * @param p a pointer to a packed tree, non-NULL
+ */
+size_t kdtree_packed_memory(const kdtree_packed *p);
+
+
+/**
+ * Destroys the given packed tree.
+ *
+ * @param p a pointer to a packed tree, or NULL
+ */
+void kdtree_packed_destroy(kdtree_packed *p);
+
+#endif
@@ -0,0 +1,489 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "kdtree_paged.h"
+#include "kdtree_file.h"
+
+#define KDTREE_PAGED_CHECKED_SIZE 40
+
+static const char kdtree_paged_magic[8] = {'K', 'D', 'T', 'P', 'A', 'G', 'E', 'D'};
+
+struct kdtree_paged{
+    int fd;
+    uint64_t page_count;
+    uint64_t root;
+    uint64_t points;
+    pthread_mutex_t lock;       //guards everything below
+    size_t frames;
+    unsigned char *data;        //frames pages
+    uint64_t *frame_page;       //the page in each frame, or 0 if it is empty
+    bool *referenced;           //CLOCK bits: used since the hand last passed
+    size_t hand;
+    size_t *slots;              //open-addressed map from page to frame + 1, or 0
+    size_t mask;
+    kdtree_io_stats totals;
+};
+
+//pages being written front to back
+typedef struct {
+    FILE *out;
+    uint64_t pages;    //pages written, counting the superblock
+    bool ok;
+} kdtree_paged_builder;
+
+static void kdtree_paged_put32(unsigned char *p, uint32_t v){
+    for (int i = 0; i < 4; i++){
+        p[i] = v >> (8 * i);
+    }
+}
+
+static uint32_t kdtree_paged_get32(const unsigned char *p){
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void kdtree_paged_put_double(unsigned char *p, double d){
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    kdtree_file_put64(p, bits);
+}
+
+static double kdtree_paged_get_double(const unsigned char *p){
+    uint64_t bits = kdtree_file_get64(p);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static double kdtree_paged_coord(const location *l, int dim){
+    return dim == 0 ? l->lon : l->lat;
+}
+
+static uint64_t kdtree_paged_checksum(const unsigned char *superblock){
+    uint64_t h = KDTREE_FILE_CHECKSUM_START;
+    for (size_t i = 0; i < KDTREE_PAGED_CHECKED_SIZE; i += 8){
+        h = kdtree_file_checksum(h, kdtree_file_get64(superblock + i));
+    }
+    return h;
+}
+
+//appends a page; returns its number
+static uint64_t kdtree_paged_write(kdtree_paged_builder *b, const unsigned char *page){
+    b->ok = b->ok && fwrite(page, 1, KDTREE_PAGE_SIZE, b->out) == KDTREE_PAGE_SIZE;
+    return b->pages++;
+}
+
+static uint64_t kdtree_paged_build(kdtree_paged_builder *b, location *pts, size_t n, int depth);
+
+//fills in split i, at the given level of a split page whose first level
+//is at the given depth, and the pages below it
+static void kdtree_paged_fill(kdtree_paged_builder *b, unsigned char *page, int levels, size_t i, int level, location *pts, size_t n, int depth){
+    size_t splits = ((size_t)1 << levels) - 1;
+    if (level == levels){
+        uint64_t child = n == 0 ? 0 : kdtree_paged_build(b, pts, n, depth + levels);
+        kdtree_file_put64(page + 8 + 8 * splits + 8 * (i - splits), child);
+        return;
+    }
+
+    int dim = (depth + level) % 2;
+    size_t median = 0;
+    double split = 0.0;
+    if (n > 0){
+        if (dim == 0){
+            qsort(pts, n, sizeof(location), (int (*)(const void *, const void *)) location_compare_longitude);
+        } else{
+            qsort(pts, n, sizeof(location), (int (*)(const void *, const void *)) location_compare_latitude);
+        }
+        //points equal to the split go right, so split at the first of them
+        median = n / 2;
+        while (median > 0 && kdtree_paged_coord(&pts[median - 1], dim) == kdtree_paged_coord(&pts[median], dim)){
+            median--;
+        }
+        if (median == 0){
+            //the smallest value is tied across the middle; split after the
+            //ties instead, so they go left and the right side still shrinks
+            double tied = kdtree_paged_coord(&pts[0], dim);
+            while (median < n && kdtree_paged_coord(&pts[median], dim) == tied){
+                median++;
+            }
+            split = median < n ? kdtree_paged_coord(&pts[median], dim) : nextafter(tied, INFINITY);
+        } else{
+            split = kdtree_paged_coord(&pts[median], dim);
+        }
+    }
+    kdtree_paged_put_double(page + 8 + 8 * i, split);
+    kdtree_paged_fill(b, page, levels, 2 * i + 1, level + 1, pts, median, depth);
+    kdtree_paged_fill(b, page, levels, 2 * i + 2, level + 1, pts + median, n - median, depth);
+}
+
+//writes the pages for the given points, whose first split is at the
+//given depth; returns the number of the top page
+static uint64_t kdtree_paged_build(kdtree_paged_builder *b, location *pts, size_t n, int depth){
+    unsigned char *page = calloc(1, KDTREE_PAGE_SIZE);
+    if (page == NULL){
+        b->ok = false;
+        return 0;
+    }
+    if (n <= KDTREE_PAGE_LEAF_MAX){
+        page[0] = KDTREE_PAGE_LEAF;
+        kdtree_paged_put32(page + 4, n);
+        for (size_t i = 0; i < n; i++){
+            kdtree_paged_put_double(page + 8 + 16 * i, pts[i].lon);
+            kdtree_paged_put_double(page + 16 + 16 * i, pts[i].lat);
+        }
+    } else{
+        //as few levels as leave about a leaf's worth in each child
+        int levels = 1;
+        while (levels < KDTREE_PAGE_LEVELS_MAX && (n >> levels) > KDTREE_PAGE_LEAF_MAX){
+            levels++;
+        }
+        page[0] = KDTREE_PAGE_SPLIT;
+        page[1] = levels;
+        page[2] = depth % 2;
+        kdtree_paged_put32(page + 4, 1u << levels);
+        kdtree_paged_fill(b, page, levels, 0, 0, pts, n, depth);
+    }
+    uint64_t number = kdtree_paged_write(b, page);
+    free(page);
+    return number;
+}
+
+bool kdtree_paged_save(location *pts, size_t n, const char *path){
+    if (path == NULL || (pts == NULL && n > 0)){
+        return false;
+    }
+    char *tmp = malloc(strlen(path) + 5);
+    if (tmp == NULL){
+        return false;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    kdtree_paged_builder b = {fopen(tmp, "wb"), 0, true};
+    if (b.out == NULL){
+        free(tmp);
+        return false;
+    }
+
+    //the superblock goes in last, once the root and page count are known
+    unsigned char superblock[KDTREE_PAGE_SIZE] = {0};
+    kdtree_paged_write(&b, superblock);
+    uint64_t root = n > 0 ? kdtree_paged_build(&b, pts, n, 0) : 0;
+
+    memcpy(superblock, kdtree_paged_magic, sizeof(kdtree_paged_magic));
+    kdtree_paged_put32(superblock + 8, KDTREE_PAGED_VERSION);
+    kdtree_paged_put32(superblock + 12, KDTREE_PAGE_SIZE);
+    kdtree_file_put64(superblock + 16, b.pages);
+    kdtree_file_put64(superblock + 24, root);
+    kdtree_file_put64(superblock + 32, n);
+    kdtree_file_put64(superblock + 40, kdtree_paged_checksum(superblock));
+    bool ok = b.ok && fseek(b.out, 0, SEEK_SET) == 0 && fwrite(superblock, 1, KDTREE_PAGE_SIZE, b.out) == KDTREE_PAGE_SIZE;
+    ok = ok && fflush(b.out) == 0 && fsync(fileno(b.out)) == 0;
+    ok = fclose(b.out) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok){
+        remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+static bool kdtree_paged_read(int fd, unsigned char *buf, size_t n, uint64_t offset){
+    while (n > 0){
+        ssize_t done = pread(fd, buf, n, offset);
+        if (done < 0 && errno == EINTR){
+            continue;
+        }
+        if (done <= 0){
+            return false;
+        }
+        buf += done;
+        n -= done;
+        offset += done;
+    }
+    return true;
+}
+
+kdtree_paged *kdtree_paged_open(const char *path, size_t cache_pages){
+    if (path == NULL || cache_pages == 0){
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    unsigned char superblock[KDTREE_PAGED_CHECKED_SIZE + 8];
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !kdtree_paged_read(fd, superblock, sizeof(superblock), 0)
+        || memcmp(superblock, kdtree_paged_magic, sizeof(kdtree_paged_magic)) != 0
+        || kdtree_paged_get32(superblock + 8) != KDTREE_PAGED_VERSION
+        || kdtree_paged_get32(superblock + 12) != KDTREE_PAGE_SIZE
+        || kdtree_file_get64(superblock + 40) != kdtree_paged_checksum(superblock)){
+        close(fd);
+        return NULL;
+    }
+    uint64_t page_count = kdtree_file_get64(superblock + 16);
+    uint64_t root = kdtree_file_get64(superblock + 24);
+    uint64_t points = kdtree_file_get64(superblock + 32);
+    if (page_count == 0 || page_count > (uint64_t)st.st_size / KDTREE_PAGE_SIZE
+        || (uint64_t)st.st_size != page_count * KDTREE_PAGE_SIZE
+        || root >= page_count || (root == 0) != (points == 0)){
+        close(fd);
+        return NULL;
+    }
+
+    size_t table = 2;
+    while (table < 2 * cache_pages){
+        table *= 2;
+    }
+    kdtree_paged *p = malloc(sizeof(kdtree_paged));
+    unsigned char *data = malloc(KDTREE_PAGE_SIZE * cache_pages);
+    uint64_t *frame_page = calloc(cache_pages, sizeof(uint64_t));
+    bool *referenced = calloc(cache_pages, sizeof(bool));
+    size_t *slots = calloc(table, sizeof(size_t));
+    if (p == NULL || data == NULL || frame_page == NULL || referenced == NULL || slots == NULL
+        || pthread_mutex_init(&p->lock, NULL) != 0){
+        free(p);
+        free(data);
+        free(frame_page);
+        free(referenced);
+        free(slots);
+        close(fd);
+        return NULL;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    p->fd = fd;
+    p->page_count = page_count;
+    p->root = root;
+    p->points = points;
+    p->frames = cache_pages;
+    p->data = data;
+    p->frame_page = frame_page;
+    p->referenced = referenced;
+    p->hand = 0;
+    p->slots = slots;
+    p->mask = table - 1;
+    p->totals = (kdtree_io_stats){0, 0};
+    return p;
+}
+
+size_t kdtree_paged_size(const kdtree_paged *p){
+    return p == NULL ? 0 : p->points;
+}
+
+static size_t kdtree_paged_hash(const kdtree_paged *p, uint64_t number){
+    return (size_t)((number * 0x9e3779b97f4a7c15ull) >> 32) & p->mask;
+}
+
+//the slot holding the given page, or the free slot where it would go
+static size_t kdtree_paged_find(const kdtree_paged *p, uint64_t number){
+    size_t i = kdtree_paged_hash(p, number);
+    while (p->slots[i] != 0 && p->frame_page[p->slots[i] - 1] != number){
+        i = (i + 1) & p->mask;
+    }
+    return i;
+}
+
+//takes the given cached page out of the map, moving later entries of
+//the probe sequence back so that lookups still find them
+static void kdtree_paged_forget(kdtree_paged *p, uint64_t number){
+    size_t i = kdtree_paged_find(p, number);
+    p->slots[i] = 0;
+    for (size_t j = (i + 1) & p->mask; p->slots[j] != 0; j = (j + 1) & p->mask){
+        size_t home = kdtree_paged_hash(p, p->frame_page[p->slots[j] - 1]);
+        //the entry at j can move to i unless its home is cyclically in (i, j]
+        bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays){
+            p->slots[i] = p->slots[j];
+            p->slots[j] = 0;
+            i = j;
+        }
+    }
+}
+
+//picks a frame to reuse: the first the hand finds that hasn't been used
+//since it last passed, clearing the bits of those that have
+static size_t kdtree_paged_victim(kdtree_paged *p){
+    while (p->referenced[p->hand]){
+        p->referenced[p->hand] = false;
+        p->hand = (p->hand + 1) % p->frames;
+    }
+    size_t frame = p->hand;
+    p->hand = (p->hand + 1) % p->frames;
+    return frame;
+}
+
+//checks everything about a page that queries rely on
+static bool kdtree_paged_valid(const unsigned char *page, uint64_t number){
+    if (page[0] == KDTREE_PAGE_LEAF){
+        return kdtree_paged_get32(page + 4) <= KDTREE_PAGE_LEAF_MAX;
+    }
+    if (page[0] != KDTREE_PAGE_SPLIT || page[1] < 1 || page[1] > KDTREE_PAGE_LEVELS_MAX || page[2] > 1){
+        return false;
+    }
+    size_t splits = ((size_t)1 << page[1]) - 1;
+    for (size_t i = 0; i <= splits; i++){
+        if (kdtree_file_get64(page + 8 + 8 * splits + 8 * i) >= number){
+            return false;
+        }
+    }
+    return true;
+}
+
+//copies the given page into buf, from the cache or from disk; false if
+//it can't be read or fails its checks
+static bool kdtree_paged_fetch(kdtree_paged *p, uint64_t number, unsigned char *buf, kdtree_io_stats *io){
+    if (number == 0 || number >= p->page_count){
+        return false;
+    }
+    pthread_mutex_lock(&p->lock);
+    size_t slot = kdtree_paged_find(p, number);
+    if (p->slots[slot] != 0){
+        size_t frame = p->slots[slot] - 1;
+        p->referenced[frame] = true;
+        memcpy(buf, p->data + frame * KDTREE_PAGE_SIZE, KDTREE_PAGE_SIZE);
+        p->totals.pages++;
+        pthread_mutex_unlock(&p->lock);
+        io->pages++;
+        return true;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    //read without the lock, so that hits in other threads don't wait
+    if (!kdtree_paged_read(p->fd, buf, KDTREE_PAGE_SIZE, number * KDTREE_PAGE_SIZE) || !kdtree_paged_valid(buf, number)){
+        return false;
+    }
+    io->pages++;
+    io->reads++;
+    pthread_mutex_lock(&p->lock);
+    p->totals.pages++;
+    p->totals.reads++;
+    //another thread may have read it in the meantime
+    if (p->slots[kdtree_paged_find(p, number)] == 0){
+        size_t frame = kdtree_paged_victim(p);
+        if (p->frame_page[frame] != 0){
+            kdtree_paged_forget(p, p->frame_page[frame]);
+        }
+        memcpy(p->data + frame * KDTREE_PAGE_SIZE, buf, KDTREE_PAGE_SIZE);
+        p->frame_page[frame] = number;
+        p->referenced[frame] = true;
+        p->slots[kdtree_paged_find(p, number)] = frame + 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return true;
+}
+
+bool kdtree_paged_contains(kdtree_paged *p, const location *l, kdtree_io_stats *io){
+    unsigned char page[KDTREE_PAGE_SIZE];
+    uint64_t number = p->root;
+    while (number != 0 && kdtree_paged_fetch(p, number, page, io)){
+        if (page[0] == KDTREE_PAGE_LEAF){
+            uint32_t count = kdtree_paged_get32(page + 4);
+            for (uint32_t i = 0; i < count; i++){
+                if (kdtree_paged_get_double(page + 8 + 16 * i) == l->lon && kdtree_paged_get_double(page + 16 + 16 * i) == l->lat){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        int levels = page[1];
+        size_t splits = ((size_t)1 << levels) - 1;
+        size_t i = 0;
+        for (int level = 0; level < levels; level++){
+            double coord = kdtree_paged_coord(l, (page[2] + level) % 2);
+            i = coord < kdtree_paged_get_double(page + 8 + 8 * i) ? 2 * i + 1 : 2 * i + 2;
+        }
+        number = kdtree_file_get64(page + 8 + 8 * splits + 8 * (i - splits));
+    }
+    return false;
+}
+
+typedef struct {
+    kdtree_paged *p;
+    const location *sw;
+    const location *ne;
+    void (*fn)(const location *, void *);
+    void *arg;
+    kdtree_io_stats *io;
+} kdtree_paged_query;
+
+static void kdtree_paged_range_page(kdtree_paged_query *q, uint64_t number);
+
+//visits the children of split i at the given level that can hold points
+//in the rectangle
+static void kdtree_paged_range_split(kdtree_paged_query *q, const unsigned char *page, size_t i, int level){
+    int levels = page[1];
+    size_t splits = ((size_t)1 << levels) - 1;
+    if (level == levels){
+        uint64_t child = kdtree_file_get64(page + 8 + 8 * splits + 8 * (i - splits));
+        if (child != 0){
+            kdtree_paged_range_page(q, child);
+        }
+        return;
+    }
+    int dim = (page[2] + level) % 2;
+    double split = kdtree_paged_get_double(page + 8 + 8 * i);
+    if (kdtree_paged_coord(q->sw, dim) < split){
+        kdtree_paged_range_split(q, page, 2 * i + 1, level + 1);
+    }
+    if (kdtree_paged_coord(q->ne, dim) >= split){
+        kdtree_paged_range_split(q, page, 2 * i + 2, level + 1);
+    }
+}
+
+static void kdtree_paged_range_page(kdtree_paged_query *q, uint64_t number){
+    unsigned char page[KDTREE_PAGE_SIZE];
+    if (!kdtree_paged_fetch(q->p, number, page, q->io)){
+        return;
+    }
+    if (page[0] == KDTREE_PAGE_SPLIT){
+        kdtree_paged_range_split(q, page, 0, 0);
+        return;
+    }
+    uint32_t count = kdtree_paged_get32(page + 4);
+    for (uint32_t i = 0; i < count; i++){
+        location l;
+        l.lon = kdtree_paged_get_double(page + 8 + 16 * i);
+        l.lat = kdtree_paged_get_double(page + 16 + 16 * i);
+        if (l.lat >= q->sw->lat && l.lat <= q->ne->lat && l.lon >= q->sw->lon && l.lon <= q->ne->lon){
+            q->fn(&l, q->arg);
+        }
+    }
+}
+
+void kdtree_paged_range_for_each(kdtree_paged *p, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg, kdtree_io_stats *io){
+    if (p->root == 0){
+        return;
+    }
+    kdtree_paged_query q = {p, sw, ne, fn, arg, io};
+    kdtree_paged_range_page(&q, p->root);
+}
+
+size_t kdtree_paged_memory(const kdtree_paged *p){
+    return sizeof(kdtree_paged) + p->frames * (KDTREE_PAGE_SIZE + sizeof(uint64_t) + sizeof(bool))
+        + (p->mask + 1) * sizeof(size_t);
+}
+
+void kdtree_paged_get_totals(kdtree_paged *p, kdtree_io_stats *io){
+    pthread_mutex_lock(&p->lock);
+    *io = p->totals;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void kdtree_paged_close(kdtree_paged *p){
+    if (p == NULL){
+        return;
+    }
+    close(p->fd);
+    pthread_mutex_destroy(&p->lock);
+    free(p->data);
+    free(p->frame_page);
+    free(p->referenced);
+    free(p->slots);
+    free(p);
+}
@@ -0,0 +1,149 @@
+#ifndef __KDTREE_PAGED_H__
+#define __KDTREE_PAGED_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * A K-D-B tree kept on disk in fixed-size pages and read through a
+ * cache of a fixed number of pages, so queries need memory for the
+ * cache and nothing in proportion to the tree.
+ *
+ * The file is a sequence of KDTREE_PAGE_SIZE-byte pages, all integers
+ * and coordinates little-endian.  Page 0 is the superblock:
+ *
+ *   offset  size  field
+ *        0     8  magic "KDTPAGED"
+ *        8     4  format version (KDTREE_PAGED_VERSION)
+ *       12     4  page size
+ *       16     8  number of pages, counting this one
+ *       24     8  page number of the root, or 0 if there are no points
+ *       32     8  number of points
+ *       40     8  checksum of the first 40 bytes, as in kdtree_file.h
+ *
+ * Every other page starts with an 8-byte header: byte 0 is the kind
+ * (KDTREE_PAGE_LEAF or KDTREE_PAGE_SPLIT), and bytes 4 to 7 hold a
+ * 32-bit count.
+ *
+ * A leaf page holds up to KDTREE_PAGE_LEAF_MAX points after its header,
+ * each as longitude then latitude, in no particular order; the count is
+ * the number of points.
+ *
+ * A split page divides its region among 2^levels child pages with a
+ * complete binary tree of median splits, like the top levels of a
+ * kdtree.  Byte 1 is the number of levels, 1 to KDTREE_PAGE_LEVELS_MAX,
+ * and byte 2 is the cutting dimension of the first (0 for longitude);
+ * each level alternates.  Then come the 2^levels - 1 split coordinates
+ * in breadth-first order (split i has splits 2i + 1 and 2i + 2 below
+ * it), and then the 2^levels child page numbers, left to right, with 0
+ * for an empty region.  Points less than a split go left and the rest
+ * right.
+ *
+ * Pages are written children first, so every child page number is less
+ * than its parent's, which is checked as each page is read; a file that
+ * fails the checks is treated as having nothing in the damaged page.
+ */
+typedef struct kdtree_paged kdtree_paged;
+
+#define KDTREE_PAGED_VERSION 1
+#define KDTREE_PAGE_SIZE 4096
+#define KDTREE_PAGE_LEAF 1
+#define KDTREE_PAGE_SPLIT 2
+#define KDTREE_PAGE_LEAF_MAX ((KDTREE_PAGE_SIZE - 8) / 16)
+#define KDTREE_PAGE_LEVELS_MAX 8
+
+
+/**
+ * Writes the given points to the given path as a paged tree.  The
+ * file is written under a temporary name and renamed, as for
+ * kdtree_file_save.
+ *
+ * @param pts an array of n distinct valid locations, which is reordered;
+ * NULL is allowed if n = 0
+ * @param n the number of points
+ * @param path the name of the file, non-NULL
+ * @return true if successful, false if the file could not be written or
+ * memory could not be allocated
+ */
+bool kdtree_paged_save(location *pts, size_t n, const char *path);
+
+
+/**
+ * Opens the given paged tree with a cache of the given number of pages.
+ * Only the superblock is read.
+ *
+ * @param path the name of a file written by kdtree_paged_save, non-NULL
+ * @param cache_pages the number of pages to cache, at least 1
+ * @return a pointer to the open tree, or NULL if the file could not be
+ * opened, is not a paged tree of a known version, or memory could not be
+ * allocated
+ */
+kdtree_paged *kdtree_paged_open(const char *path, size_t cache_pages);
+
+
+/**
+ * Returns the number of points in the given paged tree.
+ *
+ * @param p a pointer to an open paged tree, non-NULL
+ */
+size_t kdtree_paged_size(const kdtree_paged *p);
+
+
+/**
+ * Determines if the given paged tree contains the given point, adding
+ * the pages read to the given counters.
+ *
+ * @param p a pointer to an open paged tree, non-NULL
+ * @param l a pointer to a valid location, non-NULL
+ * @param io a pointer to counters, non-NULL
+ * @return true if and only if the point is in the tree
+ */
+bool kdtree_paged_contains(kdtree_paged *p, const location *l, kdtree_io_stats *io);
+
+
+/**
+ * Passes the points in the given paged tree that are in or on the
+ * borders of the given rectangle to the given function, adding the
+ * pages read to the given counters.
+ *
+ * @param p a pointer to an open paged tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location, non-NULL
+ * @param fn a pointer to a function, non-NULL
+ * @param arg a pointer to be passed as the extra argument to fn
+ * @param io a pointer to counters, non-NULL
+ */
+void kdtree_paged_range_for_each(kdtree_paged *p, const location *sw, const location *ne, void (*fn)(const location *, void *), void *arg, kdtree_io_stats *io);
+
+
+/**
+ * Returns the number of bytes of memory used by the given paged tree,
+ * almost all of it the cache.
+ *
+ * @param p a pointer to an open paged tree, non-NULL
+ */
+size_t kdtree_paged_memory(const kdtree_paged *p);
+
+
+/**
+ * Reads the counters of every query on the given paged tree since it
+ * was opened.
+ *
+ * @param p a pointer to an open paged tree, non-NULL
+ * @param io a pointer to where to store the counters, non-NULL
+ */
+void kdtree_paged_get_totals(kdtree_paged *p, kdtree_io_stats *io);
+
+
+/**
+ * Closes the given paged tree and frees its cache.
+ *
+ * @param p a pointer to an open paged tree, or NULL
+ */
+void kdtree_paged_close(kdtree_paged *p);
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef __KDTREE_QUANTIZE_H__
+#define __KDTREE_QUANTIZE_H__
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Conversions between double coordinates and 32-bit keys for the compact
+ * storage formats.  Keys preserve order: for any coordinates a and b
+ * that quantize exactly, a < b if and only if key(a) < key(b), so trees
+ * can compare keys directly instead of converting back to doubles.
+ */
+typedef enum
+{
+  KDTREE_COORDS_INT32,   // fixed point in millionths of a degree (about 11cm)
+  KDTREE_COORDS_FLOAT32  // single precision float bits, reordered to sort as integers
+} kdtree_coord_type;
+
+#define KDTREE_MICRODEGREES 1000000.0
+
+
+/**
+ * Maps the bits of a float to an int32_t that sorts in the same order.
+ */
+static inline int32_t kdtree_float_key(float f)
+{
+  if (f == 0.0f)
+    {
+      f = 0.0f; // so -0.0 and 0.0 get the same key
+    }
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+  return (int32_t)(bits ^ 0x80000000u);
+}
+
+
+static inline float kdtree_float_from_key(int32_t key)
+{
+  uint32_t bits = (uint32_t)key ^ 0x80000000u;
+  bits = (bits & 0x80000000u) ? (bits & 0x7fffffffu) : ~bits;
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+
+/**
+ * Returns the coordinate represented by the given key.
+ */
+static inline double kdtree_dequantize(kdtree_coord_type type, int32_t key)
+{
+  if (type == KDTREE_COORDS_INT32)
+    {
+      return key / KDTREE_MICRODEGREES;
+    }
+  else
+    {
+      return kdtree_float_from_key(key);
+    }
+}
+
+
+/**
+ * Finds the key nearest to the given coordinate.
+ *
+ * @param type the key format
+ * @param v a finite coordinate
+ * @param key a pointer to where to store the key, non-NULL
+ * @return false if v is outside the range of the format, true otherwise
+ */
+static inline bool kdtree_quantize(kdtree_coord_type type, double v, int32_t *key)
+{
+  if (type == KDTREE_COORDS_INT32)
+    {
+      double scaled = round(v * KDTREE_MICRODEGREES);
+      if (!(scaled >= INT32_MIN && scaled <= INT32_MAX))
+	{
+	  return false;
+	}
+      *key = (int32_t)scaled;
+      return true;
+    }
+  else
+    {
+      float f = (float)v;
+      if (isinf(f))
+	{
+	  return false;
+	}
+      *key = kdtree_float_key(f);
+      return true;
+    }
+}
+
+
+/**
+ * Determines if the given coordinate survives a round trip through a key.
+ */
+static inline bool kdtree_quantize_exact(kdtree_coord_type type, double v)
+{
+  int32_t key;
+  return kdtree_quantize(type, v, &key) && kdtree_dequantize(type, key) == v;
+}
+
+
+/**
+ * Returns the smallest key whose coordinate is >= v, or INT32_MAX + 1 if
+ * there is no such key.  Used for the low corner of range queries so that
+ * comparing keys gives the same answer as comparing coordinates.
+ */
+static inline int64_t kdtree_quantize_lower(kdtree_coord_type type, double v)
+{
+  if (type == KDTREE_COORDS_INT32)
+    {
+      double scaled = ceil(v * KDTREE_MICRODEGREES);
+      if (scaled > INT32_MAX)
+	{
+	  return (int64_t)INT32_MAX + 1;
+	}
+      if (scaled < INT32_MIN)
+	{
+	  return INT32_MIN;
+	}
+      int64_t key = (int64_t)scaled;
+      // v * 10^6 can round across an integer; fix up from the exact test
+      while (key > INT32_MIN && (key - 1) / KDTREE_MICRODEGREES >= v)
+	{
+	  key--;
+	}
+      while (key <= INT32_MAX && key / KDTREE_MICRODEGREES < v)
+	{
+	  key++;
+	}
+      return key;
+    }
+  else
+    {
+      float f = (float)v;
+      if ((double)f < v)
+	{
+	  f = nextafterf(f, INFINITY);
+	}
+      return kdtree_float_key(f);
+    }
+}
+
+
+/**
+ * Returns the largest key whose coordinate is <= v, or INT32_MIN - 1 if
+ * there is no such key.
+ */
+static inline int64_t kdtree_quantize_upper(kdtree_coord_type type, double v)
+{
+  if (type == KDTREE_COORDS_INT32)
+    {
+      double scaled = floor(v * KDTREE_MICRODEGREES);
+      if (scaled < INT32_MIN)
+	{
+	  return (int64_t)INT32_MIN - 1;
+	}
+      if (scaled > INT32_MAX)
+	{
+	  return INT32_MAX;
+	}
+      int64_t key = (int64_t)scaled;
+      while (key < INT32_MAX && (key + 1) / KDTREE_MICRODEGREES <= v)
+	{
+	  key++;
+	}
+      while (key >= INT32_MIN && key / KDTREE_MICRODEGREES > v)
+	{
+	  key--;
+	}
+      return key;
+    }
+  else
+    {
+      float f = (float)v;
+      if ((double)f > v)
+	{
+	  f = nextafterf(f, -INFINITY);
+	}
+      return kdtree_float_key(f);
+    }
+}
+
+#endif
@@ -0,0 +1,257 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "kdtree.h"
+#include "kdtree_trace.h"
+#include "location.h"
+
+/**
+ * Replays a trace written by kdtree_trace_start against a tree and
+ * reports the throughput and latency.
+ *
+ * USAGE: ./Replay trace [threads [points [options]]]
+ *
+ * The tree starts with the points in the given file (none by default,
+ * or with -), which is read by kdtree_load_stream as CSV if its name
+ * ends in .csv and as 16-byte binary records otherwise.  options is a
+ * comma-separated list of:
+ *
+ *   hash       keep a hash index (kdtree_enable_hash_index)
+ *   dfs=N      relayout depth first after every N updates
+ *   hilbert=N  relayout in Hilbert curve order after every N updates
+ *   insert     use KDTREE_CONCURRENT_INSERT mode, skipping removes
+ *   pace=X     issue calls at X times the recorded rate instead of as
+ *              fast as possible (1 for the recorded rate)
+ *
+ * With one thread (the default) the calls are made in order.  With
+ * more, the threads take calls in trace order from a shared counter, so
+ * that many are in flight at once.  The tree is then in
+ * KDTREE_SINGLE_WRITER mode with adds and removes made under a lock, or
+ * in KDTREE_CONCURRENT_INSERT mode with insert.  Prints the calls per
+ * second and, for each operation, the calls and p50/p99/p99.9/max
+ * latency as recorded by the library, as JSON on standard output.
+ * Latencies are of the calls themselves, not of waiting for the lock or
+ * for a call's time to come.
+ */
+
+typedef struct {
+    kdtree *t;
+    const kdtree_trace_call *calls;
+    const uint64_t *due;        //nanoseconds after the start; NULL if not paced
+    size_t n;
+    size_t next;                //the next call to take
+    size_t skipped;             //removes skipped in insert mode
+    bool insert;
+    bool locked;                //whether adds and removes take the lock
+    uint64_t start;
+    pthread_mutex_t lock;
+} replay_state;
+
+static uint64_t replay_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void replay_count_point(const location *l, void *count){
+    (*(size_t *)count)++;
+}
+
+static void replay_wait(uint64_t when){
+    struct timespec ts = {when / 1000000000u, when % 1000000000u};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0){
+        //interrupted; sleep the rest
+    }
+}
+
+static void replay_call(replay_state *s, const kdtree_trace_call *c){
+    int count;
+    size_t found = 0;
+    switch (c->op){
+    case KDTREE_OP_ADD:
+    case KDTREE_OP_REMOVE:
+        if (c->op == KDTREE_OP_REMOVE && s->insert){
+            __atomic_fetch_add(&s->skipped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (s->locked){
+            pthread_mutex_lock(&s->lock);
+        }
+        if (c->op == KDTREE_OP_ADD){
+            kdtree_add(s->t, &c->p);
+        } else{
+            kdtree_remove(s->t, &c->p);
+        }
+        if (s->locked){
+            pthread_mutex_unlock(&s->lock);
+        }
+        break;
+    case KDTREE_OP_CONTAINS:
+        kdtree_contains(s->t, &c->p);
+        break;
+    case KDTREE_OP_RANGE:
+        free(kdtree_range(s->t, &c->p, &c->ne, &count));
+        break;
+    case KDTREE_OP_RANGE_FOR_EACH:
+        kdtree_range_for_each(s->t, &c->p, &c->ne, replay_count_point, &found);
+        break;
+    default:
+        break;
+    }
+}
+
+static void *replay_worker(void *arg){
+    replay_state *s = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->n){
+        if (s->due != NULL){
+            replay_wait(s->start + s->due[i]);
+        }
+        replay_call(s, &s->calls[i]);
+    }
+    return NULL;
+}
+
+static bool replay_ends_with(const char *s, const char *suffix){
+    size_t n = strlen(s);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+//the tree to replay against, with the points in the given file if any
+static kdtree *replay_tree(const char *points){
+    if (points == NULL){
+        return kdtree_create(NULL, 0);
+    }
+    int fd = open(points, O_RDONLY);
+    if (fd < 0){
+        return NULL;
+    }
+    kdtree_stream_reader reader = {fd, replay_ends_with(points, ".csv") ? KDTREE_STREAM_CSV : KDTREE_STREAM_BINARY, 0, 0};
+    kdtree *t = kdtree_load_stream(&reader);
+    close(fd);
+    return t;
+}
+
+//applies the comma-separated options to the state and tree; returns
+//false if one isn't understood
+static bool replay_options(char *options, replay_state *s, double *pace){
+    for (char *o = strtok(options, ","); o != NULL; o = strtok(NULL, ",")){
+        char *end = NULL;
+        if (strcmp(o, "hash") == 0){
+            if (!kdtree_enable_hash_index(s->t)){
+                return false;
+            }
+        } else if (strcmp(o, "insert") == 0){
+            s->insert = true;
+        } else if (strncmp(o, "dfs=", 4) == 0){
+            kdtree_set_auto_relayout(s->t, KDTREE_LAYOUT_DFS, strtoul(o + 4, &end, 10));
+        } else if (strncmp(o, "hilbert=", 8) == 0){
+            kdtree_set_auto_relayout(s->t, KDTREE_LAYOUT_HILBERT, strtoul(o + 8, &end, 10));
+        } else if (strncmp(o, "pace=", 5) == 0){
+            *pace = strtod(o + 5, &end);
+            if (*pace <= 0.0){
+                return false;
+            }
+        } else{
+            return false;
+        }
+        if (end != NULL && *end != '\0'){
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv){
+    size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    if (argc < 2 || argc > 5 || threads == 0){
+        fprintf(stderr, "USAGE: %s trace [threads [points [options]]]\n", argv[0]);
+        return 1;
+    }
+    const char *points = argc > 3 && strcmp(argv[3], "-") != 0 ? argv[3] : NULL;
+
+    replay_state s = {NULL, NULL, NULL, 0, 0, 0, false, false, 0, PTHREAD_MUTEX_INITIALIZER};
+    kdtree_trace_call *calls = kdtree_trace_load(argv[1], &s.n);
+    if (calls == NULL){
+        fprintf(stderr, "%s: could not read a trace from %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    s.calls = calls;
+    s.t = replay_tree(points);
+    if (s.t == NULL){
+        fprintf(stderr, "%s: could not load %s\n", argv[0], points);
+        free(calls);
+        return 1;
+    }
+    double pace = 0.0;
+    if (argc > 4 && !replay_options(argv[4], &s, &pace)){
+        fprintf(stderr, "%s: bad options %s\n", argv[0], argv[4]);
+        kdtree_destroy(s.t);
+        free(calls);
+        return 1;
+    }
+    bool moded = true;
+    if (s.insert){
+        moded = kdtree_set_concurrency(s.t, KDTREE_CONCURRENT_INSERT);
+    } else if (threads > 1){
+        moded = kdtree_set_concurrency(s.t, KDTREE_SINGLE_WRITER);
+        s.locked = true;
+    }
+    uint64_t *due = pace > 0.0 ? malloc(sizeof(uint64_t) * (s.n > 0 ? s.n : 1)) : NULL;
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if (!moded || (pace > 0.0 && due == NULL) || workers == NULL){
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        kdtree_destroy(s.t);
+        free(calls);
+        free(due);
+        free(workers);
+        return 1;
+    }
+    //each call is due when the gaps before it, sped up by pace, have passed
+    double offset = 0.0;
+    for (size_t i = 0; due != NULL && i < s.n; i++){
+        offset += s.calls[i].gap / pace;
+        due[i] = offset;
+    }
+    s.due = due;
+
+    kdtree_latency_enable(true);
+    kdtree_latency_reset();
+    s.start = replay_now();
+    //this thread is one of them; if some of the others could not be
+    //started, the rest do their share
+    size_t started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, replay_worker, &s) == 0){
+        started++;
+    }
+    replay_worker(&s);
+    for (size_t i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+    double seconds = (replay_now() - s.start) / 1e9;
+
+    static const char *names[KDTREE_OPERATIONS] = {"add", "contains", "remove", "range", "range_for_each"};
+    printf("{\"replay\": \"%s\", \"calls\": %zu, \"threads\": %zu, \"pace\": %g, \"seconds\": %.6f, \"calls_per_second\": %.1f, \"skipped\": %zu, \"size\": %zu, \"operations\": [\n",
+           argv[1], s.n, started + 1, pace, seconds, seconds > 0.0 ? s.n / seconds : 0.0, s.skipped, kdtree_size(s.t));
+    for (int op = 0; op < KDTREE_OPERATIONS; op++){
+        kdtree_latency l;
+        kdtree_latency_read(op, &l);
+        printf("  {\"operation\": \"%s\", \"calls\": %" PRIu64 ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}%s\n",
+               names[op], l.count, l.p50, l.p99, l.p999, l.max, op + 1 < KDTREE_OPERATIONS ? "," : "");
+    }
+    printf("]}\n");
+
+    kdtree_destroy(s.t);
+    free(calls);
+    free(due);
+    free(workers);
+    return 0;
+}
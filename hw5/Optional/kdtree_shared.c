@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kdtree.h"
+#include "kdtree_file.h"
+#include "kdtree_internal.h"
+#include "kdtree_shared.h"
+
+//longest name accepted, and room for it with a generation after it
+#define KDTREE_SHARED_NAME_LENGTH 200
+#define KDTREE_SHARED_NAME_MAX (KDTREE_SHARED_NAME_LENGTH + 22)
+
+//times kdtree_shared_tree looks again when a generation is gone before
+//it can be opened because the loader has published another
+#define KDTREE_SHARED_RETRIES 8
+
+static const char kdtree_shared_magic[8] = {'K', 'D', 'T', 'S', 'H', 'A', 'R', 'E'};
+
+//the object with the plain name; only ever on one machine, so in the
+//machine's own byte order
+typedef struct {
+    char magic[8];        //set before the first generation
+    uint64_t generation;  //read and written atomically; 0 before the first
+} kdtree_shared_control;
+
+struct kdtree_shared{
+    const kdtree_shared_control *control;
+    char *name;
+    kdtree *tree;         //the tree last returned, or NULL
+    uint64_t generation;  //its generation, or 0
+};
+
+static bool kdtree_shared_name_valid(const char *name){
+    return name != NULL && name[0] == '/' && name[1] != '\0' && strchr(name + 1, '/') == NULL
+        && strlen(name) <= KDTREE_SHARED_NAME_LENGTH;
+}
+
+static void kdtree_shared_data_name(char *out, const char *name, uint64_t generation){
+    snprintf(out, KDTREE_SHARED_NAME_MAX, "%s.%" PRIu64, name, generation);
+}
+
+//writes the tree into a new object for the given generation
+static bool kdtree_shared_write(const kdtree *t, const char *name, uint64_t generation){
+    char data[KDTREE_SHARED_NAME_MAX];
+    kdtree_shared_data_name(data, name, generation);
+    int fd = shm_open(data, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST){
+        //left by a loader that failed partway through
+        shm_unlink(data);
+        fd = shm_open(data, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0){
+        return false;
+    }
+    size_t length = kdtree_file_length(kdtree_size(t));
+    void *map = ftruncate(fd, length) == 0 ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    bool ok = false;
+    if (map != MAP_FAILED){
+        kdtree_file_writer *w = kdtree_file_writer_open_memory(map, length);
+        if (w != NULL){
+            ok = kdtree_write(t, w);
+            ok = kdtree_file_writer_close(w, ok);
+        }
+        munmap(map, length);
+    }
+    if (!ok){
+        shm_unlink(data);
+    }
+    return ok;
+}
+
+uint64_t kdtree_shared_publish(const kdtree *t, const char *name){
+    if (t == NULL || !kdtree_shared_name_valid(name)){
+        return 0;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0){
+        return 0;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0
+        && (st.st_size == sizeof(kdtree_shared_control) || (st.st_size == 0 && ftruncate(fd, sizeof(kdtree_shared_control)) == 0));
+    void *map = ok ? mmap(NULL, sizeof(kdtree_shared_control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED){
+        return 0;
+    }
+
+    kdtree_shared_control *control = map;
+    uint64_t old = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+    uint64_t generation = 0;
+    //an object of the right size that is not ours is left alone
+    if ((old == 0 || memcmp(control->magic, kdtree_shared_magic, sizeof(kdtree_shared_magic)) == 0)
+        && kdtree_shared_write(t, name, old + 1)){
+        generation = old + 1;
+        memcpy(control->magic, kdtree_shared_magic, sizeof(kdtree_shared_magic));
+        //the tree and the magic are complete before anyone sees the number
+        __atomic_store_n(&control->generation, generation, __ATOMIC_RELEASE);
+        if (old > 0){
+            char data[KDTREE_SHARED_NAME_MAX];
+            kdtree_shared_data_name(data, name, old);
+            shm_unlink(data);
+        }
+    }
+    munmap(map, sizeof(kdtree_shared_control));
+    return generation;
+}
+
+bool kdtree_shared_unlink(const char *name){
+    kdtree_shared *s = kdtree_shared_attach(name);
+    if (s == NULL){
+        return false;
+    }
+    uint64_t generation = __atomic_load_n(&s->control->generation, __ATOMIC_ACQUIRE);
+    if (generation > 0){
+        char data[KDTREE_SHARED_NAME_MAX];
+        kdtree_shared_data_name(data, name, generation);
+        shm_unlink(data);
+    }
+    kdtree_shared_detach(s);
+    return shm_unlink(name) == 0;
+}
+
+kdtree_shared *kdtree_shared_attach(const char *name){
+    if (!kdtree_shared_name_valid(name)){
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    void *map = fstat(fd, &st) == 0 && st.st_size == sizeof(kdtree_shared_control)
+        ? mmap(NULL, sizeof(kdtree_shared_control), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED){
+        return NULL;
+    }
+
+    kdtree_shared *s = malloc(sizeof(kdtree_shared));
+    char *copy = malloc(strlen(name) + 1);
+    if (s == NULL || copy == NULL){
+        free(s);
+        free(copy);
+        munmap(map, sizeof(kdtree_shared_control));
+        return NULL;
+    }
+    strcpy(copy, name);
+    s->control = map;
+    s->name = copy;
+    s->tree = NULL;
+    s->generation = 0;
+    return s;
+}
+
+kdtree *kdtree_shared_tree(kdtree_shared *s){
+    for (int attempt = 0; attempt < KDTREE_SHARED_RETRIES; attempt++){
+        uint64_t generation = __atomic_load_n(&s->control->generation, __ATOMIC_ACQUIRE);
+        if (generation == s->generation
+            || memcmp(s->control->magic, kdtree_shared_magic, sizeof(kdtree_shared_magic)) != 0){
+            break;
+        }
+        char data[KDTREE_SHARED_NAME_MAX];
+        kdtree_shared_data_name(data, s->name, generation);
+        int fd = shm_open(data, O_RDONLY, 0);
+        if (fd < 0){
+            //already replaced, so there is a newer one to look for
+            continue;
+        }
+        kdtree *t = kdtree_open_file(kdtree_file_map(fd));
+        close(fd);
+        if (t == NULL){
+            break;
+        }
+        kdtree_destroy(s->tree);
+        s->tree = t;
+        s->generation = generation;
+        break;
+    }
+    return s->tree;
+}
+
+uint64_t kdtree_shared_generation(const kdtree_shared *s){
+    return s->generation;
+}
+
+void kdtree_shared_detach(kdtree_shared *s){
+    if (s == NULL){
+        return;
+    }
+    kdtree_destroy(s->tree);
+    munmap((void *)s->control, sizeof(kdtree_shared_control));
+    free(s->name);
+    free(s);
+}
@@ -0,0 +1,102 @@
+#ifndef __KDTREE_SHARED_H__
+#define __KDTREE_SHARED_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+
+/**
+ * A tree kept in POSIX shared memory, so any number of worker processes
+ * on one machine can query a single copy of it.
+ *
+ * A loader process publishes trees under a name such as "/places".  Each
+ * tree goes in a shared memory object of its own, named after the tree's
+ * generation ("/places.1", "/places.2", ...), in the format of
+ * kdtree_save, whose links are record indexes rather than pointers and
+ * so mean the same at whatever address a process maps them.  The object
+ * with the plain name holds only the current generation.  Publishing
+ * writes the new object in full, then switches the generation and
+ * removes the old object's name; workers still using the old tree keep
+ * it mapped until they next look at the generation, and the memory goes
+ * back to the system when the last of them lets go.
+ *
+ * Workers attach to the name read-only and call kdtree_shared_tree
+ * whenever they want the current tree.  Every worker maps the same
+ * pages, so the memory for the points is paid once on the machine
+ * rather than once per worker.
+ *
+ * Only one process may publish under a name at a time.
+ */
+typedef struct kdtree_shared kdtree_shared;
+
+
+/**
+ * Writes the given tree to shared memory under the given name as the
+ * next generation and makes it the current one.  The name's control
+ * object is created if need be.
+ *
+ * @param t a pointer to a tree that is not a paged tree and that no
+ * thread changes during the call, non-NULL
+ * @param name the name, a slash followed by up to 200 characters other
+ * than slashes, non-NULL
+ * @return the new generation, counting from 1, or 0 if the tree could
+ * not be written or the shared memory could not be created
+ */
+uint64_t kdtree_shared_publish(const kdtree *t, const char *name);
+
+
+/**
+ * Removes the given name and its current tree from shared memory.
+ * Attached workers keep what they have mapped.
+ *
+ * @param name the name, non-NULL
+ * @return true if the name was removed, false if it did not exist
+ */
+bool kdtree_shared_unlink(const char *name);
+
+
+/**
+ * Attaches to the given name read-only.  Nothing need have been
+ * published under it yet.
+ *
+ * @param name the name, non-NULL
+ * @return a pointer to the attachment, or NULL if the name does not
+ * exist or memory could not be allocated
+ */
+kdtree_shared *kdtree_shared_attach(const char *name);
+
+
+/**
+ * Returns the tree most recently published under the attached name,
+ * mapping it first if it is newer than the one returned before.  The
+ * tree is read-only; query it with any read-only function, from any
+ * number of threads, until the next call to kdtree_shared_tree or
+ * kdtree_shared_detach on the same attachment, and do not destroy it.
+ * A newly mapped tree is checked as kdtree_open_mmap checks a file.
+ *
+ * @param s a pointer to an attachment, non-NULL
+ * @return a pointer to the tree, or NULL if nothing has been published;
+ * if the newest tree cannot be mapped the one returned before is
+ * returned again
+ */
+kdtree *kdtree_shared_tree(kdtree_shared *s);
+
+
+/**
+ * Returns the generation of the tree last returned by kdtree_shared_tree
+ * on the given attachment, or 0 if none has been.
+ *
+ * @param s a pointer to an attachment, non-NULL
+ */
+uint64_t kdtree_shared_generation(const kdtree_shared *s);
+
+
+/**
+ * Unmaps the tree and frees the attachment.
+ *
+ * @param s a pointer to an attachment, or NULL
+ */
+void kdtree_shared_detach(kdtree_shared *s);
+
+#endif
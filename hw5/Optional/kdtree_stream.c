@@ -0,0 +1,222 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kdtree_stream.h"
+#include "kdtree_file.h"
+
+#define KDTREE_STREAM_RECORD_SIZE 16
+
+//guess at the bytes per CSV line, for sizing the nodes up front; too
+//small a guess costs a shrink at the end, too large one costs regrowing
+#define KDTREE_STREAM_CSV_GUESS 24
+
+typedef struct {
+    kdtree_stream_reader *reader;
+    bool (*fn)(const location *, void *);
+    void *arg;
+    bool skipping;    //in the middle of a CSV line too long to parse
+} kdtree_stream_state;
+
+size_t kdtree_stream_size_hint(const kdtree_stream_reader *reader){
+    struct stat st;
+    off_t pos = lseek(reader->fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(reader->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= pos){
+        return 0;
+    }
+    size_t bytes = st.st_size - pos;
+    if (reader->format == KDTREE_STREAM_BINARY){
+        return bytes / KDTREE_STREAM_RECORD_SIZE;
+    }
+    return bytes / KDTREE_STREAM_CSV_GUESS + 1;
+}
+
+//counts one record and passes it on if it is valid; false if fn says to stop
+static bool kdtree_stream_emit(kdtree_stream_state *s, const location *l){
+    s->reader->records++;
+    if (!location_validate(l)){
+        s->reader->rejected++;
+        return true;
+    }
+    return s->fn(l, s->arg);
+}
+
+static void kdtree_stream_reject(kdtree_stream_state *s){
+    s->reader->records++;
+    s->reader->rejected++;
+}
+
+static bool kdtree_stream_blank(const char *text, size_t len){
+    for (size_t i = 0; i < len; i++){
+        if (text[i] != ' ' && text[i] != '\t'){
+            return false;
+        }
+    }
+    return true;
+}
+
+//reads "latitude,longitude" with optional spaces; false if the line is anything else
+static bool kdtree_stream_parse_line(const char *line, size_t len, location *l){
+    //strtod needs the text to end in a NUL, which a mapped file doesn't
+    char text[KDTREE_STREAM_LINE_MAX + 1];
+    memcpy(text, line, len);
+    text[len] = '\0';
+
+    char *end;
+    l->lat = strtod(text, &end);
+    if (end == text){
+        return false;
+    }
+    while (*end == ' ' || *end == '\t'){
+        end++;
+    }
+    if (*end != ','){
+        return false;
+    }
+    char *start = end + 1;
+    l->lon = strtod(start, &end);
+    if (end == start){
+        return false;
+    }
+    while (*end == ' ' || *end == '\t'){
+        end++;
+    }
+    return *end == '\0';
+}
+
+//parses the complete lines at the start of buf, and the unfinished last
+//one too if at_end; sets *used to the bytes it is done with
+static bool kdtree_stream_parse_csv(kdtree_stream_state *s, const char *buf, size_t len, bool at_end, size_t *used){
+    size_t start = 0;
+    bool ok = true;
+    while (start < len && ok){
+        const char *newline = memchr(buf + start, '\n', len - start);
+        size_t end = newline != NULL ? (size_t)(newline - buf) : len;
+        size_t next = newline != NULL ? end + 1 : len;
+        if (s->skipping){
+            s->skipping = newline == NULL;
+            start = next;
+            continue;
+        }
+        if (newline == NULL && !at_end){
+            if (end - start <= KDTREE_STREAM_LINE_MAX + 1){
+                //the rest of the line is in the next chunk
+                break;
+            }
+            //already too long to parse, so reject it now and skip the rest
+            kdtree_stream_reject(s);
+            s->skipping = true;
+            start = next;
+            continue;
+        }
+
+        if (end > start && buf[end - 1] == '\r'){
+            end--;
+        }
+        location l;
+        if (kdtree_stream_blank(buf + start, end - start)){
+            //nothing to read
+        } else if (end - start > KDTREE_STREAM_LINE_MAX || !kdtree_stream_parse_line(buf + start, end - start, &l)){
+            kdtree_stream_reject(s);
+        } else{
+            ok = kdtree_stream_emit(s, &l);
+        }
+        start = next;
+    }
+    *used = start;
+    return ok;
+}
+
+//parses the whole records in buf, and counts a partial one at_end as rejected
+static bool kdtree_stream_parse_binary(kdtree_stream_state *s, const char *buf, size_t len, bool at_end, size_t *used){
+    const unsigned char *bytes = (const unsigned char *)buf;
+    size_t count = len / KDTREE_STREAM_RECORD_SIZE;
+    *used = 0;
+    for (size_t i = 0; i < count; i++){
+        uint64_t lat_bits = kdtree_file_get64(bytes + i * KDTREE_STREAM_RECORD_SIZE);
+        uint64_t lon_bits = kdtree_file_get64(bytes + i * KDTREE_STREAM_RECORD_SIZE + 8);
+        location l;
+        memcpy(&l.lat, &lat_bits, sizeof(double));
+        memcpy(&l.lon, &lon_bits, sizeof(double));
+        if (!kdtree_stream_emit(s, &l)){
+            return false;
+        }
+    }
+    *used = count * KDTREE_STREAM_RECORD_SIZE;
+    if (at_end && *used < len){
+        kdtree_stream_reject(s);
+        *used = len;
+    }
+    return true;
+}
+
+static bool kdtree_stream_parse(kdtree_stream_state *s, const char *buf, size_t len, bool at_end, size_t *used){
+    if (s->reader->format == KDTREE_STREAM_BINARY){
+        return kdtree_stream_parse_binary(s, buf, len, at_end, used);
+    }
+    return kdtree_stream_parse_csv(s, buf, len, at_end, used);
+}
+
+//parses a regular file where it lies; false if it could not be mapped
+static bool kdtree_stream_read_mapped(kdtree_stream_state *s, bool *ok){
+    int fd = s->reader->fd;
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= pos){
+        return false;
+    }
+    size_t length = st.st_size;
+    void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED){
+        return false;
+    }
+    posix_madvise(map, length, POSIX_MADV_SEQUENTIAL);
+    size_t used;
+    *ok = kdtree_stream_parse(s, (const char *)map + pos, length - pos, true, &used);
+    munmap(map, length);
+    lseek(fd, st.st_size, SEEK_SET);
+    return true;
+}
+
+bool kdtree_stream_read(kdtree_stream_reader *reader, bool (*fn)(const location *, void *), void *arg){
+    kdtree_stream_state s = {reader, fn, arg, false};
+    reader->records = 0;
+    reader->rejected = 0;
+
+    bool ok;
+    if (kdtree_stream_read_mapped(&s, &ok)){
+        return ok;
+    }
+
+    char *buf = malloc(KDTREE_STREAM_CHUNK);
+    if (buf == NULL){
+        return false;
+    }
+    size_t have = 0;
+    ok = true;
+    while (ok){
+        ssize_t got = read(reader->fd, buf + have, KDTREE_STREAM_CHUNK - have);
+        if (got < 0 && errno == EINTR){
+            continue;
+        }
+        if (got < 0){
+            ok = false;
+            break;
+        }
+        have += got;
+        size_t used;
+        ok = kdtree_stream_parse(&s, buf, have, got == 0, &used);
+        //keep the unfinished record for the next chunk
+        memmove(buf, buf + used, have - used);
+        have -= used;
+        if (got == 0){
+            break;
+        }
+    }
+    free(buf);
+    return ok;
+}
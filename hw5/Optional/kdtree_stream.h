@@ -0,0 +1,48 @@
+#ifndef __KDTREE_STREAM_H__
+#define __KDTREE_STREAM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * Reading of the records behind kdtree_load_stream.  Regular files are
+ * mapped and parsed in one pass; other descriptors are read in chunks of
+ * KDTREE_STREAM_CHUNK bytes, with a record split between chunks carried
+ * over to the next one.
+ */
+
+#define KDTREE_STREAM_CHUNK (1 << 20)
+
+// longest CSV line accepted, not counting the line ending
+#define KDTREE_STREAM_LINE_MAX 127
+
+
+/**
+ * Returns a guess at how many records are left to read from the given
+ * reader's descriptor: exact for a regular binary file, an estimate from
+ * the file size for a regular CSV file, and 0 if it can't tell.
+ *
+ * @param reader a pointer to a reader, non-NULL
+ */
+size_t kdtree_stream_size_hint(const kdtree_stream_reader *reader);
+
+
+/**
+ * Reads records from the given reader's descriptor up to end of file,
+ * passing each valid location to the given function in the order read
+ * and counting records and rejected records in the reader.
+ *
+ * @param reader a pointer to a reader whose fd and format are set,
+ * non-NULL
+ * @param fn a pointer to a function that returns false to stop reading,
+ * non-NULL
+ * @param arg a pointer to be passed as the extra argument to fn
+ * @return true if the whole stream was read, false if it could not be
+ * read, memory could not be allocated, or fn returned false
+ */
+bool kdtree_stream_read(kdtree_stream_reader *reader, bool (*fn)(const location *, void *), void *arg);
+
+#endif
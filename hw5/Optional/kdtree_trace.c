@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "kdtree.h"
+#include "kdtree_file.h"
+#include "kdtree_trace.h"
+#include "location.h"
+
+#define KDTREE_TRACE_HEADER_SIZE 16
+#define KDTREE_TRACE_VERSION 1
+//an operation byte, up to 10 bytes of gap and four words
+#define KDTREE_TRACE_RECORD_MAX 43
+
+static const char kdtree_trace_magic[8] = {'K', 'D', 'T', 'R', 'A', 'C', 'E', '\n'};
+
+static int kdtree_trace_on;
+
+//guards everything below
+static pthread_mutex_t kdtree_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *kdtree_trace_out;
+static uint64_t kdtree_trace_last;  //when the previous call was recorded
+static bool kdtree_trace_failed;
+
+static uint64_t kdtree_trace_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static bool kdtree_trace_is_range(kdtree_operation op){
+    return op == KDTREE_OP_RANGE || op == KDTREE_OP_RANGE_FOR_EACH;
+}
+
+//writes the location's bits at p; returns the bytes written
+static size_t kdtree_trace_put_location(unsigned char *p, const location *l){
+    uint64_t lat, lon;
+    memcpy(&lat, &l->lat, sizeof(lat));
+    memcpy(&lon, &l->lon, sizeof(lon));
+    kdtree_file_put64(p, lat);
+    kdtree_file_put64(p + 8, lon);
+    return 16;
+}
+
+static void kdtree_trace_get_location(const unsigned char *p, location *l){
+    uint64_t lat = kdtree_file_get64(p);
+    uint64_t lon = kdtree_file_get64(p + 8);
+    memcpy(&l->lat, &lat, sizeof(lat));
+    memcpy(&l->lon, &lon, sizeof(lon));
+}
+
+bool kdtree_trace_start(const char *path){
+    pthread_mutex_lock(&kdtree_trace_lock);
+    if (kdtree_trace_out != NULL){
+        pthread_mutex_unlock(&kdtree_trace_lock);
+        return false;
+    }
+    FILE *out = fopen(path, "wb");
+    unsigned char header[KDTREE_TRACE_HEADER_SIZE];
+    memcpy(header, kdtree_trace_magic, sizeof(kdtree_trace_magic));
+    kdtree_file_put64(header + 8, KDTREE_TRACE_VERSION);
+    if (out == NULL || fwrite(header, 1, sizeof(header), out) != sizeof(header)){
+        if (out != NULL){
+            fclose(out);
+        }
+        pthread_mutex_unlock(&kdtree_trace_lock);
+        return false;
+    }
+    kdtree_trace_out = out;
+    kdtree_trace_last = kdtree_trace_now();
+    kdtree_trace_failed = false;
+    __atomic_store_n(&kdtree_trace_on, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&kdtree_trace_lock);
+    return true;
+}
+
+bool kdtree_trace_stop(void){
+    pthread_mutex_lock(&kdtree_trace_lock);
+    __atomic_store_n(&kdtree_trace_on, 0, __ATOMIC_RELAXED);
+    FILE *out = kdtree_trace_out;
+    kdtree_trace_out = NULL;
+    bool ok = out != NULL && fclose(out) == 0 && !kdtree_trace_failed;
+    pthread_mutex_unlock(&kdtree_trace_lock);
+    return ok;
+}
+
+//writes one record; lock must be held
+static void kdtree_trace_put(kdtree_operation op, uint64_t gap, const location *p, const location *ne){
+    unsigned char record[KDTREE_TRACE_RECORD_MAX];
+    size_t size = 0;
+    record[size++] = op;
+    while (gap >= 0x80){
+        record[size++] = (gap & 0x7f) | 0x80;
+        gap >>= 7;
+    }
+    record[size++] = gap;
+    size += kdtree_trace_put_location(record + size, p);
+    if (kdtree_trace_is_range(op)){
+        size += kdtree_trace_put_location(record + size, ne);
+    }
+    if (fwrite(record, 1, size, kdtree_trace_out) != size){
+        kdtree_trace_failed = true;
+    }
+}
+
+//returns the nanoseconds since the previous call; lock must be held
+static uint64_t kdtree_trace_gap(void){
+    uint64_t now = kdtree_trace_now();
+    uint64_t gap = now - kdtree_trace_last;
+    kdtree_trace_last = now;
+    return gap;
+}
+
+void kdtree_trace_record(kdtree_operation op, const location *p, const location *ne){
+    if (!__atomic_load_n(&kdtree_trace_on, __ATOMIC_RELAXED)){
+        return;
+    }
+    pthread_mutex_lock(&kdtree_trace_lock);
+    //tracing may have stopped since the check above
+    if (kdtree_trace_out != NULL){
+        kdtree_trace_put(op, kdtree_trace_gap(), p, ne);
+    }
+    pthread_mutex_unlock(&kdtree_trace_lock);
+}
+
+void kdtree_trace_record_many(kdtree_operation op, const location *pts, size_t n){
+    if (n == 0 || !__atomic_load_n(&kdtree_trace_on, __ATOMIC_RELAXED)){
+        return;
+    }
+    pthread_mutex_lock(&kdtree_trace_lock);
+    if (kdtree_trace_out != NULL){
+        kdtree_trace_put(op, kdtree_trace_gap(), &pts[0], NULL);
+        for (size_t i = 1; i < n; i++){
+            kdtree_trace_put(op, 0, &pts[i], NULL);
+        }
+    }
+    pthread_mutex_unlock(&kdtree_trace_lock);
+}
+
+//decodes the record at p, which has the given number of bytes after it;
+//returns the record's size, 0 if it is cut off, or -1 if it is damaged
+static long kdtree_trace_decode(const unsigned char *p, size_t left, kdtree_trace_call *c){
+    size_t size = 0;
+    if (p[size] >= KDTREE_OPERATIONS){
+        return -1;
+    }
+    c->op = p[size++];
+    c->gap = 0;
+    for (int shift = 0; ; shift += 7){
+        if (size == left){
+            return 0;
+        }
+        if (shift > 63){
+            return -1;
+        }
+        c->gap |= (uint64_t)(p[size] & 0x7f) << shift;
+        if ((p[size++] & 0x80) == 0){
+            break;
+        }
+    }
+    size_t points = kdtree_trace_is_range(c->op) ? 2 : 1;
+    if (left - size < points * 16){
+        return 0;
+    }
+    kdtree_trace_get_location(p + size, &c->p);
+    c->ne = c->p;
+    if (points == 2){
+        kdtree_trace_get_location(p + size + 16, &c->ne);
+    }
+    return size + points * 16;
+}
+
+kdtree_trace_call *kdtree_trace_load(const char *path, size_t *n){
+    FILE *in = fopen(path, "rb");
+    if (in == NULL){
+        return NULL;
+    }
+    unsigned char header[KDTREE_TRACE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), in) != sizeof(header)
+        || memcmp(header, kdtree_trace_magic, sizeof(kdtree_trace_magic)) != 0
+        || kdtree_file_get64(header + 8) != KDTREE_TRACE_VERSION){
+        fclose(in);
+        return NULL;
+    }
+
+    //records are read in chunks, with any partial record at the end of
+    //one moved to the start of the next
+    unsigned char buf[65536];
+    size_t have = 0;
+    size_t capacity = 1024;
+    size_t count = 0;
+    kdtree_trace_call *calls = malloc(sizeof(kdtree_trace_call) * capacity);
+    bool ok = calls != NULL;
+    bool more = true;
+    while (ok && more){
+        size_t got = fread(buf + have, 1, sizeof(buf) - have, in);
+        more = got > 0;
+        have += got;
+        size_t used = 0;
+        while (ok && used < have){
+            if (count == capacity){
+                kdtree_trace_call *bigger = realloc(calls, sizeof(kdtree_trace_call) * capacity * 2);
+                if (bigger == NULL){
+                    ok = false;
+                    break;
+                }
+                calls = bigger;
+                capacity *= 2;
+            }
+            long size = kdtree_trace_decode(buf + used, have - used, &calls[count]);
+            if (size < 0){
+                ok = false;
+            } else if (size == 0){
+                break;
+            } else{
+                used += size;
+                count++;
+            }
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+    }
+    ok = ok && !ferror(in);
+    fclose(in);
+    if (!ok){
+        free(calls);
+        return NULL;
+    }
+    *n = count;
+    return calls;
+}
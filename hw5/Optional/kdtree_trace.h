@@ -0,0 +1,83 @@
+#ifndef __KDTREE_TRACE_H__
+#define __KDTREE_TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * Traces of the calls made to kdtree_add, kdtree_contains,
+ * kdtree_remove, kdtree_range and kdtree_range_for_each, as written
+ * between kdtree_trace_start and kdtree_trace_stop.  A call to
+ * kdtree_add_many or kdtree_contains_many is written as a call to
+ * kdtree_add or kdtree_contains for each of its points, in order, all
+ * but the first with no time between them.  A trace holds the arguments
+ * and arrival times of the calls but no points that were in the trees
+ * beforehand, so it can be shared where the data can't.
+ *
+ * A trace is a 16-byte header (magic, then the version as a
+ * little-endian 64-bit word) followed by one record per call: a byte
+ * holding the kdtree_operation, the nanoseconds since the previous call
+ * (or since tracing started) as an unsigned LEB128 number, then the bits
+ * of the point's latitude and longitude as little-endian 64-bit words,
+ * followed for the two range operations by those of the northeast
+ * corner.  A call to kdtree_add or kdtree_contains usually takes 19 or
+ * 20 bytes.
+ */
+
+
+/**
+ * One call read from a trace.
+ */
+typedef struct
+{
+  kdtree_operation op;  // which function was called
+  uint64_t gap;         // nanoseconds since the previous call
+  location p;           // the point, or the southwest corner of a range
+  location ne;          // the northeast corner of a range
+} kdtree_trace_call;
+
+
+/**
+ * Appends the given call to the trace being written, if there is one.
+ * The public functions in kdtree.c call this once they have checked
+ * their arguments.  Calls they make to one another, and work the
+ * wrapper modules do through the kdtree_do_ functions, are not traced.
+ *
+ * @param op the operation
+ * @param p the point, or the southwest corner of a range, non-NULL
+ * @param ne the northeast corner of a range, or NULL
+ */
+void kdtree_trace_record(kdtree_operation op, const location *p, const location *ne);
+
+
+/**
+ * Appends a call with the given operation for each of the given points
+ * to the trace being written, if there is one, as one call to
+ * kdtree_add_many or kdtree_contains_many.
+ *
+ * @param op KDTREE_OP_ADD or KDTREE_OP_CONTAINS
+ * @param pts a pointer to an array of n valid locations, non-NULL if n
+ * is not 0
+ * @param n the number of locations in that array
+ */
+void kdtree_trace_record_many(kdtree_operation op, const location *pts, size_t n);
+
+
+/**
+ * Reads every call in the given trace.  A partial record at the end,
+ * as left by a process that stopped without calling kdtree_trace_stop,
+ * is ignored.
+ *
+ * @param path the name of a trace file, non-NULL
+ * @param n a pointer to where to store the number of calls, non-NULL
+ * @return a pointer to an array of the calls, which the caller must
+ * free, or NULL if the file could not be read, is not a trace, or
+ * memory could not be allocated; an empty trace gives a non-NULL array
+ */
+kdtree_trace_call *kdtree_trace_load(const char *path, size_t *n);
+
+#endif
@@ -0,0 +1,468 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "kdtree.h"
+#include "kdtree_file.h"
+#include "kdtree_internal.h"
+#include "kdtree_trace.h"
+#include "kdtree_wal.h"
+#include "location.h"
+
+//the log is a 16-byte header (magic, then the version as a little-endian
+//64-bit word) followed by records of three little-endian words: the
+//longitude's bits, the latitude's bits, and a tag whose low 8 bits say
+//add or remove and whose other bits are the top of a checksum of all three
+#define KDTREE_WAL_HEADER_SIZE 16
+#define KDTREE_WAL_RECORD_SIZE 24
+#define KDTREE_WAL_VERSION 1
+#define KDTREE_WAL_ADD 1
+#define KDTREE_WAL_REMOVE 2
+
+//records read at once while replaying the log
+#define KDTREE_WAL_REPLAY_CHUNK 4096
+
+static const char kdtree_wal_magic[8] = {'K', 'D', 'T', 'W', 'A', 'L', '\r', '\n'};
+
+struct kdtree_wal{
+    kdtree *tree;
+    char *snapshot_path;
+    int fd;
+    long interval_ns;
+
+    //everything below is guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t synced;       //signalled after each commit
+    unsigned char *pending;      //records not yet handed to a commit
+    size_t pending_size;
+    size_t pending_capacity;
+    unsigned char *spare;        //the buffer the last commit wrote from
+    size_t spare_capacity;
+    uint64_t appended;           //records appended since the log was opened
+    uint64_t durable;            //how many of them are known to be on disk
+    bool committing;             //a thread is writing and syncing a group
+    bool failed;                 //a write or sync failed, so nothing more is durable
+    size_t commits;
+};
+
+static uint64_t kdtree_wal_tag(uint64_t lon, uint64_t lat, int op){
+    uint64_t h = kdtree_file_checksum(KDTREE_FILE_CHECKSUM_START, lon);
+    h = kdtree_file_checksum(h, lat);
+    h = kdtree_file_checksum(h, op);
+    return (h & ~(uint64_t)0xff) | op;
+}
+
+static void kdtree_wal_encode(unsigned char *record, int op, const location *p){
+    uint64_t lon, lat;
+    memcpy(&lon, &p->lon, sizeof(lon));
+    memcpy(&lat, &p->lat, sizeof(lat));
+    kdtree_file_put64(record, lon);
+    kdtree_file_put64(record + 8, lat);
+    kdtree_file_put64(record + 16, kdtree_wal_tag(lon, lat, op));
+}
+
+//returns the record's operation, or 0 if it is damaged
+static int kdtree_wal_decode(const unsigned char *record, location *p){
+    uint64_t lon = kdtree_file_get64(record);
+    uint64_t lat = kdtree_file_get64(record + 8);
+    uint64_t tag = kdtree_file_get64(record + 16);
+    int op = tag & 0xff;
+    if ((op != KDTREE_WAL_ADD && op != KDTREE_WAL_REMOVE) || tag != kdtree_wal_tag(lon, lat, op)){
+        return 0;
+    }
+    memcpy(&p->lon, &lon, sizeof(lon));
+    memcpy(&p->lat, &lat, sizeof(lat));
+    return op;
+}
+
+static bool kdtree_wal_write(int fd, const unsigned char *buf, size_t size){
+    while (size > 0){
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno != EINTR){
+            return false;
+        }
+        if (n > 0){
+            buf += n;
+            size -= n;
+        }
+    }
+    return true;
+}
+
+//makes room for n more pending records; lock must be held
+static bool kdtree_wal_reserve(kdtree_wal *w, size_t n){
+    size_t needed = w->pending_size + n * KDTREE_WAL_RECORD_SIZE;
+    if (needed <= w->pending_capacity){
+        return true;
+    }
+    size_t capacity = w->pending_capacity == 0 ? 64 * KDTREE_WAL_RECORD_SIZE : w->pending_capacity;
+    while (capacity < needed){
+        capacity *= 2;
+    }
+    unsigned char *bigger = realloc(w->pending, capacity);
+    if (bigger == NULL){
+        return false;
+    }
+    w->pending = bigger;
+    w->pending_capacity = capacity;
+    return true;
+}
+
+//adds a record to the pending group; room must have been reserved
+static void kdtree_wal_append(kdtree_wal *w, int op, const location *p){
+    kdtree_wal_encode(w->pending + w->pending_size, op, p);
+    w->pending_size += KDTREE_WAL_RECORD_SIZE;
+    w->appended++;
+}
+
+//takes back the updates in the given records, newest first; lock must be
+//held
+static void kdtree_wal_undo(kdtree_wal *w, const unsigned char *records, size_t size){
+    for (size_t end = size; end > 0; end -= KDTREE_WAL_RECORD_SIZE){
+        location p;
+        int op = kdtree_wal_decode(records + end - KDTREE_WAL_RECORD_SIZE, &p);
+        if (op == KDTREE_WAL_ADD){
+            kdtree_do_remove(w->tree, &p);
+        } else if (op == KDTREE_WAL_REMOVE){
+            kdtree_do_add(w->tree, &p);
+        }
+    }
+}
+
+//waits until the first target records are on disk, leading a group
+//commit if no other thread is; lock must be held
+static bool kdtree_wal_commit(kdtree_wal *w, uint64_t target){
+    while (w->durable < target && !w->failed){
+        if (w->committing){
+            pthread_cond_wait(&w->synced, &w->lock);
+            continue;
+        }
+
+        //give other updates a moment to join, then write everything
+        //pending with one write and one sync
+        w->committing = true;
+        if (w->interval_ns > 0){
+            pthread_mutex_unlock(&w->lock);
+            struct timespec pause = {w->interval_ns / 1000000000, w->interval_ns % 1000000000};
+            nanosleep(&pause, NULL);
+            pthread_mutex_lock(&w->lock);
+        }
+        unsigned char *group = w->pending;
+        size_t size = w->pending_size;
+        size_t capacity = w->pending_capacity;
+        uint64_t end = w->appended;
+        w->pending = w->spare;
+        w->pending_size = 0;
+        w->pending_capacity = w->spare_capacity;
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = kdtree_wal_write(w->fd, group, size) && fdatasync(w->fd) == 0;
+
+        pthread_mutex_lock(&w->lock);
+        w->spare = group;
+        w->spare_capacity = capacity;
+        if (ok){
+            w->durable = end;
+        } else{
+            //every update not on disk is in this group or was made since,
+            //and only logged updates changed the tree, so undoing them
+            //leaves it as the log has it
+            w->failed = true;
+            kdtree_wal_undo(w, w->pending, w->pending_size);
+            kdtree_wal_undo(w, group, size);
+            w->pending_size = 0;
+        }
+        w->commits++;
+        w->committing = false;
+        pthread_cond_broadcast(&w->synced);
+    }
+    return !w->failed;
+}
+
+//builds a tree from the snapshot file, or an empty one if there is none
+static kdtree *kdtree_wal_load(const char *path){
+    struct stat st;
+    if (stat(path, &st) != 0){
+        return errno == ENOENT ? kdtree_create(NULL, 0) : NULL;
+    }
+    kdtree *saved = kdtree_open_mmap(path);
+    if (saved == NULL){
+        return NULL;
+    }
+    //every record, since valid points may have any finite longitude
+    size_t count;
+    location *pts = kdtree_points(saved, &count);
+    size_t expected = kdtree_size(saved);
+    kdtree_destroy(saved);
+    kdtree *t = NULL;
+    if (pts != NULL && count == expected){
+        t = kdtree_create(pts, count);
+    }
+    free(pts);
+    return t;
+}
+
+//checks the log's header, writing one if the log is new
+static bool kdtree_wal_header(int fd){
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        return false;
+    }
+    unsigned char header[KDTREE_WAL_HEADER_SIZE];
+    if (st.st_size == 0){
+        memcpy(header, kdtree_wal_magic, sizeof(kdtree_wal_magic));
+        kdtree_file_put64(header + 8, KDTREE_WAL_VERSION);
+        return kdtree_wal_write(fd, header, sizeof(header)) && fsync(fd) == 0;
+    }
+    return pread(fd, header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header, kdtree_wal_magic, sizeof(kdtree_wal_magic)) == 0
+        && kdtree_file_get64(header + 8) == KDTREE_WAL_VERSION;
+}
+
+//applies the log to t, and cuts off anything after the last good record
+static bool kdtree_wal_replay(kdtree *t, int fd){
+    unsigned char *chunk = malloc(KDTREE_WAL_RECORD_SIZE * KDTREE_WAL_REPLAY_CHUNK);
+    location *adds = malloc(sizeof(location) * KDTREE_WAL_REPLAY_CHUNK);
+    if (chunk == NULL || adds == NULL){
+        free(chunk);
+        free(adds);
+        return false;
+    }
+
+    off_t good = KDTREE_WAL_HEADER_SIZE;
+    bool ok = true;
+    bool torn = false;
+    while (ok && !torn){
+        ssize_t n = pread(fd, chunk, KDTREE_WAL_RECORD_SIZE * KDTREE_WAL_REPLAY_CHUNK, good);
+        if (n < 0){
+            ok = errno == EINTR;
+            continue;
+        }
+        size_t records = n / KDTREE_WAL_RECORD_SIZE;
+        if (records == 0){
+            //the end, perhaps with part of a record torn off by a crash
+            torn = n > 0;
+            break;
+        }
+
+        size_t run = 0;
+        for (size_t i = 0; i < records && !torn; i++){
+            location p;
+            int op = kdtree_wal_decode(chunk + i * KDTREE_WAL_RECORD_SIZE, &p);
+            if (op == KDTREE_WAL_ADD){
+                adds[run++] = p;
+            } else{
+                kdtree_do_add_many(t, adds, run);
+                run = 0;
+                if (op == KDTREE_WAL_REMOVE){
+                    kdtree_do_remove(t, &p);
+                } else{
+                    torn = true;
+                    break;
+                }
+            }
+            good += KDTREE_WAL_RECORD_SIZE;
+        }
+        kdtree_do_add_many(t, adds, run);
+    }
+    free(chunk);
+    free(adds);
+
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0;
+    if (ok && st.st_size > good){
+        ok = ftruncate(fd, good) == 0 && fsync(fd) == 0;
+    }
+    return ok;
+}
+
+kdtree_wal *kdtree_wal_open(const char *snapshot_path, const char *log_path, long commit_interval_us){
+    if (snapshot_path == NULL || log_path == NULL || commit_interval_us < 0){
+        return NULL;
+    }
+    kdtree_wal *w = malloc(sizeof(kdtree_wal));
+    if (w == NULL){
+        return NULL;
+    }
+    w->snapshot_path = malloc(strlen(snapshot_path) + 1);
+    w->tree = kdtree_wal_load(snapshot_path);
+    w->fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    //replay before switching modes, since single-threaded removes are cheaper
+    bool ok = w->snapshot_path != NULL && w->tree != NULL && w->fd >= 0
+        && kdtree_wal_header(w->fd) && kdtree_wal_replay(w->tree, w->fd)
+        && kdtree_set_concurrency(w->tree, KDTREE_SINGLE_WRITER);
+    if (!ok){
+        if (w->fd >= 0){
+            close(w->fd);
+        }
+        kdtree_destroy(w->tree);
+        free(w->snapshot_path);
+        free(w);
+        return NULL;
+    }
+
+    strcpy(w->snapshot_path, snapshot_path);
+    w->interval_ns = commit_interval_us * 1000;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->synced, NULL);
+    w->pending = NULL;
+    w->pending_size = 0;
+    w->pending_capacity = 0;
+    w->spare = NULL;
+    w->spare_capacity = 0;
+    w->appended = 0;
+    w->durable = 0;
+    w->committing = false;
+    w->failed = false;
+    w->commits = 0;
+    return w;
+}
+
+bool kdtree_wal_add(kdtree_wal *w, const location *p){
+    if (w == NULL || p == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&w->lock);
+    //log only what changes the tree, and only if there is room to
+    bool added = !w->failed && kdtree_wal_reserve(w, 1) && kdtree_add(w->tree, p);
+    if (added){
+        kdtree_wal_append(w, KDTREE_WAL_ADD, p);
+        added = kdtree_wal_commit(w, w->appended);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return added;
+}
+
+static int kdtree_wal_compare(const void *a, const void *b){
+    const location *p = a;
+    const location *q = b;
+    if (p->lat != q->lat){
+        return p->lat < q->lat ? -1 : 1;
+    }
+    return (p->lon > q->lon) - (p->lon < q->lon);
+}
+
+size_t kdtree_wal_add_many(kdtree_wal *w, const location *pts, size_t n){
+    if (w == NULL || (pts == NULL && n > 0)){
+        return 0;
+    }
+    location *fresh = malloc(sizeof(location) * (n > 0 ? n : 1));
+    bool *there = malloc(sizeof(bool) * (n > 0 ? n : 1));
+    if (fresh == NULL || there == NULL){
+        free(fresh);
+        free(there);
+        return 0;
+    }
+    pthread_mutex_lock(&w->lock);
+    size_t added = 0;
+    if (!w->failed){
+        //the call is traced as it was made, but log only what changes the
+        //tree, as kdtree_wal_add does: the points not there yet, once each
+        kdtree_trace_record_many(KDTREE_OP_ADD, pts, n);
+        kdtree_do_contains_many(w->tree, pts, n, there);
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++){
+            if (!there[i]){
+                fresh[m++] = pts[i];
+            }
+        }
+        qsort(fresh, m, sizeof(location), kdtree_wal_compare);
+        size_t distinct = 0;
+        for (size_t i = 0; i < m; i++){
+            if (distinct == 0 || kdtree_wal_compare(&fresh[i], &fresh[distinct - 1]) != 0){
+                fresh[distinct++] = fresh[i];
+            }
+        }
+        if (kdtree_wal_reserve(w, distinct)){
+            added = kdtree_do_add_many(w->tree, fresh, distinct);
+            if (added < distinct){
+                //memory ran out part way, so find the ones that went in
+                kdtree_do_contains_many(w->tree, fresh, distinct, there);
+                m = 0;
+                for (size_t i = 0; i < distinct; i++){
+                    if (there[i]){
+                        fresh[m++] = fresh[i];
+                    }
+                }
+                distinct = m;
+            }
+            for (size_t i = 0; i < distinct; i++){
+                kdtree_wal_append(w, KDTREE_WAL_ADD, &fresh[i]);
+            }
+            if (!kdtree_wal_commit(w, w->appended)){
+                added = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(fresh);
+    free(there);
+    return added;
+}
+
+bool kdtree_wal_remove(kdtree_wal *w, const location *p){
+    if (w == NULL || p == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&w->lock);
+    bool removed = false;
+    if (!w->failed && kdtree_wal_reserve(w, 1)){
+        size_t before = kdtree_size(w->tree);
+        kdtree_remove(w->tree, p);
+        removed = kdtree_size(w->tree) != before;
+    }
+    if (removed){
+        kdtree_wal_append(w, KDTREE_WAL_REMOVE, p);
+        removed = kdtree_wal_commit(w, w->appended);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return removed;
+}
+
+const kdtree *kdtree_wal_tree(const kdtree_wal *w){
+    return w == NULL ? NULL : w->tree;
+}
+
+bool kdtree_wal_checkpoint(kdtree_wal *w){
+    if (w == NULL){
+        return false;
+    }
+    pthread_mutex_lock(&w->lock);
+    //every update so far is already on disk (each one waits for that), so
+    //no commit is running and the log holds exactly what the tree does
+    bool ok = kdtree_wal_commit(w, w->appended) && kdtree_save(w->tree, w->snapshot_path);
+    ok = ok && ftruncate(w->fd, KDTREE_WAL_HEADER_SIZE) == 0 && fsync(w->fd) == 0;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+void kdtree_wal_get_stats(kdtree_wal *w, kdtree_wal_stats *s){
+    if (w == NULL || s == NULL){
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    s->records = w->appended;
+    s->commits = w->commits;
+    pthread_mutex_unlock(&w->lock);
+}
+
+void kdtree_wal_close(kdtree_wal *w){
+    if (w == NULL){
+        return;
+    }
+    close(w->fd);
+    kdtree_destroy(w->tree);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->synced);
+    free(w->pending);
+    free(w->spare);
+    free(w->snapshot_path);
+    free(w);
+}
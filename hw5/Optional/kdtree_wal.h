@@ -0,0 +1,139 @@
+#ifndef __KDTREE_WAL_H__
+#define __KDTREE_WAL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "kdtree.h"
+#include "location.h"
+
+/**
+ * A kdtree whose adds and removes survive crashes.  Every update is
+ * applied to the tree and appended as a 24-byte checksummed record to a
+ * write-ahead log, and does not return until the log is synced to disk.
+ * Updates from several threads share syncs (group commit): one of them
+ * waits for the commit interval so that others can join, then writes
+ * everything pending with one write and one sync.
+ *
+ * kdtree_wal_checkpoint saves the tree with kdtree_save and empties the
+ * log.  Opening loads the saved tree and replays the log on top of it,
+ * passing runs of adds to kdtree_add_many.  Replaying updates that are
+ * already in the saved tree changes nothing (the last update to each
+ * point wins), so a crash part way through a checkpoint is harmless.
+ * A record torn by a crash ends the replay and is cut off the log.
+ *
+ * Updates may be called from any number of threads.  The tree is in
+ * KDTREE_SINGLE_WRITER mode, so any number of threads may query it at
+ * the same time.  An update is made to the tree before its record is on
+ * disk, so queries may see it while it waits for its sync.  If the log
+ * can't be written, the updates that didn't reach the disk are undone,
+ * so the tree again holds what opening the files would recover, and
+ * every later update fails.
+ */
+typedef struct kdtree_wal kdtree_wal;
+
+
+/**
+ * Counters describing a log.
+ */
+typedef struct
+{
+  size_t records;  // records appended since the log was opened
+  size_t commits;  // syncs since the log was opened
+} kdtree_wal_stats;
+
+
+/**
+ * Opens a durable tree, recovering whatever the given files hold.
+ * Either file may be missing, and is treated as empty; the log is
+ * created if it is missing.
+ *
+ * @param snapshot_path the name of the file kdtree_wal_checkpoint saves
+ * the tree to, non-NULL
+ * @param log_path the name of the log, non-NULL
+ * @param commit_interval_us how many microseconds an update waits for
+ * others to share its sync, or 0 to sync at once
+ * @return a pointer to the durable tree, or NULL if a file could not be
+ * read or written, the saved tree is damaged, the log is not a log of a
+ * known version, or memory could not be allocated
+ */
+kdtree_wal *kdtree_wal_open(const char *snapshot_path, const char *log_path, long commit_interval_us);
+
+
+/**
+ * Adds a copy of the given point, as for kdtree_add, and waits until the
+ * add is on disk.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if the point was added and the add is durable; false if
+ * it was already there, if memory could not be allocated, or if the log
+ * could not be written (in which case every later update fails)
+ */
+bool kdtree_wal_add(kdtree_wal *w, const location *p);
+
+
+/**
+ * Adds copies of the given points with kdtree_add_many, and waits until
+ * they are on disk.  Only the points that were not already there are
+ * logged, once each.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ * @param pts an array of valid locations; NULL is allowed if n = 0
+ * @param n the number of points in that array
+ * @return the number of points added, or 0 if they could not all be
+ * logged (as for kdtree_wal_add)
+ */
+size_t kdtree_wal_add_many(kdtree_wal *w, const location *pts, size_t n);
+
+
+/**
+ * Removes the given point, as for kdtree_remove, and waits until the
+ * remove is on disk.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ * @param p a pointer to a valid location, non-NULL
+ * @return true if the point was removed and the remove is durable, false
+ * if it wasn't there or could not be logged (as for kdtree_wal_add)
+ */
+bool kdtree_wal_remove(kdtree_wal *w, const location *p);
+
+
+/**
+ * Returns the tree, for queries.  The tree must not be changed except
+ * through the functions above.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ */
+const kdtree *kdtree_wal_tree(const kdtree_wal *w);
+
+
+/**
+ * Saves the tree to the snapshot file and empties the log, so the next
+ * open has less to replay.  Updates wait while the tree is saved.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ * @return true if successful, false if the snapshot could not be saved
+ * or the log could not be emptied
+ */
+bool kdtree_wal_checkpoint(kdtree_wal *w);
+
+
+/**
+ * Reads the given log's counters.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ * @param s a pointer to where to store the counters, non-NULL
+ */
+void kdtree_wal_get_stats(kdtree_wal *w, kdtree_wal_stats *s);
+
+
+/**
+ * Closes the log and destroys the tree.  Every update that returned
+ * true is already on disk.  No other thread may be using the tree.
+ *
+ * @param w a pointer to a valid durable tree, non-NULL
+ */
+void kdtree_wal_close(kdtree_wal *w);
+
+#endif
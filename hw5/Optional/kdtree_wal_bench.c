@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "kdtree.h"
+#include "kdtree_dataset.h"
+#include "kdtree_wal.h"
+#include "location.h"
+
+/**
+ * Measures durable update throughput for several group commit
+ * intervals.
+ *
+ * USAGE: ./WalBench [updates [threads [directory [dataset]]]]
+ *
+ * For each commit interval, opens an empty durable tree with its files
+ * in the given directory (. by default), has the given number of threads
+ * (8 by default) share the given number of adds (20000 by default) of
+ * points of the given kind in kdtree_dataset.h (uniform by default), and
+ * prints the time, the updates per second, the number of syncs and the
+ * average number of updates per sync.  The files are removed afterwards.
+ */
+
+static const long wal_intervals[] = {0, 50, 200, 1000, 5000};
+
+typedef struct {
+    kdtree_wal *w;
+    const location *pts;
+    size_t n;
+} wal_arg;
+
+static void *wal_worker(void *a){
+    wal_arg *arg = a;
+    for (size_t i = 0; i < arg->n; i++){
+        kdtree_wal_add(arg->w, &arg->pts[i]);
+    }
+    return NULL;
+}
+
+static double wal_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//runs the adds with the given commit interval; returns the seconds taken
+static double wal_run(const char *snapshot, const char *log, long interval, const location *pts, size_t n, size_t threads, kdtree_wal_stats *s){
+    remove(snapshot);
+    remove(log);
+    kdtree_wal *w = kdtree_wal_open(snapshot, log, interval);
+    wal_arg *args = malloc(sizeof(wal_arg) * threads);
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if (w == NULL || args == NULL || ids == NULL){
+        free(args);
+        free(ids);
+        if (w != NULL){
+            kdtree_wal_close(w);
+        }
+        return -1.0;
+    }
+    for (size_t i = 0; i < threads; i++){
+        size_t start = n * i / threads;
+        size_t end = n * (i + 1) / threads;
+        args[i] = (wal_arg){w, pts + start, end - start};
+    }
+
+    double start = wal_now();
+    size_t started = 0;
+    while (started < threads && pthread_create(&ids[started], NULL, wal_worker, &args[started]) == 0){
+        started++;
+    }
+    for (size_t i = started; i < threads; i++){
+        wal_worker(&args[i]);
+    }
+    for (size_t i = 0; i < started; i++){
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = wal_now() - start;
+
+    kdtree_wal_get_stats(w, s);
+    kdtree_wal_close(w);
+    free(args);
+    free(ids);
+    remove(snapshot);
+    remove(log);
+    return elapsed;
+}
+
+int main(int argc, char **argv){
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+    const char *dir = argc > 3 ? argv[3] : ".";
+    kdtree_dataset d = KDTREE_DATASET_UNIFORM;
+    if (n == 0 || threads == 0 || argc > 5 || (argc > 4 && !kdtree_dataset_parse(argv[4], &d))){
+        fprintf(stderr, "USAGE: %s [updates [threads [directory [dataset]]]]\n", argv[0]);
+        return 1;
+    }
+
+    location *pts = malloc(sizeof(location) * n);
+    char *snapshot = malloc(strlen(dir) + 32);
+    char *log = malloc(strlen(dir) + 32);
+    if (pts == NULL || snapshot == NULL || log == NULL || !kdtree_dataset_generate(d, 474, pts, n)){
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        free(pts);
+        free(snapshot);
+        free(log);
+        return 1;
+    }
+    sprintf(snapshot, "%s/wal_bench.kdt", dir);
+    sprintf(log, "%s/wal_bench.log", dir);
+
+    printf("%-12s %10s %14s %10s %12s\n", "interval-us", "seconds", "updates/second", "syncs", "per-sync");
+    for (size_t i = 0; i < sizeof(wal_intervals) / sizeof(wal_intervals[0]); i++){
+        kdtree_wal_stats s;
+        double elapsed = wal_run(snapshot, log, wal_intervals[i], pts, n, threads, &s);
+        if (elapsed < 0){
+            fprintf(stderr, "%s: could not open %s\n", argv[0], log);
+            break;
+        }
+        printf("%-12ld %10.3f %14.0f %10zu %12.1f\n", wal_intervals[i], elapsed, s.records / elapsed,
+               s.commits, s.commits > 0 ? (double)s.records / s.commits : 0.0);
+    }
+
+    free(pts);
+    free(snapshot);
+    free(log);
+    return 0;
+}
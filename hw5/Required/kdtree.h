@@ -2,6 +2,8 @@
 #define __KDTREE_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "location.h"
 
@@ -37,7 +39,7 @@ kdtree *kdtree_create(const location *pts, int n);
  * effect if the point is already in the tree.  The tree need not be
  * balanced after the add.  The return value is true if the point was
  * added successfully and false otherwise (if the point was already in the
- * tree).
+ * tree or memory could not be allocated).
  *
  * @param t a pointer to a valid k-d tree, non-NULL
  * @param p a pointer to a valid location, non-NULL
@@ -46,6 +48,22 @@ kdtree *kdtree_create(const location *pts, int n);
 bool kdtree_add(kdtree *t, const location *p);
 
 
+/**
+ * Adds copies of the given points to the given k-d tree, skipping any
+ * that are already there, as if by calling kdtree_add on each.  The
+ * points are added in order along a space-filling curve rather than in
+ * the order given, so that consecutive adds descend through mostly the
+ * same nodes, which is faster for large batches.  The tree ends up as if
+ * the points had been added in that order.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param pts an array of n valid locations; NULL is allowed if n = 0
+ * @param n the number of points to add
+ * @return the number of points that were added
+ */
+size_t kdtree_add_many(kdtree *t, const location *pts, size_t n);
+
+
 /**
  * Determines if the given tree contains a point with the same coordinates
  * as the given point.
@@ -57,6 +75,22 @@ bool kdtree_add(kdtree *t, const location *p);
 bool kdtree_contains(const kdtree *t, const location *p);
 
 
+/**
+ * Determines, for each of the given points, if the given tree contains a
+ * point with the same coordinates.  The result is the same as calling
+ * kdtree_contains on each point, but the searches for several points are
+ * interleaved so that the memory accesses of one can overlap with the
+ * comparisons of the others, which is much faster for large trees.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param pts an array of n valid locations; NULL is allowed if n = 0
+ * @param n the number of points to look up
+ * @param out an array of n bools to store the results in; NULL is
+ * allowed if n = 0
+ */
+void kdtree_contains_many(const kdtree *t, const location *pts, size_t n, bool *out);
+
+
 /**
  * Removes the point with the coordinates as the given point
  * from this k-d tree.  The tree need not be balanced
@@ -84,6 +118,8 @@ void kdtree_remove(kdtree *t, const location *p);
  * both strictly greater than those in sw, non-NULL
  * @param n a pointer to an integer, non-NULL
  * @return a pointer to an array containing the points in the range, or NULL
+ * (with the integer set to 0 if memory for the array of a file-backed or
+ * paged tree ran out)
  */
 location *kdtree_range(const kdtree *t, const location *sw, const location *ne, int *n);
 
@@ -105,6 +141,498 @@ location *kdtree_range(const kdtree *t, const location *sw, const location *ne,
 void kdtree_range_for_each(const kdtree *t, const location *sw, const location *ne, void (*f)(const location *, void *), void *arg);
 
 
+/**
+ * Returns the same points as kdtree_range, searching the tree with up to
+ * the given number of threads.  The subtrees near the root are handed
+ * out as separate tasks that idle threads steal from busy ones; each
+ * thread collects its points in its own buffer, and the buffers are
+ * copied into the result at the end.  Small trees are searched on the
+ * calling thread.  It is the caller's responsibility to free the
+ * returned array if it is not NULL.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param nthreads the most threads to use, including the calling one
+ * @param n a pointer to an integer, non-NULL
+ * @return a pointer to an array containing the points in the range, or
+ * NULL if there are none or memory could not be allocated (in which case
+ * *n is 0)
+ */
+location *kdtree_range_parallel(const kdtree *t, const location *sw, const location *ne, size_t nthreads, int *n);
+
+
+/**
+ * Passes the points in the given rectangle to the given function, as
+ * kdtree_range_for_each does, but searching the tree with up to the given
+ * number of threads as kdtree_range_parallel does.  The function is
+ * called from several threads at once, so it must be safe to do so.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param sw a pointer to a valid location, non-NULL
+ * @param ne a pointer to a valid location with latitude and longitude
+ * both strictly greater than those in sw, non-NULL
+ * @param nthreads the most threads to use, including the calling one
+ * @param f a pointer to a thread-safe function that takes a location and
+ * the extra argument arg, non-NULL
+ * @param arg a pointer to be passed as the extra argument to f
+ */
+void kdtree_range_for_each_parallel(const kdtree *t, const location *sw, const location *ne, size_t nthreads, void (*f)(const location *, void *), void *arg);
+
+
+/**
+ * Returns the number of points in the given tree.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @return the number of points in t
+ */
+size_t kdtree_size(const kdtree *t);
+
+
+/**
+ * Starts keeping a hash set of the points in the given tree alongside
+ * it.  While the set is kept, kdtree_contains, kdtree_contains_many and
+ * the duplicate check in kdtree_add take expected constant time no
+ * matter what shape the tree is, and kdtree_remove returns immediately
+ * for points that are not in the tree.  The set uses about 32 bytes per
+ * point.  There is no effect if the set is already being kept.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @return true if the set is being kept, false if memory could not be
+ * allocated for it or the tree is in KDTREE_CONCURRENT_INSERT mode
+ */
+bool kdtree_enable_hash_index(kdtree *t);
+
+
+/**
+ * Stops keeping the hash set started by kdtree_enable_hash_index and
+ * frees it.  There is no effect if no set is being kept.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ */
+void kdtree_disable_hash_index(kdtree *t);
+
+
+/**
+ * Orders in which kdtree_relayout can place nodes in memory.
+ */
+typedef enum
+{
+  KDTREE_LAYOUT_DFS,     // preorder, so each subtree is contiguous
+  KDTREE_LAYOUT_HILBERT  // by the Hilbert curve index of each node's point
+} kdtree_layout;
+
+
+/**
+ * Copies the nodes of the given tree into one newly allocated block of
+ * memory, in the order last given to kdtree_set_auto_relayout (depth
+ * first by default), and frees the old nodes.  The shape of the tree
+ * does not change.  Trees that have had many points added and removed
+ * get back the memory locality of a freshly built tree.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @return true if the nodes were moved, false if memory could not be
+ * allocated (in which case the tree is unchanged)
+ */
+bool kdtree_relayout(kdtree *t);
+
+
+/**
+ * Sets the order used by kdtree_relayout and makes the given tree call
+ * kdtree_relayout by itself after every given number of successful adds
+ * and removes.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param order the order to place nodes in
+ * @param updates the number of updates between relayouts, or 0 to only
+ * relayout when kdtree_relayout is called
+ */
+void kdtree_set_auto_relayout(kdtree *t, kdtree_layout order, size_t updates);
+
+
+/**
+ * Ways a tree can be shared between threads.
+ */
+typedef enum
+{
+  KDTREE_SINGLE_THREADED, // one thread at a time (the default)
+  KDTREE_SINGLE_WRITER,   // any number of readers alongside one writer
+  KDTREE_CONCURRENT_INSERT // any number of readers and adders, no removes
+} kdtree_concurrency;
+
+
+/**
+ * Sets how the given tree may be shared between threads.  In
+ * KDTREE_SINGLE_WRITER mode, kdtree_contains, kdtree_contains_many,
+ * kdtree_size and the kdtree_range functions may be called from any
+ * number of threads while one thread calls the other functions.
+ * Readers never block and never see a partly changed tree: each add or
+ * remove becomes visible all at once, and the memory it frees is only
+ * reused once every reader that might be looking at it has finished.
+ * Removes copy the path to the replacement point instead of changing
+ * nodes in place, so they allocate a few nodes and leave the tree
+ * unchanged if that fails.  Readers do not use the hash index in this
+ * mode.
+ *
+ * In KDTREE_CONCURRENT_INSERT mode, any number of threads may call
+ * kdtree_add and the reading functions above at the same time, but no
+ * other function may be called.  Each new leaf is attached with a
+ * compare-and-swap on its parent's child link, and an add that loses a
+ * race carries on down from the node that won it, so two threads adding
+ * the same point still add it once.  The hash index is dropped when
+ * entering this mode, and automatic relayouts are put off until the
+ * mode is left.
+ *
+ * The mode may only be changed while no other thread is using the tree.
+ * Trees that kdtree_snapshot has been used on, and the snapshots
+ * themselves, stay in KDTREE_SINGLE_THREADED mode.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param mode the new mode
+ * @return true if successful, false if memory could not be allocated or
+ * the tree has been snapshotted (in which case the mode is unchanged)
+ */
+bool kdtree_set_concurrency(kdtree *t, kdtree_concurrency mode);
+
+
+/**
+ * Returns an unchangeable copy of the given tree as it is now, in
+ * constant time.  The snapshot shares all of its nodes with the tree;
+ * after this, adds and removes on the tree copy the nodes on the path
+ * they change instead of changing them in place, so the snapshot never
+ * sees them.  Nodes and relayout blocks are counted by how many trees
+ * and snapshots link to them and freed when the last one lets go.
+ *
+ * The snapshot can be passed to any function that does not change a
+ * tree, from any number of threads at once, including while another
+ * thread changes the tree it came from.  kdtree_add and kdtree_remove
+ * have no effect on it and kdtree_relayout fails.  It has no hash index
+ * unless kdtree_enable_hash_index is called on it.  Destroy it with
+ * kdtree_destroy; the tree and its snapshots may be destroyed in any
+ * order.
+ *
+ * @param t a pointer to a valid k-d tree in KDTREE_SINGLE_THREADED mode,
+ * or a snapshot, non-NULL
+ * @return a pointer to the snapshot, or NULL if memory could not be
+ * allocated or the tree is in another mode
+ */
+kdtree *kdtree_snapshot(kdtree *t);
+
+
+/**
+ * Saves the given tree to the given file, node for node, in a
+ * versioned, checksummed format with offsets instead of pointers and
+ * little-endian coordinates (see kdtree_file.h), so the file can be
+ * opened with kdtree_open_mmap on any machine.  The file is replaced
+ * all at once: until this returns true it still holds whatever it held
+ * before.  No thread may change the tree during the call.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param path the name of the file, non-NULL
+ * @return true if successful, false if the file could not be written
+ */
+bool kdtree_save(const kdtree *t, const char *path);
+
+
+/**
+ * Opens a file written by kdtree_save as a read-only tree.  The file is
+ * mapped into memory, checked once against its checksums, and then
+ * searched where it lies, so opening takes one pass over the file and
+ * processes that open the same file share its pages.  kdtree_contains,
+ * kdtree_contains_many, kdtree_range, kdtree_range_for_each, kdtree_size
+ * and kdtree_save work on the result and may be called from any number
+ * of threads at once; kdtree_add and kdtree_remove have no effect and
+ * kdtree_relayout, kdtree_enable_hash_index and kdtree_snapshot fail.
+ * Destroy it with kdtree_destroy.  The file must not be changed while it
+ * is open.
+ *
+ * @param path the name of the file, non-NULL
+ * @return a pointer to the tree, or NULL if the file could not be opened
+ * or mapped, is not a tree file of a known version, or is damaged
+ */
+kdtree *kdtree_open_mmap(const char *path);
+
+
+/**
+ * Saves the points of the given tree to the given file as a paged tree:
+ * 4 KiB pages, each either up to 255 points or up to eight levels of
+ * median splits leading to 256 child pages (see kdtree_paged.h).  A
+ * lookup reads one page per eight levels of splits, plus the leaf.  The
+ * file is replaced all at once, as for kdtree_save.  This needs memory
+ * for a copy of the points.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param path the name of the file, non-NULL
+ * @return true if successful, false if the file could not be written or
+ * memory could not be allocated
+ */
+bool kdtree_save_paged(const kdtree *t, const char *path);
+
+
+/**
+ * Opens a file written by kdtree_save_paged as a read-only tree that
+ * stays on disk.  Pages are read as queries need them and kept in a
+ * cache of the given number of pages, replaced by the CLOCK algorithm,
+ * so memory use doesn't grow with the file.  kdtree_contains,
+ * kdtree_contains_many, kdtree_range, kdtree_range_for_each and
+ * kdtree_size work on the result and may be called from any number of
+ * threads at once; kdtree_add and kdtree_remove have no effect and
+ * kdtree_relayout, kdtree_enable_hash_index, kdtree_snapshot and
+ * kdtree_save fail.  Destroy it with kdtree_destroy.
+ *
+ * @param path the name of the file, non-NULL
+ * @param cache_pages the number of 4 KiB pages to cache, at least 1
+ * @return a pointer to the tree, or NULL if the file could not be
+ * opened, is not a paged tree of a known version, or memory could not be
+ * allocated
+ */
+kdtree *kdtree_open_paged(const char *path, size_t cache_pages);
+
+
+/**
+ * Page reads by queries on trees opened with kdtree_open_paged.
+ */
+typedef struct
+{
+  size_t pages;   // pages the queries looked at
+  size_t reads;   // of those, pages not in the cache and read from disk
+} kdtree_io_stats;
+
+
+/**
+ * Reads the page counts of the calling thread's most recent
+ * kdtree_contains, kdtree_range or kdtree_range_for_each on a paged
+ * tree (all of the lookups, for kdtree_contains_many).
+ *
+ * @param io a pointer to where to store the counts, non-NULL
+ */
+void kdtree_last_query_io(kdtree_io_stats *io);
+
+
+/**
+ * Reads the page counts of every query on the given tree since it was
+ * opened, or zeros if it is not a paged tree.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param io a pointer to where to store the counts, non-NULL
+ */
+void kdtree_get_io_totals(const kdtree *t, kdtree_io_stats *io);
+
+
+/**
+ * The work done by queries on trees whose points are in nodes, counted
+ * only if the library is built with KDTREE_STATS defined (for example
+ * with -DKDTREE_STATS in CFLAGS).  Otherwise the counts are always zero
+ * and the queries do nothing to keep them.
+ */
+typedef struct
+{
+  size_t nodes_visited;   // nodes the query went to
+  size_t nodes_pruned;    // children it did not go to because they could not hold an answer
+  size_t points_tested;   // points compared with the query, including by the hash index
+  size_t points_emitted;  // points in the answer
+} kdtree_query_counters;
+
+
+/**
+ * Reads the counts of the calling thread's most recent kdtree_contains,
+ * kdtree_contains_many, kdtree_range or kdtree_range_for_each (counting
+ * all of the lookups for kdtree_contains_many).  The counts are zero if
+ * it was on a mapped or paged tree or split across threads.
+ *
+ * @param c a pointer to where to store the counts, non-NULL
+ */
+void kdtree_last_query_counters(kdtree_query_counters *c);
+
+
+/**
+ * Reads the counts of every query on the given tree since it was
+ * created.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param c a pointer to where to store the counts, non-NULL
+ */
+void kdtree_get_query_totals(const kdtree *t, kdtree_query_counters *c);
+
+
+/**
+ * The shape of a tree and the memory it uses, from kdtree_stats.
+ */
+typedef struct
+{
+  size_t size;             // points
+  size_t height;           // levels, 0 for an empty tree
+  size_t leaves;           // nodes with no children
+  double mean_leaf_depth;  // average depth of the leaves, with the root at depth 0
+  size_t max_leaf_depth;   // height - 1 for a tree that isn't empty
+  double imbalance;        // height over that of a balanced tree of the same size, at least 1; 0 if empty
+  size_t memory;           // bytes used by this tree, counting nodes it shares with snapshots
+} kdtree_tree_stats;
+
+
+/**
+ * Measures the given tree by walking every node, so this takes time in
+ * proportion to its size.  A tree built by kdtree_create has an
+ * imbalance of 1; adding points in sorted order drives it up.  For a
+ * paged tree only the size and memory are filled in, and the memory of
+ * a mapped tree includes the whole file.
+ *
+ * @param t a pointer to a valid k-d tree, non-NULL
+ * @param s a pointer to where to store the measurements, non-NULL
+ * @return true if successful, false if memory for the walk could not be
+ * allocated
+ */
+bool kdtree_stats(const kdtree *t, kdtree_tree_stats *s);
+
+
+/**
+ * The operations whose latency can be recorded.
+ */
+typedef enum
+{
+  KDTREE_OP_ADD,            // kdtree_add
+  KDTREE_OP_CONTAINS,       // kdtree_contains
+  KDTREE_OP_REMOVE,         // kdtree_remove
+  KDTREE_OP_RANGE,          // kdtree_range
+  KDTREE_OP_RANGE_FOR_EACH, // kdtree_range_for_each, including the calls to its function
+  KDTREE_OPERATIONS         // the number of operations
+} kdtree_operation;
+
+
+/**
+ * The latency of one operation over every call recorded since the last
+ * reset, in nanoseconds.  Each call is counted in a bucket whose width
+ * is 1/32 of the powers of two it lies between, and percentiles are read
+ * as the top of their bucket, so they are never below the true value
+ * and at most about 3% above it.  Calls of 2^40 nanoseconds (about 18
+ * minutes) or longer are all counted as that long.
+ */
+typedef struct
+{
+  uint64_t count;  // calls recorded
+  uint64_t p50;    // median
+  uint64_t p99;    // 99th percentile
+  uint64_t p999;   // 99.9th percentile
+  uint64_t max;    // slowest
+} kdtree_latency;
+
+
+/**
+ * Turns recording of the latency of kdtree_add, kdtree_contains,
+ * kdtree_remove, kdtree_range and kdtree_range_for_each on or off for
+ * all trees in the process.  It is off to begin with; while it is off
+ * each call pays only for checking that.  While it is on, each call
+ * reads the monotonic clock twice and counts itself in a histogram of
+ * the calling thread's own, so threads never contend for one.  Calls
+ * these functions make to one another, and calls from functions such as
+ * kdtree_add_many, are not recorded separately, nor is work the wrapper
+ * modules do on their own, such as replaying a log after a rebuild or a
+ * crash.  A query on a forest is recorded as one call.
+ *
+ * @param on true to start recording, false to stop
+ */
+void kdtree_latency_enable(bool on);
+
+
+/**
+ * Merges the histograms of every thread, including threads that have
+ * exited, for the given operation and reads them.  Any thread may call
+ * this while others are recording.
+ *
+ * @param op the operation
+ * @param l a pointer to where to store the latency, non-NULL
+ */
+void kdtree_latency_read(kdtree_operation op, kdtree_latency *l);
+
+
+/**
+ * Discards every call recorded so far, for all operations.  Calls that
+ * other threads are recording at the same time may be kept or discarded.
+ */
+void kdtree_latency_reset(void);
+
+
+/**
+ * Starts writing a trace of every call to kdtree_add, kdtree_contains,
+ * kdtree_remove, kdtree_range and kdtree_range_for_each on any tree in
+ * the process to the given file, with their arguments and the time
+ * between them, in the format described in kdtree_trace.h.  The trace
+ * holds no other points, so it can be replayed by ./Replay against a
+ * tree built from different data.  Calls to kdtree_add_many and
+ * kdtree_contains_many are written as a call for each of their points.
+ * Calls whose arguments are refused, such as a NULL point, are not
+ * written, nor is work the wrapper modules do on their own, such as
+ * replaying a log; a query on a forest is written as one call.  Calls
+ * are recorded as they start, in the order they take a lock shared by
+ * all threads; while no trace is being written each call pays only for
+ * checking that.
+ *
+ * @param path the name of the file to write, which is replaced if it
+ * exists, non-NULL
+ * @return true if tracing started, false if a trace is already being
+ * written or the file could not be created
+ */
+bool kdtree_trace_start(const char *path);
+
+
+/**
+ * Stops writing the trace started by kdtree_trace_start and closes its
+ * file.  Calls that other threads make at the same time may or may not
+ * be in the trace.
+ *
+ * @return true if every call traced was written, false if a write
+ * failed or no trace was being written
+ */
+bool kdtree_trace_stop(void);
+
+
+/**
+ * Formats of the records kdtree_load_stream reads.
+ */
+typedef enum
+{
+  KDTREE_STREAM_CSV,    // text, one "latitude,longitude" line per point
+  KDTREE_STREAM_BINARY  // 16 bytes per point: latitude then longitude, little-endian doubles
+} kdtree_stream_format;
+
+
+/**
+ * Where kdtree_load_stream reads from, and what it found there.
+ */
+typedef struct
+{
+  int fd;                       // descriptor to read from, at the first record
+  kdtree_stream_format format;  // how the records are written
+  size_t records;               // set by kdtree_load_stream: records read
+  size_t rejected;              // set by kdtree_load_stream: records skipped
+} kdtree_stream_reader;
+
+
+/**
+ * Creates a balanced k-d tree from the records read from the reader's
+ * descriptor up to end of file.  A regular file is mapped into memory
+ * and parsed where it lies; anything else (a pipe, a socket) is read in
+ * large chunks.  Records are read straight into the block of nodes the
+ * tree keeps, so loading needs little more memory than the tree itself
+ * and no array of points, and duplicates are dropped as for
+ * kdtree_create.
+ *
+ * CSV lines may have spaces around the numbers and end in "\n" or
+ * "\r\n"; blank lines are ignored.  A line that is not two numbers
+ * separated by a comma (such as a header line), a location for which
+ * location_validate fails, or a partial binary record at the end is
+ * counted in reader->rejected and skipped.  The descriptor is left at
+ * end of file and is not closed.
+ *
+ * @param reader a pointer to a reader whose fd and format are set,
+ * non-NULL
+ * @return a pointer to the tree, or NULL if the descriptor could not be
+ * read or memory could not be allocated
+ */
+kdtree *kdtree_load_stream(kdtree_stream_reader *reader);
+
+
 /**
  * Destroys the given k-d tree.  The tree is invalid after being destroyed.
  *
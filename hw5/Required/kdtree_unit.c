@@ -1,9 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "kdtree.h"
+#include "kdtree_compact.h"
+#include "kdtree_dataset.h"
+#include "kdtree_external.h"
+#include "kdtree_forest.h"
+#include "kdtree_managed.h"
+#include "kdtree_packed.h"
+#include "kdtree_shared.h"
+#include "kdtree_trace.h"
+#include "kdtree_ingest.h"
+#include "kdtree_wal.h"
 #include "location.h"
 
 void unit_test_remove(size_t n, bool readd);
@@ -15,6 +37,31 @@ void unit_test_range(size_t n, double sw_lat, double sw_lon, double ne_lat, doub
 
 void unit_test_add_time_random(size_t n, int on, double lat_scale, double lon_scale);
 void unit_test_range_time(size_t n, int on, double lat_scale, double lon_scale);
+void unit_test_compact(size_t n, kdtree_coord_type type);
+void unit_test_relayout(size_t n);
+void unit_test_contains_many(size_t n);
+void unit_test_hash_index(size_t n);
+void unit_test_single_writer(size_t n, size_t rounds);
+void unit_test_concurrent_insert(size_t n, size_t rounds);
+void unit_test_forest(size_t n, size_t lat_bands, size_t lon_bands);
+void unit_test_range_parallel(size_t n);
+void unit_test_managed(size_t n, size_t rebuild_every);
+void unit_test_ingest(size_t n, size_t capacity, size_t batch);
+void unit_test_snapshot(size_t n);
+void unit_test_save(size_t n);
+void unit_test_wal(size_t n, long interval);
+void unit_test_load_stream(size_t n);
+void unit_test_external(size_t n);
+void unit_test_paged(size_t n, size_t cache_pages);
+void unit_test_shared(size_t n, size_t workers);
+void unit_test_packed(size_t n);
+void unit_test_stats(size_t n);
+void unit_test_latency(size_t n);
+void unit_test_datasets(size_t n);
+void unit_test_trace(size_t n);
+void unit_test_wide_longitudes(size_t n);
+void unit_test_compact_ties(size_t n);
+void unit_test_paged_ties(size_t n);
 
 
 /**
@@ -34,6 +81,12 @@ void unit_print_point_formatted(const location *l, void *a);
 void unit_print_point(const location *, void *);
 
 
+/**
+ * Returns the time on the monotonic clock, in nanoseconds.
+ */
+uint64_t unit_trace_now(void);
+
+
 /**
  * Determines if two points are close in either latitude or longitude to
  * each other.  "Close" means within the given parameter.
@@ -166,6 +219,114 @@ int main(int argc, char **argv)
 	}
       break;
 
+    case 18:
+      unit_test_compact(unit_test_count, KDTREE_COORDS_INT32);
+      break;
+
+    case 19:
+      unit_test_compact(unit_test_count, KDTREE_COORDS_FLOAT32);
+      break;
+
+    case 20:
+      unit_test_relayout(unit_test_count);
+      break;
+
+    case 21:
+      unit_test_contains_many(unit_test_count / 2);
+      break;
+
+    case 22:
+      unit_test_hash_index(unit_test_count);
+      break;
+
+    case 23:
+      unit_test_single_writer(unit_test_count, 500);
+      break;
+
+    case 24:
+      unit_test_concurrent_insert(unit_test_count, 200);
+      break;
+
+    case 25:
+      unit_test_forest(unit_test_count, 36, 72);
+      break;
+
+    case 26:
+      unit_test_forest(unit_test_count, 1, 1);
+      break;
+
+    case 27:
+      unit_test_range_parallel(20000);
+      break;
+
+    case 28:
+      unit_test_managed(20000, 1500);
+      break;
+
+    case 29:
+      unit_test_ingest(20000, 64, 16);
+      break;
+
+    case 30:
+      unit_test_snapshot(20000);
+      break;
+
+    case 31:
+      unit_test_save(20000);
+      break;
+
+    case 32:
+      unit_test_wal(2000, 200);
+      break;
+
+    case 33:
+      unit_test_load_stream(60000);
+      break;
+
+    case 34:
+      unit_test_external(60000);
+      break;
+
+    case 35:
+      unit_test_paged(60000, 8);
+      break;
+
+    case 36:
+      unit_test_shared(60000, 3);
+      break;
+
+    case 37:
+      unit_test_packed(60000);
+      break;
+
+    case 38:
+      unit_test_stats(60000);
+      break;
+
+    case 39:
+      unit_test_latency(20000);
+      break;
+
+    case 40:
+      unit_test_datasets(20000);
+      break;
+
+    case 41:
+      unit_test_trace(20000);
+      break;
+
+    case 42:
+      unit_test_wide_longitudes(2000);
+      break;
+
+    case 43:
+      unit_test_compact_ties(100000);
+      break;
+
+    case 44:
+      unit_test_paged_ties(2000);
+      break;
+
     default:
       fprintf(stderr, "USAGE: %s test-number\n", argv[0]);
       return 1;
@@ -632,3 +793,2849 @@ void unit_test_range_time(size_t n, int on, double lat_scale, double lon_scale)
   kdtree_destroy(t);
   free(random_points);
 }
+
+
+void unit_test_compact(size_t n, kdtree_coord_type type)
+{
+  // round the test points so that they can be stored exactly
+  location pts[n];
+  for (size_t i = 0; i < n; i++)
+    {
+      if (type == KDTREE_COORDS_INT32)
+	{
+	  pts[i].lat = round(unit_test_points[i].lat * 1e6) / 1e6;
+	  pts[i].lon = round(unit_test_points[i].lon * 1e6) / 1e6;
+	}
+      else
+	{
+	  pts[i].lat = (float)unit_test_points[i].lat;
+	  pts[i].lon = (float)unit_test_points[i].lon;
+	}
+    }
+
+  // build from the first half and add the second half
+  kdtree_compact *t = kdtree_compact_create(pts, n / 2, type);
+  if (t == NULL)
+    {
+      printf("FAILED -- could not create tree\n");
+      return;
+    }
+
+  for (size_t i = n / 2; i < n; i++)
+    {
+      if (!kdtree_compact_add(t, &pts[i]))
+	{
+	  printf("FAILED -- could not add point %f %f\n", pts[i].lat, pts[i].lon);
+	  kdtree_compact_destroy(t);
+	  return;
+	}
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_compact_add(t, &pts[i]))
+	{
+	  printf("FAILED -- added duplicate point %f %f\n", pts[i].lat, pts[i].lon);
+	  kdtree_compact_destroy(t);
+	  return;
+	}
+    }
+
+  // the whole world should give back every point exactly
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  int count;
+  location *found = kdtree_compact_range(t, &sw, &ne, &count);
+  if (count != n || kdtree_compact_size(t) != n)
+    {
+      printf("FAILED -- range returned %d points\n", count);
+      free(found);
+      kdtree_compact_destroy(t);
+      return;
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      bool match = false;
+      for (size_t j = 0; j < count; j++)
+	{
+	  match = match || (found[j].lat == pts[i].lat && found[j].lon == pts[i].lon);
+	}
+      if (!match)
+	{
+	  printf("FAILED -- range lost point %f %f\n", pts[i].lat, pts[i].lon);
+	  free(found);
+	  kdtree_compact_destroy(t);
+	  return;
+	}
+    }
+  free(found);
+
+  // remove the even-indexed points
+  for (size_t i = 0; i < n; i += 2)
+    {
+      kdtree_compact_remove(t, &pts[i]);
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_compact_contains(t, &pts[i]) != (i % 2 == 1))
+	{
+	  printf("FAILED -- wrong membership after remove for %f %f\n", pts[i].lat, pts[i].lon);
+	  kdtree_compact_destroy(t);
+	  return;
+	}
+    }
+
+  kdtree_compact_destroy(t);
+  printf("PASSED\n");
+}
+
+
+void unit_test_compact_ties(size_t n)
+{
+  // half the points on one meridian and half on one parallel, so that
+  // most share the coordinate a level cuts on; a build that splits such
+  // runs one point at a time takes seconds rather than milliseconds
+  location *pts = malloc(sizeof(location) * n);
+  bool ok = pts != NULL;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      if (i % 2 == 0)
+	{
+	  pts[i].lat = round((-80.0 + 160.0 * i / n) * 1e5) / 1e5;
+	  pts[i].lon = -72.5;
+	}
+      else
+	{
+	  pts[i].lat = 41.25;
+	  pts[i].lon = round((-170.0 + 340.0 * i / n) * 1e4) / 1e4;
+	}
+    }
+
+  kdtree_coord_type types[] = {KDTREE_COORDS_INT32, KDTREE_COORDS_FLOAT32};
+  for (size_t k = 0; k < 2 && ok; k++)
+    {
+      uint64_t start = unit_trace_now();
+      kdtree_compact *t = kdtree_compact_create(pts, n, types[k]);
+      uint64_t elapsed = unit_trace_now() - start;
+      ok = t != NULL && elapsed < 500000000 && kdtree_compact_size(t) == n;
+      for (size_t i = 0; i < n && ok; i++)
+	{
+	  ok = kdtree_compact_contains(t, &pts[i]);
+	}
+
+      // a range around where they cross finds the points in it
+      location sw = {40.0, -73.0};
+      location ne = {42.0, -72.0};
+      int expected = 0;
+      for (size_t i = 0; i < n; i++)
+	{
+	  expected += pts[i].lat >= sw.lat && pts[i].lat <= ne.lat && pts[i].lon >= sw.lon && pts[i].lon <= ne.lon;
+	}
+      int count = 0;
+      location *found = ok ? kdtree_compact_range(t, &sw, &ne, &count) : NULL;
+      ok = ok && found != NULL && count == expected;
+      free(found);
+      kdtree_compact_destroy(t);
+    }
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- points sharing a coordinate were built slowly or wrongly\n");
+    }
+}
+
+
+void unit_test_relayout(size_t n)
+{
+  // create an empty tree that relayouts itself every 3 updates
+  kdtree *t = kdtree_create(NULL, 0);
+
+  if (t == NULL)
+    {
+      printf("FAILED -- could not create tree\n");
+      return;
+    }
+  kdtree_set_auto_relayout(t, KDTREE_LAYOUT_HILBERT, 3);
+
+  // add the points to it
+  for (size_t i = 0; i < n; i++)
+    {
+      if (!kdtree_add(t, &unit_test_points[i]))
+	{
+	  printf("FAILED -- could not add point %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  // remove the even-indexed points, then lay out depth first
+  for (size_t i = 0; i < n; i += 2)
+    {
+      kdtree_remove(t, &unit_test_points[i]);
+    }
+  kdtree_set_auto_relayout(t, KDTREE_LAYOUT_DFS, 0);
+  if (!kdtree_relayout(t))
+    {
+      printf("FAILED -- could not relayout\n");
+      kdtree_destroy(t);
+      return;
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_contains(t, &unit_test_points[i]) != (i % 2 == 1))
+	{
+	  printf("FAILED -- wrong membership after relayout for %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  // re-add the removed points to a tree with nodes in the block and on the heap
+  for (size_t i = 0; i < n; i += 2)
+    {
+      if (!kdtree_add(t, &unit_test_points[i]))
+	{
+	  printf("FAILED -- could not re-add point %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  int count;
+  location *pts = kdtree_range(t, &sw, &ne, &count);
+  free(pts);
+  if (count != n)
+    {
+      printf("FAILED -- range returned %d points\n", count);
+      kdtree_destroy(t);
+      return;
+    }
+
+  kdtree_destroy(t);
+  printf("PASSED\n");
+}
+
+
+void unit_test_contains_many(size_t n)
+{
+  // build a tree from the first n test points
+  kdtree *t = kdtree_create(unit_test_points, n);
+
+  if (t == NULL)
+    {
+      printf("FAILED -- could not create tree\n");
+      return;
+    }
+
+  // look up all the test points at once; only the first n should be found
+  bool found[unit_test_count];
+  kdtree_contains_many(t, unit_test_points, unit_test_count, found);
+
+  for (size_t i = 0; i < unit_test_count; i++)
+    {
+      if (found[i] != (i < n))
+	{
+	  printf("FAILED -- wrong result for point %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  kdtree_destroy(t);
+  printf("PASSED\n");
+}
+
+
+void unit_test_hash_index(size_t n)
+{
+  // build a tree from the first half of the points, then index it
+  kdtree *t = kdtree_create(unit_test_points, n / 2);
+
+  if (t == NULL || !kdtree_enable_hash_index(t))
+    {
+      printf("FAILED -- could not create indexed tree\n");
+      kdtree_destroy(t);
+      return;
+    }
+
+  // add the rest, checking duplicates are still rejected
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_add(t, &unit_test_points[i]) != (i >= n / 2))
+	{
+	  printf("FAILED -- wrong add result for point %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  // -0.0 and 0.0 are the same coordinate
+  location zero = {0.0, 0.0};
+  location negative_zero = {-0.0, -0.0};
+  if (!kdtree_add(t, &zero) || kdtree_add(t, &negative_zero) || !kdtree_contains(t, &negative_zero))
+    {
+      printf("FAILED -- -0.0 and 0.0 treated as different\n");
+      kdtree_destroy(t);
+      return;
+    }
+  kdtree_remove(t, &negative_zero);
+
+  // remove the even-indexed points, twice
+  for (size_t i = 0; i < n; i += 2)
+    {
+      kdtree_remove(t, &unit_test_points[i]);
+      kdtree_remove(t, &unit_test_points[i]);
+    }
+
+  // the index and the tree should agree
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  int count;
+  location *pts = kdtree_range(t, &sw, &ne, &count);
+  free(pts);
+  if (count != n / 2)
+    {
+      printf("FAILED -- range returned %d points\n", count);
+      kdtree_destroy(t);
+      return;
+    }
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_contains(t, &unit_test_points[i]) != (i % 2 == 1))
+	{
+	  printf("FAILED -- wrong membership for %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_destroy(t);
+	  return;
+	}
+    }
+
+  kdtree_destroy(t);
+  printf("PASSED\n");
+}
+
+
+typedef struct
+{
+  kdtree *t;
+  size_t n;
+  atomic_bool *done;
+  bool failed;
+} unit_reader_arg;
+
+
+/**
+ * Repeatedly checks that the first half of the test points, which the
+ * writer never touches, are always visible, and that no range query sees
+ * fewer of them or more points than there are.
+ */
+void *unit_test_reader(void *a)
+{
+  unit_reader_arg *arg = a;
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  bool found[sizeof(unit_test_points) / sizeof(location)];
+
+  do
+    {
+      for (size_t i = 0; i < arg->n / 2; i++)
+	{
+	  if (!kdtree_contains(arg->t, &unit_test_points[i]))
+	    {
+	      arg->failed = true;
+	    }
+	}
+      kdtree_contains_many(arg->t, unit_test_points, arg->n, found);
+      for (size_t i = 0; i < arg->n / 2; i++)
+	{
+	  arg->failed = arg->failed || !found[i];
+	}
+
+      int count;
+      location *pts = kdtree_range(arg->t, &sw, &ne, &count);
+      if (count < arg->n / 2 || count > arg->n)
+	{
+	  arg->failed = true;
+	}
+      free(pts);
+    }
+  while (!atomic_load(arg->done));
+
+  return NULL;
+}
+
+
+void unit_test_single_writer(size_t n, size_t rounds)
+{
+  kdtree *t = kdtree_create(unit_test_points, n / 2);
+
+  if (t == NULL || !kdtree_set_concurrency(t, KDTREE_SINGLE_WRITER) || !kdtree_enable_hash_index(t))
+    {
+      printf("FAILED -- could not create tree\n");
+      kdtree_destroy(t);
+      return;
+    }
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  unit_reader_arg args[3];
+  pthread_t readers[3];
+  size_t started = 0;
+  for (size_t r = 0; r < 3; r++)
+    {
+      args[r] = (unit_reader_arg){t, n, &done, false};
+      if (pthread_create(&readers[r], NULL, unit_test_reader, &args[r]) == 0)
+	{
+	  started++;
+	}
+    }
+
+  // churn the second half of the points, plus the first half's nodes by
+  // relayout, while the readers run
+  bool failed = false;
+  for (size_t round = 0; round < rounds; round++)
+    {
+      for (size_t i = n / 2; i < n; i++)
+	{
+	  failed = failed || !kdtree_add(t, &unit_test_points[i]);
+	}
+      if (round % 50 == 0)
+	{
+	  kdtree_relayout(t);
+	}
+      for (size_t i = n / 2; i < n; i++)
+	{
+	  kdtree_remove(t, &unit_test_points[i]);
+	}
+    }
+
+  atomic_store(&done, true);
+  for (size_t r = 0; r < started; r++)
+    {
+      pthread_join(readers[r], NULL);
+      failed = failed || args[r].failed;
+    }
+
+  // back to one thread, the tree should hold just the first half
+  kdtree_set_concurrency(t, KDTREE_SINGLE_THREADED);
+  for (size_t i = 0; i < n; i++)
+    {
+      failed = failed || kdtree_contains(t, &unit_test_points[i]) != (i < n / 2);
+    }
+
+  kdtree_destroy(t);
+  if (failed || started == 0)
+    {
+      printf("FAILED -- readers saw an inconsistent tree\n");
+    }
+  else
+    {
+      printf("PASSED\n");
+    }
+}
+
+
+typedef struct
+{
+  kdtree *t;
+  size_t n;
+  size_t first;
+  size_t added;
+} unit_adder_arg;
+
+
+/**
+ * Adds all n test points, starting from a different one in each thread
+ * so that the threads race to add the same points.
+ */
+void *unit_test_adder(void *a)
+{
+  unit_adder_arg *arg = a;
+  for (size_t i = 0; i < arg->n; i++)
+    {
+      if (kdtree_add(arg->t, &unit_test_points[(arg->first + i) % arg->n]))
+	{
+	  arg->added++;
+	}
+    }
+  return NULL;
+}
+
+
+void unit_test_concurrent_insert(size_t n, size_t rounds)
+{
+  for (size_t round = 0; round < rounds; round++)
+    {
+      kdtree *t = kdtree_create(unit_test_points, 0);
+      if (t == NULL || !kdtree_set_concurrency(t, KDTREE_CONCURRENT_INSERT))
+	{
+	  printf("FAILED -- could not create tree\n");
+	  kdtree_destroy(t);
+	  return;
+	}
+
+      unit_adder_arg args[4];
+      pthread_t adders[4];
+      size_t started = 0;
+      for (size_t a = 0; a < 4; a++)
+	{
+	  args[a] = (unit_adder_arg){t, n, a * n / 4, 0};
+	  if (pthread_create(&adders[a], NULL, unit_test_adder, &args[a]) == 0)
+	    {
+	      started++;
+	    }
+	}
+      size_t added = 0;
+      for (size_t a = 0; a < started; a++)
+	{
+	  pthread_join(adders[a], NULL);
+	  added += args[a].added;
+	}
+      if (started < 4)
+	{
+	  // make up for the threads that didn't start
+	  args[0] = (unit_adder_arg){t, n, 0, 0};
+	  unit_test_adder(&args[0]);
+	  added += args[0].added;
+	}
+
+      // every point should have been added exactly once
+      kdtree_set_concurrency(t, KDTREE_SINGLE_THREADED);
+      location sw = {-90.0, -180.0};
+      location ne = {90.0, 180.0};
+      int count;
+      location *pts = kdtree_range(t, &sw, &ne, &count);
+      free(pts);
+      bool all = true;
+      for (size_t i = 0; i < n; i++)
+	{
+	  all = all && kdtree_contains(t, &unit_test_points[i]);
+	}
+      kdtree_destroy(t);
+      if (added != n || count != n || !all)
+	{
+	  printf("FAILED -- %zu adds succeeded and range found %d points\n", added, count);
+	  return;
+	}
+    }
+  printf("PASSED\n");
+}
+
+
+/**
+ * Checks a range query on the given forest against the test points
+ * marked as present.
+ */
+bool unit_forest_range_ok(kdtree_forest *f, const bool *present, size_t n, double sw_lat, double sw_lon, double ne_lat, double ne_lon)
+{
+  location sw = {sw_lat, sw_lon};
+  location ne = {ne_lat, ne_lon};
+  int count;
+  location *pts = kdtree_forest_range(f, &sw, &ne, &count);
+
+  size_t expected = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      const location *p = &unit_test_points[i];
+      if (present[i] && p->lat >= sw_lat && p->lat <= ne_lat && p->lon >= sw_lon && p->lon <= ne_lon)
+	{
+	  expected++;
+	}
+    }
+
+  bool ok = count == expected;
+  for (int i = 0; i < count && ok; i++)
+    {
+      ok = pts[i].lat >= sw_lat && pts[i].lat <= ne_lat && pts[i].lon >= sw_lon && pts[i].lon <= ne_lon;
+    }
+  free(pts);
+  return ok;
+}
+
+
+void unit_test_forest(size_t n, size_t lat_bands, size_t lon_bands)
+{
+  // build from the first half of the points, with every point twice
+  location *twice = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n / 2; i++)
+    {
+      twice[2 * i] = unit_test_points[i];
+      twice[2 * i + 1] = unit_test_points[i];
+    }
+  kdtree_forest *f = kdtree_forest_create(twice, n / 2 * 2, lat_bands, lon_bands, 4);
+  free(twice);
+  if (f == NULL)
+    {
+      printf("FAILED -- could not create forest\n");
+      return;
+    }
+
+  bool present[sizeof(unit_test_points) / sizeof(location)];
+  for (size_t i = 0; i < n; i++)
+    {
+      present[i] = i < n / 2;
+    }
+
+  // add everything, then take out every third point
+  for (size_t i = 0; i < n; i++)
+    {
+      if (kdtree_forest_add(f, &unit_test_points[i]) != (i >= n / 2))
+	{
+	  printf("FAILED -- wrong add result for point %f %f\n", unit_test_points[i].lat, unit_test_points[i].lon);
+	  kdtree_forest_destroy(f);
+	  return;
+	}
+      present[i] = true;
+    }
+  for (size_t i = 0; i < n; i += 3)
+    {
+      kdtree_forest_remove(f, &unit_test_points[i]);
+      kdtree_forest_remove(f, &unit_test_points[i]);
+      present[i] = false;
+    }
+
+  size_t expected = 0;
+  bool ok = true;
+  for (size_t i = 0; i < n; i++)
+    {
+      expected += present[i];
+      ok = ok && kdtree_forest_contains(f, &unit_test_points[i]) == present[i];
+    }
+  ok = ok && kdtree_forest_size(f) == expected;
+
+  // rectangles inside one tile, across tile borders, and covering everything
+  ok = ok && unit_forest_range_ok(f, present, n, -90.0, -180.0, 90.0, 180.0);
+  ok = ok && unit_forest_range_ok(f, present, n, 22.0, -158.0, 23.0, -157.0);
+  ok = ok && unit_forest_range_ok(f, present, n, 17.0, -164.0, 23.0, -157.5);
+  ok = ok && unit_forest_range_ok(f, present, n, 20.0, -160.0, 20.0000001, -159.9999999);
+
+  kdtree_forest_destroy(f);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- forest disagrees with the points added\n");
+    }
+}
+
+
+/**
+ * Counts the points passed to it from any number of threads.
+ */
+void unit_count_point(const location *l, void *count)
+{
+  atomic_fetch_add((atomic_size_t *)count, 1);
+}
+
+
+int unit_compare_points(const void *a, const void *b)
+{
+  const location *l1 = a;
+  const location *l2 = b;
+  if (l1->lat != l2->lat)
+    {
+      return l1->lat < l2->lat ? -1 : 1;
+    }
+  return (l1->lon > l2->lon) - (l1->lon < l2->lon);
+}
+
+
+void unit_test_range_parallel(size_t n)
+{
+  // a random tree big enough to be searched in parallel, with some
+  // repeated coordinates
+  location *pts = malloc(sizeof(location) * n);
+  srand(474);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i].lat = (rand() % 18000) / 100.0 - 90.0;
+      pts[i].lon = (rand() % 36000) / 100.0 - 180.0;
+    }
+  kdtree *t = kdtree_create(pts, n / 2);
+  for (size_t i = n / 2; i < n; i++)
+    {
+      kdtree_add(t, &pts[i]);
+    }
+  free(pts);
+
+  double boxes[][4] = {{-90.0, -180.0, 90.0, 180.0}, {-30.5, -60.25, 45.0, 10.0}, {10.0, 10.0, 10.5, 10.5}, {95.0, 0.0, 96.0, 1.0}};
+  bool ok = true;
+  for (size_t b = 0; b < sizeof(boxes) / sizeof(boxes[0]); b++)
+    {
+      location sw = {boxes[b][0], boxes[b][1]};
+      location ne = {boxes[b][2], boxes[b][3]};
+      int expected;
+      location *serial = kdtree_range(t, &sw, &ne, &expected);
+      if (expected > 0)
+	{
+	  qsort(serial, expected, sizeof(location), unit_compare_points);
+	}
+
+      for (size_t threads = 1; threads <= 8; threads *= 2)
+	{
+	  int count;
+	  location *parallel = kdtree_range_parallel(t, &sw, &ne, threads, &count);
+	  if (count > 0)
+	    {
+	      qsort(parallel, count, sizeof(location), unit_compare_points);
+	    }
+	  ok = ok && count == expected && (count == 0 || memcmp(serial, parallel, sizeof(location) * count) == 0);
+	  free(parallel);
+
+	  atomic_size_t seen;
+	  atomic_init(&seen, 0);
+	  kdtree_range_for_each_parallel(t, &sw, &ne, threads, unit_count_point, &seen);
+	  ok = ok && atomic_load(&seen) == expected;
+	}
+      free(serial);
+    }
+
+  kdtree_destroy(t);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- parallel and serial range queries differ\n");
+    }
+}
+
+
+/**
+ * Returns the i-th point of a grid with no repeated points.
+ */
+location unit_grid_point(size_t i)
+{
+  location l = {(i / 400) * 0.25 - 80.0, (i % 400) * 0.5 - 170.0};
+  return l;
+}
+
+
+typedef struct
+{
+  kdtree_managed *m;
+  size_t n;
+  atomic_bool *done;
+  bool failed;
+} unit_managed_arg;
+
+
+/**
+ * Checks that the first quarter of the grid points, which are never
+ * removed, stay visible through every rebuild.
+ */
+void *unit_test_managed_reader(void *a)
+{
+  unit_managed_arg *arg = a;
+  size_t i = 0;
+  do
+    {
+      location p = unit_grid_point(i);
+      if (!kdtree_managed_contains(arg->m, &p))
+	{
+	  arg->failed = true;
+	}
+      i = (i + 1) % (arg->n / 4);
+    }
+  while (!atomic_load(arg->done));
+  return NULL;
+}
+
+
+void unit_test_managed(size_t n, size_t rebuild_every)
+{
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree_managed *m = kdtree_managed_create(pts, n / 2);
+  free(pts);
+  if (m == NULL)
+    {
+      printf("FAILED -- could not create handle\n");
+      return;
+    }
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  unit_managed_arg arg = {m, n, &done, false};
+  pthread_t reader;
+  bool started = pthread_create(&reader, NULL, unit_test_managed_reader, &arg) == 0;
+
+  // add the second half, in order so the tree gets very unbalanced, and
+  // remove the second quarter, with rebuilds running along the way
+  kdtree_managed_set_rebuild_every(m, rebuild_every);
+  bool ok = true;
+  for (size_t i = n / 2; i < n; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = ok && kdtree_managed_add(m, &p);
+      if (i % 2 == 0)
+	{
+	  location q = unit_grid_point(n / 4 + (i - n / 2) / 2);
+	  kdtree_managed_remove(m, &q);
+	}
+    }
+  ok = kdtree_managed_rebuild(m) && kdtree_managed_wait(m) && ok;
+
+  atomic_store(&done, true);
+  if (started)
+    {
+      pthread_join(reader, NULL);
+    }
+
+  ok = ok && !arg.failed && kdtree_managed_size(m) == n - n / 4;
+  for (size_t i = 0; i < n; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = ok && kdtree_managed_contains(m, &p) == (i < n / 4 || i >= n / 2);
+    }
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  int count;
+  location *all = kdtree_managed_range(m, &sw, &ne, &count);
+  free(all);
+  ok = ok && count == n - n / 4;
+
+  kdtree_managed_destroy(m);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- rebuilt tree lost or kept the wrong points\n");
+    }
+}
+
+
+typedef struct
+{
+  kdtree_ingest *q;
+  size_t first;
+  size_t end;
+  size_t retries;
+} unit_producer_arg;
+
+
+/**
+ * Submits adds of a range of grid points, then removes of every other
+ * one, retrying whenever the queue is full.
+ */
+void *unit_test_producer(void *a)
+{
+  unit_producer_arg *arg = a;
+  for (size_t i = arg->first; i < arg->end; i++)
+    {
+      location p = unit_grid_point(i);
+      while (!kdtree_ingest_add(arg->q, &p))
+	{
+	  arg->retries++;
+	  sched_yield();
+	}
+    }
+  for (size_t i = arg->first; i < arg->end; i += 2)
+    {
+      location p = unit_grid_point(i);
+      while (!kdtree_ingest_remove(arg->q, &p))
+	{
+	  arg->retries++;
+	  sched_yield();
+	}
+    }
+  return NULL;
+}
+
+
+void unit_test_ingest(size_t n, size_t capacity, size_t batch)
+{
+  // kdtree_add_many on its own, with a repeat
+  kdtree *t = kdtree_create(NULL, 0);
+  location some[] = {unit_test_points[0], unit_test_points[1], unit_test_points[0]};
+  if (t == NULL || kdtree_add_many(t, some, 3) != 2 || kdtree_size(t) != 2)
+    {
+      printf("FAILED -- kdtree_add_many added the wrong points\n");
+      kdtree_destroy(t);
+      return;
+    }
+  kdtree_destroy(t);
+
+  t = kdtree_create(NULL, 0);
+  kdtree_ingest *q = NULL;
+  if (t != NULL && kdtree_set_concurrency(t, KDTREE_SINGLE_WRITER))
+    {
+      q = kdtree_ingest_create(t, capacity, batch);
+    }
+  if (q == NULL)
+    {
+      printf("FAILED -- could not create queue\n");
+      kdtree_ingest_destroy(q);
+      kdtree_destroy(t);
+      return;
+    }
+
+  // four producers, each with its own quarter of the points
+  unit_producer_arg args[4];
+  pthread_t producers[4];
+  size_t started = 0;
+  for (size_t i = 0; i < 4; i++)
+    {
+      args[i] = (unit_producer_arg){q, n * i / 4, n * (i + 1) / 4, 0};
+      if (pthread_create(&producers[i], NULL, unit_test_producer, &args[i]) == 0)
+	{
+	  started++;
+	}
+    }
+  for (size_t i = started; i < 4; i++)
+    {
+      unit_test_producer(&args[i]);
+    }
+  for (size_t i = 0; i < started; i++)
+    {
+      pthread_join(producers[i], NULL);
+    }
+  kdtree_ingest_flush(q);
+
+  kdtree_ingest_stats s;
+  kdtree_ingest_get_stats(q, &s);
+  size_t retries = 0;
+  for (size_t i = 0; i < 4; i++)
+    {
+      retries += args[i].retries;
+    }
+  bool ok = s.capacity == capacity && s.depth == 0 && s.submitted == n + n / 2
+    && s.applied == s.submitted && s.rejected == retries && s.max_depth <= capacity
+    && s.batches > 0;
+
+  // every producer's removes come after its adds, so odd points remain
+  ok = ok && kdtree_size(t) == n / 2;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = kdtree_contains(t, &p) == ((i - n * (i * 4 / n) / 4) % 2 == 1);
+    }
+
+  kdtree_ingest_destroy(q);
+  kdtree_destroy(t);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- queue applied the wrong updates\n");
+    }
+}
+
+
+typedef struct
+{
+  const kdtree *snapshot;
+  size_t n;
+  atomic_bool *done;
+  bool failed;
+} unit_snapshot_arg;
+
+
+/**
+ * Checks that a snapshot of the first n grid points keeps all of them
+ * and nothing else while the tree it came from changes.
+ */
+void *unit_test_snapshot_reader(void *a)
+{
+  unit_snapshot_arg *arg = a;
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  size_t i = 0;
+  do
+    {
+      location p = unit_grid_point(i);
+      location q = unit_grid_point(i + arg->n);
+      if (!kdtree_contains(arg->snapshot, &p) || kdtree_contains(arg->snapshot, &q))
+	{
+	  arg->failed = true;
+	}
+      if (i % 1000 == 0)
+	{
+	  atomic_size_t count;
+	  atomic_init(&count, 0);
+	  kdtree_range_for_each(arg->snapshot, &sw, &ne, unit_count_point, &count);
+	  if (atomic_load(&count) != arg->n || kdtree_size(arg->snapshot) != arg->n)
+	    {
+	      arg->failed = true;
+	    }
+	}
+      i = (i + 1) % arg->n;
+    }
+  while (!atomic_load(arg->done));
+  return NULL;
+}
+
+
+/**
+ * Determines if the given tree holds exactly the grid points marked
+ * present among the first n.
+ */
+bool unit_snapshot_matches(const kdtree *t, const bool *present, size_t n)
+{
+  size_t expected = 0;
+  for (size_t i = 0; i < n; i++)
+    {
+      location p = unit_grid_point(i);
+      if (kdtree_contains(t, &p) != present[i])
+	{
+	  return false;
+	}
+      expected += present[i];
+    }
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  int count;
+  location *all = kdtree_range(t, &sw, &ne, &count);
+  free(all);
+  return kdtree_size(t) == expected && count == expected;
+}
+
+
+void unit_test_snapshot(size_t n)
+{
+  location *pts = malloc(sizeof(location) * n);
+  bool *present = calloc(n, sizeof(bool));
+  bool *middle = malloc(sizeof(bool) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+      present[i] = i < n / 2;
+    }
+  kdtree *t = kdtree_create(pts, n / 2);
+  free(pts);
+  kdtree *first = NULL;
+  if (t != NULL && kdtree_enable_hash_index(t))
+    {
+      first = kdtree_snapshot(t);
+    }
+  if (first == NULL)
+    {
+      printf("FAILED -- could not create snapshot\n");
+      kdtree_destroy(t);
+      free(present);
+      free(middle);
+      return;
+    }
+
+  atomic_bool done;
+  atomic_init(&done, false);
+  unit_snapshot_arg arg = {first, n / 2, &done, false};
+  pthread_t reader;
+  bool started = pthread_create(&reader, NULL, unit_test_snapshot_reader, &arg) == 0;
+
+  // add the second half and remove every other point of the first, with
+  // a relayout, a second snapshot and a switch away from the hash index
+  // half way through
+  kdtree *second = NULL;
+  bool ok = true;
+  for (size_t i = n / 2; i < n; i++)
+    {
+      if (i == n / 2 + n / 4)
+	{
+	  ok = ok && kdtree_relayout(t);
+	  kdtree_disable_hash_index(t);
+	  second = kdtree_snapshot(t);
+	  memcpy(middle, present, sizeof(bool) * n);
+	}
+      location p = unit_grid_point(i);
+      ok = ok && kdtree_add(t, &p);
+      present[i] = true;
+      if (i % 2 == 0)
+	{
+	  location q = unit_grid_point(i - n / 2);
+	  kdtree_remove(t, &q);
+	  present[i - n / 2] = false;
+	}
+    }
+
+  atomic_store(&done, true);
+  if (started)
+    {
+      pthread_join(reader, NULL);
+    }
+  ok = ok && second != NULL && !arg.failed && unit_snapshot_matches(t, present, n);
+
+  // snapshots can't be changed, and pin their tree to one thread
+  location p = unit_grid_point(n);
+  location q = unit_grid_point(0);
+  ok = ok && !kdtree_add(first, &p) && !kdtree_relayout(first)
+    && !kdtree_set_concurrency(t, KDTREE_SINGLE_WRITER);
+  kdtree_remove(first, &q);
+
+  // snapshots outlive the tree, and each other
+  kdtree *copy = kdtree_snapshot(second);
+  kdtree_destroy(t);
+  kdtree_destroy(second);
+  for (size_t i = 0; i < n; i++)
+    {
+      present[i] = i < n / 2;
+    }
+  ok = ok && copy != NULL && unit_snapshot_matches(copy, middle, n)
+    && unit_snapshot_matches(first, present, n);
+
+  kdtree_destroy(copy);
+  kdtree_destroy(first);
+  free(present);
+  free(middle);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- snapshot changed or tree lost updates\n");
+    }
+}
+
+
+/**
+ * Determines if two trees give the same points for the given rectangle.
+ */
+bool unit_same_range(const kdtree *t1, const kdtree *t2, double sw_lat, double sw_lon, double ne_lat, double ne_lon)
+{
+  location sw = {sw_lat, sw_lon};
+  location ne = {ne_lat, ne_lon};
+  int n1, n2;
+  location *pts1 = kdtree_range(t1, &sw, &ne, &n1);
+  location *pts2 = kdtree_range(t2, &sw, &ne, &n2);
+  atomic_size_t count;
+  atomic_init(&count, 0);
+  kdtree_range_for_each(t2, &sw, &ne, unit_count_point, &count);
+  bool same = n1 == n2 && atomic_load(&count) == n2;
+  if (same && n1 > 0)
+    {
+      qsort(pts1, n1, sizeof(location), unit_compare_points);
+      qsort(pts2, n2, sizeof(location), unit_compare_points);
+      same = memcmp(pts1, pts2, sizeof(location) * n1) == 0;
+    }
+  free(pts1);
+  free(pts2);
+  return same;
+}
+
+
+/**
+ * Changes the byte at the given offset in the given file.
+ */
+bool unit_flip_byte(const char *path, long offset)
+{
+  FILE *f = fopen(path, "r+b");
+  if (f == NULL)
+    {
+      return false;
+    }
+  bool ok = fseek(f, offset, SEEK_SET) == 0;
+  int c = ok ? fgetc(f) : EOF;
+  ok = c != EOF && fseek(f, offset, SEEK_SET) == 0 && fputc(c ^ 0x10, f) != EOF;
+  return fclose(f) == 0 && ok;
+}
+
+
+void unit_test_save(size_t n)
+{
+  const char *path = "unit_test_save.kdt";
+  const char *copy_path = "unit_test_save_copy.kdt";
+
+  // an empty tree
+  kdtree *t = kdtree_create(NULL, 0);
+  kdtree *mapped = NULL;
+  if (t != NULL && kdtree_save(t, path))
+    {
+      mapped = kdtree_open_mmap(path);
+    }
+  bool ok = mapped != NULL && kdtree_size(mapped) == 0 && !kdtree_contains(mapped, &unit_test_points[0]);
+  kdtree_destroy(mapped);
+  kdtree_destroy(t);
+
+  // a grid with every third point removed and some added, so the tree
+  // isn't perfectly balanced
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  t = kdtree_create(pts, n / 2);
+  free(pts);
+  for (size_t i = 0; i < n && t != NULL; i++)
+    {
+      location p = unit_grid_point(i);
+      if (i >= n / 2)
+	{
+	  kdtree_add(t, &p);
+	}
+      if (i % 3 == 0)
+	{
+	  kdtree_remove(t, &p);
+	}
+    }
+  mapped = NULL;
+  if (t != NULL && kdtree_save(t, path))
+    {
+      mapped = kdtree_open_mmap(path);
+    }
+  ok = ok && mapped != NULL && kdtree_size(mapped) == kdtree_size(t);
+  for (size_t i = 0; i < n + 400 && ok; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = kdtree_contains(mapped, &p) == (i < n && i % 3 != 0);
+    }
+  ok = ok && unit_same_range(t, mapped, -90.0, -180.0, 90.0, 180.0)
+    && unit_same_range(t, mapped, -60.0, -100.0, -50.0, -20.0)
+    && unit_same_range(t, mapped, -75.25, -150.0, -75.25, 20.0)
+    && unit_same_range(t, mapped, 10.0, 10.0, 20.0, 20.0);
+
+  // mapped trees can't be changed, but can be saved again
+  location p = unit_grid_point(n);
+  ok = ok && !kdtree_add(mapped, &p) && !kdtree_relayout(mapped)
+    && !kdtree_enable_hash_index(mapped) && kdtree_snapshot(mapped) == NULL;
+  kdtree_remove(mapped, &unit_test_points[0]);
+  kdtree *copy = NULL;
+  if (ok && kdtree_save(mapped, copy_path))
+    {
+      copy = kdtree_open_mmap(copy_path);
+    }
+  ok = ok && copy != NULL && unit_same_range(t, copy, -90.0, -180.0, 90.0, 180.0);
+  kdtree_destroy(copy);
+  kdtree_destroy(mapped);
+  kdtree_destroy(t);
+
+  // damaged files are refused: a changed coordinate, a changed header
+  // field and a missing file
+  ok = ok && unit_flip_byte(copy_path, 64 + 24 * 100 + 3) && kdtree_open_mmap(copy_path) == NULL;
+  ok = ok && unit_flip_byte(copy_path, 64 + 24 * 100 + 3) && unit_flip_byte(copy_path, 16)
+    && kdtree_open_mmap(copy_path) == NULL;
+  remove(copy_path);
+  remove(path);
+  ok = ok && kdtree_open_mmap(path) == NULL;
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- mapped tree differs from the saved one\n");
+    }
+}
+
+
+typedef struct
+{
+  kdtree_wal *w;
+  size_t first;
+  size_t end;
+  bool failed;
+} unit_wal_arg;
+
+
+/**
+ * Adds a range of grid points one at a time, then removes every other
+ * one.
+ */
+void *unit_test_wal_writer(void *a)
+{
+  unit_wal_arg *arg = a;
+  for (size_t i = arg->first; i < arg->end; i++)
+    {
+      location p = unit_grid_point(i);
+      arg->failed = !kdtree_wal_add(arg->w, &p) || arg->failed;
+    }
+  for (size_t i = arg->first; i < arg->end; i += 2)
+    {
+      location p = unit_grid_point(i);
+      arg->failed = !kdtree_wal_remove(arg->w, &p) || arg->failed;
+    }
+  return NULL;
+}
+
+
+/**
+ * Determines if the given durable tree holds exactly the grid points
+ * before n for which the given function returns true.
+ */
+bool unit_wal_matches(kdtree_wal *w, size_t n, bool (*present)(size_t, size_t))
+{
+  const kdtree *t = kdtree_wal_tree(w);
+  size_t expected = 0;
+  for (size_t i = 0; i < n + 400; i++)
+    {
+      location p = unit_grid_point(i);
+      bool there = i < n && present(i, n);
+      if (kdtree_contains(t, &p) != there)
+	{
+	  return false;
+	}
+      expected += there;
+    }
+  return kdtree_size(t) == expected;
+}
+
+
+/**
+ * The points the writers leave: every odd one, within each quarter.
+ */
+bool unit_wal_written(size_t i, size_t n)
+{
+  return (i - n * (i * 4 / n) / 4) % 2 == 1;
+}
+
+
+/**
+ * The points left after the writers, a checkpoint, adding the second
+ * half of the grid in one batch and removing the first eighth.
+ */
+bool unit_wal_updated(size_t i, size_t n)
+{
+  return i >= n / 2 || (i >= n / 8 && unit_wal_written(i, n / 2));
+}
+
+
+void unit_test_wal(size_t n, long interval)
+{
+  const char *snapshot = "unit_test_wal.kdt";
+  const char *log = "unit_test_wal.log";
+  remove(snapshot);
+  remove(log);
+
+  // four writers on the first half of the grid, sharing syncs
+  kdtree_wal *w = kdtree_wal_open(snapshot, log, interval);
+  if (w == NULL)
+    {
+      printf("FAILED -- could not open log\n");
+      return;
+    }
+  unit_wal_arg args[4];
+  pthread_t writers[4];
+  size_t started = 0;
+  for (size_t i = 0; i < 4; i++)
+    {
+      args[i] = (unit_wal_arg){w, n / 2 * i / 4, n / 2 * (i + 1) / 4, false};
+      if (pthread_create(&writers[i], NULL, unit_test_wal_writer, &args[i]) == 0)
+	{
+	  started++;
+	}
+    }
+  for (size_t i = started; i < 4; i++)
+    {
+      unit_test_wal_writer(&args[i]);
+    }
+  for (size_t i = 0; i < started; i++)
+    {
+      pthread_join(writers[i], NULL);
+    }
+  kdtree_wal_stats s;
+  kdtree_wal_get_stats(w, &s);
+  bool ok = s.records == n / 2 + n / 4 && s.commits > 0 && s.commits <= s.records
+    && unit_wal_matches(w, n / 2, unit_wal_written);
+  for (size_t i = 0; i < 4; i++)
+    {
+      ok = ok && !args[i].failed;
+    }
+
+  // recover from the log alone, then checkpoint and log some more
+  kdtree_wal_close(w);
+  w = kdtree_wal_open(snapshot, log, 0);
+  ok = ok && w != NULL && unit_wal_matches(w, n / 2, unit_wal_written) && kdtree_wal_checkpoint(w);
+  location *pts = malloc(sizeof(location) * (n / 2));
+  for (size_t i = 0; i < n / 2; i++)
+    {
+      pts[i] = unit_grid_point(n / 2 + i);
+    }
+  ok = ok && kdtree_wal_add_many(w, pts, n / 2) == n / 2;
+  // points already there are not logged again
+  kdtree_wal_stats before;
+  kdtree_wal_get_stats(w, &before);
+  ok = ok && kdtree_wal_add_many(w, pts, n / 2) == 0;
+  kdtree_wal_get_stats(w, &s);
+  ok = ok && s.records == before.records;
+  free(pts);
+  for (size_t i = 0; i < n / 8 && ok; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = kdtree_wal_remove(w, &p) == unit_wal_written(i, n / 2);
+    }
+  kdtree_wal_close(w);
+
+  // recover from the snapshot and the log, with a torn record at the end
+  FILE *f = fopen(log, "ab");
+  ok = ok && f != NULL && fwrite("torn", 1, 4, f) == 4;
+  if (f != NULL)
+    {
+      fclose(f);
+    }
+  w = kdtree_wal_open(snapshot, log, 0);
+  ok = ok && w != NULL && unit_wal_matches(w, n, unit_wal_updated);
+  location p = unit_grid_point(n);
+  ok = ok && kdtree_wal_add(w, &p);
+  kdtree_wal_close(w);
+  w = kdtree_wal_open(snapshot, log, 0);
+  ok = ok && w != NULL && kdtree_contains(kdtree_wal_tree(w), &p);
+
+  // an update that can't be logged is taken back out of the tree, and
+  // nothing more can be updated
+  struct rlimit limit;
+  struct rlimit full;
+  FILE *sized = fopen(log, "rb");
+  long size = -1;
+  if (sized != NULL)
+    {
+      fseek(sized, 0, SEEK_END);
+      size = ftell(sized);
+      fclose(sized);
+    }
+  ok = ok && size > 0 && getrlimit(RLIMIT_FSIZE, &limit) == 0;
+  full = limit;
+  full.rlim_cur = size;
+  signal(SIGXFSZ, SIG_IGN);
+  ok = ok && setrlimit(RLIMIT_FSIZE, &full) == 0;
+  location q = unit_grid_point(n + 1);
+  size_t kept = ok ? kdtree_size(kdtree_wal_tree(w)) : 0;
+  ok = ok && !kdtree_wal_add(w, &q) && !kdtree_contains(kdtree_wal_tree(w), &q)
+    && !kdtree_wal_remove(w, &p) && kdtree_contains(kdtree_wal_tree(w), &p);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  ok = ok && kdtree_size(kdtree_wal_tree(w)) == kept;
+  kdtree_wal_close(w);
+  w = ok ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  ok = ok && w != NULL && kdtree_size(kdtree_wal_tree(w)) == kept
+    && kdtree_contains(kdtree_wal_tree(w), &p) && !kdtree_contains(kdtree_wal_tree(w), &q);
+  kdtree_wal_close(w);
+
+  remove(snapshot);
+  remove(log);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- recovered tree differs from the logged updates\n");
+    }
+}
+
+
+/**
+ * Writes the first n grid points to the given file as CSV, every fifth
+ * one twice, with a header line, a blank line, a line ending in "\r\n",
+ * an invalid point, a line too long to parse and no newline at the end.
+ */
+bool unit_write_csv(const char *path, size_t n)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    {
+      return false;
+    }
+  bool ok = fprintf(f, "latitude,longitude\n\n") > 0;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      location p = unit_grid_point(i);
+      ok = fprintf(f, i == 7 ? " %.17g , %.17g\r\n" : "%.17g,%.17g\n", p.lat, p.lon) > 0;
+      if (i % 5 == 0)
+	{
+	  ok = ok && fprintf(f, "%.17g,%.17g\n", p.lat, p.lon) > 0;
+	}
+      if (i == n / 2)
+	{
+	  ok = ok && fprintf(f, "95.0,10.0\n%0300d\n", 1) > 0;
+	}
+    }
+  ok = ok && fprintf(f, "%.17g,%.17g", unit_grid_point(0).lat, unit_grid_point(0).lon) > 0;
+  return fclose(f) == 0 && ok;
+}
+
+
+/**
+ * Writes the first n grid points to the given file as little-endian
+ * binary records, followed by half a record.
+ */
+bool unit_write_binary(const char *path, size_t n)
+{
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    {
+      return false;
+    }
+  bool ok = true;
+  for (size_t i = 0; i <= n && ok; i++)
+    {
+      location p = unit_grid_point(i);
+      unsigned char record[16];
+      for (size_t j = 0; j < 2; j++)
+	{
+	  uint64_t bits;
+	  memcpy(&bits, j == 0 ? &p.lat : &p.lon, sizeof(bits));
+	  for (size_t b = 0; b < 8; b++)
+	    {
+	      record[j * 8 + b] = bits >> (8 * b);
+	    }
+	}
+      ok = fwrite(record, 1, i < n ? 16 : 8, f) == (i < n ? 16 : 8);
+    }
+  return fclose(f) == 0 && ok;
+}
+
+
+typedef struct
+{
+  const char *path;
+  int fd;
+} unit_pipe_arg;
+
+
+/**
+ * Copies a file into the write end of a pipe, in small pieces so that
+ * records straddle the reader's chunks, and closes it.
+ */
+void *unit_test_pipe_writer(void *a)
+{
+  unit_pipe_arg *arg = a;
+  FILE *f = fopen(arg->path, "rb");
+  char buf[4099];
+  size_t got;
+  while (f != NULL && (got = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+      if (write(arg->fd, buf, got) != (ssize_t)got)
+	{
+	  break;
+	}
+    }
+  if (f != NULL)
+    {
+      fclose(f);
+    }
+  close(arg->fd);
+  return NULL;
+}
+
+
+/**
+ * Loads the given file with kdtree_load_stream, either directly (so it
+ * is mapped) or through a pipe (so it is read in chunks).
+ */
+kdtree *unit_load_file(const char *path, kdtree_stream_format format, bool piped, kdtree_stream_reader *reader)
+{
+  reader->format = format;
+  if (!piped)
+    {
+      reader->fd = open(path, O_RDONLY);
+      if (reader->fd < 0)
+	{
+	  return NULL;
+	}
+      kdtree *t = kdtree_load_stream(reader);
+      close(reader->fd);
+      return t;
+    }
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    {
+      return NULL;
+    }
+  unit_pipe_arg arg = {path, fds[1]};
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, unit_test_pipe_writer, &arg) != 0)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      return NULL;
+    }
+  reader->fd = fds[0];
+  kdtree *t = kdtree_load_stream(reader);
+  close(fds[0]);
+  pthread_join(writer, NULL);
+  return t;
+}
+
+
+/**
+ * Determines if the given tree holds exactly the first n grid points,
+ * and agrees with a tree built from them by kdtree_create.
+ */
+bool unit_loaded_matches(const kdtree *t, const kdtree *expected, size_t n)
+{
+  if (t == NULL || kdtree_size(t) != n)
+    {
+      return false;
+    }
+  for (size_t i = 0; i < n + 400; i++)
+    {
+      location p = unit_grid_point(i);
+      if (kdtree_contains(t, &p) != (i < n))
+	{
+	  return false;
+	}
+    }
+  return unit_same_range(expected, t, -90.0, -180.0, 90.0, 180.0)
+    && unit_same_range(expected, t, -60.0, -100.0, -50.0, -20.0)
+    && unit_same_range(expected, t, -75.25, -150.0, -75.25, 20.0)
+    && unit_same_range(expected, t, 10.0, -170.0, 20.0, -170.0);
+}
+
+
+void unit_test_load_stream(size_t n)
+{
+  const char *csv = "unit_test_load.csv";
+  const char *bin = "unit_test_load.bin";
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *expected = kdtree_create(pts, n);
+  free(pts);
+  bool ok = expected != NULL && unit_write_csv(csv, n) && unit_write_binary(bin, n);
+
+  // each format, mapped and piped; every record but the blank line
+  // counts, and the header, the invalid point and the long line (or the
+  // half record) are rejected
+  for (int piped = 0; piped < 2 && ok; piped++)
+    {
+      kdtree_stream_reader reader;
+      kdtree *t = unit_load_file(csv, KDTREE_STREAM_CSV, piped, &reader);
+      ok = unit_loaded_matches(t, expected, n) && reader.records == n + (n + 4) / 5 + 4 && reader.rejected == 3;
+      kdtree_destroy(t);
+      t = unit_load_file(bin, KDTREE_STREAM_BINARY, piped, &reader);
+      ok = ok && unit_loaded_matches(t, expected, n) && reader.records == n + 1 && reader.rejected == 1;
+      kdtree_destroy(t);
+    }
+
+  // the loaded tree's nodes are in one block, like a relaid tree's, and
+  // it changes like any other
+  kdtree_stream_reader reader;
+  kdtree *t = unit_load_file(bin, KDTREE_STREAM_BINARY, false, &reader);
+  ok = ok && t != NULL;
+  for (size_t i = 0; i < n / 2 && ok; i++)
+    {
+      if (i % 3 == 0)
+	{
+	  location p = unit_grid_point(i);
+	  kdtree_remove(t, &p);
+	  kdtree_remove(expected, &p);
+	  ok = !kdtree_contains(t, &p);
+	}
+      else
+	{
+	  location p = unit_grid_point(n + i);
+	  ok = kdtree_add(t, &p) && kdtree_add(expected, &p);
+	}
+    }
+  ok = ok && kdtree_relayout(t) && unit_same_range(expected, t, -90.0, -180.0, 90.0, 180.0);
+  kdtree_destroy(t);
+
+  // an empty file and a missing descriptor
+  FILE *f = fopen(csv, "w");
+  ok = ok && f != NULL && fclose(f) == 0;
+  t = unit_load_file(csv, KDTREE_STREAM_CSV, false, &reader);
+  ok = ok && t != NULL && kdtree_size(t) == 0 && reader.records == 0;
+  kdtree_destroy(t);
+  reader.fd = -1;
+  ok = ok && kdtree_load_stream(&reader) == NULL;
+
+  kdtree_destroy(expected);
+  remove(csv);
+  remove(bin);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- loaded tree differs from the records\n");
+    }
+}
+
+
+/**
+ * Builds a tree file from the given CSV file with the given memory
+ * budget and opens it.
+ */
+kdtree *unit_build_external(const char *csv, const char *path, size_t budget, kdtree_external_stats *stats)
+{
+  kdtree_stream_reader reader = {open(csv, O_RDONLY), KDTREE_STREAM_CSV};
+  bool ok = reader.fd >= 0 && kdtree_build_external(&reader, path, ".", budget, stats);
+  if (reader.fd >= 0)
+    {
+      close(reader.fd);
+    }
+  return ok ? kdtree_open_mmap(path) : NULL;
+}
+
+
+void unit_test_external(size_t n)
+{
+  const char *csv = "unit_test_external.csv";
+  const char *path = "unit_test_external.kdt";
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *expected = kdtree_create(pts, n);
+  free(pts);
+  bool ok = expected != NULL && unit_write_csv(csv, n);
+
+  // the smallest budget has room for a few thousand points, so the
+  // input is sorted in many runs merged in two passes, and split on disk
+  // several times before the parts fit
+  kdtree_external_stats stats;
+  kdtree *t = ok ? unit_build_external(csv, path, KDTREE_EXTERNAL_MIN_BUDGET, &stats) : NULL;
+  ok = unit_loaded_matches(t, expected, n) && stats.points == n && stats.sorts > 3
+    && stats.merges > 3 && stats.partitions > 8;
+  kdtree_destroy(t);
+
+  // with room for everything there is one sort and one part
+  t = ok ? unit_build_external(csv, path, 64 << 20, &stats) : NULL;
+  ok = unit_loaded_matches(t, expected, n) && stats.sorts == 1 && stats.partitions == 1;
+  kdtree_destroy(t);
+
+  // no points, too small a budget and nowhere to put temporary files
+  FILE *f = fopen(csv, "w");
+  ok = ok && f != NULL && fclose(f) == 0;
+  t = ok ? unit_build_external(csv, path, KDTREE_EXTERNAL_MIN_BUDGET, &stats) : NULL;
+  ok = ok && t != NULL && kdtree_size(t) == 0 && stats.partitions == 0;
+  kdtree_destroy(t);
+  kdtree_stream_reader reader = {open(csv, O_RDONLY), KDTREE_STREAM_CSV};
+  ok = ok && !kdtree_build_external(&reader, path, ".", KDTREE_EXTERNAL_MIN_BUDGET - 1, NULL)
+    && !kdtree_build_external(&reader, path, "unit_test_no_such_directory", KDTREE_EXTERNAL_MIN_BUDGET, NULL);
+  if (reader.fd >= 0)
+    {
+      close(reader.fd);
+    }
+
+  kdtree_destroy(expected);
+  remove(csv);
+  remove(path);
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- externally built tree differs from the records\n");
+    }
+}
+
+
+typedef struct
+{
+  const kdtree *t;
+  size_t first;
+  size_t end;
+  size_t n;
+  bool failed;
+} unit_paged_arg;
+
+
+/**
+ * Looks up a slice of the grid in a paged tree, checking that each
+ * lookup reads no more pages than it looks at.
+ */
+void *unit_test_paged_reader(void *a)
+{
+  unit_paged_arg *arg = a;
+  for (size_t i = arg->first; i < arg->end; i++)
+    {
+      location p = unit_grid_point(i);
+      kdtree_io_stats io;
+      bool there = kdtree_contains(arg->t, &p);
+      kdtree_last_query_io(&io);
+      if (there != (i < arg->n && i % 3 != 0) || io.pages < 1 || io.reads > io.pages)
+	{
+	  arg->failed = true;
+	}
+    }
+  return NULL;
+}
+
+
+void unit_test_paged(size_t n, size_t cache_pages)
+{
+  const char *path = "unit_test_paged.kdp";
+  const char *copy_path = "unit_test_paged_copy.kdp";
+
+  // the grid with every third point removed
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *t = kdtree_create(pts, n);
+  free(pts);
+  for (size_t i = 0; i < n && t != NULL; i += 3)
+    {
+      location p = unit_grid_point(i);
+      kdtree_remove(t, &p);
+    }
+  kdtree *paged = NULL;
+  if (t != NULL && kdtree_save_paged(t, path))
+    {
+      paged = kdtree_open_paged(path, cache_pages);
+    }
+  bool ok = paged != NULL && kdtree_size(paged) == kdtree_size(t);
+
+  // lookups go through one split page to a leaf, and the second time
+  // the same lookup finds both in the cache
+  kdtree_io_stats io;
+  location p = unit_grid_point(1);
+  ok = ok && kdtree_contains(paged, &p);
+  kdtree_last_query_io(&io);
+  ok = ok && io.pages == 2 && io.reads == 2 && kdtree_contains(paged, &p);
+  kdtree_last_query_io(&io);
+  ok = ok && io.pages == 2 && io.reads == 0;
+
+  // four threads share the cache
+  unit_paged_arg args[4];
+  pthread_t readers[4];
+  size_t started = 0;
+  for (size_t i = 0; i < 4 && ok; i++)
+    {
+      args[i] = (unit_paged_arg){paged, (n + 400) * i / 4, (n + 400) * (i + 1) / 4, n, false};
+      if (pthread_create(&readers[i], NULL, unit_test_paged_reader, &args[i]) == 0)
+	{
+	  started++;
+	}
+    }
+  for (size_t i = started; i < 4 && ok; i++)
+    {
+      unit_test_paged_reader(&args[i]);
+    }
+  for (size_t i = 0; i < started; i++)
+    {
+      pthread_join(readers[i], NULL);
+    }
+  for (size_t i = 0; i < 4 && ok; i++)
+    {
+      ok = !args[i].failed;
+    }
+  kdtree_get_io_totals(paged, &io);
+  ok = ok && io.pages >= 2 * (n + 400) && io.reads > 0 && io.reads < io.pages;
+
+  // ranges, including one that visits most of the leaves
+  ok = ok && unit_same_range(t, paged, -90.0, -180.0, 90.0, 180.0)
+    && unit_same_range(t, paged, -60.0, -100.0, -50.0, -20.0)
+    && unit_same_range(t, paged, -75.25, -150.0, -75.25, 20.0)
+    && unit_same_range(t, paged, 10.0, 10.0, 20.0, 20.0);
+  location sw = {-79.0, -10.0};
+  location ne = {-78.0, 10.0};
+  int count;
+  free(kdtree_range(paged, &sw, &ne, &count));
+  kdtree_last_query_io(&io);
+  ok = ok && count > 0 && io.pages >= 2 && io.pages < kdtree_size(paged) / 100;
+
+  // paged trees can't be changed or saved, but can be paged again
+  p = unit_grid_point(n);
+  ok = ok && !kdtree_add(paged, &p) && !kdtree_relayout(paged) && !kdtree_enable_hash_index(paged)
+    && kdtree_snapshot(paged) == NULL && !kdtree_save(paged, copy_path);
+  kdtree *copy = NULL;
+  if (ok && kdtree_save_paged(paged, copy_path))
+    {
+      copy = kdtree_open_paged(copy_path, 1);
+    }
+  ok = ok && copy != NULL && unit_same_range(t, copy, -90.0, -180.0, 90.0, 180.0);
+  kdtree_destroy(copy);
+  kdtree_destroy(paged);
+  kdtree_destroy(t);
+
+  // an empty tree, a damaged superblock and a cache of no pages
+  t = kdtree_create(NULL, 0);
+  paged = NULL;
+  if (t != NULL && kdtree_save_paged(t, path))
+    {
+      paged = kdtree_open_paged(path, 1);
+    }
+  ok = ok && paged != NULL && kdtree_size(paged) == 0 && !kdtree_contains(paged, &p);
+  kdtree_destroy(paged);
+  kdtree_destroy(t);
+  ok = ok && unit_flip_byte(copy_path, 20) && kdtree_open_paged(copy_path, 8) == NULL
+    && kdtree_open_paged(path, 0) == NULL;
+  remove(path);
+  remove(copy_path);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- paged tree differs from the saved one\n");
+    }
+}
+
+
+void unit_test_paged_ties(size_t n)
+{
+  const char *path = "unit_test_paged_ties.kdp";
+  const char *tmp_path = "unit_test_paged_ties.kdp.tmp";
+
+  // a cross of n + 1 points on the equator and n on the prime meridian,
+  // then the L of its quarter with no negative coordinates; more than
+  // half of some pages' points then share both smallest coordinates
+  location *pts = malloc(sizeof(location) * (2 * n + 1));
+  bool ok = pts != NULL;
+  for (size_t shape = 0; shape < 2 && ok; shape++)
+    {
+      size_t count = 0;
+      for (size_t i = 0; i <= n; i++)
+	{
+	  double lon = ((double)i - n / 2) * 0.1;
+	  if (shape == 0 || lon >= 0.0)
+	    {
+	      pts[count++] = (location){0.0, lon};
+	    }
+	}
+      for (size_t i = 0; i <= n; i++)
+	{
+	  double lat = ((double)i - n / 2) * 0.05;
+	  if (lat != 0.0 && (shape == 0 || lat > 0.0))
+	    {
+	      pts[count++] = (location){lat, 0.0};
+	    }
+	}
+
+      kdtree *t = kdtree_create(pts, count);
+      kdtree *paged = NULL;
+      if (t != NULL && kdtree_save_paged(t, path))
+	{
+	  paged = kdtree_open_paged(path, 8);
+	}
+      ok = paged != NULL && kdtree_size(paged) == count && access(tmp_path, F_OK) != 0;
+      for (size_t i = 0; i < count && ok; i++)
+	{
+	  ok = kdtree_contains(paged, &pts[i]);
+	}
+      location off = {0.05, 0.1};
+      ok = ok && !kdtree_contains(paged, &off)
+	&& unit_same_range(t, paged, -90.0, -180.0, 90.0, 180.0)
+	&& unit_same_range(t, paged, 0.0, 0.0, 0.0, 0.0)
+	&& unit_same_range(t, paged, 0.0, -10.0, 0.0, 10.0)
+	&& unit_same_range(t, paged, -10.0, 0.0, 10.0, 0.0)
+	&& unit_same_range(t, paged, 5.0, -1.0, 20.0, 1.0)
+	&& unit_same_range(t, paged, -1.0, 30.0, 1.0, 60.0)
+	&& unit_same_range(t, paged, 1.0, 1.0, 20.0, 20.0);
+      kdtree_destroy(paged);
+      kdtree_destroy(t);
+      remove(path);
+      remove(tmp_path);
+    }
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- paged tree of points sharing coordinates differs from the saved one\n");
+    }
+}
+
+
+/**
+ * Checks that the tree an attachment has is the grid of the given size,
+ * less every third point if thinned.
+ */
+bool unit_shared_matches(kdtree_shared *s, uint64_t generation, size_t n, bool thinned)
+{
+  const kdtree *t = kdtree_shared_tree(s);
+  bool ok = t != NULL && kdtree_shared_generation(s) == generation
+    && kdtree_size(t) == (thinned ? n - (n + 2) / 3 : n);
+  for (size_t i = 0; i < n + 100 && ok; i += 7)
+    {
+      location p = unit_grid_point(i);
+      ok = kdtree_contains(t, &p) == (i < n && (!thinned || i % 3 != 0));
+    }
+  return ok;
+}
+
+
+/**
+ * Attaches to the given name from a worker process, checks the first
+ * generation, says so on ready and waits on go for the second.
+ */
+bool unit_test_shared_worker(const char *name, size_t n, int ready, int go)
+{
+  kdtree_shared *s = kdtree_shared_attach(name);
+  bool ok = s != NULL && unit_shared_matches(s, 1, n, true);
+  char c = ok;
+  ok = write(ready, &c, 1) == 1 && ok && read(go, &c, 1) == 1 && unit_shared_matches(s, 2, n, false);
+  kdtree_shared_detach(s);
+  return ok;
+}
+
+
+void unit_test_shared(size_t n, size_t workers)
+{
+  char name[64];
+  sprintf(name, "/kdtree_unit_%ld", (long)getpid());
+  const char *path = "unit_test_shared.kdt";
+  bool ok = kdtree_shared_attach(name) == NULL && kdtree_shared_publish(NULL, name) == 0;
+
+  // the first generation is the grid less every third point
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *full = kdtree_create(pts, n);
+  kdtree *t = kdtree_create(pts, n);
+  free(pts);
+  for (size_t i = 0; i < n && t != NULL; i += 3)
+    {
+      location p = unit_grid_point(i);
+      kdtree_remove(t, &p);
+    }
+  ok = ok && full != NULL && t != NULL && kdtree_shared_publish(t, "no_slash") == 0
+    && kdtree_shared_publish(t, name) == 1;
+  kdtree_shared *s = kdtree_shared_attach(name);
+  ok = ok && s != NULL && unit_shared_matches(s, 1, n, true);
+  const kdtree *first = ok ? kdtree_shared_tree(s) : NULL;
+
+  // workers attach to it and wait for the second
+  int ready[2];
+  int go[2];
+  pid_t pids[workers];
+  size_t started = 0;
+  if (ok && pipe(ready) == 0)
+    {
+      if (pipe(go) == 0)
+	{
+	  fflush(stdout);
+	  for (size_t i = 0; i < workers; i++)
+	    {
+	      pid_t pid = fork();
+	      if (pid == 0)
+		{
+		  _exit(unit_test_shared_worker(name, n, ready[1], go[0]) ? 0 : 1);
+		}
+	      if (pid > 0)
+		{
+		  pids[started++] = pid;
+		}
+	    }
+	  ok = started == workers;
+
+	  // the second generation is the whole grid, published from a file
+	  char c = 1;
+	  for (size_t i = 0; i < started; i++)
+	    {
+	      ok = read(ready[0], &c, 1) == 1 && c && ok;
+	    }
+	  kdtree *mapped = NULL;
+	  if (ok && kdtree_save(full, path))
+	    {
+	      mapped = kdtree_open_mmap(path);
+	    }
+	  ok = ok && mapped != NULL && kdtree_shared_publish(mapped, name) == 2;
+	  kdtree_destroy(mapped);
+	  for (size_t i = 0; i < started; i++)
+	    {
+	      ok = write(go[1], &c, 1) == 1 && ok;
+	    }
+	  close(go[0]);
+	  close(go[1]);
+	}
+      else
+	{
+	  ok = false;
+	}
+      close(ready[0]);
+      close(ready[1]);
+    }
+  for (size_t i = 0; i < started; i++)
+    {
+      int status;
+      ok = waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+
+  // the first generation's name is gone, but it stays mapped here until
+  // this attachment looks for a newer one
+  ok = ok && unit_same_range(t, first, -90.0, -180.0, 90.0, 180.0) && unit_shared_matches(s, 2, n, false)
+    && unit_same_range(full, kdtree_shared_tree(s), -90.0, -180.0, 90.0, 180.0);
+
+  // a paged tree can't be published, and the name can be removed
+  kdtree *paged = NULL;
+  if (ok && kdtree_save_paged(t, path))
+    {
+      paged = kdtree_open_paged(path, 4);
+    }
+  ok = ok && paged != NULL && kdtree_shared_publish(paged, name) == 0 && unit_shared_matches(s, 2, n, false);
+  kdtree_destroy(paged);
+  kdtree_shared_detach(s);
+  ok = kdtree_shared_unlink(name) && ok && kdtree_shared_attach(name) == NULL && !kdtree_shared_unlink(name);
+  remove(path);
+  kdtree_destroy(t);
+  kdtree_destroy(full);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- shared tree differs from the published one\n");
+    }
+}
+
+
+/**
+ * Checks that a packed tree has the same points in a rectangle as a tree.
+ */
+bool unit_packed_same_range(const kdtree *t, const kdtree_packed *p, double sw_lat, double sw_lon, double ne_lat, double ne_lon)
+{
+  location sw = {sw_lat, sw_lon};
+  location ne = {ne_lat, ne_lon};
+  int n1, n2;
+  location *pts1 = kdtree_range(t, &sw, &ne, &n1);
+  location *pts2 = kdtree_packed_range(p, &sw, &ne, &n2);
+  atomic_size_t count;
+  atomic_init(&count, 0);
+  kdtree_packed_range_for_each(p, &sw, &ne, unit_count_point, &count);
+  bool same = n1 == n2 && atomic_load(&count) == n2;
+  if (same && n1 > 0)
+    {
+      qsort(pts1, n1, sizeof(location), unit_compare_points);
+      qsort(pts2, n2, sizeof(location), unit_compare_points);
+      same = memcmp(pts1, pts2, sizeof(location) * n1) == 0;
+    }
+  free(pts1);
+  free(pts2);
+  return same;
+}
+
+
+void unit_test_packed(size_t n)
+{
+  // the grid less every third point, which has few enough decimal places
+  // to come back exactly
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *t = kdtree_create(pts, n);
+  for (size_t i = 0; i < n && t != NULL; i += 3)
+    {
+      kdtree_remove(t, &pts[i]);
+    }
+  kdtree_packed *p = t == NULL ? NULL : kdtree_packed_create(t, 1000000);
+  bool ok = p != NULL && kdtree_packed_size(p) == kdtree_size(t);
+  for (size_t i = 0; i < n + 400 && ok; i++)
+    {
+      location q = unit_grid_point(i);
+      ok = kdtree_packed_contains(p, &q) == (i < n && i % 3 != 0);
+    }
+
+  // ranges, with points on the borders, inside blocks and across them
+  ok = ok && unit_packed_same_range(t, p, -90.0, -180.0, 90.0, 180.0)
+    && unit_packed_same_range(t, p, -60.0, -100.0, -50.0, -20.0)
+    && unit_packed_same_range(t, p, -75.25, -150.0, -75.25, 20.0)
+    && unit_packed_same_range(t, p, -70.1, -120.3, -69.9, -119.7)
+    && unit_packed_same_range(t, p, 10.0, 10.0, 20.0, 20.0)
+    && unit_packed_same_range(t, p, -89.0, 175.0, -85.0, 179.0);
+  kdtree_packed_destroy(p);
+
+  // the points are all on a grid of quarter degrees, and stored on that
+  // grid they take much less room
+  p = t == NULL ? NULL : kdtree_packed_create(t, 4);
+  ok = ok && p != NULL && kdtree_packed_memory(p) * 4 < sizeof(location) * kdtree_size(t)
+    && unit_packed_same_range(t, p, -90.0, -180.0, 90.0, 180.0)
+    && unit_packed_same_range(t, p, -60.0, -100.0, -50.0, -20.0);
+  kdtree_packed_destroy(p);
+
+  // on a grid of whole degrees points round together
+  kdtree *rounded = kdtree_create(NULL, 0);
+  for (size_t i = 0; i < n && rounded != NULL; i++)
+    {
+      if (i % 3 != 0)
+	{
+	  location q = {round(pts[i].lat), round(pts[i].lon)};
+	  kdtree_add(rounded, &q);
+	}
+    }
+  p = t == NULL ? NULL : kdtree_packed_create(t, 1);
+  ok = ok && p != NULL && rounded != NULL && kdtree_packed_size(p) == kdtree_size(rounded)
+    && unit_packed_same_range(rounded, p, -90.0, -180.0, 90.0, 180.0)
+    && unit_packed_same_range(rounded, p, -30.5, -60.5, 40.0, 70.0);
+  location q = {-79.9, -169.6};
+  ok = ok && kdtree_packed_contains(p, &q);
+  kdtree_packed_destroy(p);
+  kdtree_destroy(rounded);
+
+  // grids out of range and an empty tree
+  ok = ok && t != NULL && kdtree_packed_create(t, 0) == NULL
+    && kdtree_packed_create(t, KDTREE_PACKED_MAX_STEPS + 1) == NULL;
+  kdtree_destroy(t);
+  t = kdtree_create(NULL, 0);
+  p = t == NULL ? NULL : kdtree_packed_create(t, KDTREE_PACKED_MAX_STEPS);
+  int count = -1;
+  location sw = {-90.0, -180.0};
+  location ne = {90.0, 180.0};
+  free(p == NULL ? NULL : kdtree_packed_range(p, &sw, &ne, &count));
+  ok = ok && p != NULL && kdtree_packed_size(p) == 0 && count == 0 && !kdtree_packed_contains(p, &q);
+  kdtree_packed_destroy(p);
+  kdtree_destroy(t);
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- packed tree differs from the tree it was made from\n");
+    }
+}
+
+
+/**
+ * Checks the counts of the last query against what it found, or that
+ * they are zero if the library doesn't count.
+ */
+bool unit_query_counts(size_t found, size_t max_visited)
+{
+  kdtree_query_counters c;
+  kdtree_last_query_counters(&c);
+#ifdef KDTREE_STATS
+  return c.points_emitted == found && c.points_tested == c.nodes_visited
+    && c.nodes_visited >= found && c.nodes_visited <= max_visited;
+#else
+  return c.nodes_visited == 0 && c.nodes_pruned == 0 && c.points_tested == 0 && c.points_emitted == 0;
+#endif
+}
+
+
+void unit_test_stats(size_t n)
+{
+  const char *path = "unit_test_stats.kdt";
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *t = kdtree_create(pts, n);
+  free(pts);
+
+  // a tree built at medians is close to balanced; ties on the grid can
+  // add a level
+  kdtree_tree_stats s;
+  size_t levels = 0;
+  for (size_t m = n; m > 0; m /= 2)
+    {
+      levels++;
+    }
+  bool ok = t != NULL && kdtree_stats(t, &s) && s.size == n && s.height >= levels && s.height <= levels + 1
+    && s.imbalance == (double)s.height / levels && s.max_leaf_depth == s.height - 1 && s.leaves >= n / 4
+    && s.mean_leaf_depth > levels - 3
+    && s.mean_leaf_depth <= s.max_leaf_depth && s.memory > n * sizeof(location);
+
+  // the counts of a lookup, a range and both added up
+  location p = unit_grid_point(n / 2);
+  ok = ok && kdtree_contains(t, &p) && unit_query_counts(1, s.height);
+  location sw = {-60.0, -100.0};
+  location ne = {-50.0, -20.0};
+  int count = 0;
+  free(kdtree_range(t, &sw, &ne, &count));
+  ok = ok && count > 0 && unit_query_counts(count, n / 4);
+  kdtree_query_counters range;
+  kdtree_last_query_counters(&range);
+  atomic_size_t each;
+  atomic_init(&each, 0);
+  kdtree_range_for_each(t, &sw, &ne, unit_count_point, &each);
+  ok = ok && unit_query_counts(count, n / 4);
+  kdtree_query_counters totals;
+  kdtree_get_query_totals(t, &totals);
+#ifdef KDTREE_STATS
+  ok = ok && range.nodes_pruned > 0 && totals.points_emitted == 1 + 2 * (size_t)count
+    && totals.nodes_visited > 2 * range.nodes_visited;
+#else
+  ok = ok && totals.nodes_visited == 0 && totals.points_emitted == 0;
+#endif
+
+  // the hash index answers lookups without visiting nodes
+  ok = ok && kdtree_enable_hash_index(t) && kdtree_contains(t, &p);
+  kdtree_query_counters hashed;
+  kdtree_last_query_counters(&hashed);
+  kdtree_disable_hash_index(t);
+#ifdef KDTREE_STATS
+  ok = ok && hashed.nodes_visited == 0 && hashed.points_tested == 1 && hashed.points_emitted == 1;
+#else
+  ok = ok && hashed.points_tested == 0;
+#endif
+
+  // a saved copy has the same shape
+  kdtree_tree_stats mapped_stats;
+  kdtree *mapped = NULL;
+  if (ok && kdtree_save(t, path))
+    {
+      mapped = kdtree_open_mmap(path);
+    }
+  ok = ok && mapped != NULL && kdtree_stats(mapped, &mapped_stats) && mapped_stats.size == n
+    && mapped_stats.height == s.height && mapped_stats.leaves == s.leaves
+    && mapped_stats.mean_leaf_depth == s.mean_leaf_depth && kdtree_contains(mapped, &p) && unit_query_counts(0, 0);
+  kdtree_destroy(mapped);
+  remove(path);
+  kdtree_destroy(t);
+
+  // points added in order make a tree as deep as it is big
+  t = kdtree_create(NULL, 0);
+  for (size_t i = 0; i < 2000 && t != NULL; i++)
+    {
+      location q = {-80.0 + i * 0.01, -170.0 + i * 0.02};
+      kdtree_add(t, &q);
+    }
+  ok = ok && t != NULL && kdtree_stats(t, &s) && s.size == 2000 && s.height == 2000 && s.leaves == 1
+    && s.imbalance > 100.0;
+  kdtree_destroy(t);
+
+  // an empty tree
+  t = kdtree_create(NULL, 0);
+  ok = ok && t != NULL && kdtree_stats(t, &s) && s.size == 0 && s.height == 0 && s.leaves == 0 && s.imbalance == 0.0
+    && s.memory > 0;
+  kdtree_destroy(t);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- tree statistics or query counts are wrong\n");
+    }
+}
+
+
+/**
+ * Counts the points passed to it, sleeping for 20ms on the first.
+ */
+void unit_slow_point(const location *l, void *count)
+{
+  if ((*(size_t *)count)++ == 0)
+    {
+      struct timespec wait = {0, 20000000};
+      nanosleep(&wait, NULL);
+    }
+}
+
+
+typedef struct
+{
+  kdtree *t;
+  size_t n;
+} unit_latency_arg;
+
+
+void *unit_test_latency_reader(void *a)
+{
+  unit_latency_arg *arg = a;
+  for (size_t i = 0; i < arg->n; i++)
+    {
+      location p = unit_grid_point(i);
+      kdtree_contains(arg->t, &p);
+    }
+  return NULL;
+}
+
+
+/**
+ * Checks that the given operation has been recorded the given number of
+ * times, with percentiles in order.
+ */
+bool unit_latency_count(kdtree_operation op, uint64_t count)
+{
+  kdtree_latency l;
+  kdtree_latency_read(op, &l);
+  return l.count == count && l.p50 <= l.p99 && l.p99 <= l.p999 && l.p999 <= l.max && (count == 0 || l.max > 0);
+}
+
+
+void unit_test_latency(size_t n)
+{
+  location *pts = malloc(sizeof(location) * n);
+  for (size_t i = 0; i < n; i++)
+    {
+      pts[i] = unit_grid_point(i);
+    }
+  kdtree *t = kdtree_create(pts, n / 2);
+
+  // nothing is recorded until recording is turned on
+  bool ok = t != NULL && kdtree_contains(t, &pts[0]);
+  kdtree_latency_enable(true);
+  for (size_t i = 0; i < n / 2; i++)
+    {
+      ok = ok && kdtree_contains(t, &pts[i]);
+    }
+  for (size_t i = n / 2; i < n / 2 + 100; i++)
+    {
+      ok = ok && kdtree_add(t, &pts[i]);
+    }
+  ok = ok && kdtree_add_many(t, pts + n / 2 + 100, 100) == 100;
+  for (size_t i = n / 2; i < n / 2 + 50; i++)
+    {
+      kdtree_remove(t, &pts[i]);
+    }
+  location sw = {-80.0, -170.0};
+  location ne = {-70.0, -100.0};
+  for (size_t i = 0; i < 30; i++)
+    {
+      int count;
+      free(kdtree_range(t, &sw, &ne, &count));
+    }
+  size_t seen = 0;
+  kdtree_range_for_each(t, &sw, &ne, unit_slow_point, &seen);
+  for (size_t i = 0; i < 9; i++)
+    {
+      kdtree_range_for_each(t, &sw, &ne, unit_count_point, &seen);
+    }
+  ok = ok && unit_latency_count(KDTREE_OP_CONTAINS, n / 2) && unit_latency_count(KDTREE_OP_ADD, 100)
+    && unit_latency_count(KDTREE_OP_REMOVE, 50) && unit_latency_count(KDTREE_OP_RANGE, 30)
+    && unit_latency_count(KDTREE_OP_RANGE_FOR_EACH, 10);
+
+  // the slow call is the maximum but not the median
+  kdtree_latency each;
+  kdtree_latency_read(KDTREE_OP_RANGE_FOR_EACH, &each);
+  ok = ok && each.max >= 20000000 && each.max < 40000000 && each.p50 < 20000000;
+
+  // threads that have exited are still counted
+  pthread_t readers[4];
+  unit_latency_arg arg = {t, 1000};
+  size_t started = 0;
+  for (size_t r = 0; r < 4; r++)
+    {
+      if (pthread_create(&readers[r], NULL, unit_test_latency_reader, &arg) == 0)
+	{
+	  started++;
+	}
+    }
+  for (size_t r = 0; r < started; r++)
+    {
+      pthread_join(readers[r], NULL);
+    }
+  ok = ok && started == 4 && unit_latency_count(KDTREE_OP_CONTAINS, n / 2 + 4000);
+
+  // a query on a forest is one call however many tiles it reads, and
+  // updates replayed after a rebuild or from a log aren't recorded again
+  kdtree_latency_reset();
+  kdtree_forest *f = kdtree_forest_create(pts, n / 2, 4, 4, 1);
+  location world_sw = {-90.0, -180.0};
+  location world_ne = {90.0, 180.0};
+  int count = 0;
+  free(kdtree_forest_range(f, &world_sw, &world_ne, &count));
+  kdtree_forest_range_for_each(f, &world_sw, &world_ne, unit_count_point, &seen);
+  ok = ok && f != NULL && count == n / 2 && unit_latency_count(KDTREE_OP_RANGE, 1)
+    && unit_latency_count(KDTREE_OP_RANGE_FOR_EACH, 1);
+  kdtree_forest_destroy(f);
+
+  kdtree_managed *m = kdtree_managed_create(pts, n / 2);
+  ok = ok && m != NULL && kdtree_managed_rebuild(m);
+  for (size_t i = n / 2; i < n / 2 + 100; i++)
+    {
+      ok = ok && kdtree_managed_add(m, &pts[i]);
+    }
+  kdtree_managed_remove(m, &pts[0]);
+  ok = ok && kdtree_managed_wait(m) && kdtree_managed_size(m) == n / 2 + 99
+    && unit_latency_count(KDTREE_OP_ADD, 100) && unit_latency_count(KDTREE_OP_REMOVE, 1);
+  kdtree_managed_destroy(m);
+
+  const char *snapshot = "unit_test_latency.kdt";
+  const char *log = "unit_test_latency.log";
+  remove(snapshot);
+  remove(log);
+  kdtree_wal *w = kdtree_wal_open(snapshot, log, 0);
+  ok = ok && w != NULL && kdtree_wal_add(w, &pts[0]) && kdtree_wal_remove(w, &pts[0]);
+  kdtree_wal_close(w);
+  kdtree_latency_reset();
+  w = ok ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  ok = ok && w != NULL && kdtree_size(kdtree_wal_tree(w)) == 0
+    && unit_latency_count(KDTREE_OP_ADD, 0) && unit_latency_count(KDTREE_OP_REMOVE, 0);
+  kdtree_wal_close(w);
+  remove(snapshot);
+  remove(log);
+
+  // a reset discards everything so far, and nothing more is recorded
+  // once recording is off
+  kdtree_latency_reset();
+  ok = ok && unit_latency_count(KDTREE_OP_CONTAINS, 0) && unit_latency_count(KDTREE_OP_RANGE_FOR_EACH, 0)
+    && kdtree_contains(t, &pts[0]) && unit_latency_count(KDTREE_OP_CONTAINS, 1);
+  kdtree_latency_enable(false);
+  ok = ok && kdtree_contains(t, &pts[0]) && unit_latency_count(KDTREE_OP_CONTAINS, 1);
+
+  kdtree_destroy(t);
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- latencies were recorded wrongly\n");
+    }
+}
+
+
+/**
+ * Returns the number of distinct one-degree cells the given points are in.
+ */
+size_t unit_occupied_cells(const location *pts, size_t n)
+{
+  bool *cells = calloc(181 * 361, sizeof(bool));
+  size_t count = 0;
+  for (size_t i = 0; i < n && cells != NULL; i++)
+    {
+      size_t cell = (size_t)(pts[i].lat + 90.0) * 361 + (size_t)(pts[i].lon + 180.0);
+      count += !cells[cell];
+      cells[cell] = true;
+    }
+  free(cells);
+  return count;
+}
+
+
+void unit_test_datasets(size_t n)
+{
+  location *pts = malloc(sizeof(location) * n);
+  location *again = malloc(sizeof(location) * n);
+  bool ok = pts != NULL && again != NULL;
+  size_t uniform_cells = 0;
+  for (int d = 0; d < KDTREE_DATASETS && ok; d++)
+    {
+      // names go both ways, and the same seed gives the same points
+      kdtree_dataset parsed;
+      ok = kdtree_dataset_parse(kdtree_dataset_name(d), &parsed) && parsed == d
+	&& kdtree_dataset_generate(d, 474, pts, n) && kdtree_dataset_generate(d, 474, again, n)
+	&& memcmp(pts, again, sizeof(location) * n) == 0
+	&& kdtree_dataset_generate(d, 475, again, n) && memcmp(pts, again, sizeof(location) * n) != 0;
+      for (size_t i = 0; i < n && ok; i++)
+	{
+	  ok = location_validate(&pts[i]);
+	}
+
+      // every point is distinct
+      kdtree *t = ok ? kdtree_create(pts, n) : NULL;
+      ok = ok && t != NULL && kdtree_size(t) == n;
+      kdtree_destroy(t);
+
+      size_t cells = unit_occupied_cells(pts, n);
+      size_t on_edge = 0;
+      bool ordered = true;
+      for (size_t i = 0; i < n; i++)
+	{
+	  on_edge += fabs(pts[i].lat) == 90.0 || fabs(pts[i].lon) == 180.0;
+	  ordered = ordered && (i == 0 || pts[i - 1].lon <= pts[i].lon);
+	}
+      switch (d)
+	{
+	case KDTREE_DATASET_UNIFORM:
+	  uniform_cells = cells;
+	  ok = ok && cells > n / 2;
+	  break;
+
+	case KDTREE_DATASET_HOTSPOTS:
+	case KDTREE_DATASET_ZIPF:
+	case KDTREE_DATASET_CURVE:
+	  // clusters cover far less of the world
+	  ok = ok && cells < uniform_cells / 4;
+	  break;
+
+	case KDTREE_DATASET_SORTED:
+	  ok = ok && cells < uniform_cells / 4 && ordered;
+	  break;
+
+	case KDTREE_DATASET_BOUNDARY:
+	  ok = ok && on_edge > n / 3;
+	  break;
+	}
+    }
+
+  // points along the curve are mostly next to the one before
+  size_t near = 0;
+  ok = ok && kdtree_dataset_generate(KDTREE_DATASET_CURVE, 474, pts, n);
+  for (size_t i = 1; i < n && ok; i++)
+    {
+      near += fabs(pts[i].lat - pts[i - 1].lat) < 1.0 && fabs(pts[i].lon - pts[i - 1].lon) < 1.0;
+    }
+  kdtree_dataset unknown;
+  ok = ok && near > n * 9 / 10 && !kdtree_dataset_parse("gaussian", &unknown);
+  free(pts);
+  free(again);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- generated points are wrong\n");
+    }
+}
+
+
+uint64_t unit_trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+void unit_test_trace(size_t n)
+{
+  const char *path = "unit_test_trace.trc";
+  location *pts = malloc(sizeof(location) * n);
+  kdtree *t = pts != NULL && kdtree_dataset_generate(KDTREE_DATASET_UNIFORM, 474, pts, n) ? kdtree_create(pts, n / 2) : NULL;
+  kdtree *copy = t != NULL ? kdtree_create(pts, n / 2) : NULL;
+  kdtree_forest *forest = copy != NULL ? kdtree_forest_create(pts, n / 2, 4, 4, 1) : NULL;
+  const char *snapshot = "unit_test_trace.kdt";
+  const char *log = "unit_test_trace.log";
+  remove(snapshot);
+  remove(log);
+  kdtree_wal *w = forest != NULL ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  bool ok = w != NULL && kdtree_wal_add(w, &pts[0]) && kdtree_wal_remove(w, &pts[0]);
+  kdtree_wal_close(w);
+
+  // adds, lookups, removes and both kinds of range query, some of them
+  // of points that are not there
+  uint64_t start = unit_trace_now();
+  ok = ok && kdtree_trace_start(path) && !kdtree_trace_start(path);
+  size_t traced = 0;
+  for (size_t i = n / 2; i < n && ok; i++, traced++)
+    {
+      kdtree_add(t, &pts[i]);
+    }
+  for (size_t i = 0; i < n && ok; i += 3, traced++)
+    {
+      kdtree_contains(t, &pts[i]);
+    }
+  for (size_t i = 0; i < n && ok; i += 4, traced++)
+    {
+      kdtree_remove(t, &pts[i]);
+    }
+  atomic_size_t found = 0;
+  for (size_t i = 0; i < 100 && ok; i++, traced += 2)
+    {
+      location sw = {pts[i].lat - 1.0, pts[i].lon - 1.0};
+      location ne = {pts[i].lat + 1.0, pts[i].lon + 1.0};
+      int count;
+      free(kdtree_range(t, &sw, &ne, &count));
+      kdtree_range_for_each(t, &sw, &ne, unit_count_point, &found);
+    }
+  // calls with arguments that are refused aren't traced
+  location sw = {-1.0, -1.0};
+  location ne = {1.0, 1.0};
+  int count = 0;
+  ok = ok && !kdtree_add(t, NULL) && !kdtree_add(NULL, &pts[0]) && !kdtree_contains(t, NULL)
+    && kdtree_range(t, NULL, &ne, &count) == NULL && kdtree_range(t, &sw, NULL, &count) == NULL;
+  kdtree_remove(t, NULL);
+  kdtree_range_for_each(t, NULL, &ne, unit_count_point, &found);
+  kdtree_range_for_each(t, &sw, &ne, NULL, &found);
+
+  // a call for each point given to kdtree_add_many and
+  // kdtree_contains_many, and one for a query on a forest however many
+  // trees it reads
+  bool there[10];
+  kdtree_add_many(t, pts, 10);
+  kdtree_contains_many(t, pts + n / 2, 10, there);
+  traced += 20;
+  sw = (location){-60.0, -170.0};
+  ne = (location){-58.0, 170.0};
+  free(kdtree_forest_range(forest, &sw, &ne, &count));
+  traced++;
+
+  // but replaying a log is not
+  w = ok ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  ok = ok && w != NULL && kdtree_size(kdtree_wal_tree(w)) == 0;
+  kdtree_wal_close(w);
+  ok = ok && kdtree_trace_stop() && !kdtree_trace_stop();
+  uint64_t elapsed = unit_trace_now() - start;
+  kdtree_add(t, &pts[0]);
+
+  // the calls come back in order with their arguments, and replaying them
+  // on a copy of the tree leaves it the same as the original
+  size_t n_calls = 0;
+  kdtree_trace_call *calls = ok ? kdtree_trace_load(path, &n_calls) : NULL;
+  ok = ok && calls != NULL && n_calls == traced;
+  uint64_t gaps = 0;
+  for (size_t i = 0; i < n_calls && ok; i++)
+    {
+      gaps += calls[i].gap;
+      switch (calls[i].op)
+	{
+	case KDTREE_OP_ADD:
+	  ok = i >= n / 2 || (calls[i].p.lat == pts[n / 2 + i].lat && calls[i].p.lon == pts[n / 2 + i].lon);
+	  if (i >= traced - 21)
+	    {
+	      // from kdtree_add_many, all at once
+	      ok = ok && calls[i].p.lat == pts[i - (traced - 21)].lat && (calls[i].gap == 0) == (i > traced - 21);
+	    }
+	  kdtree_add(copy, &calls[i].p);
+	  break;
+
+	case KDTREE_OP_REMOVE:
+	  kdtree_remove(copy, &calls[i].p);
+	  break;
+
+	case KDTREE_OP_RANGE:
+	case KDTREE_OP_RANGE_FOR_EACH:
+	  ok = calls[i].ne.lat - calls[i].p.lat == 2.0;
+	  break;
+
+	default:
+	  break;
+	}
+    }
+  ok = ok && gaps <= elapsed && calls[0].op == KDTREE_OP_ADD && calls[traced - 21].op == KDTREE_OP_ADD
+    && calls[traced - 2].op == KDTREE_OP_CONTAINS && calls[traced - 2].p.lat == pts[n / 2 + 9].lat
+    && calls[n_calls - 1].op == KDTREE_OP_RANGE && calls[n_calls - 1].p.lon == -170.0;
+  kdtree_add(copy, &pts[0]);
+  ok = ok && kdtree_size(copy) == kdtree_size(t);
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      ok = kdtree_contains(copy, &pts[i]) == kdtree_contains(t, &pts[i]);
+    }
+  free(calls);
+
+  // a record cut off at the end is dropped, and a file that isn't a
+  // trace is refused
+  FILE *f = ok ? fopen(path, "r+b") : NULL;
+  long size = 0;
+  if (f != NULL)
+    {
+      fseek(f, 0, SEEK_END);
+      size = ftell(f);
+      fclose(f);
+    }
+  ok = ok && size > 0 && truncate(path, size - 5) == 0;
+  calls = ok ? kdtree_trace_load(path, &n_calls) : NULL;
+  ok = ok && calls != NULL && n_calls == traced - 1;
+  free(calls);
+  f = ok ? fopen(path, "wb") : NULL;
+  if (f != NULL)
+    {
+      fputs("KDTRACE\nnot a version", f);
+      fclose(f);
+    }
+  ok = ok && kdtree_trace_load(path, &n_calls) == NULL && kdtree_trace_load("unit_test_no_such.trc", &n_calls) == NULL;
+  remove(path);
+
+  if (t != NULL)
+    {
+      kdtree_destroy(t);
+    }
+  if (copy != NULL)
+    {
+      kdtree_destroy(copy);
+    }
+  kdtree_forest_destroy(forest);
+  remove(snapshot);
+  remove(log);
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- traced calls are wrong\n");
+    }
+}
+
+
+void unit_test_wide_longitudes(size_t n)
+{
+  // valid points need not have longitudes between -180 and 180, and
+  // whatever copies a whole tree must keep those that don't
+  location *pts = malloc(sizeof(location) * n);
+  bool ok = pts != NULL;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      pts[i].lat = (double)(i % 179) - 89.0;
+      pts[i].lon = (double)i * 0.5 - 400.0;
+      ok = location_validate(&pts[i]);
+    }
+
+  // a managed tree's rebuild
+  kdtree_managed *m = ok ? kdtree_managed_create(pts, n) : NULL;
+  ok = ok && m != NULL && kdtree_managed_rebuild(m) && kdtree_managed_wait(m) && kdtree_managed_size(m) == n;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      ok = kdtree_managed_contains(m, &pts[i]);
+    }
+  if (m != NULL)
+    {
+      kdtree_managed_destroy(m);
+    }
+
+  // a paged file saved from a tree, and one saved from that
+  const char *path = "unit_test_longitudes.kdp";
+  const char *copy_path = "unit_test_longitudes_copy.kdp";
+  kdtree *t = ok ? kdtree_create(pts, n) : NULL;
+  kdtree *paged = t != NULL && kdtree_save_paged(t, path) ? kdtree_open_paged(path, 4) : NULL;
+  kdtree *copy = paged != NULL && kdtree_save_paged(paged, copy_path) ? kdtree_open_paged(copy_path, 4) : NULL;
+  ok = ok && copy != NULL && kdtree_size(paged) == n && kdtree_size(copy) == n;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      ok = kdtree_contains(paged, &pts[i]) && kdtree_contains(copy, &pts[i]);
+    }
+
+  // a durable tree's checkpoint
+  const char *snapshot = "unit_test_longitudes.kdt";
+  const char *log = "unit_test_longitudes.log";
+  remove(snapshot);
+  remove(log);
+  kdtree_wal *w = ok ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  ok = ok && w != NULL && kdtree_wal_add_many(w, pts, n) == n && kdtree_wal_checkpoint(w);
+  kdtree_wal_close(w);
+  w = ok ? kdtree_wal_open(snapshot, log, 0) : NULL;
+  ok = ok && w != NULL && kdtree_size(kdtree_wal_tree(w)) == n;
+  for (size_t i = 0; i < n && ok; i++)
+    {
+      ok = kdtree_contains(kdtree_wal_tree(w), &pts[i]);
+    }
+  kdtree_wal_close(w);
+  remove(snapshot);
+  remove(log);
+
+  // a packed copy has no grid points for them, so it fails rather than
+  // leaving them out
+  ok = ok && kdtree_packed_create(t, 1000) == NULL;
+  kdtree *trees[] = {t, paged, copy};
+  for (size_t i = 0; i < sizeof(trees) / sizeof(trees[0]); i++)
+    {
+      if (trees[i] != NULL)
+	{
+	  kdtree_destroy(trees[i]);
+	}
+    }
+  remove(path);
+  remove(copy_path);
+  free(pts);
+
+  if (ok)
+    {
+      printf("PASSED\n");
+    }
+  else
+    {
+      printf("FAILED -- points outside -180 to 180 were lost\n");
+    }
+}